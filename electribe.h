@@ -0,0 +1,64 @@
+#ifndef ELECTRIBE_H
+#define ELECTRIBE_H
+
+/* Korg electribe, see electribe_MIDIimp.txt */
+
+/* Exclusive header: 42 3g 00 01 23 (g: global channel) */
+#define E2_HDR_SIZ			5
+#define E2_HDR_FUNC			E2_HDR_SIZ	/* Function ID offset */
+
+#define E2_FUNC_CURPAT_REQ		0x10
+#define E2_FUNC_PAT_REQ			0x1C
+#define E2_FUNC_GLOBAL_REQ		0x1E
+#define E2_FUNC_PAT_WRITE_REQ		0x11
+#define E2_FUNC_CURPAT_DUMP		0x40
+#define E2_FUNC_PAT_DUMP		0x4C
+#define E2_FUNC_GLOBAL_DUMP		0x51
+#define E2_FUNC_FORMAT_ERR		0x26
+#define E2_FUNC_LOAD_OK			0x23
+#define E2_FUNC_LOAD_ERR		0x24
+#define E2_FUNC_WRITE_OK		0x21
+#define E2_FUNC_WRITE_ERR		0x22
+
+/* Decoded and encoded (7 bit) data sizes, NOTE 1 and 2. */
+#define E2_PAT_SIZ			16384
+#define E2_PAT_ENCSIZ			18725
+#define E2_GLOBAL_SIZ			256
+#define E2_GLOBAL_ENCSIZ		293
+
+#define E2_NUM_PATTERNS			250
+
+/* Offsets in the decoded pattern data, TABLE 1, 4 and 6. Two byte values
+ * are LSB first. */
+#define E2_PAT_MAGIC			"PTST"
+#define E2_PAT_NAME			16
+#define E2_PAT_NAMESIZ			18
+#define E2_PAT_TEMPO			34	/* 2 bytes, BPM * 10 */
+#define E2_PAT_SWING			36	/* Signed, -48~48 */
+#define E2_PAT_KEY			39
+#define E2_PAT_SCALE			40
+#define E2_PAT_MFX_X			62
+#define E2_PAT_MFX_Y			63
+#define E2_PAT_PART_OFF			2048
+#define E2_PAT_PART_SIZ			816
+#define E2_NUM_PARTS			16
+
+#define E2_PART_OSC_TYPE		8	/* 2 bytes */
+#define E2_PART_OSC_EDIT		11
+#define E2_PART_FILTER_TYPE		12
+#define E2_PART_CUTOFF			13
+#define E2_PART_RESO			14
+#define E2_PART_EG_INT			15
+#define E2_PART_MOD_SPEED		17
+#define E2_PART_MOD_DEPTH		18
+#define E2_PART_ATTACK			20
+#define E2_PART_DECAY			21
+#define E2_PART_AMP_LEVEL		24
+#define E2_PART_PAN			25
+#define E2_PART_MFX_SEND		27
+#define E2_PART_IFX_ON			32
+#define E2_PART_IFX_EDIT		34
+#define E2_PART_PITCH			36
+#define E2_PART_GLIDE			37
+
+#endif
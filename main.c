@@ -4,42 +4,88 @@
 #include <string.h>
 #include <pthread.h>
 #include <time.h>
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
 #include "bstr.h"
 #include "barr.h"
 #include "midi_osx.h"
 #include "midi_queue.h"
+#include "midi_discover.h"
+#include "midi_clock.h"
+#include "midi_xact.h"
+#include "midi_codec.h"
+#include "midi_mirror.h"
+#include "midi_fleet.h"
+#include "midi_trace.h"
+#include "midi_rt.h"
+#include "midi_writer.h"
+#include "midi_filter.h"
+#include "midi_ring.h"
+#include "midi_index.h"
+#include "electribe.h"
 #include "btime.h"
 
 
 void
 usage(char *prognam)
 {
-	printf("Usage: %s <seqfile>\n", prognam);
+	printf("Usage: %s                     Dump current pattern\n"
+	    "       %s discover            Find devices\n"
+	    "       %s clock <bpm> [secs]  Send MIDI clock\n"
+	    "       %s cc <num> <val> ...  Send Control Change(s)\n"
+	    "       %s watch <part> [secs] Follow panel changes\n"
+	    "       %s fleet backup|restore <dir> <dev>[:<first>[-<last>]] ...\n"
+	    "                                Back up or restore pattern slots"
+	    " on many devices\n"
+	    "       %s index <dir>         Index the patterns backed up in dir\n"
+	    "       %s find <dir> <what>=<val>[..<max>] ...\n"
+	    "                                Search them (tempo, swing, key,"
+	    " scale,\n"
+	    "                                osc[.<part>], filter[.<part>],"
+	    " name)\n",
+	    prognam, prognam, prognam, prognam, prognam, prognam, prognam,
+	    prognam);
 }
 
 
-midi_queue_t	*midi_inq;
-midi_queue_t	*midi_outq;
-
-unsigned char	*midi_resp;
-size_t		midi_resp_siz;
-
-void *midi_writer(void *);
-int midi_get_resp();
-
-#define RESPONSE_TIMEOUT_SEC	3
-#define MIDIIO_WAKEUP_MS	50
-
-#define PROG_STATE_NONE		0
-#define PROG_STATE_RUNNING	1
-#define PROG_STATE_SHUTDOWN	2
-
-int prog_state = PROG_STATE_NONE;
-pthread_rwlock_t prog_state_rwlock;
-
-int set_prog_state(int);
-
-int decode_payload(bstr_t *, unsigned char *, size_t);
+#define CMD_DUMP		0
+#define CMD_DISCOVER		1
+#define CMD_CLOCK		2
+#define CMD_CC			3
+#define CMD_WATCH		4
+#define CMD_FLEET		5
+
+#define CLOCK_DEFAULT_SEC	10
+#define WATCH_DEFAULT_SEC	60
+#define WATCH_DRAIN_MS		100
+
+/* NOTE: The ring is only as fast as its slowest consumer, and drops what
+ * comes when it's full, the reply too. Both consumers keep reading while
+ * the dump comes, but in case one of them doesn't get to run, the ring has
+ * room for as many CCs (2 bytes with running status) as the wire carries
+ * during a dump. */
+#define WATCH_RINGSIZ		(E2_PAT_ENCSIZ / 2)
+
+typedef struct watch_drain {
+	midi_ring_cons_t	*wd_rc;
+	midi_queue_t		*wd_backlog;
+	atomic_int		wd_stop;
+} watch_drain_t;
+
+int cmd_dump(int);
+int e2_reply_iserr(unsigned char *, size_t);
+int cmd_discover(void);
+int cmd_clock(double, int);
+int cmd_cc(int, char **, int);
+int cmd_watch(midi_ring_t *, int, int, int);
+void *watch_drain(void *);
+void watch_feed(midi_mirror_t *, int, const midi_msg_t *);
+midi_fleet_t *fleet_setup(int, char **, midi_dev_t *, int);
+int filter_setup(int);
+int cmd_index(const char *);
+int cmd_find(const char *, int, char **);
+int find_parse(char *, midi_index_pred_t *);
 
 
 int
@@ -47,456 +93,968 @@ main(int argc, char **argv)
 {
 	int		ret;
 	pthread_t	write_thrd;
-	//unsigned char	midireq[] = { 0x42, 0x50, 0x00, 0x01 };
-	//unsigned char	midireq[] = { 0x7E, 0x7F, 0x06, 0x01 };
-	unsigned char	midireq[] = { 0x42, 0x30, 0x00, 0x01, 0x23, 0x10 };
-	bstr_t		*sysex_payload;
-#if 0
-	unsigned char	*buf;
-	int		i;
-#endif
+	char		cachepath[PATH_MAX];
+	midi_dev_t	devs[MIDI_DEV_MAX];
+	midi_dev_t	*dev;
+	int		devcnt;
+	int		cmd;
+	int		chan;
+	double		bpm;
+	int		secs;
+	char		*endp;
+	int		part;
+	midi_fleet_t	*fleet;
+	midi_ring_t	*ring;
 
 	midi_inq = NULL;
 	midi_outq = NULL;
 
-	midi_resp = NULL;
-	midi_resp_siz = 0;
+	chan = 0;
+	bpm = 0;
+	secs = CLOCK_DEFAULT_SEC;
+	part = 0;
+	devcnt = 0;
+	fleet = NULL;
+	ring = NULL;
 
-	sysex_payload = NULL;
-
-#if 0
-	if(argc != 2 || xstrempty(argv[1])) {
+	if(argc == 1) {
+		cmd = CMD_DUMP;
+	} else
+	if(argc == 2 && !strcmp(argv[1], "discover")) {
+		cmd = CMD_DISCOVER;
+	} else
+	if((argc == 3 || argc == 4) && !strcmp(argv[1], "clock")) {
+		cmd = CMD_CLOCK;
+		bpm = strtod(argv[2], &endp);
+		if(*endp || bpm < MIDI_CLOCK_MINBPM ||
+		    bpm > MIDI_CLOCK_MAXBPM) {
+			fprintf(stderr, "BPM must be between %.1f and %.1f\n",
+			    MIDI_CLOCK_MINBPM, MIDI_CLOCK_MAXBPM);
+			exit(-1);
+		}
+		if(argc == 4) {
+			secs = strtol(argv[3], &endp, 10);
+			if(*endp || secs <= 0) {
+				usage(argv[0]);
+				exit(-1);
+			}
+		}
+	} else
+	if(argc >= 4 && argc % 2 == 0 && !strcmp(argv[1], "cc")) {
+		cmd = CMD_CC;
+	} else
+	if((argc == 3 || argc == 4) && !strcmp(argv[1], "watch")) {
+		cmd = CMD_WATCH;
+		part = strtol(argv[2], &endp, 10);
+		if(*endp || part < 1 || part > E2_NUM_PARTS) {
+			fprintf(stderr, "Part must be between 1 and %d\n",
+			    E2_NUM_PARTS);
+			exit(-1);
+		}
+		secs = WATCH_DEFAULT_SEC;
+		if(argc == 4) {
+			secs = strtol(argv[3], &endp, 10);
+			if(*endp || secs <= 0) {
+				usage(argv[0]);
+				exit(-1);
+			}
+		}
+	} else
+	if(argc >= 5 && !strcmp(argv[1], "fleet") &&
+	    (!strcmp(argv[2], "backup") || !strcmp(argv[2], "restore"))) {
+		cmd = CMD_FLEET;
+	} else
+	if(argc == 3 && !strcmp(argv[1], "index")) {
+		/* No MIDI needed. */
+		return cmd_index(argv[2]) == 0 ? 0 : -1;
+	} else
+	if(argc >= 3 && !strcmp(argv[1], "find")) {
+		return cmd_find(argv[2], argc - 3, argv + 3) == 0 ? 0 : -1;
+	} else {
 		usage(argv[0]);
 		exit(-1);
 	}
-#endif
 
+	ret = midi_devcache_path(cachepath, sizeof(cachepath));
+	if(ret != 0)
+		cachepath[0] = 0;
+
+	if(cmd != CMD_DISCOVER && cachepath[0]) {
+		/* Open only the device's ports if we've seen it before.
+		 * Otherwise talk to everything. */
+		ret = midi_devcache_load(cachepath, devs, MIDI_DEV_MAX,
+		    &devcnt);
+		if(ret == 0 && cmd != CMD_FLEET) {
+			dev = midi_dev_find(devs, devcnt, MIDI_DEV_MFR_KORG,
+			    MIDI_DEV_FAMILY_ELECTRIBE);
+			if(dev) {
+				midi_osx_select(dev->md_srcuid,
+				    dev->md_destuid);
+				chan = dev->md_chan;
+			}
+		}
+	}
 
-	ret = midi_queue_init(&midi_inq);
-	if(ret != 0) {
-		fprintf(stderr, "Can't initialize MIDI in queue\n");
-		exit(-1);
+	if(cmd == CMD_FLEET) {
+		/* Every device gets its own input queue, which has to be
+		 * set up before system MIDI. */
+		fleet = fleet_setup(argc - 2, argv + 2, devs, devcnt);
+		if(fleet == NULL)
+			exit(-1);
 	}
 
-	ret = midi_queue_init(&midi_outq);
+	ret = filter_setup(cmd);
 	if(ret != 0) {
-		fprintf(stderr, "Can't initialize MIDI out queue\n");
+		fprintf(stderr, "Can't set up input filter: %s\n",
+		    strerror(ret));
 		exit(-1);
 	}
 
-	/* Create global state variable lock */
-	ret = pthread_rwlock_init(&prog_state_rwlock, NULL);
+	/* Before anything the threads use is allocated. */
+	(void) midi_rt_init();
+
+	if(cmd == CMD_WATCH) {
+		/* Panel changes that come while the pattern is being dumped
+		 * are for the mirror, not for the request to drop. */
+		ret = midi_ring_init(&ring, WATCH_RINGSIZ);
+		if(ret == 0)
+			ret = midi_osx_setring(ring);
+		if(ret != 0) {
+			fprintf(stderr, "Can't set up input ring: %s\n",
+			    strerror(ret));
+			exit(-1);
+		}
+	}
+
+	/* Before any other thread starts. */
+	(void) midi_trace_init();
+
+	ret = midi_queue_init(&midi_inq);
+	if(ret == 0)
+		ret = midi_queue_setinput(midi_inq, "MIDI in");
 	if(ret != 0) {
-		fprintf(stderr, "Can't create global state variable rwlock\n");
+		fprintf(stderr, "Can't initialize MIDI in queue\n");
 		exit(-1);
 	}
 
-	ret = set_prog_state(PROG_STATE_RUNNING);
+	ret = midi_queue_init(&midi_outq);
 	if(ret != 0) {
+		fprintf(stderr, "Can't initialize MIDI out queue\n");
 		exit(-1);
 	}
 
 	ret = midi_osx_init();
+	if(ret == ENOENT) {
+		fprintf(stderr, "Cached device not found. Run \"%s discover\""
+		    " to update %s.\n", argv[0], cachepath);
+		exit(-1);
+	} else
 	if(ret != 0) {
 		fprintf(stderr, "Can't initialize system MIDI.\n");
 		exit(-1);
 	}
 
 	/* Start thread(s). */
-	ret = pthread_create(&write_thrd, NULL, midi_writer, NULL);
+	ret = midi_writer_start(&write_thrd);
 	if(ret != 0) {
-		fprintf(stderr, "Can't start MIDI writer thread: %s\n",
-		    strerror(ret));
 		exit(-1);
 	}
 
+	switch(cmd) {
+	case CMD_DISCOVER:
+		(void) cmd_discover();
+		break;
+	case CMD_CLOCK:
+		(void) cmd_clock(bpm, secs);
+		break;
+	case CMD_CC:
+		(void) cmd_cc(argc - 2, argv + 2, chan);
+		break;
+	case CMD_WATCH:
+		(void) cmd_watch(ring, chan, part, secs);
+		break;
+	case CMD_FLEET:
+		(void) midi_fleet_run(fleet, stdout);
+		break;
+	default:
+		(void) cmd_dump(chan);
+		break;
+	}
 
-	ret = midi_queue_addmsg_sysex(midi_outq,
-	    (unsigned char *) midireq, 6);
-
-	/* Usually a MIDI program would have a writer and a reader thread.
-	 * However, since here we're just waiting for a specific response,
-	 * we're essentially executing the "reader thread" on the main
-	 * thread. */
-
-	ret = midi_get_resp();
+	/* Wait for thread(s) to exit. */
+	(void) midi_writer_stop(&write_thrd);
+	if(midi_rt_on)
+		midi_writer_report(stderr);
 
-	if(ret == ETIMEDOUT) {
-		fprintf(stderr, "Timeout: no answer from device.\n");
-	} else
+	ret = midi_osx_uninit();
 	if(ret != 0) {
-		fprintf(stderr, "Error: %s.\n", strerror(ret));
-	} else
-	if(midi_resp == NULL || midi_resp_siz == 0) {
-		fprintf(stderr, "Empty response.\n");
-	} else {
-#if 0
-		printf("MIDI response, siz = %zu, msg = ", midi_resp_siz);
-		for(i = 0; i < midi_resp_siz; ++i) {
-			printf("0x%02x ", midi_resp[i]);
-		}
-		printf("\n");
-#endif
-
-		sysex_payload = binit();
-		if(sysex_payload == NULL) {
-			fprintf(stderr,
-			    "Can't allocate memory for decoded payload.\n");
-		} else {
-			ret = decode_payload(sysex_payload, midi_resp + 6,
-			    midi_resp_siz - 6);
-			if(ret != 0) {
-				fprintf(stderr,
-				    "Can't decode payload.\n");
-			} else {
-#if 0
-				buf = (unsigned char *) bget(sysex_payload);
-				if(buf) {
-					printf("decoded, siz = %i, msg =\n",
-					    bstrlen(sysex_payload));
-					for(i = 0; i < bstrlen(sysex_payload);
-					    ++i) {
-						printf("%d. 0x%02x\n",
-						    i, buf[i]);
-					}
-					printf("\n");
-				}
-#endif
-
-				ret = btofilep(stdout, sysex_payload);
-				if(ret != 0) {
-					fprintf(stderr,
-					    "Can't write sysex to output.\n");
-				}
-			}
+		fprintf(stderr, "Can't uninitialize system MIDI.\n");
+	}
 
-		}
+	if(fleet) {
+		(void) midi_fleet_uninit(fleet);
+		free(fleet);
 	}
 
+	if(ring)
+		(void) midi_ring_uninit(&ring);
 
-	/* Signal to thread(s) to shut down. */
-	ret = set_prog_state(PROG_STATE_SHUTDOWN);
+	ret = midi_queue_uninit(&midi_inq);
 	if(ret != 0) {
-		exit(-1);
+		fprintf(stderr, "Can't uninitialize MIDI in queue\n");
 	}
 
-	/* Wait for thread(d) to exit. */
-	ret = pthread_join(write_thrd, NULL);
+	ret = midi_queue_uninit(&midi_outq);
 	if(ret != 0) {
-		fprintf(stderr, "Can't join writer thread.\n");
+		fprintf(stderr, "Can't uninitialize MIDI out queue\n");
 	}
 
-	ret = midi_osx_uninit();
+	/* Everything has stopped, nothing records anymore. */
+	ret = midi_trace_write();
 	if(ret != 0) {
-		fprintf(stderr, "Can't uninitialize system MIDI.\n");
+		fprintf(stderr, "Can't write trace: %s\n", strerror(ret));
 	}
 
-	ret = midi_queue_uninit(&midi_inq);
+	return 0;
+}
+
+
+int
+cmd_index(const char *dir)
+{
+	midi_index_t	ix;
+	char		path[PATH_MAX];
+	int		skipped;
+	int		ret;
+
+	(void) midi_index_init(&ix);
+
+	ret = midi_index_adddir(&ix, dir, &skipped);
 	if(ret != 0) {
-		fprintf(stderr, "Can't uninitialize MIDI in queue\n");
+		fprintf(stderr, "Can't index %s: %s\n", dir, strerror(ret));
+		goto end;
 	}
 
-	ret = midi_queue_uninit(&midi_outq);
+	snprintf(path, sizeof(path), "%s/%s", dir, MIDI_INDEX_FILE);
+	ret = midi_index_save(&ix, path);
 	if(ret != 0) {
-		fprintf(stderr, "Can't uninitialize MIDI out queue\n");
+		fprintf(stderr, "Can't save %s: %s\n", path, strerror(ret));
+		goto end;
 	}
 
-	(void) set_prog_state(PROG_STATE_NONE);
+	printf("%d patterns indexed", ix.ix_cnt);
+	if(skipped)
+		printf(", %d files skipped", skipped);
+	printf("\n");
 
-	ret = pthread_rwlock_destroy(&prog_state_rwlock);
+end:
+	(void) midi_index_uninit(&ix);
+	return ret;
+}
+
+
+int
+cmd_find(const char *dir, int argc, char **argv)
+{
+	midi_index_t		ix;
+	midi_index_pred_t	*preds;
+	char			path[PATH_MAX];
+	int			*rows;
+	int			cnt;
+	int			i;
+	int			p;
+	int			r;
+	uint64_t		start;
+	uint64_t		end;
+	int			ret;
+
+	rows = NULL;
+	(void) midi_index_init(&ix);
+
+	preds = calloc(argc ? argc : 1, sizeof(midi_index_pred_t));
+	if(preds == NULL)
+		return ENOMEM;
+
+	for(i = 0; i < argc; ++i) {
+		ret = find_parse(argv[i], &preds[i]);
+		if(ret != 0) {
+			fprintf(stderr, "Don't understand \"%s\"\n", argv[i]);
+			goto end;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", dir, MIDI_INDEX_FILE);
+	ret = midi_index_load(&ix, path);
 	if(ret != 0) {
-		fprintf(stderr, "Can't destroy global state variable rwlock\n");
+		fprintf(stderr, "Can't load %s: %s\n", path, strerror(ret));
+		goto end;
 	}
 
-	if(midi_resp)
-		free(midi_resp);
-	midi_resp_siz = 0;
+	start = midi_time_now();
+	ret = midi_index_query(&ix, preds, argc, &rows, &cnt);
+	end = midi_time_now();
+	if(ret != 0) {
+		fprintf(stderr, "Query failed: %s\n", strerror(ret));
+		goto end;
+	}
 
-	buninit(&sysex_payload);
+	for(i = 0; i < cnt; ++i) {
+		r = rows[i];
+		printf("%-20s %-18s %5.1f %3d %2d %2d ", ix.ix_srcs[r],
+		    ix.ix_names[r],
+		    midi_index_get(&ix, r, MIDI_INDEX_TEMPO, 0) / 10.0,
+		    midi_index_get(&ix, r, MIDI_INDEX_SWING, 0),
+		    midi_index_get(&ix, r, MIDI_INDEX_KEY, 0),
+		    midi_index_get(&ix, r, MIDI_INDEX_SCALE, 0));
+		for(p = 1; p <= E2_NUM_PARTS; ++p)
+			printf(" %d", midi_index_get(&ix, r, MIDI_INDEX_OSC,
+			    p));
+		printf("\n");
+	}
+
+	printf("%d of %d patterns, %.3f ms\n", cnt, ix.ix_cnt,
+	    (double) (end - start) / MIDI_TIME_NSEC_PER_MSEC);
+
+end:
+	free(rows);
+	free(preds);
+	(void) midi_index_uninit(&ix);
+	return ret;
+}
+
+
+int
+find_parse(char *term, midi_index_pred_t *ip)
+{
+	/* what=val or what=min..max, eg. tempo=120..130, osc.3=300,
+	 * name=bass */
+
+	char	*val;
+	char	*max;
+	char	*endp;
+	double	scale;
+	double	d;
+
+	val = strchr(term, '=');
+	if(val == NULL)
+		return EINVAL;
+	*val++ = 0;
+
+	memset(ip, 0, sizeof(midi_index_pred_t));
+	scale = 1;
+
+	if(!strcmp(term, "name")) {
+		ip->ip_col = MIDI_INDEX_NAME;
+		ip->ip_str = val;
+		return 0;
+	} else
+	if(!strcmp(term, "tempo")) {
+		ip->ip_col = MIDI_INDEX_TEMPO;
+		scale = 10;
+	} else
+	if(!strcmp(term, "swing")) {
+		ip->ip_col = MIDI_INDEX_SWING;
+	} else
+	if(!strcmp(term, "key")) {
+		ip->ip_col = MIDI_INDEX_KEY;
+	} else
+	if(!strcmp(term, "scale")) {
+		ip->ip_col = MIDI_INDEX_SCALE;
+	} else
+	if(!strncmp(term, "osc", 3) || !strncmp(term, "filter", 6)) {
+		ip->ip_col = term[0] == 'o' ? MIDI_INDEX_OSC :
+		    MIDI_INDEX_FILTER;
+		term += term[0] == 'o' ? 3 : 6;
+		if(*term == '.') {
+			ip->ip_part = strtol(term + 1, &endp, 10);
+			if(*endp || ip->ip_part < 1 ||
+			    ip->ip_part > E2_NUM_PARTS)
+				return EINVAL;
+		} else
+		if(*term)
+			return EINVAL;
+	} else
+		return EINVAL;
+
+	max = strstr(val, "..");
+	if(max) {
+		*max = 0;
+		max += 2;
+	}
+
+	d = strtod(val, &endp);
+	if(*endp || endp == val)
+		return EINVAL;
+	ip->ip_min = lround(d * scale);
+	ip->ip_max = ip->ip_min;
+
+	if(max) {
+		d = strtod(max, &endp);
+		if(*endp || endp == max)
+			return EINVAL;
+		ip->ip_max = lround(d * scale);
+	}
 
 	return 0;
 }
 
 
 int
-midi_get_resp()
+filter_setup(int cmd)
 {
+	/* Lets through only what the command reads, so that the reader
+	 * doesn't queue clocks or other devices' sysex for nothing. */
+
+	midi_filter_t	mf;
 	int		ret;
-	midi_msg_t	msg;
-	int		haveresp;
-	int		timeout;
-	struct timeval	now;
-	struct timeval	timeoutat;
-	struct timespec	condwaitto;
-	int		err;
-
-	haveresp = 0;
-	timeout = 0;
-	err = 0;
-
-	btimeval_tonow(&timeoutat);
-	btimeval_adds(&timeoutat, RESPONSE_TIMEOUT_SEC);
-
-	ret = pthread_mutex_lock(&midi_inq->mq_mutex);
+
+	midi_filter_init(&mf);
+
+	switch(cmd) {
+	case CMD_CLOCK:
+	case CMD_CC:
+		/* Output only. */
+		midi_filter_settypes(&mf, 0);
+		break;
+	case CMD_DISCOVER:
+		/* Identity Reply (Universal Non-Realtime) and Korg's Search
+		 * Device Reply. */
+		midi_filter_settypes(&mf, MIDI_FILTER_TYPE(MIDI_MSG_SYSEX));
+		ret = midi_filter_addmfr(&mf, 0x7E, 0);
+		if(ret == 0)
+			ret = midi_filter_addmfr(&mf, MIDI_DEV_MFR_KORG, 0);
+		if(ret != 0)
+			return ret;
+		break;
+	case CMD_WATCH:
+		midi_filter_settypes(&mf, MIDI_FILTER_TYPE(MIDI_MSG_SYSEX) |
+		    MIDI_FILTER_TYPE(MIDI_MSG_CHANCC) |
+		    MIDI_FILTER_TYPE(MIDI_MSG_CHANPROG));
+		ret = midi_filter_addmfr(&mf, MIDI_DEV_MFR_KORG, 0);
+		if(ret != 0)
+			return ret;
+		break;
+	default:
+		midi_filter_settypes(&mf, MIDI_FILTER_TYPE(MIDI_MSG_SYSEX));
+		ret = midi_filter_addmfr(&mf, MIDI_DEV_MFR_KORG, 0);
+		if(ret != 0)
+			return ret;
+		break;
+	}
+
+	return midi_osx_setfilter(&mf);
+}
+
+
+midi_fleet_t *
+fleet_setup(int argc, char **argv, midi_dev_t *devs, int devcnt)
+{
+	/* argv[0] is backup or restore, argv[1] the directory, the rest
+	 * device numbers (as listed by discover) with optional slot ranges,
+	 * eg. 2:1-64. */
+
+	midi_fleet_t	*fleet;
+	int		i;
+	int		idx;
+	int		first;
+	int		last;
+	char		*endp;
+	int		ret;
+
+	fleet = malloc(sizeof(midi_fleet_t));
+	if(fleet == NULL) {
+		fprintf(stderr, "Can't allocate fleet\n");
+		return NULL;
+	}
+
+	ret = midi_fleet_init(fleet, strcmp(argv[0], "backup") ?
+	    MIDI_FLEET_RESTORE : MIDI_FLEET_BACKUP, argv[1], e2_reply_iserr);
 	if(ret != 0) {
-		fprintf(stderr, "Can't lock queue: %s\n", strerror(ret));
-		return ENOEXEC;
+		fprintf(stderr, "Can't initialize fleet: %s\n", strerror(ret));
+		free(fleet);
+		return NULL;
 	}
 
-	while(!haveresp && !timeout) {
+	for(i = 2; i < argc; ++i) {
+		first = 1;
+		last = E2_NUM_PATTERNS;
 
-		(void) gettimeofday(&now, NULL);
+		idx = strtol(argv[i], &endp, 10);
+		if(*endp == ':') {
+			first = last = strtol(endp + 1, &endp, 10);
+			if(*endp == '-')
+				last = strtol(endp + 1, &endp, 10);
+		}
+		if(*endp || idx < 1 || idx > devcnt) {
+			fprintf(stderr, "Invalid device: %s (run discover to"
+			    " list them)\n", argv[i]);
+			ret = EINVAL;
+			break;
+		}
 
-		if(btimeval_cmp(&now, &timeoutat) >= 0) {
-			timeout++;
-			err = ETIMEDOUT;
+		ret = midi_fleet_add(fleet, &devs[idx - 1], first, last);
+		if(ret != 0) {
+			fprintf(stderr, "Can't add %s: %s\n", argv[i],
+			    strerror(ret));
 			break;
 		}
+	}
 
-		while(!midi_queue_isempty(midi_inq)) {
+	if(ret != 0) {
+		(void) midi_fleet_uninit(fleet);
+		free(fleet);
+		return NULL;
+	}
 
-			ret = midi_queue_getnext(midi_inq, &msg);
-			if(ret != 0) {
-				fprintf(stderr, "Can't get next message"
-				    " from queue: %s\n"
-				    " This is bad, exiting\n", strerror(ret));
-				exit(-1);
-			}
+	return fleet;
+}
 
-			if(msg.mm_type == MIDI_MSG_SYSEX) {
-#if 0
-				printf("Sysex received!\n");
-#endif
-				haveresp++;
-				
-				midi_resp = memdup(msg.mm_payload,
-				    msg.mm_payload_siz);
-				if(midi_resp == NULL) {
-					fprintf(stderr,
-					    "Can't copy MIDI response.\n");
-					break;
-				}
 
-				midi_resp_siz = msg.mm_payload_siz;
-				break;
-			}
-				
-			(void) midi_msg_free_payload(&msg);
-		}
+int
+cmd_discover(void)
+{
+	/* Finds out which endpoints the connected devices are on and saves
+	 * the result to the device cache. */
 
+	int		ret;
+	midi_dev_t	devs[MIDI_DEV_MAX];
+	int		devcnt;
+	int		i;
+	char		cachepath[PATH_MAX];
 
-		/* No more items to process, so go to sleep until
-		 * something happens on the queue */
-		btimespec_tonow(&condwaitto);
-		btimespec_addus(&condwaitto, MIDIIO_WAKEUP_MS * 1000);
-		ret = pthread_cond_timedwait(&midi_inq->mq_cond,
-		    &midi_inq->mq_mutex, &condwaitto);
+	ret = midi_discover(devs, MIDI_DEV_MAX, &devcnt,
+	    MIDI_DISCOVER_TIMEOUT_MS);
+	if(ret != 0) {
+		fprintf(stderr, "Device discovery failed: %s\n",
+		    strerror(ret));
+		return ret;
+	}
 
-		if(ret != 0 && ret != ETIMEDOUT) {
-			fprintf(stderr, "Error while waiting on condvar: %s\n"
-			    " This is bad, exiting\n", strerror(ret));
-			exit(-1);
-		}
+	for(i = 0; i < devcnt; ++i) {
+		printf("%2d. %-24s src=%d dest=%d chan=%d mfr=%02X"
+		    " family=%04X member=%04X ver=%d.%d.%d.%d\n", i + 1,
+		    devs[i].md_name, devs[i].md_src, devs[i].md_dest,
+		    devs[i].md_chan + 1, devs[i].md_mfr, devs[i].md_family,
+		    devs[i].md_member, devs[i].md_ver[0], devs[i].md_ver[1],
+		    devs[i].md_ver[2], devs[i].md_ver[3]);
+	}
 
+	if(devcnt == 0) {
+		fprintf(stderr, "No devices answered.\n");
+		return ENOENT;
 	}
 
-	ret = pthread_mutex_unlock(&midi_inq->mq_mutex);
+	ret = midi_devcache_path(cachepath, sizeof(cachepath));
+	if(ret == 0)
+		ret = midi_devcache_save(cachepath, devs, devcnt);
 	if(ret != 0) {
-		fprintf(stderr, "Can't unlock queue: %s\n", strerror(ret));
-		return ENOEXEC;
+		fprintf(stderr, "Can't save device cache: %s\n",
+		    strerror(ret));
+		return ret;
 	}
 
-	return err;
+	return 0;
 }
 
 
-void *
-midi_writer(void *arg)
+int
+cmd_clock(double bpm, int secs)
 {
-	int		ret;
-	midi_msg_t	msg;
-	bstr_t		*midimsg;
-	int		doshutdown;
-	struct timespec	condwaitto;
-
-	midimsg = 0;
-	doshutdown = 0;
+	/* Sends Start, runs the clock for secs seconds, sends Stop and
+	 * reports how accurately the ticks went out. */
 
-#if 0
-	printf("MIDI writer thread started.\n");
-	fflush(stdout);
-#endif
+	int		ret;
+	midi_clock_t	mc;
 
-	ret = pthread_mutex_lock(&midi_outq->mq_mutex);
+	ret = midi_clock_init(&mc, MIDI_EP_ANY, bpm);
 	if(ret != 0) {
-		fprintf(stderr, "Can't lock queue: %s\n", strerror(ret));
-		return (void *) -1;
+		fprintf(stderr, "Can't start MIDI clock: %s\n", strerror(ret));
+		return ret;
 	}
 
-	while(1) {
+	(void) midi_clock_start(&mc);
 
-		/* Check whether it's time to quit. */
-		ret = pthread_rwlock_rdlock(&prog_state_rwlock);
-		if(ret != 0) {
-			fprintf(stderr,
-			    "Can't lock global state rwlock for reading: %s\n",
-			    strerror(ret));
-			exit(-1);	
-		}
-		if(prog_state == PROG_STATE_SHUTDOWN) {
-			doshutdown++;
-		}
-		ret = pthread_rwlock_unlock(&prog_state_rwlock);
-		if(ret != 0) {
-			fprintf(stderr,
-			    "Can't unlock global state rwlock"
-			    " after reading: %s\n", strerror(ret));
-			exit(-1);	
-		}
+	(void) midi_time_sleepuntil(midi_time_now() +
+	    secs * MIDI_TIME_NSEC_PER_SEC);
 
-		if(doshutdown)
-			break;
+	(void) midi_clock_stop(&mc);
 
-		while(!midi_queue_isempty(midi_outq)) {
+	/* Give the Stop a couple of ticks to go out. */
+	(void) midi_time_sleepuntil(midi_time_now() + 2 * mc.mc_period);
 
+	midi_clock_report(stdout, &mc);
 
-			ret = midi_queue_getnext(midi_outq, &msg);
-			if(ret != 0) {
-				fprintf(stderr, "Can't get next message"
-				    " from queue: %s\n"
-				    " This is bad, exiting\n", strerror(ret));
-				exit(-1);
-			}
+	return midi_clock_uninit(&mc);
+}
 
-			midimsg = binit();
 
-			if(msg.mm_type == MIDI_MSG_SYSEX && msg.mm_payload
-			    && msg.mm_payload_siz > 0) {
-				
-				/* Send message */
-				bprintf(midimsg, "%c", 0xF0); /* SysEx begin */
-				bmemcat(midimsg, (char *) msg.mm_payload,
-				    msg.mm_payload_siz);      /* Payload     */
-				bprintf(midimsg, "%c", 0xF7); /* SysEx end   */
-			}
+int
+cmd_cc(int argc, char **argv, int chan)
+{
+	/* Sends argc / 2 Control Changes given as number / value pairs on
+	 * the device's channel. Repeated controllers are coalesced by the
+	 * writer, so only the last value of each is certain to go out. */
 
-	
-			if(!bstrempty(midimsg)) {
-				ret = midi_osx_sendmsg(
-				    (unsigned char *) bget(midimsg),
-				    bstrlen(midimsg));
-				if(ret != 0) {
-					fprintf(stderr,
-					    "Couldn't send MIDI message.\n");
-				} else {
-#if 0
-					printf("MIDI message sent.\n");
-#endif
-				}
+	int		ret;
+	int		i;
+	int		num;
+	int		val;
+	int		cnt;
+	char		*endp;
 
-			} else {
-				printf("MIDI message not sent.\n");
-			}
+	cnt = 0;
 
+	ret = pthread_mutex_lock(&midi_outq->mq_mutex);
+	if(ret != 0) {
+		fprintf(stderr, "Can't lock queue: %s\n", strerror(ret));
+		return ret;
+	}
 
-			buninit(&midimsg);
-			(void) midi_msg_free_payload(&msg);
-				
+	for(i = 0; i + 1 < argc; i += 2) {
+		num = strtol(argv[i], &endp, 0);
+		if(*endp || num < 0 || num > 0x7F) {
+			fprintf(stderr, "Invalid controller number: %s\n",
+			    argv[i]);
+			ret = EINVAL;
+			break;
 		}
-
-		/* No more items to process, so go to sleep until
-		 * something happens on the queue */
-		btimespec_tonow(&condwaitto);
-		btimespec_addus(&condwaitto, MIDIIO_WAKEUP_MS * 1000);
-		ret = pthread_cond_timedwait(&midi_outq->mq_cond,
-		    &midi_outq->mq_mutex, &condwaitto);
-		if(ret != 0 && ret != ETIMEDOUT) {
-			fprintf(stderr, "Error while waiting on condvar: %s\n"
-			    " This is bad, exiting\n", strerror(ret));
-			exit(-1);
+		val = strtol(argv[i + 1], &endp, 0);
+		if(*endp || val < 0 || val > 0x7F) {
+			fprintf(stderr, "Invalid controller value: %s\n",
+			    argv[i + 1]);
+			ret = EINVAL;
+			break;
 		}
-	}
 
-	ret = pthread_mutex_unlock(&midi_outq->mq_mutex);
-	if(ret != 0) {
-		fprintf(stderr, "Can't unlock queue: %s\n", strerror(ret));
-		return (void *) -1;
+		ret = midi_queue_addmsg_chancc(midi_outq, chan, num, val);
+		if(ret != 0) {
+			fprintf(stderr, "Can't queue Control Change: %s\n",
+			    strerror(ret));
+			break;
+		}
+		++cnt;
 	}
 
-#if 0
-	printf("MIDI writer thread exiting.\n");
-	fflush(stdout);
-#endif
+	(void) pthread_mutex_unlock(&midi_outq->mq_mutex);
 
-	return (void *) 0;
+	/* Give the writer time to put them on the wire. */
+	(void) midi_time_sleepuntil(midi_time_now() +
+	    MIDIIO_WAKEUP_MS * MIDI_TIME_NSEC_PER_MSEC +
+	    cnt * MIDI_MSG_SHORTSIZ * MIDI_TIME_NSEC_PER_SEC /
+	    MIDI_WIRE_BYTES_PER_SEC);
 
+	return ret;
 }
 
 
 int
-set_prog_state(int newstate)
+cmd_watch(midi_ring_t *ring, int chan, int part, int secs)
 {
-	int	ret;
+	/* Seeds a mirror of the current pattern with one dump, then follows
+	 * the panel of part for secs seconds and prints every parameter
+	 * that changes, without asking the device again. The request and
+	 * the mirror read the ring each on their own, so nothing that comes
+	 * while waiting for the dump is lost. */
+
+	int				ret;
+	unsigned char			midireq[] = { 0x42, 0x30, 0x00, 0x01,
+					    0x23, E2_FUNC_CURPAT_REQ };
+	midi_xact_t			mx;
+	midi_mirror_t			mi;
+	midi_msg_t			msg;
+	const midi_msg_t		*cmsg;
+	midi_ring_cons_t		*mirror_rc;
+	midi_ring_cons_t		*xact_rc;
+	midi_queue_t			*backlog;
+	watch_drain_t			wd;
+	pthread_t			drain_thrd;
+	uint64_t			deadline;
+
+	midireq[1] |= chan;
+
+	ret = midi_mirror_init(&mi, chan, MIDI_EP_ANY);
+	if(ret != 0)
+		return ret;
+	(void) midi_mirror_setpart(&mi, part);
+
+	/* What comes before the mirror is seeded waits here. Clocks and CCs
+	 * are thinned out like on the input queue. */
+	backlog = NULL;
+	ret = midi_queue_init(&backlog);
+	if(ret == 0)
+		ret = midi_queue_setinput(backlog, "Watch backlog");
+	if(ret != 0) {
+		fprintf(stderr, "Can't initialize backlog queue\n");
+		if(backlog)
+			(void) midi_queue_uninit(&backlog);
+		(void) midi_mirror_uninit(&mi);
+		return ret;
+	}
+
+	mirror_rc = xact_rc = NULL;
+	ret = midi_ring_join(ring, "mirror", &mirror_rc);
+	if(ret == 0)
+		ret = midi_ring_join(ring, "request", &xact_rc);
+	if(ret != 0) {
+		fprintf(stderr, "Can't read input ring: %s\n", strerror(ret));
+		if(mirror_rc)
+			(void) midi_ring_leave(&mirror_rc);
+		(void) midi_queue_uninit(&backlog);
+		(void) midi_mirror_uninit(&mi);
+		return ret;
+	}
 
-	ret = pthread_rwlock_wrlock(&prog_state_rwlock);
+	/* NOTE: The mirror's consumer belongs to the drain thread until it
+	 * has been joined, then to us. */
+	wd.wd_rc = mirror_rc;
+	wd.wd_backlog = backlog;
+	atomic_init(&wd.wd_stop, 0);
+	ret = pthread_create(&drain_thrd, NULL, watch_drain, &wd);
 	if(ret != 0) {
-		fprintf(stderr,
-		    "Can't lock global state rwlock for writing: %s\n",
+		fprintf(stderr, "Can't create drain thread: %s\n",
 		    strerror(ret));
+		(void) midi_ring_leave(&xact_rc);
+		(void) midi_ring_leave(&mirror_rc);
+		(void) midi_queue_uninit(&backlog);
+		(void) midi_mirror_uninit(&mi);
 		return ret;
 	}
 
-	prog_state = newstate;
-	
-	ret = pthread_rwlock_unlock(&prog_state_rwlock);
+	(void) midi_xact_init(&mx, midi_inq, MIDI_EP_ANY, e2_reply_iserr);
+	(void) midi_xact_setring(&mx, xact_rc);
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_type = MIDI_MSG_SYSEX;
+	msg.mm_src = MIDI_EP_ANY;
+	ret = midi_xact_request(&mx, midireq, sizeof(midireq), E2_HDR_SIZ,
+	    E2_HDR_SIZ + 1 + E2_PAT_ENCSIZ, &msg.mm_payload,
+	    &msg.mm_payload_siz);
+	(void) midi_ring_leave(&xact_rc);
+
+	atomic_store(&wd.wd_stop, 1);
+	(void) pthread_join(drain_thrd, NULL);
+
+	if(ret == 0) {
+		ret = midi_mirror_feed(&mi, &msg, NULL);
+		(void) midi_msg_free_payload(&msg);
+	}
 	if(ret != 0) {
-		fprintf(stderr,
-		    "Can't unlock global state rwlock after writing: %s\n",
+		fprintf(stderr, "Can't get current pattern: %s\n",
 		    strerror(ret));
+		(void) midi_ring_leave(&mirror_rc);
+		(void) midi_queue_uninit(&backlog);
+		(void) midi_mirror_uninit(&mi);
 		return ret;
 	}
 
-	return 0;
+	/* The mirror catches up with what came during the dump first. The
+	 * drain thread is gone, nobody else uses the backlog. */
+	while(midi_queue_getnext(backlog, &msg) == 0) {
+		watch_feed(&mi, part, &msg);
+		(void) midi_msg_free_payload(&msg);
+	}
+
+	deadline = midi_time_now() + secs * MIDI_TIME_NSEC_PER_SEC;
+
+	while((ret = midi_ring_next(mirror_rc, deadline, &cmsg)) == 0) {
+		watch_feed(&mi, part, cmsg);
+		midi_ring_release(mirror_rc);
+	}
+	if(ret != ETIMEDOUT)
+		fprintf(stderr, "Can't read input ring: %s\n", strerror(ret));
+
+	printf("%llu updates, %llu queries answered, %llu stale,"
+	    " %llu messages dropped\n",
+	    (unsigned long long) mi.mi_updates,
+	    (unsigned long long) mi.mi_hits,
+	    (unsigned long long) mi.mi_misses,
+	    (unsigned long long) (midi_ring_dropped(ring) +
+	    backlog->mq_dropped));
+
+	(void) midi_ring_leave(&mirror_rc);
+	(void) midi_queue_uninit(&backlog);
+
+	return midi_mirror_uninit(&mi);
+}
 
+
+void *
+watch_drain(void *arg)
+{
+	/* Keeps the mirror's cursor moving while the dump is requested, so
+	 * that it doesn't hold up the ring. What it reads is copied to the
+	 * backlog. */
+
+	watch_drain_t		*wd;
+	const midi_msg_t	*cmsg;
+	midi_msg_t		msg;
+	int			ret;
+
+	wd = arg;
+
+	while(!atomic_load(&wd->wd_stop)) {
+		ret = midi_ring_next(wd->wd_rc, midi_time_now() +
+		    WATCH_DRAIN_MS * MIDI_TIME_NSEC_PER_MSEC, &cmsg);
+		if(ret == ETIMEDOUT)
+			continue;
+		if(ret != 0) {
+			fprintf(stderr, "Can't read input ring: %s\n",
+			    strerror(ret));
+			break;
+		}
+
+		/* A full backlog reports itself. */
+		(void) pthread_mutex_lock(&wd->wd_backlog->mq_mutex);
+		if(cmsg->mm_type == MIDI_MSG_SYSEX) {
+			(void) midi_queue_addmsg_sysex_from(wd->wd_backlog,
+			    cmsg->mm_src, cmsg->mm_payload,
+			    cmsg->mm_payload_siz);
+		} else {
+			msg = *cmsg;
+			msg.mm_payload = NULL;
+			msg.mm_payload_siz = 0;
+			(void) midi_queue_addmsg(wd->wd_backlog, &msg);
+		}
+		(void) pthread_mutex_unlock(&wd->wd_backlog->mq_mutex);
+
+		midi_ring_release(wd->wd_rc);
+	}
+
+	return NULL;
+}
+
+
+void
+watch_feed(midi_mirror_t *mi, int part, const midi_msg_t *msg)
+{
+	/* Applies msg to the mirror and prints the parameter it changed. */
+
+	const midi_mirror_param_t	*mp;
+	int				val;
+	int				ret;
+
+	(void) midi_mirror_feed(mi, msg, &mp);
+	if(mp == NULL)
+		return;
+
+	ret = midi_mirror_getparam(mi, part, mp->mp_name, &val);
+	if(ret == 0)
+		printf("part %d %s = %d\n", part, mp->mp_name, val);
+	else
+		printf("part %d %s: %s\n", part, mp->mp_name, strerror(ret));
+	fflush(stdout);
 }
 
 
 int
-decode_payload(bstr_t *dec, unsigned char *enc, size_t encsiz)
+cmd_dump(int chan)
 {
-	/* All bytes in MIDI payloads have to have their MSB set to 0
-	 * (ie. < 0x80) so that interleaved MIDI commands can be distinguished
-	 * during transfer (all MIDI commands are >= 0x80). This is done by
-	 * taking 7 bytes of payload, stripping them of their MSBs and adding
-	 * an 8th byte that contains the 7 bytes' MSBs.
-	 */
-
-	unsigned char	cur;
-	unsigned char	msb_byte;
+	int		ret;
+	//unsigned char	midireq[] = { 0x42, 0x50, 0x00, 0x01 };
+	//unsigned char	midireq[] = { 0x7E, 0x7F, 0x06, 0x01 };
+	unsigned char	midireq[] = { 0x42, 0x30, 0x00, 0x01, 0x23, 0x10 };
+	bstr_t		*sysex_payload;
+	midi_xact_t	mx;
+	unsigned char	*midi_resp;
+	size_t		midi_resp_siz;
+#if 0
+	unsigned char	*buf;
 	int		i;
+#endif
 
-	if(dec == NULL || enc == 0 || encsiz == 0)
-		return EINVAL;
+	sysex_payload = NULL;
+	midi_resp = NULL;
+	midi_resp_siz = 0;
 
-	for(i = 0; i < encsiz; ++i) {
-		cur = enc[i];
-	
-		if(i % 8 == 0) {
-			/* This is the byte that contains the MSBs. */
-			msb_byte = cur;
-			continue;
+	midireq[1] |= chan;
+
+	(void) midi_xact_init(&mx, midi_inq, MIDI_EP_ANY, e2_reply_iserr);
+
+	/* Usually a MIDI program would have a writer and a reader thread.
+	 * However, since here we're just waiting for a specific response,
+	 * we're essentially executing the "reader thread" on the main
+	 * thread. */
+
+	ret = midi_xact_request(&mx, midireq, sizeof(midireq), E2_HDR_SIZ,
+	    E2_HDR_SIZ + 1 + E2_PAT_ENCSIZ, &midi_resp, &midi_resp_siz);
+
+	if(ret == ETIMEDOUT) {
+		fprintf(stderr, "Timeout: no answer from device.\n");
+	} else
+	if(ret != 0) {
+		fprintf(stderr, "Error: %s.\n", strerror(ret));
+	} else
+	if(midi_resp == NULL || midi_resp_siz <= E2_HDR_SIZ + 1) {
+		fprintf(stderr, "Empty response.\n");
+	} else {
+#if 0
+		printf("MIDI response, siz = %zu, msg = ", midi_resp_siz);
+		for(i = 0; i < midi_resp_siz; ++i) {
+			printf("0x%02x ", midi_resp[i]);
 		}
+		printf("\n");
+#endif
 
-		/* Add the MSB. */
-		cur += (msb_byte & 1) << 7;
+		sysex_payload = binit();
+		if(sysex_payload == NULL) {
+			fprintf(stderr,
+			    "Can't allocate memory for decoded payload.\n");
+		} else {
+			ret = midi_codec_decode(sysex_payload,
+			    midi_resp + E2_HDR_SIZ + 1,
+			    midi_resp_siz - E2_HDR_SIZ - 1);
+			MIDI_TRACE_STAGE(mx.mx_lastid, MIDI_TRACE_DECODED);
+			if(ret != 0) {
+				fprintf(stderr,
+				    "Can't decode payload.\n");
+			} else {
+#if 0
+				buf = (unsigned char *) bget(sysex_payload);
+				if(buf) {
+					printf("decoded, siz = %i, msg =\n",
+					    bstrlen(sysex_payload));
+					for(i = 0; i < bstrlen(sysex_payload);
+					    ++i) {
+						printf("%d. 0x%02x\n",
+						    i, buf[i]);
+					}
+					printf("\n");
+				}
+#endif
 
-		bmemcat(dec, (char *) &cur, 1);
+				ret = btofilep(stdout, sysex_payload);
+				if(ret != 0) {
+					fprintf(stderr,
+					    "Can't write sysex to output.\n");
+				}
+				MIDI_TRACE_STAGE(mx.mx_lastid,
+				    MIDI_TRACE_WRITTEN);
+			}
 
-		/* Move up the bits in the MSB byte. */
-		msb_byte >>= 1;
-	
+		}
 	}
 
-	return 0;
+	buninit(&sysex_payload);
+	if(midi_resp)
+		free(midi_resp);
+
+	return ret;
+}
+
+
+int
+e2_reply_iserr(unsigned char *resp, size_t respsiz)
+{
+	if(resp == NULL || respsiz <= E2_HDR_FUNC)
+		return 0;
+
+	switch(resp[E2_HDR_FUNC]) {
+	case E2_FUNC_FORMAT_ERR:
+	case E2_FUNC_LOAD_ERR:
+	case E2_FUNC_WRITE_ERR:
+		return 1;
+	default:
+		return 0;
+	}
 }
 
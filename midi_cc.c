@@ -0,0 +1,150 @@
+/*
+ * Control Change coalescing.
+ *
+ * A knob turned quickly can produce CCs faster than a 31.25 kbaud link
+ * carries them (about 1000 per second). Instead of queueing them all, the
+ * writer keeps only the latest value of each controller and sends it when
+ * the wire is free, so what goes out is always current.
+ *
+ * Entries are looked up by (channel, controller), then by destination,
+ * which is almost always the only one.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "midi_cc.h"
+
+
+void
+midi_cctab_init(midi_cctab_t *ct)
+{
+	int	c;
+	int	n;
+	int	i;
+
+	memset(ct, 0, sizeof(midi_cctab_t));
+
+	for(c = 0; c < MIDI_CC_CHANS; ++c) {
+		for(n = 0; n < MIDI_CC_NUMS; ++n)
+			ct->ct_hash[c][n] = MIDI_CC_NONE;
+	}
+
+	for(i = 0; i < MIDI_CC_MAXPENDING; ++i)
+		ct->ct_ent[i].ce_next = i + 1 < MIDI_CC_MAXPENDING ? i + 1 :
+		    MIDI_CC_NONE;
+	ct->ct_free = 0;
+	ct->ct_head = ct->ct_tail = MIDI_CC_NONE;
+}
+
+
+int
+midi_cctab_set(midi_cctab_t *ct, int dest, int chan, int num, int val,
+	uint64_t when, uint64_t seq)
+{
+	/* Returns ENOBUFS if too many controllers are pending. */
+
+	midi_cc_ent_t	*ce;
+	int		i;
+
+	if(ct == NULL || chan < 0 || chan >= MIDI_CC_CHANS || num < 0 ||
+	    num >= MIDI_CC_NUMS || val < 0 || val > 0x7F)
+		return EINVAL;
+
+	for(i = ct->ct_hash[chan][num]; i != MIDI_CC_NONE;
+	    i = ct->ct_ent[i].ce_hnext) {
+		ce = &ct->ct_ent[i];
+		if(ce->ce_dest == dest) {
+			/* Last value wins, it keeps the place in line. */
+			ce->ce_val = val;
+			ce->ce_time = when;
+			++ct->ct_coalesced;
+			return 0;
+		}
+	}
+
+	if(ct->ct_free == MIDI_CC_NONE)
+		return ENOBUFS;
+
+	i = ct->ct_free;
+	ce = &ct->ct_ent[i];
+	ct->ct_free = ce->ce_next;
+
+	ce->ce_dest = dest;
+	ce->ce_chan = chan;
+	ce->ce_num = num;
+	ce->ce_val = val;
+	ce->ce_time = when;
+	ce->ce_seq = seq;
+
+	ce->ce_hnext = ct->ct_hash[chan][num];
+	ct->ct_hash[chan][num] = i;
+
+	ce->ce_prev = ct->ct_tail;
+	ce->ce_next = MIDI_CC_NONE;
+	if(ct->ct_tail != MIDI_CC_NONE)
+		ct->ct_ent[ct->ct_tail].ce_next = i;
+	else
+		ct->ct_head = i;
+	ct->ct_tail = i;
+	++ct->ct_cnt;
+
+	return 0;
+}
+
+
+midi_cc_ent_t *
+midi_cctab_iter(midi_cctab_t *ct, midi_cc_ent_t *ce)
+{
+	int	i;
+
+	if(ct == NULL)
+		return NULL;
+
+	i = ce ? ce->ce_next : ct->ct_head;
+
+	return i == MIDI_CC_NONE ? NULL : &ct->ct_ent[i];
+}
+
+
+void
+midi_cctab_take(midi_cctab_t *ct, midi_cc_ent_t *ce)
+{
+	/* The entry is free again, its fields can still be read until the
+	 * next midi_cctab_set(). */
+
+	int	*p;
+	int	i;
+
+	if(ct == NULL || ce == NULL)
+		return;
+
+	i = ce - ct->ct_ent;
+
+	for(p = &ct->ct_hash[ce->ce_chan][ce->ce_num]; *p != i;
+	    p = &ct->ct_ent[*p].ce_hnext)
+		;
+	*p = ce->ce_hnext;
+
+	if(ce->ce_prev != MIDI_CC_NONE)
+		ct->ct_ent[ce->ce_prev].ce_next = ce->ce_next;
+	else
+		ct->ct_head = ce->ce_next;
+	if(ce->ce_next != MIDI_CC_NONE)
+		ct->ct_ent[ce->ce_next].ce_prev = ce->ce_prev;
+	else
+		ct->ct_tail = ce->ce_prev;
+	--ct->ct_cnt;
+
+	ce->ce_next = ct->ct_free;
+	ct->ct_free = i;
+}
+
+
+int
+midi_cctab_pending(midi_cctab_t *ct)
+{
+	if(ct == NULL)
+		return 0;
+
+	return ct->ct_cnt;
+}
@@ -0,0 +1,49 @@
+#ifndef MIDI_CC_H
+#define MIDI_CC_H
+
+#include <stdint.h>
+
+#define MIDI_CC_CHANS		16
+#define MIDI_CC_NUMS		128
+#define MIDI_CC_MAXPENDING	2048	/* Controllers pending at once */
+#define MIDI_CC_NONE		-1
+
+/* Latest value of every (destination, channel, controller) that still has
+ * to be sent, in the order they first became pending. Setting a controller
+ * that's already pending for the same destination just replaces its value
+ * and time. */
+typedef struct midi_cc_ent {
+	int		ce_dest;
+	int		ce_chan;
+	int		ce_num;
+	int		ce_val;
+	uint64_t	ce_time;	/* Due (midi_time_now()), 0: now */
+	uint64_t	ce_seq;		/* The caller's, from when it became
+					 * pending */
+	int		ce_hnext;	/* Same (chan, num), other dest */
+	int		ce_prev;	/* Pending order */
+	int		ce_next;
+} midi_cc_ent_t;
+
+typedef struct midi_cctab {
+	int		ct_hash[MIDI_CC_CHANS][MIDI_CC_NUMS];
+	midi_cc_ent_t	ct_ent[MIDI_CC_MAXPENDING];
+	int		ct_free;	/* Linked by ce_next */
+	int		ct_head;	/* Pending the longest */
+	int		ct_tail;
+	int		ct_cnt;
+	uint64_t	ct_coalesced;	/* Values replaced before sending */
+} midi_cctab_t;
+
+/* NOTE: The table has no lock, it belongs to the writer thread. */
+void midi_cctab_init(midi_cctab_t *);
+int midi_cctab_set(midi_cctab_t *, int, int, int, int, uint64_t, uint64_t);
+
+/* Goes through what is pending, oldest first: NULL gives the first one.
+ * An entry can be taken while going through, once the next one has been
+ * got. */
+midi_cc_ent_t *midi_cctab_iter(midi_cctab_t *, midi_cc_ent_t *);
+void midi_cctab_take(midi_cctab_t *, midi_cc_ent_t *);
+int midi_cctab_pending(midi_cctab_t *);
+
+#endif
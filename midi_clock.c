@@ -0,0 +1,256 @@
+/*
+ * MIDI clock master.
+ *
+ * A thread sends Timing Clock (0xF8) at 24 PPQN. Each tick is due at an
+ * absolute time computed from the start of the current tempo, so however
+ * late one wakeup is, it doesn't push the following ones back. Ticks are
+ * queued slightly ahead of time with their due time as timestamp. Start,
+ * Stop and Continue go out right before the next tick so that they line
+ * up with the clock.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "midi_clock.h"
+#include "midi_queue.h"
+#include "midi_rt.h"
+
+extern midi_queue_t *midi_outq;
+
+void *_midi_clock_thread(void *);
+int _midi_clock_settransport(midi_clock_t *, int);
+
+
+int
+midi_clock_init(midi_clock_t *mc, int dest, double bpm)
+{
+	int	ret;
+
+	if(mc == NULL)
+		return EINVAL;
+
+	if(bpm < MIDI_CLOCK_MINBPM || bpm > MIDI_CLOCK_MAXBPM)
+		return ERANGE;
+
+	memset(mc, 0, sizeof(midi_clock_t));
+	mc->mc_dest = dest;
+	mc->mc_bpm = bpm;
+	mc->mc_transport = -1;
+	mc->mc_period = (uint64_t) (60.0 * MIDI_TIME_NSEC_PER_SEC /
+	    (bpm * MIDI_CLOCK_PPQN));
+	midi_latstat_init(&mc->mc_jitter);
+
+	ret = pthread_mutex_init(&mc->mc_mutex, NULL);
+	if(ret != 0) {
+		fprintf(stderr, "Can't create mutex for MIDI clock: %s\n",
+		    strerror(ret));
+		return ret;
+	}
+
+	mc->mc_base = midi_time_now();
+
+	ret = pthread_create(&mc->mc_thrd, NULL, _midi_clock_thread, mc);
+	if(ret != 0) {
+		fprintf(stderr, "Can't start MIDI clock thread: %s\n",
+		    strerror(ret));
+		(void) pthread_mutex_destroy(&mc->mc_mutex);
+		return ret;
+	}
+	mc->mc_thrd_running++;
+
+	return 0;
+}
+
+
+int
+midi_clock_uninit(midi_clock_t *mc)
+{
+	int	ret;
+
+	if(mc == NULL || !mc->mc_thrd_running)
+		return EINVAL;
+
+	ret = pthread_mutex_lock(&mc->mc_mutex);
+	if(ret != 0)
+		return ret;
+	mc->mc_quit++;
+	(void) pthread_mutex_unlock(&mc->mc_mutex);
+
+	ret = pthread_join(mc->mc_thrd, NULL);
+	if(ret != 0) {
+		fprintf(stderr, "Can't join MIDI clock thread.\n");
+		return ret;
+	}
+	mc->mc_thrd_running = 0;
+
+	(void) pthread_mutex_destroy(&mc->mc_mutex);
+
+	return 0;
+}
+
+
+int
+midi_clock_setbpm(midi_clock_t *mc, double bpm)
+{
+	int	ret;
+
+	if(mc == NULL)
+		return EINVAL;
+
+	if(bpm < MIDI_CLOCK_MINBPM || bpm > MIDI_CLOCK_MAXBPM)
+		return ERANGE;
+
+	ret = pthread_mutex_lock(&mc->mc_mutex);
+	if(ret != 0)
+		return ret;
+
+	/* The tick that's already due keeps its time; the new tempo
+	 * counts from there. */
+	mc->mc_base += mc->mc_tickcnt * mc->mc_period;
+	mc->mc_tickcnt = 0;
+	mc->mc_bpm = bpm;
+	mc->mc_period = (uint64_t) (60.0 * MIDI_TIME_NSEC_PER_SEC /
+	    (bpm * MIDI_CLOCK_PPQN));
+
+	(void) pthread_mutex_unlock(&mc->mc_mutex);
+
+	return 0;
+}
+
+
+int
+midi_clock_start(midi_clock_t *mc)
+{
+	return _midi_clock_settransport(mc, MIDI_MSG_SYSRT_START);
+}
+
+
+int
+midi_clock_stop(midi_clock_t *mc)
+{
+	return _midi_clock_settransport(mc, MIDI_MSG_SYSRT_STOP);
+}
+
+
+int
+midi_clock_continue(midi_clock_t *mc)
+{
+	return _midi_clock_settransport(mc, MIDI_MSG_SYSRT_CONTINUE);
+}
+
+
+int
+_midi_clock_settransport(midi_clock_t *mc, int type)
+{
+	int	ret;
+
+	if(mc == NULL)
+		return EINVAL;
+
+	ret = pthread_mutex_lock(&mc->mc_mutex);
+	if(ret != 0)
+		return ret;
+
+	mc->mc_transport = type;
+
+	(void) pthread_mutex_unlock(&mc->mc_mutex);
+
+	return 0;
+}
+
+
+void *
+_midi_clock_thread(void *arg)
+{
+	midi_clock_t	*mc;
+	uint64_t	due;
+	uint64_t	now;
+	int		transport;
+	int		quit;
+	int		ret;
+
+	mc = (midi_clock_t *) arg;
+
+	(void) midi_rt_thread("clock");
+
+	while(1) {
+		ret = pthread_mutex_lock(&mc->mc_mutex);
+		if(ret != 0) {
+			fprintf(stderr, "Can't lock MIDI clock: %s\n",
+			    strerror(ret));
+			return (void *) -1;
+		}
+		due = mc->mc_base + mc->mc_tickcnt * mc->mc_period;
+		quit = mc->mc_quit;
+		(void) pthread_mutex_unlock(&mc->mc_mutex);
+
+		if(quit)
+			break;
+
+		/* Wake up a little early and hand the tick over with its
+		 * timestamp, the system sends it at the right time. */
+		(void) midi_time_sleepuntil(due - MIDI_CLOCK_LEAD_NS);
+		now = midi_time_now() + MIDI_CLOCK_LEAD_NS;
+
+		ret = pthread_mutex_lock(&mc->mc_mutex);
+		if(ret != 0) {
+			fprintf(stderr, "Can't lock MIDI clock: %s\n",
+			    strerror(ret));
+			return (void *) -1;
+		}
+
+		midi_latstat_add(&mc->mc_jitter, (int64_t) (now - due));
+		if(now > due + mc->mc_period)
+			mc->mc_latecnt++;
+
+		transport = mc->mc_transport;
+		mc->mc_transport = -1;
+		mc->mc_tickcnt++;
+
+		(void) pthread_mutex_unlock(&mc->mc_mutex);
+
+		ret = pthread_mutex_lock(&midi_outq->mq_mutex);
+		if(ret != 0) {
+			fprintf(stderr, "Can't lock queue: %s\n",
+			    strerror(ret));
+			return (void *) -1;
+		}
+
+		if(transport >= 0) {
+			ret = midi_queue_addmsg_sysrt_at(midi_outq,
+			    mc->mc_dest, due, transport);
+			if(ret != 0) {
+				fprintf(stderr, "Can't add MIDI message: %s\n",
+				    strerror(ret));
+			}
+		}
+
+		ret = midi_queue_addmsg_sysrt_at(midi_outq, mc->mc_dest, due,
+		    MIDI_MSG_SYSRT_CLOCK);
+		if(ret != 0) {
+			fprintf(stderr, "Can't add MIDI message: %s\n",
+			    strerror(ret));
+		}
+
+		(void) pthread_mutex_unlock(&midi_outq->mq_mutex);
+	}
+
+	return (void *) 0;
+}
+
+
+void
+midi_clock_report(FILE *f, midi_clock_t *mc)
+{
+	if(pthread_mutex_lock(&mc->mc_mutex) != 0)
+		return;
+
+	fprintf(f, "Clock: %.1f BPM, period %.1fus, %llu ticks late by more"
+	    " than a period\n", mc->mc_bpm, mc->mc_period / 1000.0,
+	    (unsigned long long) mc->mc_latecnt);
+	midi_latstat_print(f, "Tick wakeup lateness", &mc->mc_jitter);
+
+	(void) pthread_mutex_unlock(&mc->mc_mutex);
+}
@@ -0,0 +1,48 @@
+#ifndef MIDI_CLOCK_H
+#define MIDI_CLOCK_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "midi_time.h"
+
+#define MIDI_CLOCK_PPQN		24
+#define MIDI_CLOCK_MINBPM	20.0	/* electribe tempo range */
+#define MIDI_CLOCK_MAXBPM	300.0
+
+/* How long before a tick is due it's put on the out queue. Should be less
+ * than the writer's lookahead. */
+#define MIDI_CLOCK_LEAD_NS	(2 * MIDI_TIME_NSEC_PER_MSEC)
+
+typedef struct midi_clock {
+	int		mc_dest;
+	double		mc_bpm;
+	int		mc_transport;	/* Sent before the next tick */
+	int		mc_quit;
+	pthread_mutex_t	mc_mutex;
+	pthread_t	mc_thrd;
+	int		mc_thrd_running;
+
+	/* Tick n is due at mc_base + n * mc_period. Changing the tempo
+	 * starts a new base at the next tick. */
+	uint64_t	mc_base;
+	uint64_t	mc_period;
+	uint64_t	mc_tickcnt;
+	uint64_t	mc_latecnt;	/* Ticks later than a whole period */
+
+	midi_latstat_t	mc_jitter;	/* Wakeup lateness (ns), relative
+					 * to due - MIDI_CLOCK_LEAD_NS */
+} midi_clock_t;
+
+/* NOTE: The clock puts its messages on midi_outq, so the writer thread must
+ * be running while the clock is. */
+int midi_clock_init(midi_clock_t *, int, double);
+int midi_clock_uninit(midi_clock_t *);
+
+int midi_clock_setbpm(midi_clock_t *, double);
+int midi_clock_start(midi_clock_t *);
+int midi_clock_stop(midi_clock_t *);
+int midi_clock_continue(midi_clock_t *);
+
+void midi_clock_report(FILE *, midi_clock_t *);
+
+#endif
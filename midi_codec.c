@@ -0,0 +1,122 @@
+/*
+ * Encoding of data carried in sysex payloads.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include "midi_codec.h"
+
+
+int
+midi_codec_decode(bstr_t *dec, unsigned char *enc, size_t encsiz)
+{
+	/* All bytes in MIDI payloads have to have their MSB set to 0
+	 * (ie. < 0x80) so that interleaved MIDI commands can be distinguished
+	 * during transfer (all MIDI commands are >= 0x80). This is done by
+	 * taking 7 bytes of payload, stripping them of their MSBs and adding
+	 * an 8th byte that contains the 7 bytes' MSBs.
+	 */
+
+	unsigned char	cur;
+	unsigned char	msb_byte;
+	int		i;
+
+	if(dec == NULL || enc == 0 || encsiz == 0)
+		return EINVAL;
+
+	for(i = 0; i < encsiz; ++i) {
+		cur = enc[i];
+	
+		if(i % 8 == 0) {
+			/* This is the byte that contains the MSBs. */
+			msb_byte = cur;
+			continue;
+		}
+
+		/* Add the MSB. */
+		cur += (msb_byte & 1) << 7;
+
+		bmemcat(dec, (char *) &cur, 1);
+
+		/* Move up the bits in the MSB byte. */
+		msb_byte >>= 1;
+	
+	}
+
+	return 0;
+}
+
+
+size_t
+midi_codec_encsiz(size_t siz)
+{
+	/* Whole groups of 8 for every 7 bytes, then the MSB byte and what
+	 * is needed of the last group. */
+
+	if(siz == 0)
+		return 0;
+
+	return (siz - 1) / 7 * 8 + (siz - 1) % 7 + 2;
+}
+
+
+int
+midi_codec_decode_range(unsigned char *dec, const unsigned char *enc,
+	size_t encsiz, size_t off, size_t siz)
+{
+	/* Every group is 8 bytes for 7, so where a decoded byte comes from
+	 * can be worked out without going through the ones before: byte n is
+	 * byte n % 7 of group n / 7, and its MSB is bit n % 7 of the group's
+	 * first byte. */
+
+	const unsigned char	*grp;
+	size_t			i;
+	size_t			n;
+
+	if(dec == NULL || enc == NULL)
+		return EINVAL;
+
+	if(off + siz < off)
+		return ERANGE;
+
+	if(midi_codec_encsiz(off + siz) > encsiz)
+		return ENODATA;
+
+	for(i = 0; i < siz; ++i) {
+		n = off + i;
+		grp = enc + n / 7 * 8;
+		dec[i] = grp[1 + n % 7] | ((grp[0] >> (n % 7)) & 1) << 7;
+	}
+
+	return 0;
+}
+
+
+int
+midi_codec_encode(bstr_t *enc, unsigned char *dec, size_t decsiz)
+{
+	/* The reverse of midi_codec_decode(): every 7 bytes become a byte
+	 * holding their MSBs followed by the 7 bytes without them. The last
+	 * group can be shorter. */
+
+	unsigned char	group[8];
+	size_t		i;
+	int		k;
+	int		n;
+
+	if(enc == NULL || dec == NULL || decsiz == 0)
+		return EINVAL;
+
+	for(i = 0; i < decsiz; i += 7) {
+		n = decsiz - i < 7 ? decsiz - i : 7;
+
+		group[0] = 0;
+		for(k = 0; k < n; ++k) {
+			group[0] |= (dec[i + k] >> 7) << k;
+			group[k + 1] = dec[i + k] & 0x7F;
+		}
+
+		bmemcat(enc, (char *) group, n + 1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef MIDI_CODEC_H
+#define MIDI_CODEC_H
+
+#include <stddef.h>
+#include "bstr.h"
+
+/* Decodes 8 bit data that was sent as 7 bit bytes (groups of an MSB byte
+ * followed by up to 7 data bytes) and appends it to the bstr. */
+int midi_codec_decode(bstr_t *, unsigned char *, size_t);
+int midi_codec_encode(bstr_t *, unsigned char *, size_t);
+
+/* Encoded bytes it takes to carry the first siz decoded bytes, ie. how
+ * much of a dump has to have come in to read up to there. */
+size_t midi_codec_encsiz(size_t);
+
+/* Decodes siz bytes at decoded offset off straight from the encoded data,
+ * leaving out everything before and after. ENODATA if the encoded data
+ * doesn't reach that far (yet). */
+int midi_codec_decode_range(unsigned char *, const unsigned char *, size_t,
+	size_t, size_t);
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * Device discovery.
+ *
+ * A Universal Device Inquiry and a Korg Search Device request are sent to
+ * every destination in the system at once. Replies are collected until a
+ * single shared deadline. Korg devices echo back the ID that was in the
+ * request, which we set to the destination's index, so for them we learn
+ * the destination directly. For everything else the destination is taken
+ * to be the one on the same entity as the source the reply came in on.
+ *
+ * The result can be saved to a cache file so that later runs can open
+ * only the endpoints they need.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "midi_discover.h"
+#include "midi_queue.h"
+#include "btime.h"
+
+extern midi_queue_t *midi_inq;
+extern midi_queue_t *midi_outq;
+
+int _midi_discover_reply(midi_dev_t *, int, int *, midi_msg_t *);
+midi_dev_t *_midi_discover_getdev(midi_dev_t *, int, int *, int);
+
+
+int
+midi_discover(midi_dev_t *devs, int maxdevs, int *devcnt, int timeout_ms)
+{
+	int		ret;
+	int		destcnt;
+	int		dest;
+	unsigned char	inquiry[] = { 0x7E, 0x7F, 0x06, 0x01 };
+	unsigned char	search[] = { 0x42, 0x50, 0x00, 0x00 };
+	struct timespec	deadline;
+	midi_msg_t	msg;
+
+	if(devs == NULL || devcnt == NULL || maxdevs <= 0)
+		return EINVAL;
+
+	*devcnt = 0;
+
+	destcnt = midi_osx_getdestcnt();
+
+	/* The echo back ID is 7 bits, so that's how many destinations we
+	 * can tell apart. */
+	if(destcnt > 0x80) {
+		fprintf(stderr, "Only searching first %d of %d destinations\n",
+		    0x80, destcnt);
+		destcnt = 0x80;
+	}
+
+	ret = pthread_mutex_lock(&midi_outq->mq_mutex);
+	if(ret != 0) {
+		fprintf(stderr, "Can't lock queue: %s\n", strerror(ret));
+		return ENOEXEC;
+	}
+
+	for(dest = 0; dest < destcnt; ++dest) {
+		search[3] = dest;	/* Echo back ID */
+		ret = midi_queue_addmsg_sysex_to(midi_outq, dest, search,
+		    sizeof(search));
+		if(ret == 0)
+			ret = midi_queue_addmsg_sysex_to(midi_outq, dest,
+			    inquiry, sizeof(inquiry));
+		if(ret != 0) {
+			fprintf(stderr, "Can't add MIDI message: %s\n",
+			    strerror(ret));
+			break;
+		}
+	}
+
+	(void) pthread_mutex_unlock(&midi_outq->mq_mutex);
+
+	if(ret != 0)
+		return ret;
+
+	btimespec_tonow(&deadline);
+	btimespec_addus(&deadline, timeout_ms * 1000);
+
+	ret = pthread_mutex_lock(&midi_inq->mq_mutex);
+	if(ret != 0) {
+		fprintf(stderr, "Can't lock queue: %s\n", strerror(ret));
+		return ENOEXEC;
+	}
+
+	while(1) {
+		while(!midi_queue_isempty(midi_inq)) {
+			ret = midi_queue_getnext(midi_inq, &msg);
+			if(ret != 0) {
+				fprintf(stderr, "Can't get next message"
+				    " from queue: %s\n"
+				    " This is bad, exiting\n", strerror(ret));
+				exit(-1);
+			}
+
+			if(msg.mm_type == MIDI_MSG_SYSEX)
+				(void) _midi_discover_reply(devs, maxdevs,
+				    devcnt, &msg);
+
+			(void) midi_msg_free_payload(&msg);
+		}
+
+		/* All ports share the same deadline. */
+		ret = pthread_cond_timedwait(&midi_inq->mq_cond,
+		    &midi_inq->mq_mutex, &deadline);
+		if(ret == ETIMEDOUT)
+			break;
+		if(ret != 0) {
+			fprintf(stderr, "Error while waiting on condvar: %s\n"
+			    " This is bad, exiting\n", strerror(ret));
+			exit(-1);
+		}
+	}
+
+	ret = pthread_mutex_unlock(&midi_inq->mq_mutex);
+	if(ret != 0) {
+		fprintf(stderr, "Can't unlock queue: %s\n", strerror(ret));
+		return ENOEXEC;
+	}
+
+	return 0;
+}
+
+
+int
+_midi_discover_reply(midi_dev_t *devs, int maxdevs, int *devcnt,
+	midi_msg_t *msg)
+{
+	/* Parses a Korg Search Device reply:
+	 *
+	 *   42 50 01 0g dd ff ff mm mm vv vv vv vv
+	 *
+	 * or a Universal Device Inquiry reply:
+	 *
+	 *   7E 0g 06 02 ii [ii ii] ff ff mm mm vv vv vv vv
+	 *
+	 * (g: global channel, dd: echo back ID, ii: manufacturer,
+	 * ff: family, mm: member, vv: version) */
+
+	unsigned char	*p;
+	size_t		siz;
+	midi_dev_t	*dev;
+	midi_osx_ep_t	ep;
+	int		i;
+	int		flag;
+	int		dest;
+	int		mfr;
+
+	p = msg->mm_payload;
+	siz = msg->mm_payload_siz;
+
+	if(siz >= 13 && p[0] == 0x42 && p[1] == 0x50 && p[2] == 0x01) {
+		flag = MIDI_DEV_F_KORGSEARCH;
+		mfr = MIDI_DEV_MFR_KORG;
+		dest = p[4];
+		i = 5;
+	} else
+	if(siz >= 5 && p[0] == 0x7E && p[2] == 0x06 && p[3] == 0x02) {
+		flag = MIDI_DEV_F_INQUIRY;
+		dest = -1;
+		if(p[4] == 0x00) {
+			/* Three byte manufacturer ID */
+			if(siz < 7)
+				return EINVAL;
+			mfr = (p[5] << 8) | p[6];
+			i = 7;
+		} else {
+			mfr = p[4];
+			i = 5;
+		}
+	} else
+		return ENOENT;
+
+	if(siz < i + 8)
+		return EINVAL;
+
+	if(msg->mm_src == MIDI_EP_ANY) {
+		/* Can't tell where it came from. */
+		return ENOENT;
+	}
+
+	dev = _midi_discover_getdev(devs, maxdevs, devcnt, msg->mm_src);
+	if(dev == NULL) {
+		fprintf(stderr, "Too many MIDI devices\n");
+		return ENOMEM;
+	}
+
+	dev->md_flags |= flag;
+	dev->md_chan = p[flag == MIDI_DEV_F_KORGSEARCH ? 3 : 1] & 0x0F;
+	dev->md_mfr = mfr;
+	dev->md_family = (p[i + 1] << 8) | p[i];
+	dev->md_member = (p[i + 3] << 8) | p[i + 2];
+	dev->md_ver[0] = p[i + 4];
+	dev->md_ver[1] = p[i + 5];
+	dev->md_ver[2] = p[i + 6];
+	dev->md_ver[3] = p[i + 7];
+
+	/* The echo back ID beats guessing from the entity. */
+	if(dest >= 0)
+		dev->md_dest = dest;
+
+	if(dev->md_dest >= 0 && midi_osx_getdest(dev->md_dest, &ep) == 0)
+		dev->md_destuid = ep.me_uid;
+
+	return 0;
+}
+
+
+midi_dev_t *
+_midi_discover_getdev(midi_dev_t *devs, int maxdevs, int *devcnt, int src)
+{
+	/* Returns the device that answers on source src, adding a new one
+	 * if it hasn't been seen yet. */
+
+	midi_dev_t	*dev;
+	midi_osx_ep_t	ep;
+	int		i;
+
+	for(i = 0; i < *devcnt; ++i) {
+		if(devs[i].md_src == src)
+			return &devs[i];
+	}
+
+	if(*devcnt >= maxdevs)
+		return NULL;
+
+	dev = &devs[*devcnt];
+	memset(dev, 0, sizeof(midi_dev_t));
+	dev->md_src = src;
+	dev->md_dest = -1;
+
+	if(midi_osx_getsrc(src, &ep) == 0) {
+		dev->md_srcuid = ep.me_uid;
+		dev->md_dest = ep.me_peer;
+		snprintf(dev->md_name, MIDI_DEV_NAMELEN, "%s", ep.me_name);
+	}
+
+	++*devcnt;
+	return dev;
+}
+
+
+midi_dev_t *
+midi_dev_find(midi_dev_t *devs, int devcnt, int mfr, int family)
+{
+	/* Returns the first device with the given manufacturer and family
+	 * that we know both endpoints of. */
+
+	int	i;
+
+	if(devs == NULL)
+		return NULL;
+
+	for(i = 0; i < devcnt; ++i) {
+		if(devs[i].md_mfr == mfr && devs[i].md_family == family &&
+		    devs[i].md_srcuid != 0 && devs[i].md_destuid != 0)
+			return &devs[i];
+	}
+
+	return NULL;
+}
+
+
+int
+midi_dev_resolve(midi_dev_t *dev)
+{
+	/* Looks up the endpoint indexes of a device from the cache in this
+	 * run. NOTE: System MIDI must be initialized. */
+
+	midi_osx_ep_t	ep;
+	int		i;
+
+	if(dev == NULL)
+		return EINVAL;
+
+	dev->md_src = -1;
+	dev->md_dest = -1;
+
+	for(i = 0; i < midi_osx_getsrccnt(); ++i) {
+		if(midi_osx_getsrc(i, &ep) == 0 && ep.me_uid == dev->md_srcuid)
+			dev->md_src = i;
+	}
+
+	for(i = 0; i < midi_osx_getdestcnt(); ++i) {
+		if(midi_osx_getdest(i, &ep) == 0 &&
+		    ep.me_uid == dev->md_destuid)
+			dev->md_dest = i;
+	}
+
+	if(dev->md_src < 0 || dev->md_dest < 0)
+		return ENOENT;
+
+	return 0;
+}
+
+
+int
+midi_devcache_path(char *buf, size_t siz)
+{
+	char	*home;
+
+	home = getenv("HOME");
+	if(home == NULL || *home == 0)
+		return ENOENT;
+
+	if(snprintf(buf, siz, "%s/%s", home, MIDI_DEV_CACHEFILE) >= siz)
+		return ENAMETOOLONG;
+
+	return 0;
+}
+
+
+int
+midi_devcache_load(const char *path, midi_dev_t *devs, int maxdevs,
+	int *devcnt)
+{
+	/* Reads the cache written by midi_devcache_save(). Endpoint indexes
+	 * are not stored, they are only valid during the run that saw
+	 * them. */
+
+	FILE		*f;
+	char		line[256];
+	midi_dev_t	*dev;
+	int		ret;
+
+	if(path == NULL || devs == NULL || devcnt == NULL)
+		return EINVAL;
+
+	*devcnt = 0;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+		return errno;
+
+	while(*devcnt < maxdevs && fgets(line, sizeof(line), f)) {
+		if(line[0] == '#' || line[0] == '\n')
+			continue;
+
+		dev = &devs[*devcnt];
+		memset(dev, 0, sizeof(midi_dev_t));
+
+		ret = sscanf(line, "%d %d %d %x %d %x %x %d.%d.%d.%d %63[^\n]",
+		    &dev->md_srcuid, &dev->md_destuid, &dev->md_flags,
+		    &dev->md_mfr, &dev->md_chan, &dev->md_family,
+		    &dev->md_member, &dev->md_ver[0], &dev->md_ver[1],
+		    &dev->md_ver[2], &dev->md_ver[3], dev->md_name);
+		if(ret < 11) {
+			fprintf(stderr, "Ignoring bad line in %s\n", path);
+			continue;
+		}
+
+		dev->md_src = -1;
+		dev->md_dest = -1;
+		++*devcnt;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+int
+midi_devcache_save(const char *path, midi_dev_t *devs, int devcnt)
+{
+	FILE		*f;
+	int		i;
+
+	if(path == NULL || devs == NULL)
+		return EINVAL;
+
+	f = fopen(path, "w");
+	if(f == NULL)
+		return errno;
+
+	fprintf(f, "# srcuid destuid flags mfr chan family member version"
+	    " name\n");
+
+	for(i = 0; i < devcnt; ++i) {
+		fprintf(f, "%d %d %d %x %d %x %x %d.%d.%d.%d %s\n",
+		    devs[i].md_srcuid, devs[i].md_destuid, devs[i].md_flags,
+		    devs[i].md_mfr, devs[i].md_chan, devs[i].md_family,
+		    devs[i].md_member, devs[i].md_ver[0], devs[i].md_ver[1],
+		    devs[i].md_ver[2], devs[i].md_ver[3], devs[i].md_name);
+	}
+
+	if(fclose(f) != 0)
+		return errno;
+
+	return 0;
+}
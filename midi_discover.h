@@ -0,0 +1,44 @@
+#ifndef MIDI_DISCOVER_H
+#define MIDI_DISCOVER_H
+
+#include "midi_osx.h"
+
+#define MIDI_DEV_MAX			32
+#define MIDI_DEV_NAMELEN		MIDI_OSX_NAMELEN
+#define MIDI_DEV_CACHEFILE		".midisysex_devices"
+
+#define MIDI_DISCOVER_TIMEOUT_MS	1000
+
+#define MIDI_DEV_MFR_KORG		0x42
+#define MIDI_DEV_FAMILY_ELECTRIBE	0x0123
+
+/* Which requests the device answered. */
+#define MIDI_DEV_F_INQUIRY		1	/* Universal Device Inquiry */
+#define MIDI_DEV_F_KORGSEARCH		2	/* Korg Search Device */
+
+typedef struct midi_dev {
+	SInt32		md_srcuid;	/* Endpoint unique IDs */
+	SInt32		md_destuid;
+	int		md_src;		/* Endpoint indexes in this run, */
+	int		md_dest;	/* -1 if not known */
+	int		md_flags;
+	int		md_chan;	/* Global channel (device ID) */
+	int		md_mfr;
+	int		md_family;
+	int		md_member;
+	int		md_ver[4];
+	char		md_name[MIDI_DEV_NAMELEN];
+} midi_dev_t;
+
+/* NOTE: midi_discover() uses midi_inq and midi_outq, so it must be called
+ * after system MIDI and the writer thread have been started. */
+int midi_discover(midi_dev_t *, int, int *, int);
+
+midi_dev_t *midi_dev_find(midi_dev_t *, int, int, int);
+int midi_dev_resolve(midi_dev_t *);
+
+int midi_devcache_path(char *, size_t);
+int midi_devcache_load(const char *, midi_dev_t *, int, int *);
+int midi_devcache_save(const char *, midi_dev_t *, int);
+
+#endif
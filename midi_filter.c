@@ -0,0 +1,153 @@
+/*
+ * Input filtering.
+ *
+ * Most of what arrives isn't wanted by anyone: clocks while dumping a
+ * pattern, other manufacturers' sysex, traffic from sources that aren't
+ * being talked to. The reader asks the filter about each message as it
+ * parses it, so that what isn't wanted never takes the queue's lock. A
+ * sysex message is decided as soon as its first bytes rule out every
+ * prefix; the rest of it is read past without being stored.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "midi_filter.h"
+#include "midi_queue.h"
+
+
+void
+midi_filter_init(midi_filter_t *mf)
+{
+	memset(mf, 0, sizeof(midi_filter_t));
+	mf->mf_types = MIDI_FILTER_ALLTYPES;
+}
+
+
+void
+midi_filter_settypes(midi_filter_t *mf, unsigned int types)
+{
+	mf->mf_types = types;
+}
+
+
+int
+midi_filter_addsrc(midi_filter_t *mf, int src)
+{
+	if(mf == NULL || src < 0 || src >= 64)
+		return EINVAL;
+
+	mf->mf_srcs |= (uint64_t) 1 << src;
+
+	return 0;
+}
+
+
+int
+midi_filter_addprefix(midi_filter_t *mf, unsigned char *prefix, size_t siz)
+{
+	if(mf == NULL || prefix == NULL || siz == 0 ||
+	    siz > MIDI_FILTER_PREFIXSIZ)
+		return EINVAL;
+
+	if(mf->mf_prefixcnt >= MIDI_FILTER_MAXPREFIX)
+		return ENOSPC;
+
+	memcpy(mf->mf_prefix[mf->mf_prefixcnt], prefix, siz);
+	mf->mf_prefixsiz[mf->mf_prefixcnt] = siz;
+	++mf->mf_prefixcnt;
+
+	return 0;
+}
+
+
+int
+midi_filter_addmfr(midi_filter_t *mf, int mfr, int is3byte)
+{
+	unsigned char	id[3];
+
+	/* NOTE: Not told apart by value, 0x000074 and 0x74 are different
+	 * manufacturers. */
+	if(!is3byte) {
+		if(mfr <= 0 || mfr > 0x7F)
+			return EINVAL;
+		id[0] = mfr;
+		return midi_filter_addprefix(mf, id, 1);
+	}
+
+	/* Three byte IDs start with 0x00. */
+	if(mfr <= 0 || mfr > 0x7F7F || (mfr & 0x80))
+		return EINVAL;
+	id[0] = 0x00;
+	id[1] = (mfr >> 8) & 0x7F;
+	id[2] = mfr & 0x7F;
+	return midi_filter_addprefix(mf, id, 3);
+}
+
+
+int
+midi_filter_pass(midi_filter_t *mf, int src, int type)
+{
+	/* Returns nonzero if a message of type from src is let through. */
+
+	if(mf == NULL)
+		return 1;
+
+	if(!(mf->mf_types & MIDI_FILTER_TYPE(type)))
+		return 0;
+
+	if(mf->mf_srcs == 0)
+		return 1;
+
+	if(src < 0 || src >= 64)
+		return 0;
+
+	return (mf->mf_srcs & ((uint64_t) 1 << src)) != 0;
+}
+
+
+int
+midi_filter_sysex_begin(midi_filter_t *mf, int src, midi_filter_sysex_t *fs)
+{
+	if(!midi_filter_pass(mf, src, MIDI_MSG_SYSEX)) {
+		fs->fs_state = MIDI_FILTER_DROP;
+	} else
+	if(mf == NULL || mf->mf_prefixcnt == 0) {
+		fs->fs_state = MIDI_FILTER_PASS;
+	} else {
+		fs->fs_state = MIDI_FILTER_UNDECIDED;
+		fs->fs_alive = (1U << mf->mf_prefixcnt) - 1;
+	}
+
+	return fs->fs_state;
+}
+
+
+int
+midi_filter_sysex_byte(midi_filter_t *mf, midi_filter_sysex_t *fs,
+	size_t off, unsigned char dat)
+{
+	int	i;
+
+	if(fs->fs_state != MIDI_FILTER_UNDECIDED)
+		return fs->fs_state;
+
+	for(i = 0; i < mf->mf_prefixcnt; ++i) {
+		if(!(fs->fs_alive & (1U << i)))
+			continue;
+
+		if(mf->mf_prefix[i][off] != dat) {
+			fs->fs_alive &= ~(1U << i);
+			continue;
+		}
+
+		if(off + 1 == mf->mf_prefixsiz[i]) {
+			fs->fs_state = MIDI_FILTER_PASS;
+			return fs->fs_state;
+		}
+	}
+
+	if(fs->fs_alive == 0)
+		fs->fs_state = MIDI_FILTER_DROP;
+
+	return fs->fs_state;
+}
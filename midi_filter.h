@@ -0,0 +1,62 @@
+#ifndef MIDI_FILTER_H
+#define MIDI_FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* What the reader lets through to the queues. Everything else is dropped
+ * as it is parsed, before the queue is locked or anything is copied. */
+
+#define MIDI_FILTER_MAXPREFIX	8
+#define MIDI_FILTER_PREFIXSIZ	8
+
+#define MIDI_FILTER_TYPE(t)	(1U << (t))
+#define MIDI_FILTER_ALLTYPES	(~0U)
+
+/* How far a sysex message has got. */
+#define MIDI_FILTER_UNDECIDED	0
+#define MIDI_FILTER_PASS	1
+#define MIDI_FILTER_DROP	2
+
+typedef struct midi_filter {
+	unsigned int	mf_types;	/* MIDI_FILTER_TYPE()s */
+	uint64_t	mf_srcs;	/* Bit per source index, 0: all */
+	int		mf_prefixcnt;	/* 0: any sysex */
+	unsigned char	mf_prefix[MIDI_FILTER_MAXPREFIX]
+			    [MIDI_FILTER_PREFIXSIZ];
+	size_t		mf_prefixsiz[MIDI_FILTER_MAXPREFIX];
+} midi_filter_t;
+
+/* Sysex matching state, one per source. */
+typedef struct midi_filter_sysex {
+	int		fs_state;
+	unsigned int	fs_alive;	/* Prefixes still matching */
+} midi_filter_sysex_t;
+
+/* Lets everything through until narrowed down. */
+void midi_filter_init(midi_filter_t *);
+
+/* Only these message types, a MIDI_FILTER_TYPE() mask. */
+void midi_filter_settypes(midi_filter_t *, unsigned int);
+
+/* Only from these sources. Can be called more than once. */
+int midi_filter_addsrc(midi_filter_t *, int);
+
+/* Only sysex that starts with one of the prefixes given, or that comes
+ * from one of the manufacturers given: eg. 0x42, or 0x002109 with is3byte
+ * set for the three byte IDs. Can be called more than once. */
+int midi_filter_addprefix(midi_filter_t *, unsigned char *, size_t);
+int midi_filter_addmfr(midi_filter_t *, int, int);
+
+/* NOTE: The below functions are called by the reader for every message or
+ * byte, so they don't lock or allocate. A NULL filter lets everything
+ * through. */
+int midi_filter_pass(midi_filter_t *, int, int);
+
+/* Called on F0, then with every data byte and its offset in the payload
+ * until it says PASS or DROP. */
+int midi_filter_sysex_begin(midi_filter_t *, int, midi_filter_sysex_t *);
+int midi_filter_sysex_byte(midi_filter_t *, midi_filter_sysex_t *, size_t,
+	unsigned char);
+
+#endif
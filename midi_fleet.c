@@ -0,0 +1,676 @@
+/*
+ * Fleet mode: backup and restore of pattern slots on many devices at
+ * once.
+ *
+ * Every device has a worker that does nothing but talk to it, one slot
+ * after the other, so each link stays busy and a slow or dead unit only
+ * holds up itself. What's left to do after a transfer (decoding, writing
+ * the file) goes on the worker's deque. A worker gets to its own deque
+ * only when its device is done, and steals from the others' when that's
+ * empty, so workers of devices that finished early take over the rest.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include "midi_fleet.h"
+#include "midi_osx.h"
+#include "midi_time.h"
+#include "midi_codec.h"
+#include "midi_trace.h"
+#include "electribe.h"
+#include "bstr.h"
+#include "btime.h"
+
+#define MIDI_FLEET_REPORT_MS	1000
+
+void *_midi_fleet_worker(void *);
+int _midi_fleet_backup(midi_fleet_dev_t *, midi_xact_t *, int);
+int _midi_fleet_restore(midi_fleet_dev_t *, midi_xact_t *, int);
+int _midi_fleet_post(midi_fleet_job_t *);
+void _midi_fleet_progress(midi_fleet_dev_t *, int, size_t);
+void _midi_fleet_saved(midi_fleet_dev_t *, int);
+int _midi_fleet_deque_init(midi_fleet_deque_t *, int);
+void _midi_fleet_deque_uninit(midi_fleet_deque_t *);
+int _midi_fleet_deque_push(midi_fleet_deque_t *, midi_fleet_job_t *);
+midi_fleet_job_t *_midi_fleet_deque_pop(midi_fleet_deque_t *);
+midi_fleet_job_t *_midi_fleet_deque_steal(midi_fleet_deque_t *);
+
+
+int
+midi_fleet_init(midi_fleet_t *fl, int op, const char *dir,
+	midi_xact_errfn_t iserr)
+{
+	int	ret;
+
+	if(fl == NULL || dir == NULL ||
+	    (op != MIDI_FLEET_BACKUP && op != MIDI_FLEET_RESTORE))
+		return EINVAL;
+
+	memset(fl, 0, sizeof(midi_fleet_t));
+	fl->fl_op = op;
+	fl->fl_dir = dir;
+	fl->fl_iserr = iserr;
+
+	ret = pthread_mutex_init(&fl->fl_mutex, NULL);
+	if(ret != 0)
+		return ret;
+
+	ret = pthread_cond_init(&fl->fl_cond, NULL);
+	if(ret != 0) {
+		(void) pthread_mutex_destroy(&fl->fl_mutex);
+		return ret;
+	}
+
+	return 0;
+}
+
+
+int
+midi_fleet_add(midi_fleet_t *fl, midi_dev_t *dev, int first, int last)
+{
+	midi_fleet_dev_t	*fd;
+	int			ret;
+
+	if(fl == NULL || dev == NULL || first < 1 || last < first ||
+	    last > E2_NUM_PATTERNS)
+		return EINVAL;
+
+	if(fl->fl_devcnt >= MIDI_FLEET_MAXDEV)
+		return ENOMEM;
+
+	fd = &fl->fl_devs[fl->fl_devcnt];
+	memset(fd, 0, sizeof(midi_fleet_dev_t));
+	fd->fd_fleet = fl;
+	fd->fd_idx = fl->fl_devcnt;
+	fd->fd_dev = *dev;
+	fd->fd_first = first;
+	fd->fd_last = last;
+
+	ret = midi_queue_init(&fd->fd_inq);
+	if(ret != 0)
+		return ret;
+	(void) midi_queue_setinput(fd->fd_inq, "Device in");
+
+	ret = _midi_fleet_deque_init(&fd->fd_post, last - first + 1);
+	if(ret != 0) {
+		(void) midi_queue_uninit(&fd->fd_inq);
+		return ret;
+	}
+
+	ret = midi_osx_setsrcq(dev->md_srcuid, fd->fd_inq);
+	if(ret != 0) {
+		_midi_fleet_deque_uninit(&fd->fd_post);
+		(void) midi_queue_uninit(&fd->fd_inq);
+		return ret;
+	}
+
+	++fl->fl_devcnt;
+
+	return 0;
+}
+
+
+int
+midi_fleet_run(midi_fleet_t *fl, FILE *progress)
+{
+	/* Starts a worker for every device and waits for all of them,
+	 * reporting progress every second. */
+
+	midi_fleet_dev_t	*fd;
+	int			i;
+	int			ret;
+	struct timespec		condwaitto;
+
+	if(fl == NULL)
+		return EINVAL;
+
+	for(i = 0; i < fl->fl_devcnt; ++i) {
+		fd = &fl->fl_devs[i];
+
+		ret = midi_dev_resolve(&fd->fd_dev);
+		if(ret != 0) {
+			fprintf(stderr, "%s isn't connected\n",
+			    fd->fd_dev.md_name);
+			fd->fd_gaveup = 1;
+			fd->fd_failed = fd->fd_last - fd->fd_first + 1;
+		}
+	}
+
+	fl->fl_running = fl->fl_devcnt;
+
+	for(i = 0; i < fl->fl_devcnt; ++i) {
+		fd = &fl->fl_devs[i];
+
+		ret = pthread_create(&fd->fd_thrd, NULL, _midi_fleet_worker,
+		    fd);
+		if(ret != 0) {
+			fprintf(stderr, "Can't start fleet worker: %s\n",
+			    strerror(ret));
+			(void) pthread_mutex_lock(&fl->fl_mutex);
+			--fl->fl_running;
+			(void) pthread_mutex_unlock(&fl->fl_mutex);
+			continue;
+		}
+		fd->fd_thrd_running = 1;
+	}
+
+	(void) pthread_mutex_lock(&fl->fl_mutex);
+	while(fl->fl_iodone < fl->fl_running) {
+		btimespec_tonow(&condwaitto);
+		btimespec_addus(&condwaitto, MIDI_FLEET_REPORT_MS * 1000);
+		ret = pthread_cond_timedwait(&fl->fl_cond, &fl->fl_mutex,
+		    &condwaitto);
+		if(ret == ETIMEDOUT && progress)
+			midi_fleet_report(progress, fl);
+	}
+	(void) pthread_mutex_unlock(&fl->fl_mutex);
+
+	for(i = 0; i < fl->fl_devcnt; ++i) {
+		fd = &fl->fl_devs[i];
+		if(!fd->fd_thrd_running)
+			continue;
+		ret = pthread_join(fd->fd_thrd, NULL);
+		if(ret != 0)
+			fprintf(stderr, "Can't join fleet worker: %s\n",
+			    strerror(ret));
+		fd->fd_thrd_running = 0;
+	}
+
+	if(progress) {
+		(void) pthread_mutex_lock(&fl->fl_mutex);
+		midi_fleet_report(progress, fl);
+		fprintf(progress, "%d post jobs stolen\n", fl->fl_stolen);
+		(void) pthread_mutex_unlock(&fl->fl_mutex);
+	}
+
+	for(i = 0; i < fl->fl_devcnt; ++i) {
+		if(fl->fl_devs[i].fd_failed)
+			return EIO;
+	}
+
+	return 0;
+}
+
+
+void
+midi_fleet_report(FILE *f, midi_fleet_t *fl)
+{
+	/* NOTE: The caller must hold the fleet's lock. */
+
+	midi_fleet_dev_t	*fd;
+	int			i;
+	uint64_t		end;
+	double			secs;
+
+	for(i = 0; i < fl->fl_devcnt; ++i) {
+		fd = &fl->fl_devs[i];
+
+		end = fd->fd_end ? fd->fd_end : midi_time_now();
+		secs = fd->fd_start ? (double) (end - fd->fd_start) /
+		    MIDI_TIME_NSEC_PER_SEC : 0;
+
+		fprintf(f, "%-24s %3d/%-3d transferred", fd->fd_dev.md_name,
+		    fd->fd_done, fd->fd_last - fd->fd_first + 1);
+		if(fl->fl_op == MIDI_FLEET_BACKUP)
+			fprintf(f, ", %d saved", fd->fd_saved);
+		fprintf(f, ", %d failed%s, %.0f bytes/s\n", fd->fd_failed,
+		    fd->fd_gaveup ? " (gave up)" : "",
+		    secs > 0 ? fd->fd_bytes / secs : 0);
+	}
+	fflush(f);
+}
+
+
+int
+midi_fleet_uninit(midi_fleet_t *fl)
+{
+	midi_fleet_dev_t	*fd;
+	midi_fleet_job_t	*job;
+	int			i;
+
+	if(fl == NULL)
+		return EINVAL;
+
+	for(i = 0; i < fl->fl_devcnt; ++i) {
+		fd = &fl->fl_devs[i];
+		while((job = _midi_fleet_deque_pop(&fd->fd_post)) != NULL) {
+			free(job->fj_data);
+			free(job);
+		}
+		_midi_fleet_deque_uninit(&fd->fd_post);
+		(void) midi_queue_uninit(&fd->fd_inq);
+	}
+
+	(void) pthread_cond_destroy(&fl->fl_cond);
+	(void) pthread_mutex_destroy(&fl->fl_mutex);
+
+	return 0;
+}
+
+
+void *
+_midi_fleet_worker(void *arg)
+{
+	midi_fleet_dev_t	*fd;
+	midi_fleet_t		*fl;
+	midi_fleet_job_t	*job;
+	midi_xact_t		mx;
+	int			slot;
+	int			fails;
+	int			i;
+	int			ret;
+	struct timespec		condwaitto;
+
+	fd = (midi_fleet_dev_t *) arg;
+	fl = fd->fd_fleet;
+	fails = 0;
+
+	midi_trace_thread(fd->fd_dev.md_name);
+
+	(void) midi_xact_init(&mx, fd->fd_inq, fd->fd_dev.md_dest,
+	    fl->fl_iserr);
+
+	(void) pthread_mutex_lock(&fl->fl_mutex);
+	fd->fd_start = midi_time_now();
+	(void) pthread_mutex_unlock(&fl->fl_mutex);
+
+	/* Transfers first, the link is what's slow. */
+	for(slot = fd->fd_first; slot <= fd->fd_last && !fd->fd_gaveup;
+	    ++slot) {
+		if(fl->fl_op == MIDI_FLEET_BACKUP)
+			ret = _midi_fleet_backup(fd, &mx, slot);
+		else
+			ret = _midi_fleet_restore(fd, &mx, slot);
+
+		if(ret == 0) {
+			fails = 0;
+			continue;
+		}
+
+		fprintf(stderr, "%s: slot %d: %s\n", fd->fd_dev.md_name, slot,
+		    strerror(ret));
+
+		(void) pthread_mutex_lock(&fl->fl_mutex);
+		++fd->fd_failed;
+		if(++fails >= MIDI_FLEET_MAXFAIL) {
+			/* Count what's left as failed too. */
+			fd->fd_gaveup = 1;
+			fd->fd_failed += fd->fd_last - slot;
+		}
+		(void) pthread_mutex_unlock(&fl->fl_mutex);
+	}
+
+	(void) pthread_mutex_lock(&fl->fl_mutex);
+	fd->fd_end = midi_time_now();
+	++fl->fl_iodone;
+	(void) pthread_cond_broadcast(&fl->fl_cond);
+	(void) pthread_mutex_unlock(&fl->fl_mutex);
+
+	/* Then whatever post work there is, ours or anybody's. */
+	while(1) {
+		job = _midi_fleet_deque_pop(&fd->fd_post);
+
+		for(i = 1; job == NULL && i < fl->fl_devcnt; ++i) {
+			job = _midi_fleet_deque_steal(
+			    &fl->fl_devs[(fd->fd_idx + i) %
+			    fl->fl_devcnt].fd_post);
+			if(job) {
+				(void) pthread_mutex_lock(&fl->fl_mutex);
+				++fl->fl_stolen;
+				(void) pthread_mutex_unlock(&fl->fl_mutex);
+			}
+		}
+
+		if(job) {
+			ret = _midi_fleet_post(job);
+			_midi_fleet_saved(job->fj_dev, ret);
+			free(job->fj_data);
+			free(job);
+			continue;
+		}
+
+		/* Nothing to be had. Done if nobody is transferring
+		 * anymore, otherwise wait for more. */
+		(void) pthread_mutex_lock(&fl->fl_mutex);
+		if(fl->fl_iodone >= fl->fl_running) {
+			(void) pthread_mutex_unlock(&fl->fl_mutex);
+			break;
+		}
+		btimespec_tonow(&condwaitto);
+		btimespec_addus(&condwaitto, MIDI_FLEET_REPORT_MS * 1000);
+		(void) pthread_cond_timedwait(&fl->fl_cond, &fl->fl_mutex,
+		    &condwaitto);
+		(void) pthread_mutex_unlock(&fl->fl_mutex);
+	}
+
+	return (void *) 0;
+}
+
+
+int
+_midi_fleet_backup(midi_fleet_dev_t *fd, midi_xact_t *mx, int slot)
+{
+	/* Fetches one pattern. Decoding and saving it is left on the
+	 * deque. */
+
+	unsigned char		req[E2_HDR_SIZ + 3];
+	unsigned char		magic[sizeof(E2_PAT_MAGIC) - 1];
+	unsigned char		*resp;
+	size_t			respsiz;
+	midi_fleet_job_t	*job;
+	int			ret;
+
+	req[0] = 0x42;
+	req[1] = 0x30 | fd->fd_dev.md_chan;
+	req[2] = 0x00;
+	req[3] = 0x01;
+	req[4] = 0x23;
+	req[E2_HDR_FUNC] = E2_FUNC_PAT_REQ;
+	req[E2_HDR_FUNC + 1] = (slot - 1) & 0x7F;
+	req[E2_HDR_FUNC + 2] = ((slot - 1) >> 7) & 0x7F;
+
+	resp = NULL;
+	respsiz = 0;
+
+	ret = midi_xact_request(mx, req, sizeof(req), E2_HDR_SIZ,
+	    E2_HDR_SIZ + 3 + E2_PAT_ENCSIZ, &resp, &respsiz);
+	if(ret != 0)
+		return ret;
+
+	if(respsiz <= E2_HDR_SIZ + 3 || resp[E2_HDR_FUNC] != E2_FUNC_PAT_DUMP ||
+	    resp[E2_HDR_FUNC + 1] != req[E2_HDR_FUNC + 1] ||
+	    resp[E2_HDR_FUNC + 2] != req[E2_HDR_FUNC + 2]) {
+		free(resp);
+		return EPROTO;
+	}
+
+	/* Only the first group needs decoding to tell a pattern from
+	 * garbage, and a bad dump is better retried now than found out
+	 * about on the deque. */
+	ret = midi_codec_decode_range(magic, resp + E2_HDR_SIZ + 3,
+	    respsiz - E2_HDR_SIZ - 3, 0, sizeof(magic));
+	if(ret != 0 || memcmp(magic, E2_PAT_MAGIC, sizeof(magic)) != 0) {
+		free(resp);
+		return EPROTO;
+	}
+
+	job = calloc(1, sizeof(midi_fleet_job_t));
+	if(job == NULL) {
+		free(resp);
+		return ENOMEM;
+	}
+	job->fj_dev = fd;
+	job->fj_slot = slot;
+	job->fj_id = mx->mx_lastid;
+	job->fj_data = resp;
+	job->fj_siz = respsiz;
+
+	ret = _midi_fleet_deque_push(&fd->fd_post, job);
+	if(ret != 0) {
+		free(resp);
+		free(job);
+		return ret;
+	}
+
+	/* Transferred. Saving it is counted separately, it may not happen
+	 * before all transfers are done. */
+	(void) pthread_mutex_lock(&fd->fd_fleet->fl_mutex);
+	++fd->fd_done;
+	fd->fd_bytes += sizeof(req) + respsiz + 4;
+	(void) pthread_cond_broadcast(&fd->fd_fleet->fl_cond);
+	(void) pthread_mutex_unlock(&fd->fd_fleet->fl_mutex);
+
+	return 0;
+}
+
+
+int
+_midi_fleet_restore(midi_fleet_dev_t *fd, midi_xact_t *mx, int slot)
+{
+	/* Sends one pattern from its file. Reading and encoding it is done
+	 * here: it takes next to nothing next to 6 seconds on the wire. */
+
+	char		path[PATH_MAX];
+	unsigned char	dec[E2_PAT_SIZ];
+	unsigned char	hdr[E2_HDR_SIZ + 3];
+	bstr_t		*req;
+	unsigned char	*resp;
+	size_t		respsiz;
+	FILE		*f;
+	size_t		siz;
+	int		ret;
+
+	snprintf(path, sizeof(path), MIDI_FLEET_FILEFMT, fd->fd_fleet->fl_dir,
+	    (unsigned int) fd->fd_dev.md_srcuid, slot);
+
+	f = fopen(path, "r");
+	if(f == NULL)
+		return errno;
+	siz = fread(dec, 1, sizeof(dec), f);
+	fclose(f);
+	if(siz != sizeof(dec))
+		return EINVAL;
+
+	hdr[0] = 0x42;
+	hdr[1] = 0x30 | fd->fd_dev.md_chan;
+	hdr[2] = 0x00;
+	hdr[3] = 0x01;
+	hdr[4] = 0x23;
+	hdr[E2_HDR_FUNC] = E2_FUNC_PAT_DUMP;
+	hdr[E2_HDR_FUNC + 1] = (slot - 1) & 0x7F;
+	hdr[E2_HDR_FUNC + 2] = ((slot - 1) >> 7) & 0x7F;
+
+	req = binit();
+	if(req == NULL)
+		return ENOMEM;
+
+	bmemcat(req, (char *) hdr, sizeof(hdr));
+	ret = midi_codec_encode(req, dec, sizeof(dec));
+	if(ret != 0) {
+		buninit(&req);
+		return ret;
+	}
+
+	resp = NULL;
+	respsiz = 0;
+
+	/* The device answers DATA LOAD COMPLETED or DATA LOAD ERROR. */
+	ret = midi_xact_request(mx, (unsigned char *) bget(req), bstrlen(req),
+	    E2_HDR_SIZ, E2_HDR_SIZ + 1, &resp, &respsiz);
+	if(ret == 0) {
+		if(respsiz <= E2_HDR_FUNC ||
+		    resp[E2_HDR_FUNC] != E2_FUNC_LOAD_OK)
+			ret = EPROTO;
+		free(resp);
+	}
+
+	if(ret == 0)
+		_midi_fleet_progress(fd, 0, bstrlen(req) + respsiz + 4);
+
+	buninit(&req);
+
+	return ret;
+}
+
+
+int
+_midi_fleet_post(midi_fleet_job_t *job)
+{
+	/* Decodes a pattern dump and saves it. */
+
+	char		path[PATH_MAX];
+	bstr_t		*dec;
+	FILE		*f;
+	int		ret;
+
+	dec = binit();
+	if(dec == NULL)
+		return ENOMEM;
+
+	ret = midi_codec_decode(dec, job->fj_data + E2_HDR_SIZ + 3,
+	    job->fj_siz - E2_HDR_SIZ - 3);
+	MIDI_TRACE_STAGE(job->fj_id, MIDI_TRACE_DECODED);
+	if(ret == 0 && bstrlen(dec) < E2_PAT_SIZ)
+		ret = EPROTO;
+	if(ret != 0) {
+		buninit(&dec);
+		return ret;
+	}
+
+	snprintf(path, sizeof(path), MIDI_FLEET_FILEFMT,
+	    job->fj_dev->fd_fleet->fl_dir,
+	    (unsigned int) job->fj_dev->fd_dev.md_srcuid, job->fj_slot);
+
+	f = fopen(path, "w");
+	if(f == NULL) {
+		ret = errno;
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(ret));
+		buninit(&dec);
+		return ret;
+	}
+
+	ret = btofilep(f, dec);
+	if(fclose(f) != 0 && ret == 0)
+		ret = errno;
+	MIDI_TRACE_STAGE(job->fj_id, MIDI_TRACE_WRITTEN);
+
+	buninit(&dec);
+
+	return ret;
+}
+
+
+void
+_midi_fleet_progress(midi_fleet_dev_t *fd, int err, size_t bytes)
+{
+	midi_fleet_t	*fl;
+
+	fl = fd->fd_fleet;
+
+	(void) pthread_mutex_lock(&fl->fl_mutex);
+	if(err == 0)
+		++fd->fd_done;
+	else
+		++fd->fd_failed;
+	fd->fd_bytes += bytes;
+	(void) pthread_mutex_unlock(&fl->fl_mutex);
+}
+
+
+void
+_midi_fleet_saved(midi_fleet_dev_t *fd, int err)
+{
+	/* A backed up pattern was decoded and written, or not, in which
+	 * case its slot failed after all. */
+
+	midi_fleet_t	*fl;
+
+	fl = fd->fd_fleet;
+
+	(void) pthread_mutex_lock(&fl->fl_mutex);
+	if(err == 0)
+		++fd->fd_saved;
+	else
+		++fd->fd_failed;
+	(void) pthread_mutex_unlock(&fl->fl_mutex);
+}
+
+
+int
+_midi_fleet_deque_init(midi_fleet_deque_t *fq, int cap)
+{
+	int	ret;
+
+	memset(fq, 0, sizeof(midi_fleet_deque_t));
+
+	fq->fq_jobs = calloc(cap, sizeof(midi_fleet_job_t *));
+	if(fq->fq_jobs == NULL)
+		return ENOMEM;
+	fq->fq_cap = cap;
+
+	ret = pthread_mutex_init(&fq->fq_mutex, NULL);
+	if(ret != 0) {
+		free(fq->fq_jobs);
+		fq->fq_jobs = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
+
+void
+_midi_fleet_deque_uninit(midi_fleet_deque_t *fq)
+{
+	if(fq->fq_jobs == NULL)
+		return;
+
+	(void) pthread_mutex_destroy(&fq->fq_mutex);
+	free(fq->fq_jobs);
+	fq->fq_jobs = NULL;
+}
+
+
+int
+_midi_fleet_deque_push(midi_fleet_deque_t *fq, midi_fleet_job_t *job)
+{
+	/* NOTE: Only the owner pushes. There's never more than one job per
+	 * slot, so the deque can't fill up. Once emptied, it starts over
+	 * from the beginning. */
+
+	int	ret;
+
+	(void) pthread_mutex_lock(&fq->fq_mutex);
+
+	if(fq->fq_top == fq->fq_bottom)
+		fq->fq_top = fq->fq_bottom = 0;
+
+	if(fq->fq_bottom >= fq->fq_cap) {
+		ret = ENOMEM;
+	} else {
+		fq->fq_jobs[fq->fq_bottom++] = job;
+		ret = 0;
+	}
+
+	(void) pthread_mutex_unlock(&fq->fq_mutex);
+
+	return ret;
+}
+
+
+midi_fleet_job_t *
+_midi_fleet_deque_pop(midi_fleet_deque_t *fq)
+{
+	/* The owner takes its newest job. */
+
+	midi_fleet_job_t	*job;
+
+	job = NULL;
+
+	(void) pthread_mutex_lock(&fq->fq_mutex);
+	if(fq->fq_bottom > fq->fq_top)
+		job = fq->fq_jobs[--fq->fq_bottom];
+	(void) pthread_mutex_unlock(&fq->fq_mutex);
+
+	return job;
+}
+
+
+midi_fleet_job_t *
+_midi_fleet_deque_steal(midi_fleet_deque_t *fq)
+{
+	/* Others take the oldest one. */
+
+	midi_fleet_job_t	*job;
+
+	job = NULL;
+
+	(void) pthread_mutex_lock(&fq->fq_mutex);
+	if(fq->fq_bottom > fq->fq_top)
+		job = fq->fq_jobs[fq->fq_top++];
+	(void) pthread_mutex_unlock(&fq->fq_mutex);
+
+	return job;
+}
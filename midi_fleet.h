@@ -0,0 +1,93 @@
+#ifndef MIDI_FLEET_H
+#define MIDI_FLEET_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "midi_queue.h"
+#include "midi_discover.h"
+#include "midi_xact.h"
+
+#define MIDI_FLEET_MAXDEV	MIDI_DEV_MAX
+
+/* A device that fails this many slots in a row is given up on. */
+#define MIDI_FLEET_MAXFAIL	3
+
+#define MIDI_FLEET_BACKUP	0
+#define MIDI_FLEET_RESTORE	1
+
+#define MIDI_FLEET_FILEFMT	"%s/%08X-%03d.e2pat"
+
+struct midi_fleet;
+struct midi_fleet_dev;
+
+/* Work left on a slot after its transfer, which any worker can do. */
+typedef struct midi_fleet_job {
+	struct midi_fleet_dev	*fj_dev;
+	int			fj_slot;
+	uint64_t		fj_id;		/* Trace ID of the request */
+	unsigned char		*fj_data;	/* Reply payload */
+	size_t			fj_siz;
+} midi_fleet_job_t;
+
+/* The owner pushes and pops at the bottom, other workers steal from the
+ * top. */
+typedef struct midi_fleet_deque {
+	pthread_mutex_t		fq_mutex;
+	midi_fleet_job_t	**fq_jobs;
+	int			fq_cap;
+	int			fq_top;
+	int			fq_bottom;
+} midi_fleet_deque_t;
+
+typedef struct midi_fleet_dev {
+	struct midi_fleet	*fd_fleet;
+	int			fd_idx;
+	midi_dev_t		fd_dev;
+	midi_queue_t		*fd_inq;	/* Only this device's input */
+	int			fd_first;	/* Slots, 1~250 */
+	int			fd_last;
+	midi_fleet_deque_t	fd_post;
+	pthread_t		fd_thrd;
+	int			fd_thrd_running;
+
+	/* Progress, under the fleet's lock. */
+	int			fd_done;	/* Slots transferred */
+	int			fd_saved;	/* Backups decoded and
+						 * written */
+	int			fd_failed;
+	int			fd_gaveup;
+	uint64_t		fd_bytes;	/* Sysex bytes both ways */
+	uint64_t		fd_start;
+	uint64_t		fd_end;		/* 0 while transferring */
+} midi_fleet_dev_t;
+
+typedef struct midi_fleet {
+	int			fl_op;
+	const char		*fl_dir;
+	midi_xact_errfn_t	fl_iserr;
+	midi_fleet_dev_t	fl_devs[MIDI_FLEET_MAXDEV];
+	int			fl_devcnt;
+
+	pthread_mutex_t		fl_mutex;
+	pthread_cond_t		fl_cond;	/* Post work was added or a
+						 * worker finished its
+						 * transfers */
+	int			fl_running;	/* Workers started */
+	int			fl_iodone;	/* ... and done transferring */
+	int			fl_stolen;
+} midi_fleet_t;
+
+int midi_fleet_init(midi_fleet_t *, int, const char *, midi_xact_errfn_t);
+
+/* NOTE: Devices must be added before midi_osx_init(), their input is
+ * routed to queues of their own. */
+int midi_fleet_add(midi_fleet_t *, midi_dev_t *, int, int);
+
+/* NOTE: Needs system MIDI and the writer thread. */
+int midi_fleet_run(midi_fleet_t *, FILE *);
+void midi_fleet_report(FILE *, midi_fleet_t *);
+
+int midi_fleet_uninit(midi_fleet_t *);
+
+#endif
@@ -0,0 +1,558 @@
+/*
+ * Search index over backed-up patterns.
+ *
+ * A query like "tempo 120~130, scale 5, any part with oscillator 300"
+ * only looks at a few parameters out of 16384 bytes per pattern. So the
+ * parameters are pulled out once, into one array per parameter, and a
+ * query goes through the arrays it needs: the values it compares are next
+ * to each other, and 100000 patterns are a few hundred kilobytes per
+ * column.
+ *
+ * Matches are kept as a bitmap, 64 patterns to a word. Each predicate
+ * clears the bits of the patterns it rules out, and skips the words that
+ * are already all clear.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "midi_index.h"
+
+#define MIDI_INDEX_INITCAP	1024
+#define MIDI_INDEX_SUFFIX	".e2pat"
+
+int _midi_index_grow(midi_index_t *, int);
+int _midi_index_col(int, int);
+void _midi_index_scan(midi_index_t *, int, int, int, uint64_t *, int);
+int _midi_index_hasstr(const char *, const char *);
+
+
+int
+midi_index_init(midi_index_t *ix)
+{
+	if(ix == NULL)
+		return EINVAL;
+
+	memset(ix, 0, sizeof(midi_index_t));
+
+	return 0;
+}
+
+
+int
+midi_index_uninit(midi_index_t *ix)
+{
+	int	i;
+
+	if(ix == NULL)
+		return EINVAL;
+
+	for(i = 0; i < MIDI_INDEX_NCOLS; ++i)
+		free(ix->ix_cols[i]);
+	free(ix->ix_names);
+	if(ix->ix_srcs) {
+		for(i = 0; i < ix->ix_cnt; ++i)
+			free(ix->ix_srcs[i]);
+		free(ix->ix_srcs);
+	}
+
+	memset(ix, 0, sizeof(midi_index_t));
+
+	return 0;
+}
+
+
+int
+midi_index_add(midi_index_t *ix, const char *src, unsigned char *pat,
+	size_t siz)
+{
+	unsigned char	*part;
+	int		row;
+	int		p;
+	int		ret;
+
+	if(ix == NULL || src == NULL || pat == NULL)
+		return EINVAL;
+
+	if(siz != E2_PAT_SIZ || memcmp(pat, E2_PAT_MAGIC,
+	    strlen(E2_PAT_MAGIC)) != 0)
+		return EPROTO;
+
+	ret = _midi_index_grow(ix, ix->ix_cnt + 1);
+	if(ret != 0)
+		return ret;
+
+	row = ix->ix_cnt;
+
+	ix->ix_srcs[row] = strdup(src);
+	if(ix->ix_srcs[row] == NULL)
+		return ENOMEM;
+
+	memcpy(ix->ix_names[row], pat + E2_PAT_NAME, E2_PAT_NAMESIZ);
+	ix->ix_names[row][E2_PAT_NAMESIZ] = 0;
+
+	ix->ix_cols[MIDI_INDEX_TEMPO][row] = pat[E2_PAT_TEMPO] |
+	    pat[E2_PAT_TEMPO + 1] << 8;
+	ix->ix_cols[MIDI_INDEX_SWING][row] = (int8_t) pat[E2_PAT_SWING];
+	ix->ix_cols[MIDI_INDEX_KEY][row] = pat[E2_PAT_KEY];
+	ix->ix_cols[MIDI_INDEX_SCALE][row] = pat[E2_PAT_SCALE];
+
+	for(p = 0; p < E2_NUM_PARTS; ++p) {
+		part = pat + E2_PAT_PART_OFF + p * E2_PAT_PART_SIZ;
+		ix->ix_cols[MIDI_INDEX_OSC + p][row] =
+		    part[E2_PART_OSC_TYPE] | part[E2_PART_OSC_TYPE + 1] << 8;
+		ix->ix_cols[MIDI_INDEX_FILTER + p][row] =
+		    part[E2_PART_FILTER_TYPE];
+	}
+
+	++ix->ix_cnt;
+
+	return 0;
+}
+
+
+int
+midi_index_adddir(midi_index_t *ix, const char *dir, int *skipped)
+{
+	/* Files that aren't pattern dumps are counted in *skipped. */
+
+	DIR		*d;
+	struct dirent	*de;
+	FILE		*f;
+	char		path[1024];
+	unsigned char	*pat;
+	size_t		len;
+	size_t		sufflen;
+	size_t		siz;
+	int		ret;
+
+	if(ix == NULL || dir == NULL)
+		return EINVAL;
+
+	sufflen = strlen(MIDI_INDEX_SUFFIX);
+
+	if(skipped)
+		*skipped = 0;
+
+	pat = malloc(E2_PAT_SIZ + 1);
+	if(pat == NULL)
+		return ENOMEM;
+
+	d = opendir(dir);
+	if(d == NULL) {
+		ret = errno;
+		free(pat);
+		return ret;
+	}
+
+	ret = 0;
+	while((de = readdir(d)) != NULL) {
+		len = strlen(de->d_name);
+		if(len <= sufflen || strcmp(de->d_name + len - sufflen,
+		    MIDI_INDEX_SUFFIX) != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		f = fopen(path, "r");
+		if(f == NULL) {
+			fprintf(stderr, "Can't open %s: %s\n", path,
+			    strerror(errno));
+			if(skipped)
+				++*skipped;
+			continue;
+		}
+		/* One byte more than a dump, to tell if the file is
+		 * longer. */
+		siz = fread(pat, 1, E2_PAT_SIZ + 1, f);
+		fclose(f);
+
+		ret = midi_index_add(ix, de->d_name, pat, siz);
+		if(ret == EPROTO) {
+			if(skipped)
+				++*skipped;
+			ret = 0;
+			continue;
+		}
+		if(ret != 0)
+			break;
+	}
+
+	closedir(d);
+	free(pat);
+
+	return ret;
+}
+
+
+int
+midi_index_save(midi_index_t *ix, const char *path)
+{
+	FILE		*f;
+	uint32_t	hdr[2];
+	int		i;
+	int		ret;
+
+	if(ix == NULL || path == NULL)
+		return EINVAL;
+
+	f = fopen(path, "w");
+	if(f == NULL)
+		return errno;
+
+	hdr[0] = MIDI_INDEX_VERSION;
+	hdr[1] = ix->ix_cnt;
+
+	ret = 0;
+	if(fwrite(MIDI_INDEX_MAGIC, strlen(MIDI_INDEX_MAGIC), 1, f) != 1 ||
+	    fwrite(hdr, sizeof(hdr), 1, f) != 1)
+		ret = EIO;
+
+	for(i = 0; ret == 0 && ix->ix_cnt > 0 && i < MIDI_INDEX_NCOLS; ++i) {
+		if(fwrite(ix->ix_cols[i], sizeof(int16_t), ix->ix_cnt, f) !=
+		    ix->ix_cnt)
+			ret = EIO;
+	}
+
+	if(ret == 0 && ix->ix_cnt > 0 && fwrite(ix->ix_names,
+	    sizeof(ix->ix_names[0]), ix->ix_cnt, f) != ix->ix_cnt)
+		ret = EIO;
+
+	for(i = 0; ret == 0 && i < ix->ix_cnt; ++i) {
+		if(fwrite(ix->ix_srcs[i], strlen(ix->ix_srcs[i]) + 1, 1, f)
+		    != 1)
+			ret = EIO;
+	}
+
+	if(fclose(f) != 0 && ret == 0)
+		ret = errno;
+
+	return ret;
+}
+
+
+int
+midi_index_load(midi_index_t *ix, const char *path)
+{
+	FILE		*f;
+	struct stat	st;
+	char		magic[4];
+	uint32_t	hdr[2];
+	char		src[1024];
+	off_t		left;
+	size_t		rowsiz;
+	int		cnt;
+	int		i;
+	int		c;
+	int		len;
+	int		ret;
+
+	if(ix == NULL || path == NULL)
+		return EINVAL;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+		return errno;
+
+	if(fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, MIDI_INDEX_MAGIC, sizeof(magic)) != 0 ||
+	    fread(hdr, sizeof(hdr), 1, f) != 1 ||
+	    hdr[0] != MIDI_INDEX_VERSION || hdr[1] > INT32_MAX) {
+		fclose(f);
+		return EPROTO;
+	}
+
+	/* NOTE: The count isn't trusted further than the file goes, a bad
+	 * one would have us allocate whatever it says. Every row takes its
+	 * columns, its name and at least the NUL of its source. */
+	if(fstat(fileno(f), &st) != 0) {
+		ret = errno;
+		fclose(f);
+		return ret;
+	}
+	left = st.st_size - (off_t) (sizeof(magic) + sizeof(hdr));
+	rowsiz = MIDI_INDEX_NCOLS * sizeof(int16_t) +
+	    sizeof(ix->ix_names[0]) + 1;
+	if(left < 0 || hdr[1] > (uint64_t) left / rowsiz) {
+		fclose(f);
+		return EPROTO;
+	}
+
+	cnt = hdr[1];
+	if(cnt > INT_MAX - ix->ix_cnt) {
+		fclose(f);
+		return EOVERFLOW;
+	}
+
+	ret = _midi_index_grow(ix, ix->ix_cnt + cnt);
+	if(ret != 0) {
+		fclose(f);
+		return ret;
+	}
+
+	/* Appended after what's there already. */
+	for(i = 0; ret == 0 && cnt > 0 && i < MIDI_INDEX_NCOLS; ++i) {
+		if(fread(ix->ix_cols[i] + ix->ix_cnt, sizeof(int16_t), cnt,
+		    f) != cnt)
+			ret = EPROTO;
+	}
+
+	if(ret == 0 && cnt > 0 && fread(ix->ix_names + ix->ix_cnt,
+	    sizeof(ix->ix_names[0]), cnt, f) != cnt)
+		ret = EPROTO;
+
+	for(i = 0; ret == 0 && i < cnt; ++i) {
+		len = 0;
+		while((c = getc(f)) != EOF && c != 0) {
+			if(len < sizeof(src) - 1)
+				src[len++] = c;
+		}
+		if(c == EOF) {
+			ret = EPROTO;
+			break;
+		}
+		src[len] = 0;
+
+		ix->ix_srcs[ix->ix_cnt + i] = strdup(src);
+		if(ix->ix_srcs[ix->ix_cnt + i] == NULL)
+			ret = ENOMEM;
+	}
+
+	fclose(f);
+
+	if(ret != 0) {
+		/* Nothing half loaded stays. */
+		for(i = 0; i < cnt; ++i) {
+			free(ix->ix_srcs[ix->ix_cnt + i]);
+			ix->ix_srcs[ix->ix_cnt + i] = NULL;
+		}
+		return ret;
+	}
+
+	ix->ix_cnt += cnt;
+
+	return 0;
+}
+
+
+int
+midi_index_query(midi_index_t *ix, midi_index_pred_t *preds, int predcnt,
+	int **resp, int *rescnt)
+{
+	midi_index_pred_t	*ip;
+	uint64_t		*sel;
+	int			*res;
+	int			words;
+	int			i;
+	int			w;
+	int			cnt;
+	int			p;
+	uint64_t		bits;
+
+	if(ix == NULL || (preds == NULL && predcnt > 0) || resp == NULL ||
+	    rescnt == NULL)
+		return EINVAL;
+
+	*resp = NULL;
+	*rescnt = 0;
+
+	for(i = 0; i < predcnt; ++i) {
+		ip = &preds[i];
+		if(ip->ip_col < 0 || ip->ip_col > MIDI_INDEX_NAME ||
+		    (ip->ip_col == MIDI_INDEX_NAME && ip->ip_str == NULL) ||
+		    ip->ip_part < 0 || ip->ip_part > E2_NUM_PARTS)
+			return EINVAL;
+	}
+
+	words = (ix->ix_cnt + 63) / 64;
+	sel = malloc((words ? words : 1) * sizeof(uint64_t));
+	if(sel == NULL)
+		return ENOMEM;
+
+	/* Everything matches until a predicate says otherwise. */
+	for(w = 0; w < words; ++w)
+		sel[w] = ~(uint64_t) 0;
+	if(ix->ix_cnt % 64)
+		sel[words - 1] = ((uint64_t) 1 << (ix->ix_cnt % 64)) - 1;
+
+	for(i = 0; i < predcnt; ++i) {
+		ip = &preds[i];
+
+		if(ip->ip_col == MIDI_INDEX_NAME) {
+			for(w = 0; w < words; ++w) {
+				bits = sel[w];
+				while(bits) {
+					p = __builtin_ctzll(bits);
+					bits &= bits - 1;
+					if(!_midi_index_hasstr(
+					    ix->ix_names[w * 64 + p],
+					    ip->ip_str))
+						sel[w] &= ~((uint64_t) 1 << p);
+				}
+			}
+			continue;
+		}
+
+		if((ip->ip_col == MIDI_INDEX_OSC ||
+		    ip->ip_col == MIDI_INDEX_FILTER) && ip->ip_part == 0) {
+			/* Any part: a pattern stays if one of its parts
+			 * matches. */
+			_midi_index_scan(ix, ip->ip_col, ip->ip_min,
+			    ip->ip_max, sel, 1);
+			continue;
+		}
+
+		_midi_index_scan(ix, _midi_index_col(ip->ip_col, ip->ip_part),
+		    ip->ip_min, ip->ip_max, sel, 0);
+	}
+
+	cnt = 0;
+	for(w = 0; w < words; ++w)
+		cnt += __builtin_popcountll(sel[w]);
+
+	res = malloc((cnt ? cnt : 1) * sizeof(int));
+	if(res == NULL) {
+		free(sel);
+		return ENOMEM;
+	}
+
+	cnt = 0;
+	for(w = 0; w < words; ++w) {
+		bits = sel[w];
+		while(bits) {
+			res[cnt++] = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+		}
+	}
+
+	free(sel);
+
+	*resp = res;
+	*rescnt = cnt;
+
+	return 0;
+}
+
+
+int16_t
+midi_index_get(midi_index_t *ix, int row, int col, int part)
+{
+	return ix->ix_cols[_midi_index_col(col, part)][row];
+}
+
+
+void
+_midi_index_scan(midi_index_t *ix, int col, int min, int max, uint64_t *sel,
+	int anypart)
+{
+	/* Clears the bits of the rows whose value in col isn't between min
+	 * and max. With anypart, col is the first of the part columns and a
+	 * row stays if any of them matches. */
+
+	int16_t		*v;
+	uint64_t	bits;
+	int		words;
+	int		w;
+	int		b;
+	int		n;
+	int		p;
+	int		parts;
+
+	words = (ix->ix_cnt + 63) / 64;
+	parts = anypart ? E2_NUM_PARTS : 1;
+
+	for(w = 0; w < words; ++w) {
+		if(sel[w] == 0)
+			continue;
+
+		n = ix->ix_cnt - w * 64;
+		if(n > 64)
+			n = 64;
+
+		bits = 0;
+		for(p = 0; p < parts; ++p) {
+			v = ix->ix_cols[col + p] + w * 64;
+			/* No branches, so that the compiler can
+			 * vectorize. */
+			for(b = 0; b < n; ++b)
+				bits |= (uint64_t) (v[b] >= min &&
+				    v[b] <= max) << b;
+		}
+
+		sel[w] &= bits;
+	}
+}
+
+
+int
+_midi_index_col(int col, int part)
+{
+	if((col == MIDI_INDEX_OSC || col == MIDI_INDEX_FILTER) && part > 0)
+		return col + part - 1;
+
+	return col;
+}
+
+
+int
+_midi_index_hasstr(const char *name, const char *str)
+{
+	size_t	len;
+
+	len = strlen(str);
+	for(; *name; ++name) {
+		if(strncasecmp(name, str, len) == 0)
+			return 1;
+	}
+
+	return len == 0;
+}
+
+
+int
+_midi_index_grow(midi_index_t *ix, int cnt)
+{
+	void	*p;
+	size_t	cap;
+	int	i;
+
+	if(cnt <= ix->ix_cap)
+		return 0;
+
+	/* Doubling stays below 2 * INT_MAX, which a size_t holds. */
+	cap = ix->ix_cap ? ix->ix_cap : MIDI_INDEX_INITCAP;
+	while(cap < (size_t) cnt)
+		cap *= 2;
+	if(cap > INT_MAX)
+		cap = cnt;
+
+	if(cap > SIZE_MAX / sizeof(ix->ix_names[0]) ||
+	    cap > SIZE_MAX / sizeof(char *))
+		return EOVERFLOW;
+
+	for(i = 0; i < MIDI_INDEX_NCOLS; ++i) {
+		p = realloc(ix->ix_cols[i], cap * sizeof(int16_t));
+		if(p == NULL)
+			return ENOMEM;
+		ix->ix_cols[i] = p;
+	}
+
+	p = realloc(ix->ix_names, cap * sizeof(ix->ix_names[0]));
+	if(p == NULL)
+		return ENOMEM;
+	ix->ix_names = p;
+
+	p = realloc(ix->ix_srcs, cap * sizeof(char *));
+	if(p == NULL)
+		return ENOMEM;
+	ix->ix_srcs = p;
+	memset(ix->ix_srcs + ix->ix_cap, 0, (cap - ix->ix_cap) *
+	    sizeof(char *));
+
+	ix->ix_cap = (int) cap;
+
+	return 0;
+}
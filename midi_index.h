@@ -0,0 +1,65 @@
+#ifndef MIDI_INDEX_H
+#define MIDI_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "electribe.h"
+
+/* Columns. The part columns are E2_NUM_PARTS columns each, one per
+ * part. */
+#define MIDI_INDEX_TEMPO	0	/* BPM * 10 */
+#define MIDI_INDEX_SWING	1
+#define MIDI_INDEX_KEY		2
+#define MIDI_INDEX_SCALE	3
+#define MIDI_INDEX_OSC		4
+#define MIDI_INDEX_FILTER	(MIDI_INDEX_OSC + E2_NUM_PARTS)
+#define MIDI_INDEX_NCOLS	(MIDI_INDEX_FILTER + E2_NUM_PARTS)
+/* Not a column, names can only be searched. */
+#define MIDI_INDEX_NAME		MIDI_INDEX_NCOLS
+
+#define MIDI_INDEX_FILE		"patterns.e2ix"
+#define MIDI_INDEX_MAGIC	"E2IX"
+#define MIDI_INDEX_VERSION	1
+
+/* Pattern parameters of a collection of dumps, kept by column so that a
+ * query only goes through the values it looks at. */
+typedef struct midi_index {
+	int		ix_cnt;
+	int		ix_cap;
+	int16_t		*ix_cols[MIDI_INDEX_NCOLS];
+	char		(*ix_names)[E2_PAT_NAMESIZ + 1];
+	char		**ix_srcs;	/* Where each pattern came from */
+} midi_index_t;
+
+/* One condition of a query. Numeric columns match between ip_min and
+ * ip_max (inclusive), names if they contain ip_str (case ignored). */
+typedef struct midi_index_pred {
+	int		ip_col;
+	int		ip_part;	/* Part columns: 1~16, 0: any part */
+	int		ip_min;
+	int		ip_max;
+	const char	*ip_str;
+} midi_index_pred_t;
+
+int midi_index_init(midi_index_t *);
+int midi_index_uninit(midi_index_t *);
+
+/* Adds a decoded pattern dump, E2_PAT_SIZ bytes. */
+int midi_index_add(midi_index_t *, const char *, unsigned char *, size_t);
+
+/* Adds the decoded dumps (*.e2pat, see MIDI_FLEET_FILEFMT) in a
+ * directory. */
+int midi_index_adddir(midi_index_t *, const char *, int *);
+
+/* The index file is a cache, in the machine's byte order. */
+int midi_index_save(midi_index_t *, const char *);
+int midi_index_load(midi_index_t *, const char *);
+
+/* Finds the patterns that match all the predicates. Their row numbers are
+ * returned in a newly allocated array. */
+int midi_index_query(midi_index_t *, midi_index_pred_t *, int, int **,
+	int *);
+
+int16_t midi_index_get(midi_index_t *, int, int, int);
+
+#endif
@@ -0,0 +1,973 @@
+/*
+ * epoll event loop for file descriptor MIDI ports.
+ *
+ * Input is read as soon as there is any and parsed right there, byte by
+ * byte, the way the CoreMIDI reader does it. Output is written as far as
+ * the fd takes it; what's left waits for the fd to become writable. All
+ * timeouts share one timerfd, set for whichever is due first.
+ *
+ * Unlike CoreMIDI, a file descriptor is the wire itself, so running status
+ * is used on output.
+ */
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#ifdef MIDI_UMP_ALSA
+#include <sys/ioctl.h>
+#include <sound/asound.h>
+#endif
+#include "midi_loop.h"
+#include "midi_time.h"
+#include "midi_trace.h"
+#include "midi_rt.h"
+
+#define MIDI_LOOP_TIMERTAG	UINT32_MAX
+#define MIDI_LOOP_MAXEVENTS	16
+
+/* Each port is registered with tag 2 * index for its input fd and
+ * 2 * index + 1 for its output fd if that's a different one. */
+#define MIDI_LOOP_TAG(idx, w)	((uint32_t) (idx) * 2 + (w))
+
+int _midi_loop_nonblock(int);
+int _midi_loop_watch(midi_loop_t *, int, int);
+int _midi_loop_reserve(midi_loop_port_t *, size_t);
+int _midi_loop_flush(midi_loop_t *, int);
+int _midi_loop_read(midi_loop_t *, int);
+void _midi_loop_parse(midi_loop_t *, int, unsigned char);
+void _midi_loop_parse_chan(midi_loop_t *, int, unsigned char);
+void _midi_loop_drop(midi_loop_t *, int);
+int _midi_loop_arm(midi_loop_t *);
+void _midi_loop_expire(midi_loop_t *);
+
+
+int
+midi_loop_init(midi_loop_t *ml, midi_loop_msgfn_t msgfn, void *arg)
+{
+	struct epoll_event	ev;
+	int			i;
+	int			ret;
+
+	if(ml == NULL)
+		return EINVAL;
+
+	memset(ml, 0, sizeof(midi_loop_t));
+	for(i = 0; i < MIDI_LOOP_MAXPORTS; ++i) {
+		ml->ml_ports[i].mp_rfd = -1;
+		ml->ml_ports[i].mp_wfd = -1;
+	}
+	ml->ml_msgfn = msgfn;
+	ml->ml_arg = arg;
+	ml->ml_tfd = -1;
+
+	midi_runstat_init(&ml->ml_runstat, MIDI_RUNSTAT_REFRESH_MS *
+	    MIDI_TIME_NSEC_PER_MSEC);
+
+	ml->ml_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(ml->ml_epfd < 0) {
+		ret = errno;
+		fprintf(stderr, "Can't create epoll instance: %s\n",
+		    strerror(ret));
+		return ret;
+	}
+
+	ml->ml_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK |
+	    TFD_CLOEXEC);
+	if(ml->ml_tfd < 0) {
+		ret = errno;
+		fprintf(stderr, "Can't create timerfd: %s\n", strerror(ret));
+		(void) close(ml->ml_epfd);
+		return ret;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = MIDI_LOOP_TIMERTAG;
+	if(epoll_ctl(ml->ml_epfd, EPOLL_CTL_ADD, ml->ml_tfd, &ev) != 0) {
+		ret = errno;
+		fprintf(stderr, "Can't watch timerfd: %s\n", strerror(ret));
+		(void) close(ml->ml_tfd);
+		(void) close(ml->ml_epfd);
+		return ret;
+	}
+
+	return 0;
+}
+
+
+int
+midi_loop_uninit(midi_loop_t *ml)
+{
+	int	i;
+
+	if(ml == NULL)
+		return EINVAL;
+
+	for(i = 0; i < ml->ml_portcnt; ++i) {
+		free(ml->ml_ports[i].mp_sysex);
+		free(ml->ml_ports[i].mp_out);
+	}
+
+	(void) close(ml->ml_tfd);
+	(void) close(ml->ml_epfd);
+
+	memset(ml, 0, sizeof(midi_loop_t));
+	ml->ml_epfd = -1;
+	ml->ml_tfd = -1;
+
+	return 0;
+}
+
+
+int
+midi_loop_setumpfn(midi_loop_t *ml, midi_loop_umpfn_t fn, void *arg)
+{
+	if(ml == NULL)
+		return EINVAL;
+
+	if(ml->ml_portcnt > 0)
+		return EBUSY;
+
+	ml->ml_umpfn = fn;
+	ml->ml_umparg = arg;
+
+	return 0;
+}
+
+
+int
+midi_loop_addport(midi_loop_t *ml, int rfd, int wfd, int *idxp)
+{
+	struct epoll_event	ev;
+	midi_loop_port_t	*mp;
+	int			idx;
+	int			ret;
+
+	if(ml == NULL || (rfd < 0 && wfd < 0))
+		return EINVAL;
+
+	if(ml->ml_portcnt >= MIDI_LOOP_MAXPORTS)
+		return ENOSPC;
+
+	idx = ml->ml_portcnt;
+	mp = &ml->ml_ports[idx];
+
+	if(rfd >= 0) {
+		ret = _midi_loop_nonblock(rfd);
+		if(ret != 0)
+			return ret;
+	}
+	if(wfd >= 0 && wfd != rfd) {
+		ret = _midi_loop_nonblock(wfd);
+		if(ret != 0)
+			return ret;
+	}
+
+	if(rfd >= 0 && ml->ml_umpfn) {
+		midi_ump_parser_init(&mp->mp_ump, idx);
+	} else
+	if(rfd >= 0) {
+		mp->mp_sysex = malloc(MIDI_LOOP_MAXSYSEX);
+		if(mp->mp_sysex == NULL)
+			return ENOMEM;
+		midi_rt_prefault(mp->mp_sysex, MIDI_LOOP_MAXSYSEX);
+	}
+
+	if(rfd >= 0) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = MIDI_LOOP_TAG(idx, 0);
+		if(epoll_ctl(ml->ml_epfd, EPOLL_CTL_ADD, rfd, &ev) != 0) {
+			ret = errno;
+			fprintf(stderr, "Can't watch fd %d: %s\n", rfd,
+			    strerror(ret));
+			free(mp->mp_sysex);
+			mp->mp_sysex = NULL;
+			return ret;
+		}
+	}
+
+	if(wfd >= 0 && wfd != rfd) {
+		/* Nothing to wait for until a write doesn't go through. */
+		memset(&ev, 0, sizeof(ev));
+		ev.events = 0;
+		ev.data.u32 = MIDI_LOOP_TAG(idx, 1);
+		if(epoll_ctl(ml->ml_epfd, EPOLL_CTL_ADD, wfd, &ev) != 0) {
+			ret = errno;
+			fprintf(stderr, "Can't watch fd %d: %s\n", wfd,
+			    strerror(ret));
+			if(rfd >= 0)
+				(void) epoll_ctl(ml->ml_epfd, EPOLL_CTL_DEL,
+				    rfd, NULL);
+			free(mp->mp_sysex);
+			mp->mp_sysex = NULL;
+			return ret;
+		}
+	}
+
+	mp->mp_rfd = rfd;
+	mp->mp_wfd = wfd;
+	++ml->ml_portcnt;
+
+	if(idxp)
+		*idxp = idx;
+
+	return 0;
+}
+
+
+#ifdef MIDI_UMP_ALSA
+int
+midi_loop_addump(midi_loop_t *ml, int fd, int *idxp)
+{
+	struct snd_ump_endpoint_info	info;
+	int				idx;
+	int				ret;
+
+	if(ml == NULL || fd < 0 || ml->ml_umpfn == NULL)
+		return EINVAL;
+
+	/* Plain rawmidi devices don't know this one. */
+	memset(&info, 0, sizeof(info));
+	if(ioctl(fd, SNDRV_UMP_IOCTL_ENDPOINT_INFO, &info) != 0) {
+		ret = errno;
+		fprintf(stderr, "fd %d isn't a UMP endpoint: %s\n", fd,
+		    strerror(ret));
+		return ret;
+	}
+
+	ret = midi_loop_addport(ml, fd, fd, &idx);
+	if(ret != 0)
+		return ret;
+
+	ml->ml_ports[idx].mp_native = 1;
+
+	if(idxp)
+		*idxp = idx;
+
+	return 0;
+}
+#endif
+
+
+int
+midi_loop_send(midi_loop_t *ml, int idx, midi_msg_t *msg)
+{
+	midi_loop_port_t	*mp;
+	unsigned char		buf[MIDI_MSG_SHORTSIZ];
+	unsigned char		*out;
+	size_t			siz;
+	size_t			skip;
+	int			ret;
+
+	if(ml == NULL || idx < 0 || idx >= ml->ml_portcnt || msg == NULL)
+		return EINVAL;
+
+	mp = &ml->ml_ports[idx];
+	if(mp->mp_wfd < 0)
+		return EBADF;
+
+#ifdef MIDI_UMP_ALSA
+	if(mp->mp_native)
+		return ENOTSUP;
+#endif
+
+	if(MIDI_MSG_ISSYSRT(msg->mm_type)) {
+		if(mp->mp_rtcnt >= MIDI_LOOP_MAXRT)
+			return ENOBUFS;
+		ret = midi_msg_encode_short(msg, buf, &siz);
+		if(ret != 0)
+			return ret;
+		mp->mp_rt[mp->mp_rtcnt++] = buf[0];
+		return _midi_loop_flush(ml, idx);
+	}
+
+	if(msg->mm_type == MIDI_MSG_SYSEX) {
+		if(msg->mm_payload == NULL || msg->mm_payload_siz == 0)
+			return EINVAL;
+		siz = msg->mm_payload_siz + 2;
+		ret = _midi_loop_reserve(mp, siz);
+		if(ret != 0)
+			return ret;
+		out = mp->mp_out + mp->mp_outsiz;
+		out[0] = 0xF0;
+		memcpy(out + 1, msg->mm_payload, msg->mm_payload_siz);
+		out[siz - 1] = 0xF7;
+	} else {
+		ret = midi_msg_encode_short(msg, buf, &siz);
+		if(ret != 0)
+			return ret;
+		ret = _midi_loop_reserve(mp, siz);
+		if(ret != 0)
+			return ret;
+		out = mp->mp_out + mp->mp_outsiz;
+		memcpy(out, buf, siz);
+	}
+
+	/* Sysex only ever ends the running status. */
+	skip = midi_runstat_skip(&ml->ml_runstat, idx, midi_time_now(), out,
+	    siz);
+	if(skip)
+		memmove(out, out + skip, siz - skip);
+	mp->mp_outsiz += siz - skip;
+
+	MIDI_TRACE_STAGE(msg->mm_id, MIDI_TRACE_SEND);
+
+	return _midi_loop_flush(ml, idx);
+}
+
+
+int
+midi_loop_send_ump(midi_loop_t *ml, int idx, const midi_ump_t *ump)
+{
+	midi_loop_port_t	*mp;
+	unsigned char		buf[MIDI_UMP_MAXBYTES];
+	unsigned char		*out;
+	size_t			siz;
+	size_t			skip;
+	int			ret;
+
+	if(ml == NULL || idx < 0 || idx >= ml->ml_portcnt || ump == NULL)
+		return EINVAL;
+
+	mp = &ml->ml_ports[idx];
+	if(mp->mp_wfd < 0)
+		return EBADF;
+
+#ifdef MIDI_UMP_ALSA
+	if(mp->mp_native) {
+		/* A packet is never split, so realtime ones can't overtake
+		 * anything and simply go in order. */
+		siz = midi_ump_words(ump) * sizeof(uint32_t);
+		ret = _midi_loop_reserve(mp, siz);
+		if(ret != 0)
+			return ret;
+		memcpy(mp->mp_out + mp->mp_outsiz, ump->mu_w, siz);
+		mp->mp_outsiz += siz;
+		return _midi_loop_flush(ml, idx);
+	}
+#endif
+
+	ret = midi_ump_to_bytes(ump, buf, &siz);
+	if(ret != 0)
+		return ret;
+
+	if(siz == 1 && buf[0] >= 0xF8) {
+		if(mp->mp_rtcnt >= MIDI_LOOP_MAXRT)
+			return ENOBUFS;
+		mp->mp_rt[mp->mp_rtcnt++] = buf[0];
+		return _midi_loop_flush(ml, idx);
+	}
+
+	ret = _midi_loop_reserve(mp, siz);
+	if(ret != 0)
+		return ret;
+	out = mp->mp_out + mp->mp_outsiz;
+	memcpy(out, buf, siz);
+
+	/* The middle packets of a sysex message are only data, which
+	 * doesn't change the running status. */
+	skip = midi_runstat_skip(&ml->ml_runstat, idx, midi_time_now(), out,
+	    siz);
+	if(skip)
+		memmove(out, out + skip, siz - skip);
+	mp->mp_outsiz += siz - skip;
+
+	return _midi_loop_flush(ml, idx);
+}
+
+
+int
+midi_loop_settimer(midi_loop_t *ml, uint64_t when, midi_loop_timerfn_t fn,
+	void *arg, int *id)
+{
+	int	i;
+
+	if(ml == NULL || fn == NULL)
+		return EINVAL;
+
+	for(i = 0; i < MIDI_LOOP_MAXTIMERS; ++i) {
+		if(ml->ml_timers[i].lt_when == 0)
+			break;
+	}
+	if(i == MIDI_LOOP_MAXTIMERS)
+		return ENOSPC;
+
+	/* 0 means unused, and would disarm the timerfd. */
+	ml->ml_timers[i].lt_when = when ? when : 1;
+	ml->ml_timers[i].lt_fn = fn;
+	ml->ml_timers[i].lt_arg = arg;
+
+	if(id)
+		*id = i + 1;
+
+	return _midi_loop_arm(ml);
+}
+
+
+int
+midi_loop_canceltimer(midi_loop_t *ml, int id)
+{
+	if(ml == NULL || id < 1 || id > MIDI_LOOP_MAXTIMERS)
+		return EINVAL;
+
+	if(ml->ml_timers[id - 1].lt_when == 0)
+		return ENOENT;
+
+	ml->ml_timers[id - 1].lt_when = 0;
+
+	return _midi_loop_arm(ml);
+}
+
+
+int
+midi_loop_run(midi_loop_t *ml)
+{
+	struct epoll_event	evs[MIDI_LOOP_MAXEVENTS];
+	midi_loop_port_t	*mp;
+	uint32_t		tag;
+	int			idx;
+	int			n;
+	int			i;
+	int			live;
+	int			ret;
+
+	if(ml == NULL)
+		return EINVAL;
+
+	ml->ml_quit = 0;
+
+	while(!ml->ml_quit) {
+
+		live = 0;
+		for(i = 0; i < ml->ml_portcnt; ++i) {
+			mp = &ml->ml_ports[i];
+			if(mp->mp_rfd >= 0 || mp->mp_wfd >= 0)
+				++live;
+		}
+		for(i = 0; i < MIDI_LOOP_MAXTIMERS; ++i) {
+			if(ml->ml_timers[i].lt_when != 0)
+				++live;
+		}
+		if(live == 0)
+			break;
+
+		n = epoll_wait(ml->ml_epfd, evs, MIDI_LOOP_MAXEVENTS, -1);
+		if(n < 0) {
+			ret = errno;
+			if(ret == EINTR)
+				continue;
+			fprintf(stderr, "Error while waiting for events: %s\n",
+			    strerror(ret));
+			return ret;
+		}
+
+		for(i = 0; i < n; ++i) {
+			tag = evs[i].data.u32;
+
+			if(tag == MIDI_LOOP_TIMERTAG) {
+				_midi_loop_expire(ml);
+				continue;
+			}
+
+			idx = tag / 2;
+			if(idx >= ml->ml_portcnt)
+				continue;
+			mp = &ml->ml_ports[idx];
+
+			if(tag % 2 == 0 && mp->mp_rfd >= 0 &&
+			    (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				(void) _midi_loop_read(ml, idx);
+
+			/* The read may have dropped the port. */
+			if(mp->mp_wfd < 0)
+				continue;
+
+			if(evs[i].events & EPOLLOUT)
+				(void) _midi_loop_flush(ml, idx);
+			else
+			if(tag % 2 == 1 &&
+			    (evs[i].events & (EPOLLHUP | EPOLLERR))) {
+				fprintf(stderr, "MIDI port %d went away\n",
+				    idx);
+				_midi_loop_drop(ml, idx);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+void
+midi_loop_quit(midi_loop_t *ml)
+{
+	/* NOTE: Only from the loop's own thread, eg. a callback. */
+
+	if(ml)
+		ml->ml_quit = 1;
+}
+
+
+int
+_midi_loop_nonblock(int fd)
+{
+	int	flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		fprintf(stderr, "Can't make fd %d non-blocking: %s\n", fd,
+		    strerror(errno));
+		return errno;
+	}
+
+	return 0;
+}
+
+
+int
+_midi_loop_watch(midi_loop_t *ml, int idx, int wantout)
+{
+	/* Starts or stops waiting for the port's output fd to become
+	 * writable. */
+
+	midi_loop_port_t	*mp;
+	struct epoll_event	ev;
+	int			ret;
+
+	mp = &ml->ml_ports[idx];
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = wantout ? EPOLLOUT : 0;
+	if(mp->mp_wfd == mp->mp_rfd) {
+		ev.events |= EPOLLIN;
+		ev.data.u32 = MIDI_LOOP_TAG(idx, 0);
+	} else
+		ev.data.u32 = MIDI_LOOP_TAG(idx, 1);
+
+	if(epoll_ctl(ml->ml_epfd, EPOLL_CTL_MOD, mp->mp_wfd, &ev) != 0) {
+		ret = errno;
+		fprintf(stderr, "Can't change events of fd %d: %s\n",
+		    mp->mp_wfd, strerror(ret));
+		return ret;
+	}
+
+	mp->mp_polling = wantout;
+
+	return 0;
+}
+
+
+int
+_midi_loop_reserve(midi_loop_port_t *mp, size_t siz)
+{
+	/* Makes room for siz more bytes at the end of the port's output. */
+
+	unsigned char	*out;
+	size_t		cap;
+
+	/* What's been written already isn't needed anymore. */
+	if(mp->mp_outoff > 0) {
+		memmove(mp->mp_out, mp->mp_out + mp->mp_outoff,
+		    mp->mp_outsiz - mp->mp_outoff);
+		mp->mp_outsiz -= mp->mp_outoff;
+		mp->mp_outoff = 0;
+	}
+
+	if(mp->mp_outsiz + siz <= mp->mp_outcap)
+		return 0;
+
+	cap = mp->mp_outcap ? mp->mp_outcap : MIDI_LOOP_READSIZ;
+	while(cap < mp->mp_outsiz + siz)
+		cap *= 2;
+
+	out = realloc(mp->mp_out, cap);
+	if(out == NULL)
+		return ENOMEM;
+
+	mp->mp_out = out;
+	mp->mp_outcap = cap;
+
+	return 0;
+}
+
+
+int
+_midi_loop_flush(midi_loop_t *ml, int idx)
+{
+	/* Writes as much of the port's output as the fd takes, realtime
+	 * bytes first. */
+
+	midi_loop_port_t	*mp;
+	ssize_t			n;
+	size_t			want;
+	int			pending;
+	int			ret;
+
+	mp = &ml->ml_ports[idx];
+	ret = 0;
+
+	while(mp->mp_rtcnt > 0 || mp->mp_outoff < mp->mp_outsiz) {
+
+		if(mp->mp_rtcnt > 0) {
+			want = mp->mp_rtcnt;
+			n = write(mp->mp_wfd, mp->mp_rt, want);
+		} else {
+			want = mp->mp_outsiz - mp->mp_outoff;
+			n = write(mp->mp_wfd, mp->mp_out + mp->mp_outoff,
+			    want);
+		}
+
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			ret = errno;
+			fprintf(stderr, "Can't write to MIDI port %d: %s\n",
+			    idx, strerror(ret));
+			_midi_loop_drop(ml, idx);
+			return ret;
+		}
+
+		ml->ml_wbytes += n;
+		if((size_t) n < want)
+			++ml->ml_partial;
+
+		if(mp->mp_rtcnt > 0) {
+			memmove(mp->mp_rt, mp->mp_rt + n, mp->mp_rtcnt - n);
+			mp->mp_rtcnt -= n;
+		} else
+			mp->mp_outoff += n;
+	}
+
+	if(mp->mp_outoff == mp->mp_outsiz) {
+		mp->mp_outoff = 0;
+		mp->mp_outsiz = 0;
+	}
+
+	pending = mp->mp_rtcnt > 0 || mp->mp_outsiz > 0;
+	if(pending != mp->mp_polling)
+		ret = _midi_loop_watch(ml, idx, pending);
+
+	return ret;
+}
+
+
+int
+_midi_loop_read(midi_loop_t *ml, int idx)
+{
+	/* One read per wakeup, so that a busy port can't starve the
+	 * others. The fd stays readable until everything's been read. */
+
+	midi_loop_port_t	*mp;
+	unsigned char		buf[MIDI_LOOP_READSIZ];
+	midi_ump_t		ump;
+	ssize_t			n;
+	ssize_t			i;
+	int			ret;
+
+	mp = &ml->ml_ports[idx];
+
+	do {
+		n = read(mp->mp_rfd, buf, sizeof(buf));
+	} while(n < 0 && errno == EINTR);
+
+	if(n < 0) {
+		ret = errno;
+		if(ret == EAGAIN || ret == EWOULDBLOCK)
+			return 0;
+		/* A pseudo-terminal whose other side was closed says EIO. */
+		if(ret != EIO)
+			fprintf(stderr, "Can't read from MIDI port %d: %s\n",
+			    idx, strerror(ret));
+		_midi_loop_drop(ml, idx);
+		return ret;
+	}
+
+	if(n == 0) {
+		_midi_loop_drop(ml, idx);
+		return 0;
+	}
+
+	ml->ml_rbytes += n;
+
+#ifdef MIDI_UMP_ALSA
+	if(mp->mp_native) {
+		/* Words in host order, as many as the first one says. */
+		for(i = 0; i < n && mp->mp_rfd >= 0; ++i) {
+			((unsigned char *) mp->mp_nat.mu_w)[mp->mp_natsiz++] =
+			    buf[i];
+			if(mp->mp_natsiz < sizeof(uint32_t) ||
+			    mp->mp_natsiz < midi_ump_words(&mp->mp_nat) *
+			    sizeof(uint32_t))
+				continue;
+			ml->ml_umpfn(ml, idx, &mp->mp_nat, ml->ml_umparg);
+			memset(&mp->mp_nat, 0, sizeof(midi_ump_t));
+			mp->mp_natsiz = 0;
+		}
+		return 0;
+	}
+#endif
+
+	if(ml->ml_umpfn) {
+		for(i = 0; i < n && mp->mp_rfd >= 0; ++i) {
+			if(midi_ump_parse(&mp->mp_ump, buf[i], &ump))
+				ml->ml_umpfn(ml, idx, &ump, ml->ml_umparg);
+		}
+		return 0;
+	}
+
+	for(i = 0; i < n && mp->mp_rfd >= 0; ++i)
+		_midi_loop_parse(ml, idx, buf[i]);
+
+	return 0;
+}
+
+
+void
+_midi_loop_parse(midi_loop_t *ml, int idx, unsigned char dat)
+{
+	midi_loop_port_t	*mp;
+	midi_msg_t		msg;
+
+	mp = &ml->ml_ports[idx];
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_src = idx;
+	msg.mm_dest = MIDI_EP_ANY;
+
+	switch(dat) {
+	case 0xF8:
+		msg.mm_type = MIDI_MSG_SYSRT_CLOCK;
+		break;
+	case 0xFA:
+		msg.mm_type = MIDI_MSG_SYSRT_START;
+		break;
+	case 0xFB:
+		msg.mm_type = MIDI_MSG_SYSRT_CONTINUE;
+		break;
+	case 0xFC:
+		msg.mm_type = MIDI_MSG_SYSRT_STOP;
+		break;
+	case 0xF0:
+		mp->mp_status = 0;
+		if(mp->mp_in_sysex) {
+			fprintf(stderr, "Received sysex begin while in sysex"
+			    " on port %d, discarding %zu bytes\n", idx,
+			    mp->mp_sysex_siz);
+			mp->mp_sysex_siz = 0;
+			return;
+		}
+		mp->mp_in_sysex++;
+		if(midi_trace_on)
+			mp->mp_sysex_start = midi_time_now();
+		return;
+	case 0xF7:
+		mp->mp_status = 0;
+		if(!mp->mp_in_sysex) {
+			fprintf(stderr, "Received sysex end but never saw"
+			    " beginning!\n");
+			return;
+		}
+		mp->mp_in_sysex = 0;
+		if(mp->mp_sysex_siz == 0) {
+			fprintf(stderr, "Zero length Sysex received!\n");
+			return;
+		}
+		msg.mm_type = MIDI_MSG_SYSEX;
+		msg.mm_payload = mp->mp_sysex;
+		msg.mm_payload_siz = mp->mp_sysex_siz;
+		if(midi_trace_on) {
+			msg.mm_id = midi_trace_newid();
+			midi_trace_stage(msg.mm_id, MIDI_TRACE_REPLY_F0,
+			    mp->mp_sysex_start);
+			midi_trace_stage(msg.mm_id, MIDI_TRACE_REPLY_F7, 0);
+		}
+		mp->mp_sysex_siz = 0;
+		break;
+	default:
+		if(dat >= 0xF8) {
+			/* Other realtime bytes (Active Sensing) are
+			 * ignored, wherever they come. */
+			return;
+		}
+		if(!mp->mp_in_sysex) {
+			_midi_loop_parse_chan(ml, idx, dat);
+			return;
+		}
+		if(mp->mp_sysex_siz >= MIDI_LOOP_MAXSYSEX) {
+			fprintf(stderr, "Sysex data too long.\n");
+			return;
+		}
+		mp->mp_sysex[mp->mp_sysex_siz++] = dat;
+		return;
+	}
+
+	if(ml->ml_msgfn)
+		ml->ml_msgfn(ml, &msg, ml->ml_arg);
+}
+
+
+void
+_midi_loop_parse_chan(midi_loop_t *ml, int idx, unsigned char dat)
+{
+	/* Channel messages, running status included. Control and Program
+	 * Changes are handed on, the others are only read past. */
+
+	midi_loop_port_t	*mp;
+	midi_msg_t		msg;
+	int			status;
+	int			need;
+
+	mp = &ml->ml_ports[idx];
+
+	if(dat >= 0xF0) {
+		/* System common. */
+		mp->mp_status = 0;
+		mp->mp_datacnt = 0;
+		return;
+	}
+
+	if(dat >= 0x80) {
+		mp->mp_status = dat;
+		mp->mp_datacnt = 0;
+		return;
+	}
+
+	if(mp->mp_status == 0) {
+		/* Data without status, we came in in the middle. */
+		return;
+	}
+
+	mp->mp_data[mp->mp_datacnt++] = dat;
+
+	status = mp->mp_status & 0xF0;
+	need = (status == 0xC0 || status == 0xD0) ? 1 : 2;
+	if(mp->mp_datacnt < need)
+		return;
+
+	/* Complete. Status stays for the next one. */
+	mp->mp_datacnt = 0;
+
+	if(status != 0xB0 && status != 0xC0)
+		return;
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_src = idx;
+	msg.mm_dest = MIDI_EP_ANY;
+	msg.mm_chan = mp->mp_status & 0x0F;
+	if(status == 0xB0) {
+		msg.mm_type = MIDI_MSG_CHANCC;
+		msg.mm_num = mp->mp_data[0];
+		msg.mm_val = mp->mp_data[1];
+	} else {
+		msg.mm_type = MIDI_MSG_CHANPROG;
+		msg.mm_val = mp->mp_data[0];
+	}
+
+	if(ml->ml_msgfn)
+		ml->ml_msgfn(ml, &msg, ml->ml_arg);
+}
+
+
+void
+_midi_loop_drop(midi_loop_t *ml, int idx)
+{
+	/* Stops watching the port's fds. They are the caller's to close. */
+
+	midi_loop_port_t	*mp;
+
+	mp = &ml->ml_ports[idx];
+
+	if(mp->mp_rfd >= 0)
+		(void) epoll_ctl(ml->ml_epfd, EPOLL_CTL_DEL, mp->mp_rfd, NULL);
+	if(mp->mp_wfd >= 0 && mp->mp_wfd != mp->mp_rfd)
+		(void) epoll_ctl(ml->ml_epfd, EPOLL_CTL_DEL, mp->mp_wfd, NULL);
+
+	mp->mp_rfd = -1;
+	mp->mp_wfd = -1;
+	mp->mp_polling = 0;
+	mp->mp_rtcnt = 0;
+	mp->mp_outoff = 0;
+	mp->mp_outsiz = 0;
+	mp->mp_in_sysex = 0;
+	mp->mp_sysex_siz = 0;
+	midi_ump_parser_init(&mp->mp_ump, idx);
+#ifdef MIDI_UMP_ALSA
+	mp->mp_natsiz = 0;
+#endif
+}
+
+
+int
+_midi_loop_arm(midi_loop_t *ml)
+{
+	/* Sets the timerfd for the first timer due, or disarms it. */
+
+	struct itimerspec	its;
+	uint64_t		first;
+	int			i;
+	int			ret;
+
+	first = 0;
+	for(i = 0; i < MIDI_LOOP_MAXTIMERS; ++i) {
+		if(ml->ml_timers[i].lt_when == 0)
+			continue;
+		if(first == 0 || ml->ml_timers[i].lt_when < first)
+			first = ml->ml_timers[i].lt_when;
+	}
+
+	/* midi_time_now() is CLOCK_MONOTONIC here. */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = first / MIDI_TIME_NSEC_PER_SEC;
+	its.it_value.tv_nsec = first % MIDI_TIME_NSEC_PER_SEC;
+
+	if(timerfd_settime(ml->ml_tfd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+		ret = errno;
+		fprintf(stderr, "Can't set timerfd: %s\n", strerror(ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+
+void
+_midi_loop_expire(midi_loop_t *ml)
+{
+	midi_loop_timerfn_t	fn;
+	void			*arg;
+	uint64_t		expirations;
+	uint64_t		now;
+	int			i;
+
+	/* Only clears the readiness; which timers are due is decided by
+	 * the time. */
+	(void) read(ml->ml_tfd, &expirations, sizeof(expirations));
+
+	now = midi_time_now();
+
+	for(i = 0; i < MIDI_LOOP_MAXTIMERS; ++i) {
+		if(ml->ml_timers[i].lt_when == 0 ||
+		    ml->ml_timers[i].lt_when > now)
+			continue;
+
+		/* The callback may set the same slot again. */
+		fn = ml->ml_timers[i].lt_fn;
+		arg = ml->ml_timers[i].lt_arg;
+		ml->ml_timers[i].lt_when = 0;
+
+		fn(ml, arg);
+	}
+
+	(void) _midi_loop_arm(ml);
+}
+
+#endif /* __linux__ */
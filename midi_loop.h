@@ -0,0 +1,142 @@
+#ifndef MIDI_LOOP_H
+#define MIDI_LOOP_H
+
+#ifdef __linux__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "midi_queue.h"
+#include "midi_runstat.h"
+#include "midi_ump.h"
+
+/*
+ * Event loop for MIDI ports that are file descriptors: serial and USB
+ * (/dev/ttyUSB*, /dev/snd/midiC*D*) devices, pipes and pseudo-terminals.
+ * Everything happens on the thread that runs the loop, so messages are
+ * handed to the callback as they are parsed instead of going through a
+ * queue, and nothing is locked.
+ */
+
+#define MIDI_LOOP_MAXPORTS	MIDI_RUNSTAT_MAXDEST
+#define MIDI_LOOP_MAXTIMERS	64
+#define MIDI_LOOP_MAXSYSEX	65535
+#define MIDI_LOOP_READSIZ	1024
+#define MIDI_LOOP_MAXRT		64	/* Realtime bytes waiting */
+
+struct midi_loop;
+
+/* Called for every message read. mm_src is the port's index. The payload
+ * of a sysex message is only valid until the callback returns. */
+typedef void (*midi_loop_msgfn_t)(struct midi_loop *, midi_msg_t *, void *);
+
+/* Same, for a loop that hands input on as Universal MIDI Packets. The int
+ * is the port's index. */
+typedef void (*midi_loop_umpfn_t)(struct midi_loop *, int,
+	const midi_ump_t *, void *);
+
+/* Called when a timer expires. */
+typedef void (*midi_loop_timerfn_t)(struct midi_loop *, void *);
+
+typedef struct midi_loop_port {
+	int		mp_rfd;		/* -1 if none or closed */
+	int		mp_wfd;
+
+	/* Input */
+	int		mp_status;	/* Running status, 0 if none */
+	unsigned char	mp_data[2];
+	int		mp_datacnt;
+	int		mp_in_sysex;
+	unsigned char	*mp_sysex;
+	size_t		mp_sysex_siz;
+	uint64_t	mp_sysex_start;	/* When F0 came, if tracing */
+	midi_ump_parser_t mp_ump;	/* Instead, with ml_umpfn */
+#ifdef MIDI_UMP_ALSA
+	int		mp_native;	/* Reads and writes packets */
+	midi_ump_t	mp_nat;		/* Packet read so far */
+	size_t		mp_natsiz;
+#endif
+
+	/* Output. Realtime bytes may go between any two bytes, so they
+	 * overtake whatever is half written. */
+	unsigned char	mp_rt[MIDI_LOOP_MAXRT];
+	int		mp_rtcnt;
+	unsigned char	*mp_out;
+	size_t		mp_outsiz;
+	size_t		mp_outoff;	/* Written so far */
+	size_t		mp_outcap;
+	int		mp_polling;	/* Waiting for EPOLLOUT */
+} midi_loop_port_t;
+
+typedef struct midi_loop_timer {
+	uint64_t		lt_when;	/* midi_time_now(), 0: unused */
+	midi_loop_timerfn_t	lt_fn;
+	void			*lt_arg;
+} midi_loop_timer_t;
+
+typedef struct midi_loop {
+	int			ml_epfd;
+	int			ml_tfd;		/* Set for the first
+						 * timer due */
+	midi_loop_port_t	ml_ports[MIDI_LOOP_MAXPORTS];
+	int			ml_portcnt;
+	midi_loop_timer_t	ml_timers[MIDI_LOOP_MAXTIMERS];
+	midi_loop_msgfn_t	ml_msgfn;
+	void			*ml_arg;
+	midi_loop_umpfn_t	ml_umpfn;	/* Replaces ml_msgfn if set */
+	void			*ml_umparg;
+	midi_runstat_t		ml_runstat;
+	int			ml_quit;
+
+	uint64_t		ml_rbytes;	/* Stats */
+	uint64_t		ml_wbytes;
+	uint64_t		ml_partial;	/* Writes that didn't take
+						 * everything */
+} midi_loop_t;
+
+int midi_loop_init(midi_loop_t *, midi_loop_msgfn_t, void *);
+int midi_loop_uninit(midi_loop_t *);
+
+/* Must be called before midi_loop_addport(). Input is translated into
+ * packets as it is read, each port on the group of its index (mod 16),
+ * and handed to fn instead of the message callback. Sysex comes in
+ * packets of 6 bytes, so nothing is put together or allocated for it. */
+int midi_loop_setumpfn(midi_loop_t *, midi_loop_umpfn_t, void *);
+
+/* Adds a port that reads from rfd and writes to wfd, which can be the same
+ * (a tty) or -1 (input or output only). Both are made non-blocking. The
+ * caller still owns them and closes them after midi_loop_uninit().
+ * NOTE: Writing to a pipe whose other end is closed raises SIGPIPE, which
+ * the program should ignore. */
+int midi_loop_addport(midi_loop_t *, int, int, int *);
+
+#ifdef MIDI_UMP_ALSA
+/* Adds an ALSA UMP endpoint (/dev/snd/umpC*D*), opened read-write, that
+ * takes and gives packets itself. They are passed through as they are,
+ * MIDI 2.0 and 8 bit sysex included, with nothing turned into bytes.
+ * Needs midi_loop_setumpfn(); midi_loop_send() doesn't work on it. */
+int midi_loop_addump(midi_loop_t *, int, int *);
+#endif
+
+/* Puts msg on the port's output, leaving out the status byte when running
+ * status allows it. Written right away as far as the fd takes it, the rest
+ * when it's writable again. */
+int midi_loop_send(midi_loop_t *, int, midi_msg_t *);
+
+/* Same for a packet. The packets of a sysex message have to be sent one
+ * after the other, with only realtime ones in between. */
+int midi_loop_send_ump(midi_loop_t *, int, const midi_ump_t *);
+
+/* Calls fn at the time when (midi_time_now()). The id returned can be used
+ * to cancel it. */
+int midi_loop_settimer(midi_loop_t *, uint64_t, midi_loop_timerfn_t, void *,
+	int *);
+int midi_loop_canceltimer(midi_loop_t *, int);
+
+/* Runs until midi_loop_quit() is called, or until there are no ports and
+ * timers left. The thread running it can call midi_rt_thread() first. */
+int midi_loop_run(midi_loop_t *);
+void midi_loop_quit(midi_loop_t *);
+
+#endif /* __linux__ */
+
+#endif
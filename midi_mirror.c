@@ -0,0 +1,361 @@
+/*
+ * Device state mirror.
+ *
+ * Reading a parameter from the device takes a whole pattern dump, which is
+ * about 6 seconds on the wire. The mirror keeps a copy of the current
+ * pattern and global data that is seeded from a dump and then follows the
+ * Panel Control CCs the device sends, so most queries can be answered
+ * without asking the device.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "midi_mirror.h"
+#include "midi_time.h"
+#include "midi_codec.h"
+#include "bstr.h"
+
+static const midi_mirror_param_t mirror_params[] = {
+	{ 0x07, E2_PART_AMP_LEVEL,	1, MIDI_MIRROR_KIND_PLAIN,  "amp"      },
+	{ 0x0A, E2_PART_PAN,		1, MIDI_MIRROR_KIND_SIGNED, "pan"      },
+	{ 0x47, E2_PART_RESO,		1, MIDI_MIRROR_KIND_PLAIN,  "reso"     },
+	{ 0x48, E2_PART_DECAY,		1, MIDI_MIRROR_KIND_PLAIN,  "decay"    },
+	{ 0x49, E2_PART_ATTACK,		1, MIDI_MIRROR_KIND_PLAIN,  "attack"   },
+	{ 0x4A, E2_PART_CUTOFF,		1, MIDI_MIRROR_KIND_PLAIN,  "cutoff"   },
+	{ 0x50, E2_PART_PITCH,		1, MIDI_MIRROR_KIND_SIGNED, "pitch"    },
+	{ 0x51, E2_PART_GLIDE,		1, MIDI_MIRROR_KIND_PLAIN,  "glide"    },
+	{ 0x52, E2_PART_OSC_EDIT,	1, MIDI_MIRROR_KIND_PLAIN,  "oscedit"  },
+	{ 0x53, E2_PART_EG_INT,		1, MIDI_MIRROR_KIND_SIGNED, "egint"    },
+	{ 0x55, E2_PART_MOD_DEPTH,	1, MIDI_MIRROR_KIND_PLAIN,  "moddepth" },
+	{ 0x56, E2_PART_MOD_SPEED,	1, MIDI_MIRROR_KIND_PLAIN,  "modspeed" },
+	{ 0x57, E2_PART_IFX_EDIT,	1, MIDI_MIRROR_KIND_PLAIN,  "ifxedit"  },
+	{ 0x66, E2_PAT_MFX_X,		0, MIDI_MIRROR_KIND_PLAIN,  "mfxx"     },
+	{ 0x67, E2_PAT_MFX_Y,		0, MIDI_MIRROR_KIND_PLAIN,  "mfxy"     },
+	{ 0x68, E2_PART_IFX_ON,		1, MIDI_MIRROR_KIND_SWITCH, "ifx"      },
+	{ 0x69, E2_PART_MFX_SEND,	1, MIDI_MIRROR_KIND_SWITCH, "mfxsend"  },
+	{ 0x6A, -1,			0, MIDI_MIRROR_KIND_SWITCH, "mfx"      },
+	{ -1, 0, 0, 0, NULL }
+};
+
+int _midi_mirror_fresh(midi_mirror_t *, int);
+int _midi_mirror_feed_sysex(midi_mirror_t *, const midi_msg_t *);
+
+
+int
+midi_mirror_init(midi_mirror_t *mi, int chan, int src)
+{
+	int	ret;
+
+	if(mi == NULL || chan < 0 || chan > 0x0F)
+		return EINVAL;
+
+	memset(mi, 0, sizeof(midi_mirror_t));
+
+	ret = pthread_mutex_init(&mi->mi_mutex, NULL);
+	if(ret != 0) {
+		fprintf(stderr, "Can't create mutex for mirror: %s\n",
+		    strerror(ret));
+		return ret;
+	}
+
+	mi->mi_chan = chan;
+	mi->mi_src = src;
+	mi->mi_maxage = (uint64_t) MIDI_MIRROR_MAXAGE_SEC *
+	    MIDI_TIME_NSEC_PER_SEC;
+
+	return 0;
+}
+
+
+int
+midi_mirror_uninit(midi_mirror_t *mi)
+{
+	if(mi == NULL)
+		return EINVAL;
+
+	return pthread_mutex_destroy(&mi->mi_mutex);
+}
+
+
+int
+midi_mirror_setpart(midi_mirror_t *mi, int part)
+{
+	/* The device doesn't say which part its panel is editing, so the
+	 * caller has to. 0 means not known. */
+
+	if(mi == NULL || part < 0 || part > E2_NUM_PARTS)
+		return EINVAL;
+
+	(void) pthread_mutex_lock(&mi->mi_mutex);
+	mi->mi_part = part;
+	(void) pthread_mutex_unlock(&mi->mi_mutex);
+
+	return 0;
+}
+
+
+int
+midi_mirror_seed(midi_mirror_t *mi, int func, unsigned char *dec,
+	size_t siz)
+{
+	if(mi == NULL || dec == NULL)
+		return EINVAL;
+
+	if(func == E2_FUNC_CURPAT_DUMP) {
+		if(siz < E2_PAT_SIZ)
+			return EINVAL;
+		(void) pthread_mutex_lock(&mi->mi_mutex);
+		memcpy(mi->mi_pat, dec, E2_PAT_SIZ);
+		mi->mi_patseen = midi_time_now();
+		mi->mi_patstale = 0;
+		(void) pthread_mutex_unlock(&mi->mi_mutex);
+	} else
+	if(func == E2_FUNC_GLOBAL_DUMP) {
+		if(siz < E2_GLOBAL_SIZ)
+			return EINVAL;
+		(void) pthread_mutex_lock(&mi->mi_mutex);
+		memcpy(mi->mi_global, dec, E2_GLOBAL_SIZ);
+		mi->mi_globalseen = midi_time_now();
+		(void) pthread_mutex_unlock(&mi->mi_mutex);
+	} else
+		return EINVAL;
+
+	return 0;
+}
+
+
+int
+midi_mirror_feed(midi_mirror_t *mi, const midi_msg_t *msg,
+	const midi_mirror_param_t **param)
+{
+	/* Messages from other devices or channels are ignored. */
+
+	const midi_mirror_param_t	*mp;
+	int				val;
+	int				off;
+
+	if(mi == NULL || msg == NULL)
+		return EINVAL;
+
+	if(param)
+		*param = NULL;
+
+	if(mi->mi_src != MIDI_EP_ANY && msg->mm_src != mi->mi_src)
+		return 0;
+
+	if(msg->mm_type == MIDI_MSG_SYSEX)
+		return _midi_mirror_feed_sysex(mi, msg);
+
+	if(msg->mm_chan != mi->mi_chan)
+		return 0;
+
+	if(msg->mm_type == MIDI_MSG_CHANPROG) {
+		/* Another pattern was selected, what we have is of the old
+		 * one. */
+		(void) pthread_mutex_lock(&mi->mi_mutex);
+		mi->mi_patstale = 1;
+		(void) pthread_mutex_unlock(&mi->mi_mutex);
+		return 0;
+	}
+
+	if(msg->mm_type != MIDI_MSG_CHANCC)
+		return 0;
+
+	mp = midi_mirror_param_bycc(msg->mm_num);
+	if(mp == NULL || mp->mp_off < 0)
+		return 0;
+
+	switch(mp->mp_kind) {
+	case MIDI_MIRROR_KIND_SIGNED:
+		val = msg->mm_val - 0x40;
+		if(val < -63)
+			val = -63;
+		break;
+	case MIDI_MIRROR_KIND_SWITCH:
+		val = msg->mm_val >= 0x40;
+		break;
+	default:
+		val = msg->mm_val;
+		break;
+	}
+
+	(void) pthread_mutex_lock(&mi->mi_mutex);
+
+	if(mp->mp_ispart && mi->mi_part == 0) {
+		/* Some part changed but we don't know which one. */
+		mi->mi_patstale = 1;
+		(void) pthread_mutex_unlock(&mi->mi_mutex);
+		return 0;
+	}
+
+	off = mp->mp_off;
+	if(mp->mp_ispart)
+		off += E2_PAT_PART_OFF + E2_PAT_PART_SIZ * (mi->mi_part - 1);
+
+	mi->mi_pat[off] = (unsigned char) val;
+	++mi->mi_updates;
+
+	(void) pthread_mutex_unlock(&mi->mi_mutex);
+
+	if(param)
+		*param = mp;
+
+	return 0;
+}
+
+
+int
+_midi_mirror_feed_sysex(midi_mirror_t *mi, const midi_msg_t *msg)
+{
+	/* Dumps the device sends, whether we asked for them or not, replace
+	 * what we have. */
+
+	unsigned char	*p;
+	bstr_t		*dec;
+	int		ret;
+
+	p = msg->mm_payload;
+
+	if(p == NULL || msg->mm_payload_siz <= E2_HDR_SIZ + 1)
+		return 0;
+
+	if(p[0] != 0x42 || p[1] != (0x30 | mi->mi_chan) || p[2] != 0x00 ||
+	    p[3] != 0x01 || p[4] != 0x23)
+		return 0;
+
+	if(p[E2_HDR_FUNC] != E2_FUNC_CURPAT_DUMP &&
+	    p[E2_HDR_FUNC] != E2_FUNC_GLOBAL_DUMP)
+		return 0;
+
+	dec = binit();
+	if(dec == NULL)
+		return ENOMEM;
+
+	ret = midi_codec_decode(dec, p + E2_HDR_SIZ + 1,
+	    msg->mm_payload_siz - E2_HDR_SIZ - 1);
+	if(ret == 0) {
+		ret = midi_mirror_seed(mi, p[E2_HDR_FUNC],
+		    (unsigned char *) bget(dec), bstrlen(dec));
+	}
+
+	buninit(&dec);
+
+	return ret;
+}
+
+
+int
+midi_mirror_read(midi_mirror_t *mi, int what, size_t off, unsigned char *buf,
+	size_t siz)
+{
+	/* Copies siz bytes at offset off of the pattern or global data. */
+
+	unsigned char	*src;
+	size_t		max;
+	int		ret;
+
+	if(mi == NULL || buf == NULL)
+		return EINVAL;
+
+	if(what == MIDI_MIRROR_PATTERN) {
+		src = mi->mi_pat;
+		max = E2_PAT_SIZ;
+	} else
+	if(what == MIDI_MIRROR_GLOBAL) {
+		src = mi->mi_global;
+		max = E2_GLOBAL_SIZ;
+	} else
+		return EINVAL;
+
+	if(off > max || siz > max - off)
+		return ERANGE;
+
+	(void) pthread_mutex_lock(&mi->mi_mutex);
+	ret = _midi_mirror_fresh(mi, what);
+	if(ret == 0) {
+		memcpy(buf, src + off, siz);
+		++mi->mi_hits;
+	} else
+		++mi->mi_misses;
+	(void) pthread_mutex_unlock(&mi->mi_mutex);
+
+	return ret;
+}
+
+
+int
+midi_mirror_getparam(midi_mirror_t *mi, int part, const char *name,
+	int *val)
+{
+	/* Looks up a Panel Control parameter by name. part (1~16) is only
+	 * used for part parameters. */
+
+	const midi_mirror_param_t	*mp;
+	unsigned char			b;
+	size_t				off;
+	int				ret;
+
+	if(mi == NULL || name == NULL || val == NULL)
+		return EINVAL;
+
+	for(mp = mirror_params; mp->mp_name; ++mp) {
+		if(!strcmp(mp->mp_name, name))
+			break;
+	}
+	if(mp->mp_name == NULL || mp->mp_off < 0)
+		return ENOENT;
+
+	off = mp->mp_off;
+	if(mp->mp_ispart) {
+		if(part < 1 || part > E2_NUM_PARTS)
+			return EINVAL;
+		off += E2_PAT_PART_OFF + E2_PAT_PART_SIZ * (part - 1);
+	}
+
+	ret = midi_mirror_read(mi, MIDI_MIRROR_PATTERN, off, &b, 1);
+	if(ret != 0)
+		return ret;
+
+	if(mp->mp_kind == MIDI_MIRROR_KIND_SIGNED)
+		*val = (signed char) b;
+	else
+		*val = b;
+
+	return 0;
+}
+
+
+const midi_mirror_param_t *
+midi_mirror_param_bycc(int cc)
+{
+	const midi_mirror_param_t	*mp;
+
+	for(mp = mirror_params; mp->mp_name; ++mp) {
+		if(mp->mp_cc == cc)
+			return mp;
+	}
+
+	return NULL;
+}
+
+
+int
+_midi_mirror_fresh(midi_mirror_t *mi, int what)
+{
+	/* NOTE: The caller must hold the mirror's lock. */
+
+	uint64_t	seen;
+
+	if(what == MIDI_MIRROR_PATTERN) {
+		if(mi->mi_patstale)
+			return ESTALE;
+		seen = mi->mi_patseen;
+	} else
+		seen = mi->mi_globalseen;
+
+	if(seen == 0 || midi_time_now() > seen + mi->mi_maxage)
+		return ESTALE;
+
+	return 0;
+}
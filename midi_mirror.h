@@ -0,0 +1,70 @@
+#ifndef MIDI_MIRROR_H
+#define MIDI_MIRROR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "midi_queue.h"
+#include "electribe.h"
+
+/* Some panel changes (oscillator type, steps, ...) aren't sent as CCs, so
+ * after a while the mirror can't be trusted anymore even if every CC was
+ * seen. */
+#define MIDI_MIRROR_MAXAGE_SEC	60
+
+#define MIDI_MIRROR_PATTERN	0
+#define MIDI_MIRROR_GLOBAL	1
+
+/* How a CC value becomes the value stored in the pattern. */
+#define MIDI_MIRROR_KIND_PLAIN	0	/* 0~127 */
+#define MIDI_MIRROR_KIND_SIGNED	1	/* 00,01~40~7F: -63,-63~0~+63 */
+#define MIDI_MIRROR_KIND_SWITCH	2	/* 00,7F: Off,On */
+
+typedef struct midi_mirror_param {
+	int		mp_cc;
+	int		mp_off;		/* -1: not in the pattern data */
+	int		mp_ispart;	/* mp_off is in the part's TABLE 6 */
+	int		mp_kind;
+	const char	*mp_name;
+} midi_mirror_param_t;
+
+/* The current pattern and global data of one device, kept up to date from
+ * what the device sends. */
+typedef struct midi_mirror {
+	pthread_mutex_t	mi_mutex;
+	int		mi_chan;	/* Global channel of the device */
+	int		mi_src;		/* Endpoint it sends on, or MIDI_EP_ANY */
+	int		mi_part;	/* Selected part 1~16, 0 if unknown */
+	uint64_t	mi_maxage;	/* ns */
+
+	unsigned char	mi_pat[E2_PAT_SIZ];
+	uint64_t	mi_patseen;	/* When the last dump came, 0: never */
+	int		mi_patstale;
+
+	unsigned char	mi_global[E2_GLOBAL_SIZ];
+	uint64_t	mi_globalseen;
+
+	uint64_t	mi_updates;	/* Stats */
+	uint64_t	mi_hits;
+	uint64_t	mi_misses;
+} midi_mirror_t;
+
+int midi_mirror_init(midi_mirror_t *, int, int);
+int midi_mirror_uninit(midi_mirror_t *);
+int midi_mirror_setpart(midi_mirror_t *, int);
+
+/* Replaces pattern (E2_FUNC_CURPAT_DUMP) or global (E2_FUNC_GLOBAL_DUMP)
+ * data with decoded dump data. */
+int midi_mirror_seed(midi_mirror_t *, int, unsigned char *, size_t);
+
+/* Applies a message received from the device. If it changed a known
+ * parameter and param isn't NULL, *param is set to it. */
+int midi_mirror_feed(midi_mirror_t *, const midi_msg_t *,
+	const midi_mirror_param_t **);
+
+/* Queries. Return ESTALE if the data has to be dumped again first. */
+int midi_mirror_read(midi_mirror_t *, int, size_t, unsigned char *, size_t);
+int midi_mirror_getparam(midi_mirror_t *, int, const char *, int *);
+
+const midi_mirror_param_t *midi_mirror_param_bycc(int);
+
+#endif
@@ -11,13 +11,21 @@
  */
 #include "midi_osx.h"
 #include "midi_queue.h"
+#include "midi_filter.h"
+#include "midi_ring.h"
+#include "midi_trace.h"
+#include "midi_time.h"
+#include "midi_rt.h"
+#include <stdlib.h>
 #include <pthread.h>
+#include <mach/mach_time.h>
  
 
 #define MIDI_OSX_CLIENTNAME	"midi_osx.c"
 #define MIDI_OSX_INPORTNAME	"midi_osx.c_in"
 #define MIDI_OSX_OUTPORTNAME	"midi_osx.c_out"
 #define MIDI_OSX_MAXMSG   	  65535
+#define MIDI_OSX_MAXPKTS	MIDI_UMP_SYSEX_PKTS(MIDI_OSX_MAXMSG)
 
 static MIDIPortRef osx_midiin;
 static MIDIPortRef osx_midiout;
@@ -25,16 +33,138 @@ static MIDIClientRef osx_midiclient;
 
 static int midi_osx_ready = 0;
 
-/* Buffer to hold incoming sysex data across callbacks. */
-static unsigned char sysex_in[MIDI_OSX_MAXMSG];
-static size_t sysex_in_siz;
-static int in_sysex;
+/* Endpoints selected with midi_osx_select(). 0 means all. */
+static SInt32 osx_srcuid = 0;
+static SInt32 osx_destuid = 0;
+static int osx_destidx = MIDI_EP_ANY;
+
+/* For converting timestamps to host time. */
+static mach_timebase_info_data_t osx_tb;
+
+/* Reassembly state of each source. Sources send independently of each
+ * other, so each needs its own buffer to hold incoming sysex data across
+ * callbacks. What's read is handed on as packets (midi_ump.h). */
+typedef struct midi_osx_src {
+	int		ms_idx;
+	int		ms_in_sysex;
+	unsigned char	*ms_sysex_in;
+	size_t		ms_sysex_in_siz;
+	midi_ump_t	*ms_sysex_pkts;	/* The sysex, packed at F7 */
+	int		ms_status;	/* Running status, 0 if none */
+	unsigned char	ms_data[2];	/* Channel message data so far */
+	int		ms_datacnt;
+	uint64_t	ms_sysex_start;	/* When F0 came, if tracing */
+	midi_filter_sysex_t ms_filt;	/* Whether the sysex is wanted */
+	midi_queue_t	*ms_inq;	/* NULL: use midi_inq */
+	midi_ring_t	*ms_ring;	/* Instead of midi_inq, if set */
+} midi_osx_src_t;
+
+static midi_osx_src_t *osx_srcs = NULL;
+static int osx_srcs_cnt = 0;
+
+/* Per-source queues registered with midi_osx_setsrcq(). */
+#define MIDI_OSX_MAXSRCQ	32
+
+static struct {
+	SInt32		sq_uid;
+	midi_queue_t	*sq_inq;
+} osx_srcq[MIDI_OSX_MAXSRCQ];
+static int osx_srcq_cnt = 0;
+
+/* Set with midi_osx_setfilter(), NULL lets everything through. */
+static midi_filter_t osx_filter;
+static midi_filter_t *osx_filt = NULL;
+
+/* Set with midi_osx_setring(). */
+static midi_ring_t *osx_ring = NULL;
 
 
 static  MIDIPortRef osx_midiout;
 
 extern midi_queue_t *midi_inq;
 void midi_osx_reader_callback(const MIDIPacketList *, void *, void *);
+int _midi_osx_read_chan(midi_osx_src_t *, midi_queue_t *, unsigned char,
+	int *);
+int _midi_osx_lockq(midi_queue_t *, int *);
+int _midi_osx_put(midi_osx_src_t *, midi_queue_t *, int *, uint64_t,
+	const midi_ump_t *, int);
+int _midi_osx_getep(MIDIEndpointRef, int, midi_osx_ep_t *);
+void _midi_osx_freesrcs(void);
+
+
+void
+midi_osx_select(SInt32 srcuid, SInt32 destuid)
+{
+	osx_srcuid = srcuid;
+	osx_destuid = destuid;
+}
+
+
+int
+midi_osx_setsrcq(SInt32 srcuid, midi_queue_t *mq)
+{
+	/* Messages from the source with unique ID srcuid will be put on mq
+	 * instead of midi_inq. */
+
+	int	i;
+
+	if(midi_osx_ready)
+		return EBUSY;
+
+	if(srcuid == 0 || mq == NULL)
+		return EINVAL;
+
+	for(i = 0; i < osx_srcq_cnt; ++i) {
+		if(osx_srcq[i].sq_uid == srcuid) {
+			osx_srcq[i].sq_inq = mq;
+			return 0;
+		}
+	}
+
+	if(osx_srcq_cnt >= MIDI_OSX_MAXSRCQ)
+		return ENOSPC;
+
+	osx_srcq[osx_srcq_cnt].sq_uid = srcuid;
+	osx_srcq[osx_srcq_cnt].sq_inq = mq;
+	++osx_srcq_cnt;
+
+	return 0;
+}
+
+
+int
+midi_osx_setfilter(midi_filter_t *mf)
+{
+	/* The filter is copied, NULL removes it. */
+
+	if(midi_osx_ready)
+		return EBUSY;
+
+	if(mf == NULL) {
+		osx_filt = NULL;
+		return 0;
+	}
+
+	osx_filter = *mf;
+	osx_filt = &osx_filter;
+
+	return 0;
+}
+
+
+int
+midi_osx_setring(midi_ring_t *mr)
+{
+	/* What would go on midi_inq is published on mr instead, NULL goes
+	 * back to midi_inq. */
+
+	if(midi_osx_ready)
+		return EBUSY;
+
+	osx_ring = mr;
+
+	return 0;
+}
 
 
 int
@@ -42,12 +172,22 @@ midi_osx_init()
 {
 	OSStatus	oret;
         ItemCount	osx_srccnt;
+        ItemCount	osx_destcnt;
         ItemCount	osx_i;
         MIDIEndpointRef	osx_midisrc;
+	SInt32		osx_uid;
+	int		osx_conncnt;
+	int		osx_q;
+	midi_osx_src_t	*osx_src;
+	int		ret;
 
 	if(midi_osx_ready)
 		return EEXIST;
 
+	osx_midiclient = 0;
+	osx_midiin = 0;
+	osx_midiout = 0;
+
 	oret = MIDIClientCreate(CFSTR(MIDI_OSX_CLIENTNAME), NULL, NULL,
 	    &osx_midiclient);
 	if(oret) {
@@ -61,27 +201,102 @@ midi_osx_init()
 	if(oret) {
 		fprintf(stderr, "Can't create MIDI input port: OSStatus=%d\n",
 		    oret);
-		return ENOEXEC;
+		ret = ENOEXEC;
+		goto fail;
 	}
 
 	osx_srccnt = MIDIGetNumberOfSources();
 	if(osx_srccnt == 0) {
 		fprintf(stderr, "No MIDI sources in the system\n");
-		return ENOEXEC;
+		ret = ENOEXEC;
+		goto fail;
+	}
+
+	osx_srcs = calloc(osx_srccnt, sizeof(midi_osx_src_t));
+	if(osx_srcs == NULL) {
+		ret = ENOMEM;
+		goto fail;
 	}
+	osx_srcs_cnt = osx_srccnt;
 
+	osx_conncnt = 0;
 	for(osx_i = 0; osx_i < osx_srccnt; ++osx_i) {
 		osx_midisrc = MIDIGetSource(osx_i);
 		if(osx_midisrc == 0) {
 			fprintf(stderr, "Can't retrieve MIDI source %lu\n",
 			    osx_i);
-			return ENOEXEC;
+			ret = ENOEXEC;
+			goto fail;
+		}
+
+		oret = MIDIObjectGetIntegerProperty(osx_midisrc,
+		    kMIDIPropertyUniqueID, &osx_uid);
+		if(oret)
+			osx_uid = 0;
+
+		if(osx_srcuid != 0 && osx_uid != osx_srcuid)
+			continue;
+
+		osx_src = &osx_srcs[osx_i];
+		osx_src->ms_idx = osx_i;
+		osx_src->ms_sysex_in = malloc(MIDI_OSX_MAXMSG);
+		if(osx_src->ms_sysex_in == NULL) {
+			ret = ENOMEM;
+			goto fail;
+		}
+		midi_rt_prefault(osx_src->ms_sysex_in, MIDI_OSX_MAXMSG);
+		if(posix_memalign((void **) &osx_src->ms_sysex_pkts,
+		    _Alignof(midi_ump_t), MIDI_OSX_MAXPKTS *
+		    sizeof(midi_ump_t)) != 0) {
+			osx_src->ms_sysex_pkts = NULL;
+			ret = ENOMEM;
+			goto fail;
 		}
-		oret = MIDIPortConnectSource(osx_midiin, osx_midisrc, NULL);
+		midi_rt_prefault(osx_src->ms_sysex_pkts, MIDI_OSX_MAXPKTS *
+		    sizeof(midi_ump_t));
+
+		for(osx_q = 0; osx_uid != 0 && osx_q < osx_srcq_cnt; ++osx_q) {
+			if(osx_srcq[osx_q].sq_uid == osx_uid)
+				osx_src->ms_inq = osx_srcq[osx_q].sq_inq;
+		}
+		if(osx_src->ms_inq == NULL)
+			osx_src->ms_ring = osx_ring;
+
+		/* The source's state is passed back to the reader callback,
+		 * which also tags incoming messages with the index. */
+		oret = MIDIPortConnectSource(osx_midiin, osx_midisrc, osx_src);
 		if(oret) {
 			fprintf(stderr, "Can't connect MIDI source %lu:"
 			    " OSStatus=%d\n", osx_i, oret);
-			return ENOEXEC;
+			ret = ENOEXEC;
+			goto fail;
+		}
+		++osx_conncnt;
+	}
+
+	if(osx_conncnt == 0) {
+		fprintf(stderr, "Selected MIDI source not found\n");
+		ret = ENOENT;
+		goto fail;
+	}
+
+	osx_destidx = MIDI_EP_ANY;
+	if(osx_destuid != 0) {
+		osx_destcnt = MIDIGetNumberOfDestinations();
+		for(osx_i = 0; osx_i < osx_destcnt; ++osx_i) {
+			oret = MIDIObjectGetIntegerProperty(
+			    MIDIGetDestination(osx_i), kMIDIPropertyUniqueID,
+			    &osx_uid);
+			if(oret == 0 && osx_uid == osx_destuid) {
+				osx_destidx = osx_i;
+				break;
+			}
+		}
+		if(osx_destidx == MIDI_EP_ANY) {
+			fprintf(stderr,
+			    "Selected MIDI destination not found\n");
+			ret = ENOENT;
+			goto fail;
 		}
 	}
 
@@ -90,14 +305,28 @@ midi_osx_init()
 	if(oret) {
 		fprintf(stderr, "Can't create MIDI output port: OSStatus=%d\n",
 		    oret);
-		return ENOEXEC;
+		ret = ENOEXEC;
+		goto fail;
 	}
 
-	in_sysex = 0;
-	sysex_in_siz = 0;
-
 	++midi_osx_ready;
 	return 0;
+
+fail:
+	/* Disposing of the input port disconnects the sources, so once it
+	 * is gone no callback can touch them anymore. */
+	if(osx_midiin)
+		(void) MIDIPortDispose(osx_midiin);
+	if(osx_midiout)
+		(void) MIDIPortDispose(osx_midiout);
+	(void) MIDIClientDispose(osx_midiclient);
+	osx_midiin = 0;
+	osx_midiout = 0;
+	osx_midiclient = 0;
+
+	_midi_osx_freesrcs();
+
+	return ret;
 }
 
 
@@ -130,42 +359,75 @@ midi_osx_uninit()
 		return ENOEXEC;
 	}
 
+	/* The port is gone, so no more callbacks can touch the sources. */
+	_midi_osx_freesrcs();
+
 	midi_osx_ready = 0;
 	return 0;
 }
 
 
+void
+_midi_osx_freesrcs(void)
+{
+	int	i;
+
+	for(i = 0; osx_srcs && i < osx_srcs_cnt; ++i) {
+		if(osx_srcs[i].ms_sysex_in)
+			free(osx_srcs[i].ms_sysex_in);
+		free(osx_srcs[i].ms_sysex_pkts);
+	}
+	free(osx_srcs);
+	osx_srcs = NULL;
+	osx_srcs_cnt = 0;
+}
+
+
 void
 midi_osx_reader_callback(const MIDIPacketList *packets, void* readconn,
 	void* srcconn)
 {
 	/* In OS X, MIDI messages come in through a callback. We read the
 	 * message from the OS here, put it on the in queue, and broadcast
-	 * on the queue's condvar.  */
+	 * on the queue's condvar. A packet list only ever holds data from
+	 * one source, so the source's own queue and reassembly state are
+	 * used for all of it.
+	 *
+	 * What the filter doesn't let through is dropped here, and the
+	 * queue is only locked once there is something to put on it: a list
+	 * of clocks nobody asked for doesn't hold up the consumer. */
 
 	const MIDIPacket	*packet;
 	int			i;
 	int			t;
 	int			cnt;
+	int			pktcnt;
 	int			anyadded;
+	int			locked;
 	int			ret;
+	int			type;
 	unsigned char		dat;
+	int			src;
+	midi_osx_src_t		*ms;
+	midi_queue_t		*inq;
+	uint64_t		id;
+	midi_ump_t		ump;
 
 	packet = &packets->packet[0];
 	cnt = packets->numPackets;
 	anyadded = 0;
+	locked = 0;
+
+	ms = (midi_osx_src_t *) srcconn;
+	if(ms == NULL)
+		return;
+	src = ms->ms_idx;
+	inq = ms->ms_inq ? ms->ms_inq : midi_inq;
 
 #if 0
 	printf("MIDI reader callback called\n");
 #endif
 
-	ret = pthread_mutex_lock(&midi_inq->mq_mutex);
-	if(ret != 0) {
-		fprintf(stderr, "Can't lock queue: %s\n", strerror(ret));
-		return;
-	}
-
-
 	for (i = 0; i < cnt; ++i) {
 
 		if(packet == NULL)
@@ -175,88 +437,117 @@ midi_osx_reader_callback(const MIDIPacketList *packets, void* readconn,
 			dat = packet->data[t];
 
 			switch(dat) {
-			case 0xF8:
-				/* Clock */
+			case 0xF8:	/* Clock */
+			case 0xFA:	/* Start */
+			case 0xFB:	/* Continue */
+			case 0xFC:	/* Stop */
 #if 0
-	printf("Clock\n");
+	printf("Realtime %02X\n", dat);
 #endif
-
-				ret = midi_queue_addmsg_sysrt(midi_inq,
-				    MIDI_MSG_SYSRT_CLOCK);
-				if(ret != 0) {
-					fprintf(stderr,
-					    "Can't add MIDI message: %s\n",
-					    strerror(ret));
-				}
-				anyadded++;
-				break;
-			case 0xFA:
-				/* Start */
-				ret = midi_queue_addmsg_sysrt(midi_inq,
-				    MIDI_MSG_SYSRT_START);
-				if(ret != 0) {
-					fprintf(stderr,
-					    "Can't add MIDI message: %s\n",
-					    strerror(ret));
-				}
-				anyadded++;
-				break;
-			case 0xFC:
-				/* Stop */
-				ret = midi_queue_addmsg_sysrt(midi_inq,
-				    MIDI_MSG_SYSRT_STOP);
-				if(ret != 0) {
-					fprintf(stderr,
-					    "Can't add MIDI message:"
-					    " %s\n", strerror(ret));
-				}
+				type = dat == 0xF8 ? MIDI_MSG_SYSRT_CLOCK :
+				    dat == 0xFA ? MIDI_MSG_SYSRT_START :
+				    dat == 0xFB ? MIDI_MSG_SYSRT_CONTINUE :
+				    MIDI_MSG_SYSRT_STOP;
+				if(!midi_filter_pass(osx_filt, src, type))
+					break;
+				(void) midi_ump_from_bytes(&dat, 1, 0, &ump);
+				(void) _midi_osx_put(ms, inq, &locked, 0, &ump,
+				    1);
 				anyadded++;
 				break;
 			case 0xF0:
-				if(in_sysex) {
-					fprintf(stderr, "Received sysex begin"
-					    " while in sysex!\n");
+				ms->ms_status = 0;
+				if(ms->ms_in_sysex) {
+					if(ms->ms_filt.fs_state ==
+					    MIDI_FILTER_PASS)
+						fprintf(stderr, "Received sysex"
+						    " begin while in sysex on"
+						    " source %d, discarding"
+						    " %zu bytes\n", src,
+						    ms->ms_sysex_in_siz);
+					ms->ms_sysex_in_siz = 0;
+					(void) midi_filter_sysex_begin(
+					    osx_filt, src, &ms->ms_filt);
 					break;
 				}
-				in_sysex++;
+				ms->ms_in_sysex++;
+				(void) midi_filter_sysex_begin(osx_filt, src,
+				    &ms->ms_filt);
+				if(midi_trace_on)
+					ms->ms_sysex_start = midi_time_now();
 				break;
 
 			case 0xF7:
-				if(!in_sysex) {
+				ms->ms_status = 0;
+				if(!ms->ms_in_sysex) {
 					fprintf(stderr,
 					    "Received sysex end but never saw"
 					    " beginning!\n");
 					break;
 				}
-				if(sysex_in_siz == 0) {
+				if(ms->ms_filt.fs_state != MIDI_FILTER_PASS) {
+					/* Not wanted, or shorter than any
+					 * of the prefixes. */
+					ms->ms_in_sysex = 0;
+					ms->ms_sysex_in_siz = 0;
+					break;
+				}
+				if(ms->ms_sysex_in_siz == 0) {
 					fprintf(stderr,
 					    "Zero length Sysex received!\n");
 					break;
 				}
-				ret = midi_queue_addmsg_sysex(midi_inq,
-				    sysex_in, sysex_in_siz);
-				if(ret != 0) {
-					fprintf(stderr,
-					    "Can't add MIDI message:"
-					    " %s\n", strerror(ret));
+				id = 0;
+				if(midi_trace_on) {
+					id = midi_trace_newid();
+					midi_trace_stage(id,
+					    MIDI_TRACE_REPLY_F0,
+					    ms->ms_sysex_start);
+					midi_trace_stage(id,
+					    MIDI_TRACE_REPLY_F7, 0);
 				}
+				ret = midi_ump_from_sysex(ms->ms_sysex_in,
+				    ms->ms_sysex_in_siz, 0, ms->ms_sysex_pkts,
+				    MIDI_OSX_MAXPKTS, &pktcnt);
+				if(ret == 0)
+					(void) _midi_osx_put(ms, inq, &locked,
+					    id, ms->ms_sysex_pkts, pktcnt);
+				else
+					fprintf(stderr, "Can't add MIDI"
+					    " message: %s\n", strerror(ret));
 				anyadded++;
 
-				in_sysex = 0;
-				sysex_in_siz = 0;
+				ms->ms_in_sysex = 0;
+				ms->ms_sysex_in_siz = 0;
 
 				break;
 
 			default:
-				if(!in_sysex)
+				if(dat >= 0xF8) {
+					/* Other realtime bytes (Active
+					 * Sensing) are ignored, wherever they
+					 * come. */
+					break;
+				}
+				if(!ms->ms_in_sysex) {
+					if(_midi_osx_read_chan(ms, inq, dat,
+					    &locked))
+						anyadded++;
+					break;
+				}
+				/* Once it's clear nobody wants the message,
+				 * the rest of it isn't even stored. */
+				if(midi_filter_sysex_byte(osx_filt,
+				    &ms->ms_filt, ms->ms_sysex_in_siz, dat) ==
+				    MIDI_FILTER_DROP)
 					break;
-				if(sysex_in_siz >= MIDI_OSX_MAXMSG) {
+				if(ms->ms_sysex_in_siz >= MIDI_OSX_MAXMSG) {
 					fprintf(stderr,
 					    "Sysex data too long.\n");
 					break;
 				}
-				sysex_in[sysex_in_siz] = dat;
-				sysex_in_siz++;
+				ms->ms_sysex_in[ms->ms_sysex_in_siz] = dat;
+				ms->ms_sysex_in_siz++;
 				break;
 			}
 		}
@@ -267,11 +558,14 @@ midi_osx_reader_callback(const MIDIPacketList *packets, void* readconn,
 
 	if(anyadded) {
 #if 0
-		printf("%d messages on inqueue\n", midi_inq->mq_cnt);
+		printf("%d messages on inqueue\n", inq->mq_cnt);
 #endif
 	}
 
-	ret = pthread_mutex_unlock(&midi_inq->mq_mutex);
+	if(!locked)
+		return;
+
+	ret = pthread_mutex_unlock(&inq->mq_mutex);
 	if(ret != 0) {
 	fprintf(stderr, "Can't unlock queue: %s\n", strerror(ret));
 		return;
@@ -280,10 +574,145 @@ midi_osx_reader_callback(const MIDIPacketList *packets, void* readconn,
 }
 
 
+int
+_midi_osx_lockq(midi_queue_t *inq, int *locked)
+{
+	/* Locks inq the first time there's something to put on it. */
+
+	int	ret;
+
+	if(*locked)
+		return 0;
+
+	ret = pthread_mutex_lock(&inq->mq_mutex);
+	if(ret != 0) {
+		fprintf(stderr, "Can't lock queue: %s\n", strerror(ret));
+		return ret;
+	}
+
+	*locked = 1;
+
+	return 0;
+}
+
+
+int
+_midi_osx_put(midi_osx_src_t *ms, midi_queue_t *inq, int *locked,
+	uint64_t id, const midi_ump_t *pkts, int cnt)
+{
+	/* Hands a message read on ms on to its ring or queue, locking the
+	 * queue the first time. */
+
+	int	ret;
+
+	if(ms->ms_ring) {
+		ret = midi_ring_put_ump(ms->ms_ring, ms->ms_idx, id, pkts,
+		    cnt);
+	} else {
+		ret = _midi_osx_lockq(inq, locked);
+		if(ret != 0)
+			return ret;
+		ret = midi_queue_addump(inq, ms->ms_idx, MIDI_EP_ANY, 0, id,
+		    pkts, cnt);
+	}
+
+	/* The ring and the queues report being full themselves. */
+	if(ret != 0 && ret != ENOBUFS)
+		fprintf(stderr, "Can't add MIDI message: %s\n",
+		    strerror(ret));
+
+	return ret;
+}
+
+
+int
+_midi_osx_read_chan(midi_osx_src_t *ms, midi_queue_t *inq, unsigned char dat,
+	int *locked)
+{
+	/* Collects channel messages byte by byte, running status included.
+	 * Control and Program Changes go on the queue if the filter lets
+	 * them through, the others are only read past. Returns nonzero if a
+	 * message was added. */
+
+	unsigned char	buf[MIDI_MSG_SHORTSIZ];
+	midi_ump_t	ump;
+	int		status;
+	int		need;
+	int		type;
+
+	if(dat >= 0xF0) {
+		/* System common. */
+		ms->ms_status = 0;
+		ms->ms_datacnt = 0;
+		return 0;
+	}
+
+	if(dat >= 0x80) {
+		ms->ms_status = dat;
+		ms->ms_datacnt = 0;
+		return 0;
+	}
+
+	if(ms->ms_status == 0) {
+		/* Data without status, we came in in the middle. */
+		return 0;
+	}
+
+	ms->ms_data[ms->ms_datacnt++] = dat;
+
+	status = ms->ms_status & 0xF0;
+	need = (status == 0xC0 || status == 0xD0) ? 1 : 2;
+	if(ms->ms_datacnt < need)
+		return 0;
+
+	/* Complete. Status stays for the next one. */
+	ms->ms_datacnt = 0;
+
+	if(status == 0xB0)
+		type = MIDI_MSG_CHANCC;
+	else
+	if(status == 0xC0)
+		type = MIDI_MSG_CHANPROG;
+	else
+		return 0;
+
+	if(!midi_filter_pass(osx_filt, ms->ms_idx, type))
+		return 0;
+
+	buf[0] = ms->ms_status;
+	memcpy(buf + 1, ms->ms_data, need);
+	if(midi_ump_from_bytes(buf, need + 1, 0, &ump) != 0)
+		return 0;
+
+	if(_midi_osx_put(ms, inq, locked, 0, &ump, 1) != 0)
+		return 0;
+
+	return 1;
+}
+
 
 int
 midi_osx_sendmsg(unsigned char *msg, size_t msgsiz)
 {
+	return midi_osx_sendmsg_to(MIDI_EP_ANY, msg, msgsiz);
+}
+
+
+int
+midi_osx_sendmsg_to(int dest, unsigned char *msg, size_t msgsiz)
+{
+	return midi_osx_sendmsg_at(dest, 0, msg, msgsiz);
+}
+
+
+int
+midi_osx_sendmsg_at(int dest, uint64_t when, unsigned char *msg,
+	size_t msgsiz)
+{
+	/* CoreMIDI delivers messages at their timestamp, so a message that
+	 * should go out at a certain time can be handed over a little
+	 * early. when is in midi_time_now() time, 0 means now. */
+
 	MIDITimeStamp   timestamp;
 	MIDIPacketList  *packetlist;
 	MIDIPacket      *currentpacket;
@@ -294,13 +723,25 @@ midi_osx_sendmsg(unsigned char *msg, size_t msgsiz)
 	unsigned char	buf[MIDI_OSX_MAXMSG];
 
 	timestamp = 0;	/* "Send now." */
+	if(when != 0) {
+		if(osx_tb.denom == 0)
+			(void) mach_timebase_info(&osx_tb);
+		timestamp = when * osx_tb.denom / osx_tb.numer;
+	}
 
 
 	if(!midi_osx_ready)
 		return ENOEXEC;
 
+	destcnt = MIDIGetNumberOfDestinations();
+
+	if(dest != MIDI_EP_ANY && (dest < 0 || dest >= destcnt))
+		return EINVAL;
 
-	/* Send to all MIDI destinations in the system. */
+	/* Without an explicit destination, send to the selected destination
+	 * or to all MIDI destinations in the system. */
+	if(dest == MIDI_EP_ANY)
+		dest = osx_destidx;
 
 	memset(buf, 0, MIDI_OSX_MAXMSG);
 	packetlist = (MIDIPacketList *) buf;
@@ -308,9 +749,9 @@ midi_osx_sendmsg(unsigned char *msg, size_t msgsiz)
 	currentpacket = MIDIPacketListAdd(packetlist, MIDI_OSX_MAXMSG,
 	    currentpacket, timestamp, msgsiz, msg);
 
-	destcnt = MIDIGetNumberOfDestinations();
-
 	for(idest = 0; idest < destcnt; idest++) {
+		if(dest != MIDI_EP_ANY && idest != dest)
+			continue;
 		destref = MIDIGetDestination(idest);
 		oret = MIDISend(osx_midiout, destref, packetlist);
 		if(oret != 0)
@@ -319,3 +760,260 @@ midi_osx_sendmsg(unsigned char *msg, size_t msgsiz)
 
 	return 0;
 }
+
+
+int
+midi_osx_batch_init(midi_osx_batch_t *mb)
+{
+	if(mb == NULL)
+		return EINVAL;
+
+	mb->mb_dest = MIDI_EP_ANY;
+	mb->mb_cnt = 0;
+	mb->mb_idcnt = 0;
+	mb->mb_lastts = 0;
+	mb->mb_cur = MIDIPacketListInit(&mb->mb_u.mb_list);
+
+	return 0;
+}
+
+
+int
+midi_osx_batch_add(midi_osx_batch_t *mb, int dest, uint64_t when,
+	unsigned char *msg, size_t msgsiz)
+{
+	/* Adds a message to the batch. The batch is sent first if the
+	 * message is for another destination, doesn't fit, or is due before
+	 * what's already in it (packets must be in time order). */
+
+	MIDITimeStamp	timestamp;
+	MIDIPacket	*packet;
+	int		ret;
+
+	if(mb == NULL || msg == NULL || msgsiz == 0)
+		return EINVAL;
+
+	timestamp = 0;
+	if(when != 0) {
+		if(osx_tb.denom == 0)
+			(void) mach_timebase_info(&osx_tb);
+		timestamp = when * osx_tb.denom / osx_tb.numer;
+	}
+
+	if(mb->mb_cnt > 0 && (dest != mb->mb_dest ||
+	    timestamp < mb->mb_lastts)) {
+		ret = midi_osx_batch_flush(mb);
+		if(ret != 0)
+			return ret;
+	}
+
+	mb->mb_dest = dest;
+
+	packet = MIDIPacketListAdd(&mb->mb_u.mb_list, MIDI_OSX_BATCHSIZ,
+	    mb->mb_cur, timestamp, msgsiz, msg);
+	if(packet == NULL) {
+		ret = midi_osx_batch_flush(mb);
+		if(ret != 0)
+			return ret;
+
+		mb->mb_dest = dest;
+		packet = MIDIPacketListAdd(&mb->mb_u.mb_list,
+		    MIDI_OSX_BATCHSIZ, mb->mb_cur, timestamp, msgsiz, msg);
+		if(packet == NULL) {
+			/* Doesn't fit even on its own. */
+			return midi_osx_sendmsg_at(dest, when, msg, msgsiz);
+		}
+	}
+
+	mb->mb_cur = packet;
+	mb->mb_lastts = timestamp;
+	++mb->mb_cnt;
+
+	return 0;
+}
+
+
+void
+midi_osx_batch_mark(midi_osx_batch_t *mb, uint64_t id, int marks)
+{
+	/* If the bytes already went out on their own, or there are too
+	 * many messages in the batch to keep track of, the stages are
+	 * recorded now. */
+
+	if(!midi_trace_on || mb == NULL || id == 0 || marks == 0)
+		return;
+
+	if(mb->mb_cnt == 0 || mb->mb_idcnt >= MIDI_OSX_BATCHIDS) {
+		if(marks & MIDI_OSX_MARK_SEND)
+			midi_trace_stage(id, MIDI_TRACE_SEND, 0);
+		if(marks & MIDI_OSX_MARK_SENT)
+			midi_trace_stage(id, MIDI_TRACE_SENT, 0);
+		return;
+	}
+
+	mb->mb_ids[mb->mb_idcnt] = id;
+	mb->mb_marks[mb->mb_idcnt] = marks;
+	++mb->mb_idcnt;
+}
+
+
+int
+midi_osx_batch_flush(midi_osx_batch_t *mb)
+{
+	ItemCount       destcnt;
+	ItemCount       idest;
+	OSStatus        oret;
+	int		dest;
+	int		ret;
+	int		i;
+	uint64_t	start;
+
+	if(mb == NULL)
+		return EINVAL;
+
+	if(mb->mb_cnt == 0)
+		return 0;
+
+	ret = 0;
+
+	if(!midi_osx_ready) {
+		ret = ENOEXEC;
+		goto end_label;
+	}
+
+	destcnt = MIDIGetNumberOfDestinations();
+
+	dest = mb->mb_dest;
+	if(dest == MIDI_EP_ANY)
+		dest = osx_destidx;
+
+	start = midi_trace_on ? midi_time_now() : 0;
+
+	for(i = 0; i < mb->mb_idcnt; ++i) {
+		if(mb->mb_marks[i] & MIDI_OSX_MARK_SEND)
+			midi_trace_stage(mb->mb_ids[i], MIDI_TRACE_SEND, start);
+	}
+
+	for(idest = 0; idest < destcnt; idest++) {
+		if(dest != MIDI_EP_ANY && idest != dest)
+			continue;
+		oret = MIDISend(osx_midiout, MIDIGetDestination(idest),
+		    &mb->mb_u.mb_list);
+		if(oret != 0)
+			ret = ENOEXEC;
+	}
+
+	MIDI_TRACE_SPAN("MIDISend", 0, start);
+
+	for(i = 0; i < mb->mb_idcnt; ++i) {
+		if(mb->mb_marks[i] & MIDI_OSX_MARK_SENT)
+			midi_trace_stage(mb->mb_ids[i], MIDI_TRACE_SENT, 0);
+	}
+
+end_label:
+
+	(void) midi_osx_batch_init(mb);
+
+	return ret;
+}
+
+
+int
+midi_osx_getsrccnt()
+{
+	return (int) MIDIGetNumberOfSources();
+}
+
+
+int
+midi_osx_getdestcnt()
+{
+	return (int) MIDIGetNumberOfDestinations();
+}
+
+
+int
+midi_osx_getseldest()
+{
+	/* Where MIDI_EP_ANY goes: the selected destination, or MIDI_EP_ANY
+	 * itself if that's all of them. */
+
+	return osx_destidx;
+}
+
+
+int
+midi_osx_getsrc(int idx, midi_osx_ep_t *ep)
+{
+	if(ep == NULL || idx < 0 || idx >= MIDIGetNumberOfSources())
+		return EINVAL;
+
+	return _midi_osx_getep(MIDIGetSource(idx), 0, ep);
+}
+
+
+int
+midi_osx_getdest(int idx, midi_osx_ep_t *ep)
+{
+	if(ep == NULL || idx < 0 || idx >= MIDIGetNumberOfDestinations())
+		return EINVAL;
+
+	return _midi_osx_getep(MIDIGetDestination(idx), 1, ep);
+}
+
+
+int
+_midi_osx_getep(MIDIEndpointRef epref, int isdest, midi_osx_ep_t *ep)
+{
+	/* Fills in the unique ID and name of an endpoint. The peer is the
+	 * endpoint going the other way on the same entity (eg. the "out"
+	 * port on the same USB cable as an "in" port), which is where a
+	 * device will answer a request that was sent to it. */
+
+	OSStatus	oret;
+	CFStringRef	name;
+	MIDIEntityRef	entity;
+	MIDIEntityRef	peerentity;
+	ItemCount	peercnt;
+	ItemCount	i;
+
+	if(epref == 0)
+		return ENOENT;
+
+	memset(ep, 0, sizeof(midi_osx_ep_t));
+	ep->me_peer = -1;
+
+	oret = MIDIObjectGetIntegerProperty(epref, kMIDIPropertyUniqueID,
+	    &ep->me_uid);
+	if(oret) {
+		fprintf(stderr, "Can't get MIDI endpoint ID: OSStatus=%d\n",
+		    oret);
+		return ENOEXEC;
+	}
+
+	oret = MIDIObjectGetStringProperty(epref, kMIDIPropertyName, &name);
+	if(oret == 0) {
+		(void) CFStringGetCString(name, ep->me_name, MIDI_OSX_NAMELEN,
+		    kCFStringEncodingUTF8);
+		CFRelease(name);
+	}
+
+	oret = MIDIEndpointGetEntity(epref, &entity);
+	if(oret || entity == 0) {
+		/* Virtual endpoints don't belong to an entity. */
+		return 0;
+	}
+
+	peercnt = isdest ? MIDIGetNumberOfSources() :
+	    MIDIGetNumberOfDestinations();
+	for(i = 0; i < peercnt; ++i) {
+		oret = MIDIEndpointGetEntity(isdest ? MIDIGetSource(i) :
+		    MIDIGetDestination(i), &peerentity);
+		if(oret == 0 && peerentity == entity) {
+			ep->me_peer = i;
+			break;
+		}
+	}
+
+	return 0;
+}
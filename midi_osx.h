@@ -2,10 +2,89 @@
 #define MIDI_OSX
 
 #include <CoreMIDI/CoreMIDI.h>
+#include <stdint.h>
+
+struct midi_queue;
+struct midi_filter;
+struct midi_ring;
+
+#define MIDI_OSX_NAMELEN	64
+
+/* 31.25 kbaud, 10 bits per byte. */
+#define MIDI_WIRE_BYTES_PER_SEC	3125
+
+/* Packets handed to CoreMIDI must hold complete messages, running status
+ * isn't allowed in them. The driver may still apply it on the wire. */
+#define MIDI_OSX_RUNSTATUS	0
+
+typedef struct midi_osx_ep {
+	SInt32		me_uid;		/* kMIDIPropertyUniqueID */
+	int		me_peer;	/* Endpoint on the other side of the
+					 * same entity, or -1 */
+	char		me_name[MIDI_OSX_NAMELEN];
+} midi_osx_ep_t;
+
+/* Collects messages for one destination into a single packet list, so
+ * that they can be handed to the system with one call. */
+#define MIDI_OSX_BATCHSIZ	4096
+
+/* Messages whose trace stages are recorded when the batch goes out. */
+#define MIDI_OSX_BATCHIDS	128
+#define MIDI_OSX_MARK_SEND	0x01	/* First bytes are in the batch */
+#define MIDI_OSX_MARK_SENT	0x02	/* Last bytes are */
+
+typedef struct midi_osx_batch {
+	int		mb_dest;
+	int		mb_cnt;
+	MIDITimeStamp	mb_lastts;
+	MIDIPacket	*mb_cur;
+	uint64_t	mb_ids[MIDI_OSX_BATCHIDS];
+	int		mb_marks[MIDI_OSX_BATCHIDS];
+	int		mb_idcnt;
+	union {
+		MIDIPacketList	mb_list;
+		unsigned char	mb_buf[MIDI_OSX_BATCHSIZ];
+	} mb_u;
+} midi_osx_batch_t;
+
+/* Must be called before midi_osx_init(). Restricts the wrapper to the
+ * source and destination with the given unique IDs. 0 means all. */
+void midi_osx_select(SInt32, SInt32);
+
+/* Must be called before midi_osx_init(). Messages from the source with the
+ * given unique ID go to the given queue instead of the global in queue, so
+ * that several devices can be talked to independently. */
+int midi_osx_setsrcq(SInt32, struct midi_queue *);
+
+/* Must be called before midi_osx_init(). Only what the filter lets through
+ * is put on the queues, see midi_filter.h. */
+int midi_osx_setfilter(struct midi_filter *);
+
+/* Must be called before midi_osx_init(). Messages that would go on the
+ * global in queue are published on the ring instead, so that several
+ * consumers can read them, see midi_ring.h. */
+int midi_osx_setring(struct midi_ring *);
 
 int midi_osx_init();
 int midi_osx_uninit();
 
+int midi_osx_getsrccnt();
+int midi_osx_getdestcnt();
+int midi_osx_getseldest();
+int midi_osx_getsrc(int, midi_osx_ep_t *);
+int midi_osx_getdest(int, midi_osx_ep_t *);
+
 int midi_osx_sendmsg(unsigned char *, size_t);
+int midi_osx_sendmsg_to(int, unsigned char *, size_t);
+int midi_osx_sendmsg_at(int, uint64_t, unsigned char *, size_t);
+
+int midi_osx_batch_init(midi_osx_batch_t *);
+int midi_osx_batch_add(midi_osx_batch_t *, int, uint64_t, unsigned char *,
+	size_t);
+int midi_osx_batch_flush(midi_osx_batch_t *);
+
+/* Records MIDI_TRACE_SEND right before and MIDI_TRACE_SENT right after the
+ * batch holding the bytes just added is handed to the system. */
+void midi_osx_batch_mark(midi_osx_batch_t *, uint64_t, int);
 
 #endif
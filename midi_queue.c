@@ -3,6 +3,29 @@
 #include <errno.h>
 #include <string.h>
 #include "midi_queue.h"
+#include "midi_trace.h"
+
+midi_queue_t	*midi_inq = NULL;
+midi_queue_t	*midi_outq = NULL;
+
+int _midi_queue_addmsg(midi_queue_t *, const midi_msg_t *);
+int _midi_queue_addmsg_sysex(midi_queue_t *, int, int, uint64_t, uint64_t,
+	unsigned char *, size_t);
+int _midi_queue_addmsg_chan(midi_queue_t *, int, int, int, int, int, int);
+int _midi_queue_allocent(int, midi_queue_ent_t **);
+int _midi_queue_link(midi_queue_t *, midi_queue_ent_t *);
+int _midi_queue_detach(midi_queue_t *, midi_queue_ent_t **,
+	midi_queue_ent_t **, midi_queue_ent_t **);
+int _midi_queue_admit(midi_queue_t *, midi_queue_ent_t *);
+int _midi_queue_isfull(midi_queue_t *, size_t);
+int _midi_queue_dropoldest(midi_queue_t *);
+int _midi_queue_coalesce(midi_queue_t *, midi_queue_ent_t *);
+int _midi_queue_fill(midi_queue_t *);
+void _midi_queue_checkwm(midi_queue_t *);
+
+#define _MIDI_QUEUE_ENTSIZ(e)	(sizeof(midi_queue_ent_t) + \
+				 (e)->me_pktcnt * sizeof(midi_ump_t))
+#define _MIDI_QUEUE_COALESCED	-2
 
 
 int
@@ -43,20 +66,437 @@ midi_queue_init(midi_queue_t **res)
 
 
 int
-_midi_queue_addmsg(midi_queue_t *mq, midi_msg_t mmsg)
+midi_queue_setlimits(midi_queue_t *mq, int maxcnt, size_t maxbytes)
 {
-	midi_queue_ent_t	*newent;
-	int			ret;
+	/* At most maxcnt messages taking up maxbytes with their packets,
+	 * 0 for no limit. */
 
-	if(mq == NULL)
+	if(mq == NULL || maxcnt < 0)
+		return EINVAL;
+
+	mq->mq_maxcnt = maxcnt;
+	mq->mq_maxbytes = maxbytes;
+
+	return 0;
+}
+
+
+int
+midi_queue_setpolicy(midi_queue_t *mq, int type, int policy)
+{
+	if(mq == NULL || type < 0 || type >= MIDI_MSG_NTYPES)
+		return EINVAL;
+
+	if(policy != MIDI_QUEUE_FAIL && policy != MIDI_QUEUE_DROPOLDEST &&
+	    policy != MIDI_QUEUE_COALESCE && policy != MIDI_QUEUE_BLOCK)
+		return EINVAL;
+
+	if(policy == MIDI_QUEUE_COALESCE && type != MIDI_MSG_CHANCC)
+		return EINVAL;
+
+	mq->mq_policy[type] = policy;
+
+	return 0;
+}
+
+
+int
+midi_queue_setwatermarks(midi_queue_t *mq, int hi, int lo,
+	midi_queue_wmfn_t fn, void *arg)
+{
+	/* hi and lo are how full the queue is in percent, of whichever
+	 * limit it's closer to. */
+
+	if(mq == NULL || hi <= 0 || hi > 100 || lo < 0 || lo >= hi)
+		return EINVAL;
+
+	mq->mq_hiwat = hi;
+	mq->mq_lowat = lo;
+	mq->mq_above = 0;
+	mq->mq_wmfn = fn;
+	mq->mq_wmarg = arg;
+
+	return 0;
+}
+
+
+int
+midi_queue_setinput(midi_queue_t *mq, const char *name)
+{
+	int	ret;
+
+	ret = midi_queue_setlimits(mq, MIDI_QUEUE_INMAXCNT,
+	    MIDI_QUEUE_INMAXBYTES);
+	if(ret != 0)
+		return ret;
+
+	/* Only the latest clocks matter, and only the latest value of a
+	 * controller. A sysex that doesn't fit is lost either way. */
+	(void) midi_queue_setpolicy(mq, MIDI_MSG_SYSRT_CLOCK,
+	    MIDI_QUEUE_DROPOLDEST);
+	(void) midi_queue_setpolicy(mq, MIDI_MSG_CHANCC, MIDI_QUEUE_COALESCE);
+
+	/* A Start that came after a Program Change mustn't be seen before
+	 * it. The realtime lane is for what goes out. */
+	mq->mq_fifo = 1;
+
+	return midi_queue_setwatermarks(mq, MIDI_QUEUE_INHIWAT,
+	    MIDI_QUEUE_INLOWAT, midi_queue_warn, (void *) name);
+}
+
+
+void
+midi_queue_warn(midi_queue_t *mq, int above, void *arg)
+{
+	fprintf(stderr, "%s queue %s (%d messages, %zu bytes, %llu"
+	    " dropped)\n", arg ? (const char *) arg : "MIDI",
+	    above ? "filling up" : "back to normal", mq->mq_cnt,
+	    mq->mq_bytes, (unsigned long long) mq->mq_dropped);
+}
+
+
+int
+_midi_queue_isfull(midi_queue_t *mq, size_t siz)
+{
+	/* Returns nonzero if a message of siz bytes doesn't fit. */
+
+	if(mq->mq_maxcnt && mq->mq_cnt + 1 > mq->mq_maxcnt)
+		return 1;
+
+	if(mq->mq_maxbytes && mq->mq_bytes + siz > mq->mq_maxbytes)
+		return 1;
+
+	return 0;
+}
+
+
+int
+_midi_queue_admit(midi_queue_t *mq, midi_queue_ent_t *ent)
+{
+	/* Makes room for ent. Returns 0 if it can be added,
+	 * _MIDI_QUEUE_COALESCED if it went into a message already queued,
+	 * ENOBUFS otherwise. */
+
+	size_t	siz;
+	int	policy;
+	int	ret;
+
+	siz = _MIDI_QUEUE_ENTSIZ(ent);
+
+	/* Never fits, whatever is dropped or however long we wait. */
+	if(mq->mq_maxbytes && siz > mq->mq_maxbytes)
+		goto full_label;
+
+	policy = MIDI_QUEUE_FAIL;
+	if(ent->me_type >= 0 && ent->me_type < MIDI_MSG_NTYPES)
+		policy = mq->mq_policy[ent->me_type];
+
+	while(_midi_queue_isfull(mq, siz)) {
+		/* A CC for a controller that's already queued doesn't need
+		 * room of its own. */
+		if(policy == MIDI_QUEUE_COALESCE &&
+		    _midi_queue_coalesce(mq, ent) == 0)
+			return _MIDI_QUEUE_COALESCED;
+
+		/* Clocks and such make room for anything. */
+		if(_midi_queue_dropoldest(mq) == 0)
+			continue;
+
+		if(policy != MIDI_QUEUE_BLOCK)
+			goto full_label;
+
+		/* Whoever takes something off wakes us up. */
+		++mq->mq_blocked;
+		ret = pthread_cond_wait(&mq->mq_cond, &mq->mq_mutex);
+		--mq->mq_blocked;
+		if(ret != 0) {
+			fprintf(stderr, "Error while waiting on condvar: %s\n",
+			    strerror(ret));
+			goto full_label;
+		}
+	}
+
+	return 0;
+
+full_label:
+	/* NOTE: Producers like the reader leave it to the hook to say that
+	 * something was lost, so a drop counts as being above the high
+	 * watermark even if the queue isn't. */
+	++mq->mq_dropped;
+	if(mq->mq_wmfn && !mq->mq_above) {
+		mq->mq_above = 1;
+		mq->mq_wmfn(mq, 1, mq->mq_wmarg);
+	}
+	return ENOBUFS;
+}
+
+
+int
+_midi_queue_dropoldest(midi_queue_t *mq)
+{
+	/* Removes the oldest message whose type may be dropped, looking at
+	 * the realtime lane first. Returns ENOENT if there is none. */
+
+	midi_queue_ent_t	**first;
+	midi_queue_ent_t	**last;
+	midi_queue_ent_t	*prev;
+	midi_queue_ent_t	*ent;
+	int			lane;
+	int			type;
+
+	ent = prev = NULL;
+	first = last = NULL;
+
+	for(lane = 0; lane < 2 && ent == NULL; ++lane) {
+		first = lane == 0 ? &mq->mq_rtfirst : &mq->mq_first;
+		last = lane == 0 ? &mq->mq_rtlast : &mq->mq_last;
+
+		prev = NULL;
+		for(ent = *first; ent; prev = ent, ent = ent->me_next) {
+			type = ent->me_type;
+			if(type >= 0 && type < MIDI_MSG_NTYPES &&
+			    mq->mq_policy[type] == MIDI_QUEUE_DROPOLDEST)
+				break;
+		}
+	}
+	if(ent == NULL)
+		return ENOENT;
+
+	if(prev)
+		prev->me_next = ent->me_next;
+	else
+		*first = ent->me_next;
+	if(*last == ent)
+		*last = prev;
+
+	mq->mq_bytes -= _MIDI_QUEUE_ENTSIZ(ent);
+	--mq->mq_cnt;
+	++mq->mq_dropped;
+
+	free(ent);
+
+	return 0;
+}
+
+
+int
+_midi_queue_coalesce(midi_queue_t *mq, midi_queue_ent_t *newent)
+{
+	/* Puts the value of a Control Change into the newest one queued for
+	 * the same controller. Returns ENOENT if there is none. */
+
+	midi_queue_ent_t	*ent;
+	midi_queue_ent_t	*found;
+	uint32_t		ctl;
+
+	if(newent->me_type != MIDI_MSG_CHANCC)
+		return ENOENT;
+
+	/* Everything but the value: group, channel and controller. */
+	ctl = newent->me_pkts[0].mu_w[0] >> 8;
+
+	found = NULL;
+	for(ent = mq->mq_first; ent; ent = ent->me_next) {
+		if(ent->me_type == MIDI_MSG_CHANCC &&
+		    ent->me_pkts[0].mu_w[0] >> 8 == ctl &&
+		    ent->me_src == newent->me_src &&
+		    ent->me_dest == newent->me_dest)
+			found = ent;
+	}
+	if(found == NULL)
+		return ENOENT;
+
+	found->me_pkts[0].mu_w[0] = (found->me_pkts[0].mu_w[0] & ~0x7FU) |
+	    (newent->me_pkts[0].mu_w[0] & 0x7F);
+	++mq->mq_coalesced;
+
+	return 0;
+}
+
+
+int
+_midi_queue_fill(midi_queue_t *mq)
+{
+	/* How full the queue is in percent of the closest limit. */
+
+	int	fill;
+	int	bfill;
+
+	fill = 0;
+	if(mq->mq_maxcnt)
+		fill = (int) ((uint64_t) mq->mq_cnt * 100 / mq->mq_maxcnt);
+
+	if(mq->mq_maxbytes) {
+		bfill = (int) ((uint64_t) mq->mq_bytes * 100 /
+		    mq->mq_maxbytes);
+		if(bfill > fill)
+			fill = bfill;
+	}
+
+	return fill;
+}
+
+
+void
+_midi_queue_checkwm(midi_queue_t *mq)
+{
+	int	fill;
+
+	if(mq->mq_wmfn == NULL)
+		return;
+
+	fill = _midi_queue_fill(mq);
+
+	if(!mq->mq_above && fill >= mq->mq_hiwat) {
+		mq->mq_above = 1;
+		mq->mq_wmfn(mq, 1, mq->mq_wmarg);
+	} else
+	if(mq->mq_above && fill <= mq->mq_lowat) {
+		mq->mq_above = 0;
+		mq->mq_wmfn(mq, 0, mq->mq_wmarg);
+	}
+}
+
+
+int
+_midi_queue_allocent(int cnt, midi_queue_ent_t **res)
+{
+	/* An entry with room for cnt packets, aligned like them. */
+
+	midi_queue_ent_t	*ent;
+	size_t			siz;
+
+	if(cnt < 1)
 		return EINVAL;
 
-	newent = calloc(1, sizeof(midi_queue_ent_t));
-	if(newent == NULL)
+	siz = sizeof(midi_queue_ent_t) + cnt * sizeof(midi_ump_t);
+	if(posix_memalign((void **) &ent, _Alignof(midi_ump_t), siz) != 0)
 		return ENOMEM;
+	memset(ent, 0, sizeof(midi_queue_ent_t));
+
+	ent->me_type = -1;
+	ent->me_src = MIDI_EP_ANY;
+	ent->me_dest = MIDI_EP_ANY;
+	ent->me_pktcnt = cnt;
+
+	*res = ent;
+
+	return 0;
+}
+
+
+int
+midi_queue_newent(const midi_ump_t *pkts, int cnt, midi_queue_ent_t **res)
+{
+	/* An entry for a message that's already in packets, as it came from
+	 * a port that speaks UMP or from midi_ump_parse(). */
+
+	midi_queue_ent_t	*ent;
+	int			ret;
+
+	if(res == NULL || midi_ump_check(pkts, cnt) != 0)
+		return EINVAL;
+
+	ret = _midi_queue_allocent(cnt, &ent);
+	if(ret != 0)
+		return ret;
+
+	memcpy(ent->me_pkts, pkts, cnt * sizeof(midi_ump_t));
+	ent->me_type = midi_ump_msgtype(&pkts[0]);
+
+	*res = ent;
+
+	return 0;
+}
+
+
+int
+midi_queue_ent_tomsg(const midi_queue_ent_t *ent, midi_msg_t *mmsg)
+{
+	/* What's in the packets, as a message. Sysex gets a payload of its
+	 * own, for the caller to free with midi_msg_free_payload(). Returns
+	 * ENOTSUP for packets midi_msg_t can't hold (8 bit sysex, MIDI 2.0
+	 * channel voice, ...). */
+
+	size_t	siz;
+	int	ret;
+	int	i;
+
+	if(ent == NULL || mmsg == NULL)
+		return EINVAL;
 
-	newent->me_msg = mmsg;
+	if(ent->me_type < 0)
+		return ENOTSUP;
+
+	if(ent->me_type == MIDI_MSG_SYSEX) {
+		memset(mmsg, 0, sizeof(midi_msg_t));
+		mmsg->mm_type = MIDI_MSG_SYSEX;
+
+		siz = 0;
+		for(i = 0; i < ent->me_pktcnt; ++i)
+			siz += midi_ump_sysex_data(&ent->me_pkts[i], NULL);
+
+		if(siz) {
+			mmsg->mm_payload = malloc(siz);
+			if(mmsg->mm_payload == NULL)
+				return ENOMEM;
+		}
+		for(i = 0; i < ent->me_pktcnt; ++i) {
+			mmsg->mm_payload_siz += midi_ump_sysex_data(
+			    &ent->me_pkts[i], mmsg->mm_payload +
+			    mmsg->mm_payload_siz);
+		}
+	} else {
+		ret = midi_ump_to_msg(&ent->me_pkts[0], mmsg);
+		if(ret != 0)
+			return ret;
+	}
+
+	mmsg->mm_src = ent->me_src;
+	mmsg->mm_dest = ent->me_dest;
+	mmsg->mm_time = ent->me_time;
+	mmsg->mm_id = ent->me_id;
+
+	return 0;
+}
 
+
+int
+_midi_queue_link(midi_queue_t *mq, midi_queue_ent_t *newent)
+{
+	/* Puts newent at the end of its lane. Returns 0 if the queue took
+	 * it, which may mean its value went into one already queued and it
+	 * was freed; the caller keeps it otherwise. */
+
+	int	ret;
+
+	ret = _midi_queue_admit(mq, newent);
+	if(ret == _MIDI_QUEUE_COALESCED) {
+		free(newent);
+		/* Nothing new for the consumer to see, but it may be
+		 * waiting for the one that got the value. */
+		(void) pthread_cond_broadcast(&mq->mq_cond);
+		return 0;
+	}
+	if(ret != 0)
+		return ret;
+
+	/* A message's life starts the first time it's queued. */
+	if(midi_trace_on && newent->me_id == 0) {
+		newent->me_id = midi_trace_newid();
+		midi_trace_stage(newent->me_id, MIDI_TRACE_ENQUEUE, 0);
+	}
+
+	newent->me_next = NULL;
+
+	if(MIDI_MSG_ISSYSRT(newent->me_type) && !mq->mq_fifo) {
+		if(mq->mq_rtfirst == NULL) {
+			mq->mq_rtfirst = mq->mq_rtlast = newent;
+		} else {
+			mq->mq_rtlast->me_next = newent;
+			mq->mq_rtlast = newent;
+		}
+	} else
 	if(mq->mq_first == NULL) {
 		/* First entry. */
 		mq->mq_first = mq->mq_last = newent;
@@ -66,6 +506,8 @@ _midi_queue_addmsg(midi_queue_t *mq, midi_msg_t mmsg)
 	}
 
 	++mq->mq_cnt; 
+	mq->mq_bytes += _MIDI_QUEUE_ENTSIZ(newent);
+	_midi_queue_checkwm(mq);
 
 	/* Broadcast */
 	ret = pthread_cond_broadcast(&mq->mq_cond);
@@ -79,13 +521,137 @@ _midi_queue_addmsg(midi_queue_t *mq, midi_msg_t mmsg)
 }
 
 
+int
+_midi_queue_addmsg(midi_queue_t *mq, const midi_msg_t *mmsg)
+{
+	/* Packs mmsg into an entry and queues it. The payload stays the
+	 * caller's. */
+
+	midi_queue_ent_t	*newent;
+	int			cnt;
+	int			ret;
+
+	if(mq == NULL)
+		return EINVAL;
+
+	cnt = mmsg->mm_type == MIDI_MSG_SYSEX ?
+	    MIDI_UMP_SYSEX_PKTS(mmsg->mm_payload_siz) : 1;
+
+	ret = _midi_queue_allocent(cnt, &newent);
+	if(ret != 0)
+		return ret;
+
+	ret = midi_ump_from_msg(mmsg, 0, newent->me_pkts, cnt,
+	    &newent->me_pktcnt);
+	if(ret != 0) {
+		free(newent);
+		return ret;
+	}
+
+	newent->me_type = mmsg->mm_type;
+	newent->me_src = mmsg->mm_src;
+	newent->me_dest = mmsg->mm_dest;
+	newent->me_time = mmsg->mm_time;
+	newent->me_id = mmsg->mm_id;
+
+	ret = _midi_queue_link(mq, newent);
+	if(ret != 0)
+		free(newent);
+
+	return ret;
+}
+
+
+int
+midi_queue_addmsg(midi_queue_t *mq, midi_msg_t *mmsg)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a message that has already been filled in. The queue takes
+	 * over the payload, which is freed once it's been copied into
+	 * packets. */
+
+	int	ret;
+
+	if(mq == NULL || mmsg == NULL)
+		return EINVAL;
+
+	ret = _midi_queue_addmsg(mq, mmsg);
+	if(ret == 0)
+		(void) midi_msg_free_payload(mmsg);
+
+	return ret;
+}
+
+
+int
+midi_queue_addump(midi_queue_t *mq, int src, int dest, uint64_t when,
+	uint64_t id, const midi_ump_t *pkts, int cnt)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a message that's already in packets: one, or the packets of
+	 * one sysex message in order. */
+
+	midi_queue_ent_t	*newent;
+	int			ret;
+
+	if(mq == NULL)
+		return EINVAL;
+
+	ret = midi_queue_newent(pkts, cnt, &newent);
+	if(ret != 0)
+		return ret;
+
+	newent->me_src = src;
+	newent->me_dest = dest;
+	newent->me_time = when;
+	newent->me_id = id;
+
+	ret = _midi_queue_link(mq, newent);
+	if(ret != 0)
+		free(newent);
+
+	return ret;
+}
+
+
+int
+midi_queue_putent(midi_queue_t *mq, midi_queue_ent_t *ent)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Queues an entry taken off another queue. If it can't be, it stays
+	 * the caller's. */
+
+	if(mq == NULL || ent == NULL)
+		return EINVAL;
+
+	return _midi_queue_link(mq, ent);
+}
+
+
 int
 midi_queue_addmsg_sysrt(midi_queue_t *mq, int type)
 {
 	/* NOTE: This function should only be called while the caller
 	 * is holding the queue's lock. */
 
-	/* Adds a System Real-Time message to the queue.
+	return midi_queue_addmsg_sysrt_from(mq, MIDI_EP_ANY, type);
+}
+
+
+int
+midi_queue_addmsg_sysrt_from(midi_queue_t *mq, int src, int type)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a System Real-Time message that was received on endpoint
+	 * src to the queue.
 	 * System Real-Time messages don't have parameters, just a type. */
 
 	midi_msg_t	mmsg;
@@ -95,8 +661,128 @@ midi_queue_addmsg_sysrt(midi_queue_t *mq, int type)
 
 	memset(&mmsg, 0, sizeof(midi_msg_t));
 	mmsg.mm_type = type;
+	mmsg.mm_src = src;
+	mmsg.mm_dest = MIDI_EP_ANY;
+
+	return _midi_queue_addmsg(mq, &mmsg);
+}
+
+
+int
+midi_queue_addmsg_sysrt_to(midi_queue_t *mq, int dest, int type)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a System Real-Time message that should only be sent to
+	 * destination endpoint dest. */
+
+	return midi_queue_addmsg_sysrt_at(mq, dest, 0, type);
+}
+
+
+int
+midi_queue_addmsg_sysrt_at(midi_queue_t *mq, int dest, uint64_t when,
+	int type)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a System Real-Time message that should be sent to dest at
+	 * the time when (as returned by midi_time_now()). */
+
+	midi_msg_t	mmsg;
+
+	if(mq == NULL)
+		return EINVAL;
+
+	memset(&mmsg, 0, sizeof(midi_msg_t));
+	mmsg.mm_type = type;
+	mmsg.mm_src = MIDI_EP_ANY;
+	mmsg.mm_dest = dest;
+	mmsg.mm_time = when;
+
+	return _midi_queue_addmsg(mq, &mmsg);
+}
+
+
+int
+midi_queue_addmsg_chancc(midi_queue_t *mq, int chan, int num, int val)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	return midi_queue_addmsg_chancc_to(mq, MIDI_EP_ANY, chan, num, val);
+}
+
+
+int
+midi_queue_addmsg_chancc_to(midi_queue_t *mq, int dest, int chan, int num,
+	int val)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a Control Change message for channel chan (0-15),
+	 * controller num. */
+
+	return _midi_queue_addmsg_chan(mq, MIDI_MSG_CHANCC, MIDI_EP_ANY, dest,
+	    chan, num, val);
+}
+
+
+int
+midi_queue_addmsg_chancc_from(midi_queue_t *mq, int src, int chan, int num,
+	int val)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a Control Change message that was received on endpoint
+	 * src. */
+
+	return _midi_queue_addmsg_chan(mq, MIDI_MSG_CHANCC, src, MIDI_EP_ANY,
+	    chan, num, val);
+}
+
+
+int
+midi_queue_addmsg_chanprog_from(midi_queue_t *mq, int src, int chan,
+	int prog)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a Program Change message that was received on endpoint src.
+	 * The program number is in mm_val. */
+
+	return _midi_queue_addmsg_chan(mq, MIDI_MSG_CHANPROG, src, MIDI_EP_ANY,
+	    chan, 0, prog);
+}
+
+
+int
+_midi_queue_addmsg_chan(midi_queue_t *mq, int type, int src, int dest,
+	int chan, int num, int val)
+{
+	midi_msg_t	mmsg;
+
+	if(mq == NULL)
+		return EINVAL;
+
+	if(chan < 0 || chan > 0x0F || num < 0 || num > 0x7F || val < 0 ||
+	    val > 0x7F)
+		return EINVAL;
+
+	memset(&mmsg, 0, sizeof(midi_msg_t));
+	mmsg.mm_type = type;
+	mmsg.mm_src = src;
+	mmsg.mm_dest = dest;
+	mmsg.mm_chan = chan;
+	mmsg.mm_num = num;
+	mmsg.mm_val = val;
 
-	return _midi_queue_addmsg(mq, mmsg);
+	return _midi_queue_addmsg(mq, &mmsg);
 }
 
 
@@ -107,11 +793,79 @@ midi_queue_addmsg_sysex(midi_queue_t *mq, unsigned char *payload,
 	/* NOTE: This function should only be called while the caller
 	 * is holding the queue's lock. */
 
+	return _midi_queue_addmsg_sysex(mq, MIDI_EP_ANY, MIDI_EP_ANY, 0, 0,
+	    payload, siz);
+}
+
+
+int
+midi_queue_addmsg_sysex_from(midi_queue_t *mq, int src,
+	unsigned char *payload, size_t siz)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a System Exclusive message that was received on source
+	 * endpoint src. */
+
+	return _midi_queue_addmsg_sysex(mq, src, MIDI_EP_ANY, 0, 0, payload,
+	    siz);
+}
+
+
+int
+midi_queue_addmsg_sysex_to(midi_queue_t *mq, int dest,
+	unsigned char *payload, size_t siz)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a System Exclusive message that should only be sent to
+	 * destination endpoint dest. */
+
+	return _midi_queue_addmsg_sysex(mq, MIDI_EP_ANY, dest, 0, 0, payload,
+	    siz);
+}
+
+
+int
+midi_queue_addmsg_sysex_at(midi_queue_t *mq, int dest, uint64_t when,
+	unsigned char *payload, size_t siz)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a System Exclusive message that should be sent to dest at
+	 * the time when (as returned by midi_time_now()). */
+
+	return _midi_queue_addmsg_sysex(mq, MIDI_EP_ANY, dest, when, 0,
+	    payload, siz);
+}
+
+
+int
+midi_queue_addmsg_sysex_id(midi_queue_t *mq, int src, int dest, uint64_t id,
+	unsigned char *payload, size_t siz)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Adds a System Exclusive message that keeps the trace ID the
+	 * caller already recorded events for. */
+
+	return _midi_queue_addmsg_sysex(mq, src, dest, 0, id, payload, siz);
+}
+
+
+int
+_midi_queue_addmsg_sysex(midi_queue_t *mq, int src, int dest, uint64_t when,
+	uint64_t id, unsigned char *payload, size_t siz)
+{
 	/* Adds a System Exclusive message to the queue. The payload should
-	 * be what's between the 0xF0 and 0xF7 bytes. */
+	 * be what's between the 0xF0 and 0xF7 bytes, and stays the
+	 * caller's. */
 
 	midi_msg_t	mmsg;
-	int		ret;
 
 	if(mq == NULL)
 		return EINVAL;
@@ -129,19 +883,14 @@ midi_queue_addmsg_sysex(midi_queue_t *mq, unsigned char *payload,
 
 	memset(&mmsg, 0, sizeof(midi_msg_t));
 	mmsg.mm_type = MIDI_MSG_SYSEX;
-
-	mmsg.mm_payload = malloc(siz);
-	if(mmsg.mm_payload == NULL)
-		return ENOENT;
-
-	memcpy(mmsg.mm_payload, payload, siz);
+	mmsg.mm_src = src;
+	mmsg.mm_dest = dest;
+	mmsg.mm_time = when;
+	mmsg.mm_id = id;
+	mmsg.mm_payload = payload;
 	mmsg.mm_payload_siz = siz;
 
-	ret = _midi_queue_addmsg(mq, mmsg);
-	if(ret != 0)
-		midi_msg_free_payload(&mmsg);
-
-	return ret;
+	return _midi_queue_addmsg(mq, &mmsg);
 }
 
 
@@ -155,41 +904,160 @@ midi_queue_getnext(midi_queue_t *mq, midi_msg_t *mmsg)
 	 * message to the caller. The detached queue entry will be freed and
 	 * the message values will be copied into the struct pointed to by the
 	 * mmsg argument. When done with the message, caller should call
-	 * midi_msg_free_payload() to make sure payload is freed correctly. */
+	 * midi_msg_free_payload() to make sure payload is freed correctly.
+	 * Realtime messages are returned before all others. A message
+	 * midi_msg_t can't hold is taken off all the same, and ENOTSUP
+	 * returned. */
 
 	midi_queue_ent_t	*ent;
+	int			ret;
 
-	if(mq == NULL)
+	ret = midi_queue_getent(mq, &ent);
+	if(ret != 0)
+		return ret;
+
+	ret = midi_queue_ent_tomsg(ent, mmsg);
+	free(ent);
+
+	return ret;
+}
+
+
+int
+midi_queue_getnext_rt(midi_queue_t *mq, midi_msg_t *mmsg)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	/* Like midi_queue_getnext() but only looks at the realtime lane.
+	 * Returns ENOENT if there are no realtime messages. */
+
+	midi_queue_ent_t	*ent;
+	int			ret;
+
+	ret = midi_queue_getent_rt(mq, &ent);
+	if(ret != 0)
+		return ret;
+
+	ret = midi_queue_ent_tomsg(ent, mmsg);
+	free(ent);
+
+	return ret;
+}
+
+
+int
+midi_queue_getent(midi_queue_t *mq, midi_queue_ent_t **ent)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	if(mq == NULL || ent == NULL)
 		return EINVAL;
 
 	if(midi_queue_isempty(mq))
 		return ENOENT;
 
-	ent = mq->mq_first;
+	if(mq->mq_rtfirst)
+		return _midi_queue_detach(mq, &mq->mq_rtfirst, &mq->mq_rtlast,
+		    ent);
+
+	return _midi_queue_detach(mq, &mq->mq_first, &mq->mq_last, ent);
+}
+
+
+int
+midi_queue_getent_rt(midi_queue_t *mq, midi_queue_ent_t **ent)
+{
+	/* NOTE: This function should only be called while the caller
+	 * is holding the queue's lock. */
+
+	if(mq == NULL || ent == NULL)
+		return EINVAL;
+
+	if(mq->mq_rtfirst == NULL)
+		return ENOENT;
+
+	return _midi_queue_detach(mq, &mq->mq_rtfirst, &mq->mq_rtlast, ent);
+}
+
+
+int
+_midi_queue_detach(midi_queue_t *mq, midi_queue_ent_t **first,
+	midi_queue_ent_t **last, midi_queue_ent_t **res)
+{
+	midi_queue_ent_t	*ent;
+
+	ent = *first;
 
 	/* Detach */
-	if(ent == mq->mq_last) {
+	if(ent == *last) {
 		/* This was the only entry in the list */
-		mq->mq_first = mq->mq_last = NULL;
+		*first = *last = NULL;
 		
 	} else
-		mq->mq_first = ent->me_next;
-
-
-	/* Copy values */
-	*mmsg = ent->me_msg;
-
+		*first = ent->me_next;
 
-	/* Free entry */
-	free(ent);
+	ent->me_next = NULL;
+	*res = ent;
 	
 	--mq->mq_cnt;
+	mq->mq_bytes -= _MIDI_QUEUE_ENTSIZ(ent);
+	_midi_queue_checkwm(mq);
+
+	/* There's room for a producer waiting for it. */
+	if(mq->mq_blocked)
+		(void) pthread_cond_broadcast(&mq->mq_cond);
 
 	return 0;
 
 }
 
 
+int
+midi_queue_swap(midi_queue_t *mq, midi_queue_t *other)
+{
+	/* Exchanges the contents of two queues, eg. to take everything off
+	 * a shared queue at once and work through it without holding the
+	 * lock. The locks and condvars stay where they are. */
+
+	midi_queue_t	tmp;
+
+	if(mq == NULL || other == NULL)
+		return EINVAL;
+
+	/* Limits, policies and stats stay too. */
+	tmp.mq_cnt = mq->mq_cnt;
+	tmp.mq_first = mq->mq_first;
+	tmp.mq_last = mq->mq_last;
+	tmp.mq_rtfirst = mq->mq_rtfirst;
+	tmp.mq_rtlast = mq->mq_rtlast;
+	tmp.mq_bytes = mq->mq_bytes;
+
+	mq->mq_cnt = other->mq_cnt;
+	mq->mq_first = other->mq_first;
+	mq->mq_last = other->mq_last;
+	mq->mq_rtfirst = other->mq_rtfirst;
+	mq->mq_rtlast = other->mq_rtlast;
+	mq->mq_bytes = other->mq_bytes;
+
+	other->mq_cnt = tmp.mq_cnt;
+	other->mq_first = tmp.mq_first;
+	other->mq_last = tmp.mq_last;
+	other->mq_rtfirst = tmp.mq_rtfirst;
+	other->mq_rtlast = tmp.mq_rtlast;
+	other->mq_bytes = tmp.mq_bytes;
+
+	_midi_queue_checkwm(mq);
+	_midi_queue_checkwm(other);
+
+	if(mq->mq_blocked)
+		(void) pthread_cond_broadcast(&mq->mq_cond);
+
+	return 0;
+}
+
+
 int
 midi_queue_isempty(midi_queue_t *mq)
 {
@@ -201,7 +1069,7 @@ midi_queue_isempty(midi_queue_t *mq)
 		return -1;
 	}
 
-	if(mq->mq_first)
+	if(mq->mq_first || mq->mq_rtfirst)
 		return 0;
 	else
 		return 1;
@@ -214,18 +1082,20 @@ midi_queue_uninit(midi_queue_t **mq)
 	/* NOTE: This function should only be called after all worker threads
 	 * that could access this queue have exited. */
 
-	midi_msg_t	foo;
-	int		ret;
+	midi_queue_ent_t	*ent;
+	int			ret;
 
 	if(mq == NULL)
 		return EINVAL;
 
 	/* Consume all remaining messages on queue. No need to acquire the
 	 * lock. We assume there are no more worker threads running. */
+	(*mq)->mq_wmfn = NULL;
 	while(!midi_queue_isempty(*mq)) {
-		ret = midi_queue_getnext(*mq, &foo);
+		ret = midi_queue_getent(*mq, &ent);
 		if(ret != 0)
 			return ENOEXEC;
+		free(ent);
 	}
 
 	ret = pthread_mutex_destroy(&((*mq)->mq_mutex));
@@ -266,3 +1136,45 @@ midi_msg_free_payload(midi_msg_t *msg)
 
 	return 0;
 }
+
+
+int
+midi_msg_encode_short(midi_msg_t *msg, unsigned char *buf, size_t *siz)
+{
+	/* Encodes a message that isn't sysex into buf, which has to be at
+	 * least MIDI_MSG_SHORTSIZ bytes. */
+
+	if(msg == NULL || buf == NULL || siz == NULL)
+		return EINVAL;
+
+	*siz = 1;
+
+	if(msg->mm_type == MIDI_MSG_SYSRT_CLOCK) {
+		buf[0] = 0xF8;
+	} else
+	if(msg->mm_type == MIDI_MSG_SYSRT_START) {
+		buf[0] = 0xFA;
+	} else
+	if(msg->mm_type == MIDI_MSG_SYSRT_CONTINUE) {
+		buf[0] = 0xFB;
+	} else
+	if(msg->mm_type == MIDI_MSG_SYSRT_STOP) {
+		buf[0] = 0xFC;
+	} else
+	if(msg->mm_type == MIDI_MSG_CHANCC) {
+		buf[0] = 0xB0 | (msg->mm_chan & 0x0F);
+		buf[1] = msg->mm_num & 0x7F;
+		buf[2] = msg->mm_val & 0x7F;
+		*siz = 3;
+	} else
+	if(msg->mm_type == MIDI_MSG_CHANPROG) {
+		buf[0] = 0xC0 | (msg->mm_chan & 0x0F);
+		buf[1] = msg->mm_val & 0x7F;
+		*siz = 2;
+	} else {
+		*siz = 0;
+		return EINVAL;
+	}
+
+	return 0;
+}
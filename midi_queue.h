@@ -2,51 +2,178 @@
 #define MIDI_QUEUE_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include "midi_ump.h"
 
 #define MIDI_MSG_SYSRT_CLOCK		0
 #define MIDI_MSG_SYSRT_START		1
 #define MIDI_MSG_SYSRT_STOP		2
 #define MIDI_MSG_SYSEX			3
+#define MIDI_MSG_SYSRT_CONTINUE		4
+#define MIDI_MSG_CHANCC			5
+#define MIDI_MSG_CHANPROG		6
+#define MIDI_MSG_NTYPES			7
+
+/* Longest message that isn't sysex, on the wire. */
+#define MIDI_MSG_SHORTSIZ		3
+
+/* Endpoint index meaning "not known" on incoming and "all" on outgoing
+ * messages. */
+#define MIDI_EP_ANY			-1
 
 typedef struct midi_msg {
 	int			mm_type;
 	int			mm_chan;
+	int			mm_num;		/* Controller number */
 	int			mm_val;
+	int			mm_src;		/* Source endpoint index */
+	int			mm_dest;	/* Destination endpoint index */
+	uint64_t		mm_time;	/* Due (midi_time_now()), 0: now */
+	uint64_t		mm_id;		/* For tracing, 0 if none */
 	unsigned char	        *mm_payload;
 	size_t			mm_payload_siz;
 } midi_msg_t;
 
 
+/* A message is kept as the Universal MIDI Packets it takes, right after
+ * the entry, so sysex needs no allocation of its own and every message
+ * is in one piece of memory. */
 typedef struct midi_queue_ent {
-	midi_msg_t		me_msg;
 	struct midi_queue_ent	*me_next;
+	int			me_type;	/* MIDI_MSG_*, -1 if none */
+	int			me_src;
+	int			me_dest;
+	uint64_t		me_time;
+	uint64_t		me_id;
+	int			me_pktcnt;
+	midi_ump_t		me_pkts[];
 } midi_queue_ent_t;
 
 
+/* System Real-Time messages may go out in the middle of anything else,
+ * including sysex, so they are kept on a lane of their own that
+ * midi_queue_getnext() always serves first. Not on queues of received
+ * messages (mq_fifo), which keep the order they came in. */
+#define MIDI_MSG_ISSYSRT(t)	((t) == MIDI_MSG_SYSRT_CLOCK || \
+				 (t) == MIDI_MSG_SYSRT_START || \
+				 (t) == MIDI_MSG_SYSRT_STOP || \
+				 (t) == MIDI_MSG_SYSRT_CONTINUE)
+
+/* What happens to a message that doesn't fit, by type. */
+#define MIDI_QUEUE_FAIL		0	/* Refused with ENOBUFS */
+#define MIDI_QUEUE_DROPOLDEST	1	/* Dropped, oldest first, to make
+					 * room for any message */
+#define MIDI_QUEUE_COALESCE	2	/* CCs: the value of one queued for
+					 * the same controller is replaced */
+#define MIDI_QUEUE_BLOCK	3	/* Waits for the consumer */
+
+/* Limits of queues the reader feeds, see midi_queue_setinput(). */
+#define MIDI_QUEUE_INMAXCNT	4096
+#define MIDI_QUEUE_INMAXBYTES	(4 * 1024 * 1024)
+#define MIDI_QUEUE_INHIWAT	75	/* Percent */
+#define MIDI_QUEUE_INLOWAT	25
+
+struct midi_queue;
+
+/* Called with the queue locked when it fills up past the high watermark
+ * or has to drop a message (nonzero), and when it's back under the low
+ * watermark (zero). */
+typedef void (*midi_queue_wmfn_t)(struct midi_queue *, int, void *);
+
 typedef struct midi_queue {
 	int			mq_cnt;
-	midi_queue_ent_t	*mq_first;
+	midi_queue_ent_t	*mq_first;	/* Bulk lane */
 	midi_queue_ent_t	*mq_last;
+	midi_queue_ent_t	*mq_rtfirst;	/* Realtime lane */
+	midi_queue_ent_t	*mq_rtlast;
+	size_t			mq_bytes;	/* Entries and packets */
+	int			mq_fifo;	/* No realtime lane */
+
+	/* Limits, 0 means none. */
+	int			mq_maxcnt;
+	size_t			mq_maxbytes;
+	int			mq_policy[MIDI_MSG_NTYPES];
+	int			mq_blocked;	/* Producers waiting */
+
+	int			mq_hiwat;	/* Percent of the limits */
+	int			mq_lowat;
+	int			mq_above;
+	midi_queue_wmfn_t	mq_wmfn;
+	void			*mq_wmarg;
+
+	uint64_t		mq_dropped;	/* Stats */
+	uint64_t		mq_coalesced;
 
 	pthread_mutex_t		mq_mutex;
 	pthread_cond_t		mq_cond;
 } midi_queue_t;
 
+/* Everything received that isn't routed to a queue of its own, and
+ * everything to be sent. */
+extern midi_queue_t *midi_inq;
+extern midi_queue_t *midi_outq;
+
 /* NOTE: The below functions should only be called from the main thread,
  * when there are no other threads (yet or anymore) running that could access
  * the queue. */
 int midi_queue_init(midi_queue_t **);
 int midi_queue_uninit(midi_queue_t **);
 
+/* A new queue has no limits. Once there are, a message that doesn't fit
+ * is dealt with according to the policy of its type, MIDI_QUEUE_FAIL
+ * unless set otherwise.
+ * NOTE: A producer that blocks waits for the consumer, so it mustn't be
+ * the consumer itself or the system's MIDI callback. */
+int midi_queue_setlimits(midi_queue_t *, int, size_t);
+int midi_queue_setpolicy(midi_queue_t *, int, int);
+int midi_queue_setwatermarks(midi_queue_t *, int, int, midi_queue_wmfn_t,
+	void *);
+
+/* Limits for a queue the reader puts incoming messages on, which must
+ * never wait: clocks drop the oldest, CCs coalesce, sysex and the rest
+ * are refused. Crossing the watermarks is reported on stderr, with name.
+ * Realtime messages stay in order with the rest. */
+int midi_queue_setinput(midi_queue_t *, const char *);
+void midi_queue_warn(midi_queue_t *, int, void *);
+
 /* NOTE: The below functions must only be called after the queue's lock has
  * been acquired. */
+int midi_queue_addmsg(midi_queue_t *, midi_msg_t *);
 int midi_queue_addmsg_sysrt(midi_queue_t *, int);
 int midi_queue_addmsg_chancc(midi_queue_t *, int, int, int);
+int midi_queue_addmsg_chancc_to(midi_queue_t *, int, int, int, int);
+int midi_queue_addmsg_chancc_from(midi_queue_t *, int, int, int, int);
+int midi_queue_addmsg_chanprog_from(midi_queue_t *, int, int, int);
 int midi_queue_addmsg_sysex(midi_queue_t *, unsigned char *, size_t);
+int midi_queue_addmsg_sysrt_from(midi_queue_t *, int, int);
+int midi_queue_addmsg_sysrt_to(midi_queue_t *, int, int);
+int midi_queue_addmsg_sysex_from(midi_queue_t *, int, unsigned char *, size_t);
+int midi_queue_addmsg_sysex_to(midi_queue_t *, int, unsigned char *, size_t);
+int midi_queue_addmsg_sysrt_at(midi_queue_t *, int, uint64_t, int);
+int midi_queue_addmsg_sysex_at(midi_queue_t *, int, uint64_t, unsigned char *,
+	size_t);
+int midi_queue_addmsg_sysex_id(midi_queue_t *, int, int, uint64_t,
+	unsigned char *, size_t);
+int midi_queue_addump(midi_queue_t *, int, int, uint64_t, uint64_t,
+	const midi_ump_t *, int);
 int midi_queue_isempty(midi_queue_t *);
 int midi_queue_getnext(midi_queue_t *, midi_msg_t *);
+int midi_queue_getnext_rt(midi_queue_t *, midi_msg_t *);
+
+/* The same without translating: the entry itself is taken off, to be
+ * freed with free() or put on another queue as it is. */
+int midi_queue_getent(midi_queue_t *, midi_queue_ent_t **);
+int midi_queue_getent_rt(midi_queue_t *, midi_queue_ent_t **);
+int midi_queue_putent(midi_queue_t *, midi_queue_ent_t *);
+
+/* NOTE: The caller must hold the lock of the first queue and must be the
+ * only user of the second one. */
+int midi_queue_swap(midi_queue_t *, midi_queue_t *);
 
 /* NOTE: the below functions can be called at any time. */
 int midi_msg_free_payload(midi_msg_t *);
+int midi_msg_encode_short(midi_msg_t *, unsigned char *, size_t *);
+int midi_queue_newent(const midi_ump_t *, int, midi_queue_ent_t **);
+int midi_queue_ent_tomsg(const midi_queue_ent_t *, midi_msg_t *);
 
 #endif
@@ -0,0 +1,585 @@
+/*
+ * Broadcast ring for incoming messages.
+ *
+ * Works like the LMAX disruptor: the producer stamps every message with
+ * the next sequence number and publishes it by storing that number, each
+ * consumer keeps the sequence it has read up to. A slot can be reused
+ * once the slowest consumer is past it. Nothing is locked, and the only
+ * thing consumers share with each other is the published sequence they
+ * all read.
+ *
+ * Slots hold packets, which the producer writes once. Each consumer turns
+ * them into a message in a buffer of its own as it reads them.
+ *
+ * Consumers that run out of messages sleep on a condvar. The producer only
+ * takes its lock to wake them up, and only if somebody is sleeping.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "midi_ring.h"
+#include "midi_trace.h"
+#include "midi_time.h"
+#include "midi_rt.h"
+#include "btime.h"
+
+uint64_t _midi_ring_gate(midi_ring_t *, uint64_t, midi_ring_cons_t **);
+int _midi_ring_claim(midi_ring_t *, int, midi_ring_slot_t **);
+void _midi_ring_publish(midi_ring_t *);
+int _midi_ring_wait(midi_ring_cons_t *, uint64_t);
+int _midi_ring_tomsg(midi_ring_cons_t *, midi_ring_slot_t *);
+
+
+int
+midi_ring_init(midi_ring_t **res, int siz)
+{
+	midi_ring_t	*mr;
+	int		ret;
+	int		i;
+
+	if(res == NULL || siz < 0)
+		return EINVAL;
+
+	if(siz == 0)
+		siz = MIDI_RING_DEFSIZ;
+	for(i = 1; i < siz; i <<= 1)
+		;
+	siz = i;
+
+	/* The cursors have to be on cache lines of their own. */
+	ret = posix_memalign((void **) &mr, MIDI_RING_CACHELINE,
+	    sizeof(midi_ring_t));
+	if(ret != 0)
+		return ENOMEM;
+	memset(mr, 0, sizeof(midi_ring_t));
+
+	mr->mr_slots = calloc(siz, sizeof(midi_ring_slot_t));
+	if(mr->mr_slots == NULL) {
+		free(mr);
+		return ENOMEM;
+	}
+	mr->mr_siz = siz;
+	midi_rt_prefault(mr->mr_slots, siz * sizeof(midi_ring_slot_t));
+
+	atomic_init(&mr->mr_pub, 0);
+	atomic_init(&mr->mr_dropped, 0);
+	atomic_init(&mr->mr_gen, 0);
+	atomic_init(&mr->mr_sleepers, 0);
+	for(i = 0; i < MIDI_RING_MAXCONS; ++i) {
+		atomic_init(&mr->mr_cons[i].rc_cursor, 0);
+		atomic_init(&mr->mr_cons[i].rc_state, MIDI_RING_FREE);
+		atomic_init(&mr->mr_cons[i].rc_stalls, 0);
+		mr->mr_cons[i].rc_ring = mr;
+	}
+
+	ret = pthread_mutex_init(&mr->mr_mutex, NULL);
+	if(ret != 0) {
+		fprintf(stderr, "Can't create mutex for MIDI ring: %s\n",
+		    strerror(ret));
+		free(mr->mr_slots);
+		free(mr);
+		return -1;
+	}
+
+	ret = pthread_cond_init(&mr->mr_cond, NULL);
+	if(ret != 0) {
+		fprintf(stderr, "Can't create condvar for MIDI ring: %s\n",
+		    strerror(ret));
+		(void) pthread_mutex_destroy(&mr->mr_mutex);
+		free(mr->mr_slots);
+		free(mr);
+		return -1;
+	}
+
+	*res = mr;
+	return 0;
+}
+
+
+int
+midi_ring_uninit(midi_ring_t **mr)
+{
+	int	i;
+
+	if(mr == NULL || *mr == NULL)
+		return EINVAL;
+
+	for(i = 0; i < (*mr)->mr_siz; ++i)
+		free((*mr)->mr_slots[i].rs_buf);
+	free((*mr)->mr_slots);
+	for(i = 0; i < MIDI_RING_MAXCONS; ++i)
+		free((*mr)->mr_cons[i].rc_buf);
+
+	(void) pthread_mutex_destroy(&(*mr)->mr_mutex);
+	(void) pthread_cond_destroy(&(*mr)->mr_cond);
+
+	free(*mr);
+	*mr = NULL;
+
+	return 0;
+}
+
+
+uint64_t
+_midi_ring_gate(midi_ring_t *mr, uint64_t pub, midi_ring_cons_t **slowest)
+{
+	/* Returns the sequence every consumer has released, and which
+	 * consumer that is. Without consumers, everything is. */
+
+	midi_ring_cons_t	*rc;
+	uint64_t		gate;
+	uint64_t		cur;
+	int			i;
+
+	gate = pub;
+	*slowest = NULL;
+
+	for(i = 0; i < MIDI_RING_MAXCONS; ++i) {
+		rc = &mr->mr_cons[i];
+		if(atomic_load(&rc->rc_state) != MIDI_RING_ACTIVE)
+			continue;
+		cur = atomic_load_explicit(&rc->rc_cursor,
+		    memory_order_acquire);
+		if(cur < gate || *slowest == NULL) {
+			gate = cur < gate ? cur : gate;
+			*slowest = rc;
+		}
+	}
+
+	return gate;
+}
+
+
+int
+_midi_ring_claim(midi_ring_t *mr, int cnt, midi_ring_slot_t **res)
+{
+	/* NOTE: This function should only be called by the producer. */
+
+	/* Returns the next slot, with room for cnt packets. */
+
+	midi_ring_slot_t	*rs;
+	midi_ring_cons_t	*slowest;
+	midi_ump_t		*buf;
+	uint64_t		seq;
+	unsigned int		gen;
+
+	seq = atomic_load_explicit(&mr->mr_pub, memory_order_relaxed) + 1;
+
+	/* The slowest cursor only has to be looked up again when the ring
+	 * seems full, or when a consumer joined and may not be protected by
+	 * the one we have. */
+	gen = atomic_load(&mr->mr_gen);
+	if(gen != mr->mr_consgen || seq > mr->mr_gate + mr->mr_siz) {
+		mr->mr_consgen = gen;
+		mr->mr_gate = _midi_ring_gate(mr, seq - 1, &slowest);
+
+		if(seq > mr->mr_gate + mr->mr_siz) {
+			atomic_fetch_add(&mr->mr_dropped, 1);
+			atomic_fetch_add(&slowest->rc_stalls, 1);
+			if(!mr->mr_full) {
+				fprintf(stderr, "MIDI ring full, dropping"
+				    " messages until %s catches up\n",
+				    slowest->rc_name);
+				mr->mr_full = 1;
+			}
+			return ENOBUFS;
+		}
+	}
+	mr->mr_full = 0;
+
+	rs = &mr->mr_slots[seq & (mr->mr_siz - 1)];
+
+	/* Every consumer is past this slot, so the buffer can be replaced.
+	 * What was in it doesn't have to be kept. */
+	if(cnt > 1 && cnt > rs->rs_cap) {
+		if(posix_memalign((void **) &buf, _Alignof(midi_ump_t),
+		    cnt * sizeof(midi_ump_t)) != 0) {
+			atomic_fetch_add(&mr->mr_dropped, 1);
+			return ENOMEM;
+		}
+		free(rs->rs_buf);
+		rs->rs_buf = buf;
+		rs->rs_cap = cnt;
+	}
+
+	rs->rs_type = -1;
+	rs->rs_src = MIDI_EP_ANY;
+	rs->rs_id = 0;
+	rs->rs_pktcnt = cnt;
+
+	*res = rs;
+
+	return 0;
+}
+
+
+void
+_midi_ring_publish(midi_ring_t *mr)
+{
+	/* NOTE: This function should only be called by the producer, after
+	 * a successful _midi_ring_claim(). */
+
+	midi_ring_slot_t	*rs;
+	uint64_t		seq;
+
+	seq = atomic_load_explicit(&mr->mr_pub, memory_order_relaxed) + 1;
+	rs = &mr->mr_slots[seq & (mr->mr_siz - 1)];
+
+	/* A message's life starts the first time it's queued. */
+	if(midi_trace_on && rs->rs_id == 0) {
+		rs->rs_id = midi_trace_newid();
+		midi_trace_stage(rs->rs_id, MIDI_TRACE_ENQUEUE, 0);
+	}
+
+	atomic_store(&mr->mr_pub, seq);
+
+	/* A consumer going to sleep counts itself in before it looks at
+	 * mr_pub the last time, holding the lock until it waits. Either it
+	 * sees the new sequence or we see it and wake it up. */
+	if(atomic_load(&mr->mr_sleepers) > 0) {
+		(void) pthread_mutex_lock(&mr->mr_mutex);
+		(void) pthread_cond_broadcast(&mr->mr_cond);
+		(void) pthread_mutex_unlock(&mr->mr_mutex);
+	}
+}
+
+
+int
+midi_ring_put_ump(midi_ring_t *mr, int src, uint64_t id,
+	const midi_ump_t *pkts, int cnt)
+{
+	/* NOTE: This function should only be called by the producer. */
+
+	midi_ring_slot_t	*rs;
+	int			ret;
+
+	if(mr == NULL || midi_ump_check(pkts, cnt) != 0)
+		return EINVAL;
+
+	ret = _midi_ring_claim(mr, cnt, &rs);
+	if(ret != 0)
+		return ret;
+
+	memcpy(MIDI_RING_PKTS(rs), pkts, cnt * sizeof(midi_ump_t));
+	rs->rs_type = midi_ump_msgtype(&pkts[0]);
+	rs->rs_src = src;
+	rs->rs_id = id;
+
+	_midi_ring_publish(mr);
+
+	return 0;
+}
+
+
+int
+midi_ring_put_sysrt(midi_ring_t *mr, int src, int type)
+{
+	/* NOTE: This function should only be called by the producer. */
+
+	midi_msg_t	msg;
+	midi_ump_t	ump;
+	int		cnt;
+	int		ret;
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_type = type;
+
+	ret = midi_ump_from_msg(&msg, 0, &ump, 1, &cnt);
+	if(ret != 0)
+		return ret;
+
+	return midi_ring_put_ump(mr, src, 0, &ump, cnt);
+}
+
+
+int
+midi_ring_put_chan(midi_ring_t *mr, int src, int type, int chan, int num,
+	int val)
+{
+	/* NOTE: This function should only be called by the producer. */
+
+	/* Control Change or Program Change received on endpoint src, the
+	 * program number is in val. */
+
+	midi_msg_t	msg;
+	midi_ump_t	ump;
+	int		cnt;
+	int		ret;
+
+	if(chan < 0 || chan > 0x0F || num < 0 || num > 0x7F || val < 0 ||
+	    val > 0x7F)
+		return EINVAL;
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_type = type;
+	msg.mm_chan = chan;
+	msg.mm_num = num;
+	msg.mm_val = val;
+
+	ret = midi_ump_from_msg(&msg, 0, &ump, 1, &cnt);
+	if(ret != 0)
+		return ret;
+
+	return midi_ring_put_ump(mr, src, 0, &ump, cnt);
+}
+
+
+int
+midi_ring_put_sysex(midi_ring_t *mr, int src, uint64_t id,
+	unsigned char *payload, size_t siz)
+{
+	/* NOTE: This function should only be called by the producer. */
+
+	/* The payload should be what's between the 0xF0 and 0xF7 bytes. It
+	 * is packed straight into the slot. */
+
+	midi_ring_slot_t	*rs;
+	int			cnt;
+	int			ret;
+
+	if(mr == NULL || payload == NULL || siz == 0)
+		return EINVAL;
+
+	ret = _midi_ring_claim(mr, MIDI_UMP_SYSEX_PKTS(siz), &rs);
+	if(ret != 0)
+		return ret;
+
+	/* Not published, so the slot is free again. */
+	ret = midi_ump_from_sysex(payload, siz, 0, MIDI_RING_PKTS(rs),
+	    rs->rs_pktcnt, &cnt);
+	if(ret != 0)
+		return ret;
+
+	rs->rs_type = MIDI_MSG_SYSEX;
+	rs->rs_src = src;
+	rs->rs_id = id;
+
+	_midi_ring_publish(mr);
+
+	return 0;
+}
+
+
+int
+midi_ring_join(midi_ring_t *mr, const char *name, midi_ring_cons_t **res)
+{
+	midi_ring_cons_t	*rc;
+	uint64_t		pub;
+	int			state;
+	int			i;
+
+	if(mr == NULL || res == NULL)
+		return EINVAL;
+
+	rc = NULL;
+	for(i = 0; i < MIDI_RING_MAXCONS; ++i) {
+		state = MIDI_RING_FREE;
+		if(atomic_compare_exchange_strong(&mr->mr_cons[i].rc_state,
+		    &state, MIDI_RING_JOINING)) {
+			rc = &mr->mr_cons[i];
+			break;
+		}
+	}
+	if(rc == NULL)
+		return ENOSPC;
+
+	snprintf(rc->rc_name, sizeof(rc->rc_name), "%s",
+	    name ? name : "consumer");
+	atomic_store(&rc->rc_stalls, 0);
+
+	/* The producer may have already decided to overwrite slots after
+	 * pub without knowing about us, but once it sees mr_gen change it
+	 * won't go past pub anymore. Whatever it published in the meantime
+	 * is left out. */
+	pub = atomic_load(&mr->mr_pub);
+	atomic_store(&rc->rc_cursor, pub);
+	atomic_store(&rc->rc_state, MIDI_RING_ACTIVE);
+	atomic_fetch_add(&mr->mr_gen, 1);
+
+	rc->rc_avail = atomic_load(&mr->mr_pub);
+	rc->rc_next = rc->rc_avail + 1;
+
+	*res = rc;
+
+	return 0;
+}
+
+
+int
+midi_ring_leave(midi_ring_cons_t **rc)
+{
+	midi_ring_t	*mr;
+
+	if(rc == NULL || *rc == NULL)
+		return EINVAL;
+
+	mr = (*rc)->rc_ring;
+
+	atomic_store(&(*rc)->rc_state, MIDI_RING_FREE);
+	atomic_fetch_add(&mr->mr_gen, 1);
+
+	*rc = NULL;
+
+	return 0;
+}
+
+
+int
+_midi_ring_wait(midi_ring_cons_t *rc, uint64_t deadline)
+{
+	/* Returns 0 once rc_next has been published, waiting for it until
+	 * deadline. */
+
+	midi_ring_t	*mr;
+	uint64_t	now;
+	struct timespec	condwaitto;
+	int		ret;
+
+	mr = rc->rc_ring;
+
+	if(rc->rc_next > rc->rc_avail)
+		rc->rc_avail = atomic_load_explicit(&mr->mr_pub,
+		    memory_order_acquire);
+
+	if(rc->rc_next <= rc->rc_avail)
+		return 0;
+
+	if(deadline == 0)
+		return ENOENT;
+
+	ret = pthread_mutex_lock(&mr->mr_mutex);
+	if(ret != 0) {
+		fprintf(stderr, "Can't lock ring: %s\n", strerror(ret));
+		return ENOEXEC;
+	}
+	atomic_fetch_add(&mr->mr_sleepers, 1);
+
+	while(rc->rc_next > (rc->rc_avail = atomic_load(&mr->mr_pub))) {
+		now = midi_time_now();
+		if(now >= deadline) {
+			ret = ETIMEDOUT;
+			break;
+		}
+
+		btimespec_tonow(&condwaitto);
+		btimespec_addus(&condwaitto, (deadline - now) /
+		    MIDI_TIME_NSEC_PER_USEC + 1);
+		ret = pthread_cond_timedwait(&mr->mr_cond, &mr->mr_mutex,
+		    &condwaitto);
+		if(ret != 0 && ret != ETIMEDOUT) {
+			fprintf(stderr, "Error while waiting on condvar: %s\n",
+			    strerror(ret));
+			break;
+		}
+		ret = 0;
+	}
+
+	atomic_fetch_sub(&mr->mr_sleepers, 1);
+	(void) pthread_mutex_unlock(&mr->mr_mutex);
+
+	return ret;
+}
+
+
+int
+_midi_ring_tomsg(midi_ring_cons_t *rc, midi_ring_slot_t *rs)
+{
+	/* Turns the slot's packets into rc_msg, sysex into rc_buf. */
+
+	const midi_ump_t	*pkts;
+	unsigned char		*buf;
+	size_t			siz;
+	int			ret;
+	int			i;
+
+	if(rs->rs_type < 0)
+		return ENOTSUP;
+
+	pkts = MIDI_RING_PKTS(rs);
+
+	if(rs->rs_type == MIDI_MSG_SYSEX) {
+		siz = 0;
+		for(i = 0; i < rs->rs_pktcnt; ++i)
+			siz += midi_ump_sysex_data(&pkts[i], NULL);
+
+		if(siz > rc->rc_cap) {
+			buf = realloc(rc->rc_buf, siz);
+			if(buf == NULL)
+				return ENOMEM;
+			rc->rc_buf = buf;
+			rc->rc_cap = siz;
+		}
+
+		memset(&rc->rc_msg, 0, sizeof(midi_msg_t));
+		rc->rc_msg.mm_type = MIDI_MSG_SYSEX;
+		rc->rc_msg.mm_payload = rc->rc_buf;
+		for(i = 0; i < rs->rs_pktcnt; ++i) {
+			rc->rc_msg.mm_payload_siz += midi_ump_sysex_data(
+			    &pkts[i], rc->rc_buf + rc->rc_msg.mm_payload_siz);
+		}
+	} else {
+		ret = midi_ump_to_msg(&pkts[0], &rc->rc_msg);
+		if(ret != 0)
+			return ret;
+	}
+
+	rc->rc_msg.mm_src = rs->rs_src;
+	rc->rc_msg.mm_id = rs->rs_id;
+
+	return 0;
+}
+
+
+int
+midi_ring_next(midi_ring_cons_t *rc, uint64_t deadline,
+	const midi_msg_t **res)
+{
+	/* NOTE: This function should only be called by the consumer's own
+	 * thread. */
+
+	midi_ring_t		*mr;
+	midi_ring_slot_t	*rs;
+	int			ret;
+
+	if(rc == NULL || res == NULL)
+		return EINVAL;
+
+	mr = rc->rc_ring;
+
+	do {
+		ret = _midi_ring_wait(rc, deadline);
+		if(ret != 0)
+			return ret;
+
+		rs = &mr->mr_slots[rc->rc_next & (mr->mr_siz - 1)];
+		++rc->rc_next;
+
+		ret = _midi_ring_tomsg(rc, rs);
+		if(ret != 0 && ret != ENOTSUP)
+			fprintf(stderr, "Can't read MIDI message from ring:"
+			    " %s\n", strerror(ret));
+	} while(ret != 0);
+
+	*res = &rc->rc_msg;
+
+	return 0;
+}
+
+
+void
+midi_ring_release(midi_ring_cons_t *rc)
+{
+	/* NOTE: This function should only be called by the consumer's own
+	 * thread. */
+
+	atomic_store_explicit(&rc->rc_cursor, rc->rc_next - 1,
+	    memory_order_release);
+}
+
+
+uint64_t
+midi_ring_dropped(midi_ring_t *mr)
+{
+	return atomic_load(&mr->mr_dropped);
+}
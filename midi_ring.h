@@ -0,0 +1,113 @@
+#ifndef MIDI_RING_H
+#define MIDI_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "midi_queue.h"
+
+/*
+ * Broadcast ring for incoming messages.
+ *
+ * A queue hands each message to one consumer. The ring keeps the last
+ * mr_siz messages, as Universal MIDI Packets, and every consumer reads all
+ * of them at its own pace with a cursor of its own. The producer only
+ * reuses a slot once every consumer has released it. When one hasn't, the
+ * new message is dropped and the consumer holding up the ring is reported,
+ * the producer never waits.
+ */
+
+#define MIDI_RING_DEFSIZ	1024	/* Slots, a power of 2 */
+#define MIDI_RING_MAXCONS	8
+#define MIDI_RING_NAMELEN	16
+#define MIDI_RING_CACHELINE	64
+
+#define MIDI_RING_FREE		0
+#define MIDI_RING_JOINING	1
+#define MIDI_RING_ACTIVE	2
+
+/* Most messages are one packet, which is kept in the slot. Sysex takes
+ * a buffer, which stays for the next message that goes there. */
+typedef struct midi_ring_slot {
+	int		rs_type;	/* MIDI_MSG_*, -1 if none */
+	int		rs_src;
+	uint64_t	rs_id;
+	int		rs_pktcnt;
+	int		rs_cap;		/* Packets rs_buf holds */
+	midi_ump_t	*rs_buf;
+	midi_ump_t	rs_pkt;
+} midi_ring_slot_t;
+
+#define MIDI_RING_PKTS(rs)	((rs)->rs_pktcnt > 1 ? (rs)->rs_buf : \
+				 &(rs)->rs_pkt)
+
+/* Cursors are written by their own consumer only and are a cache line
+ * each, so that consumers don't slow each other down. */
+typedef struct midi_ring_cons {
+	_Alignas(MIDI_RING_CACHELINE)
+	atomic_uint_fast64_t	rc_cursor;	/* Last sequence released */
+	atomic_int		rc_state;
+	atomic_uint_fast64_t	rc_stalls;	/* Messages dropped because of
+						 * this one */
+	uint64_t		rc_next;	/* Next sequence to read */
+	uint64_t		rc_avail;	/* Last published seen */
+	struct midi_ring	*rc_ring;
+	char			rc_name[MIDI_RING_NAMELEN];
+	midi_msg_t		rc_msg;		/* Last one read */
+	unsigned char		*rc_buf;	/* Its payload */
+	size_t			rc_cap;
+} midi_ring_cons_t;
+
+typedef struct midi_ring {
+	/* Producer side. */
+	_Alignas(MIDI_RING_CACHELINE)
+	atomic_uint_fast64_t	mr_pub;		/* Last sequence published */
+	uint64_t		mr_gate;	/* Slowest cursor last seen */
+	unsigned int		mr_consgen;	/* mr_gen last seen */
+	int			mr_full;	/* Dropping since last report */
+	atomic_uint_fast64_t	mr_dropped;
+
+	_Alignas(MIDI_RING_CACHELINE)
+	atomic_uint		mr_gen;		/* Bumped on join and leave */
+	atomic_int		mr_sleepers;
+	pthread_mutex_t		mr_mutex;	/* Only to sleep on mr_cond */
+	pthread_cond_t		mr_cond;
+
+	int			mr_siz;
+	midi_ring_slot_t	*mr_slots;
+	midi_ring_cons_t	mr_cons[MIDI_RING_MAXCONS];
+} midi_ring_t;
+
+/* NOTE: Only call these when neither the producer nor any consumer is
+ * running. siz is rounded up to a power of 2, 0 means MIDI_RING_DEFSIZ. */
+int midi_ring_init(midi_ring_t **, int);
+int midi_ring_uninit(midi_ring_t **);
+
+/* NOTE: The below functions are for the producer, of which there can only
+ * be one. They don't lock or wait; ENOBUFS means the message was dropped.
+ * midi_ring_put_ump() takes one packet, or the packets of one sysex
+ * message in order. */
+int midi_ring_put_ump(midi_ring_t *, int, uint64_t, const midi_ump_t *,
+	int);
+int midi_ring_put_sysrt(midi_ring_t *, int, int);
+int midi_ring_put_chan(midi_ring_t *, int, int, int, int, int);
+int midi_ring_put_sysex(midi_ring_t *, int, uint64_t, unsigned char *,
+	size_t);
+
+/* A consumer sees what is published after it joins. Can be called at any
+ * time, from any thread. */
+int midi_ring_join(midi_ring_t *, const char *, midi_ring_cons_t **);
+int midi_ring_leave(midi_ring_cons_t **);
+
+/* NOTE: The below functions must only be called by the consumer's own
+ * thread. midi_ring_next() returns the next message, waiting for it until
+ * deadline (midi_time_now() time, 0: don't wait). It's the consumer's own
+ * copy, valid until the next call; packets that midi_msg_t can't hold are
+ * skipped. midi_ring_release() lets the producer reuse every slot read
+ * so far. */
+int midi_ring_next(midi_ring_cons_t *, uint64_t, const midi_msg_t **);
+void midi_ring_release(midi_ring_cons_t *);
+
+uint64_t midi_ring_dropped(midi_ring_t *);
+
+#endif
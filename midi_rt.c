@@ -0,0 +1,256 @@
+/*
+ * Realtime mode.
+ *
+ * A thread that sleeps until a message is due is only as punctual as the
+ * scheduler lets it be: behind other threads of the same priority, on a
+ * cpu busy with something else, or waiting for a page to come back from
+ * swap. Realtime mode takes these out of the way for the few threads that
+ * need it. Everything else keeps running normally.
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* pthread_setaffinity_np() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "midi_rt.h"
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#endif
+
+int midi_rt_on = 0;
+
+static int rt_policy = MIDI_RT_FIFO;
+static int rt_prio = 0;
+static int rt_cpu = MIDI_RT_ANYCPU;
+
+void _midi_rt_stack(void);
+
+
+int
+midi_rt_init(void)
+{
+	const char	*s;
+	char		*end;
+	int		policy;
+	long		prio;
+	long		cpu;
+
+	s = getenv(MIDI_RT_ENV);
+	if(s == NULL || s[0] == 0)
+		return 0;
+
+	policy = MIDI_RT_FIFO;
+	if(strncmp(s, "fifo:", 5) == 0) {
+		s += 5;
+	} else
+	if(strncmp(s, "rr:", 3) == 0) {
+		policy = MIDI_RT_RR;
+		s += 3;
+	}
+
+	prio = strtol(s, &end, 10);
+	if(end == s || prio < INT_MIN || prio > INT_MAX)
+		goto bad;
+
+	cpu = MIDI_RT_ANYCPU;
+	if(*end == '@') {
+		s = end + 1;
+		cpu = strtol(s, &end, 10);
+		if(end == s || cpu < 0 || cpu > INT_MAX)
+			goto bad;
+	}
+	if(*end != 0)
+		goto bad;
+
+	return midi_rt_setup(policy, (int) prio, (int) cpu);
+
+bad:
+	fprintf(stderr, "Bad %s, expected [fifo:|rr:]<priority>[@<cpu>]\n",
+	    MIDI_RT_ENV);
+	return EINVAL;
+}
+
+
+int
+midi_rt_setup(int policy, int prio, int cpu)
+{
+	int	ret;
+
+	if(policy != MIDI_RT_FIFO && policy != MIDI_RT_RR)
+		return EINVAL;
+
+	if(cpu < MIDI_RT_ANYCPU)
+		return EINVAL;
+
+#ifdef __linux__
+	/* A cpu_set_t only has room for so many. */
+	if(cpu >= CPU_SETSIZE) {
+		fprintf(stderr, "Cpu %d out of range\n", cpu);
+		return ERANGE;
+	}
+#endif
+
+#ifndef __APPLE__
+	if(prio < sched_get_priority_min(policy == MIDI_RT_RR ? SCHED_RR :
+	    SCHED_FIFO) || prio > sched_get_priority_max(policy ==
+	    MIDI_RT_RR ? SCHED_RR : SCHED_FIFO)) {
+		fprintf(stderr, "Realtime priority %d out of range\n", prio);
+		return ERANGE;
+	}
+#endif
+
+	rt_policy = policy;
+	rt_prio = prio;
+	rt_cpu = cpu;
+	midi_rt_on = 1;
+
+#ifdef __GLIBC__
+	/* Keep what is freed, so that the next allocation doesn't have to
+	 * map (and fault in) new pages. */
+	(void) mallopt(M_TRIM_THRESHOLD, -1);
+	(void) mallopt(M_MMAP_MAX, 0);
+#endif
+
+	/* NOTE: Needs RLIMIT_MEMLOCK or privileges, and isn't there on OS X.
+	 * The threads still get their policy, only page faults can't be
+	 * ruled out. */
+	ret = 0;
+#ifndef __APPLE__
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		ret = errno;
+		fprintf(stderr, "Can't lock memory: %s\n", strerror(ret));
+	}
+#endif
+
+	return ret;
+}
+
+
+void
+_midi_rt_stack(void)
+{
+	/* Grows the stack to MIDI_RT_STACKSIZ now rather than on the first
+	 * deep call. */
+
+	volatile unsigned char	buf[MIDI_RT_STACKSIZ];
+	long			pagesiz;
+	size_t			i;
+
+	pagesiz = sysconf(_SC_PAGESIZE);
+	if(pagesiz <= 0)
+		pagesiz = 4096;
+
+	for(i = 0; i < sizeof(buf); i += pagesiz)
+		buf[i] = 0;
+}
+
+
+int
+midi_rt_thread(const char *name)
+{
+#ifdef __APPLE__
+	thread_time_constraint_policy_data_t	pol;
+	mach_timebase_info_data_t		tb;
+	kern_return_t				kret;
+#else
+	struct sched_param			sp;
+#ifdef __linux__
+	cpu_set_t				cpus;
+#endif
+#endif
+	int					ret;
+
+	if(!midi_rt_on)
+		return 0;
+
+	_midi_rt_stack();
+
+	ret = 0;
+
+#ifdef __APPLE__
+	/* Aperiodic: the writer and the clock wake up when something is due,
+	 * then have to be done within the constraint. */
+	(void) mach_timebase_info(&tb);
+	pol.period = 0;
+	pol.computation = MIDI_RT_COMPUTATION_NS * tb.denom / tb.numer;
+	pol.constraint = MIDI_RT_CONSTRAINT_NS * tb.denom / tb.numer;
+	pol.preemptible = 1;
+
+	kret = thread_policy_set(pthread_mach_thread_np(pthread_self()),
+	    THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t) &pol,
+	    THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+	if(kret != KERN_SUCCESS) {
+		fprintf(stderr, "Can't make %s thread realtime: %s\n", name,
+		    mach_error_string(kret));
+		ret = EPERM;
+	}
+
+	if(rt_cpu != MIDI_RT_ANYCPU) {
+		fprintf(stderr, "Can't pin %s thread to a cpu on this"
+		    " system\n", name);
+	}
+#else
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = rt_prio;
+
+	ret = pthread_setschedparam(pthread_self(), rt_policy == MIDI_RT_RR ?
+	    SCHED_RR : SCHED_FIFO, &sp);
+	if(ret != 0) {
+		fprintf(stderr, "Can't make %s thread realtime: %s\n", name,
+		    strerror(ret));
+	}
+
+#ifdef __linux__
+	if(rt_cpu != MIDI_RT_ANYCPU) {
+		CPU_ZERO(&cpus);
+		CPU_SET(rt_cpu, &cpus);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+		    &cpus) != 0) {
+			fprintf(stderr, "Can't pin %s thread to cpu %d\n",
+			    name, rt_cpu);
+		}
+	}
+#endif
+#endif
+
+	return ret;
+}
+
+
+void
+midi_rt_prefault(void *buf, size_t siz)
+{
+	volatile unsigned char	*p;
+	long			pagesiz;
+	size_t			i;
+
+	if(!midi_rt_on || buf == NULL)
+		return;
+
+	pagesiz = sysconf(_SC_PAGESIZE);
+	if(pagesiz <= 0)
+		pagesiz = 4096;
+
+	/* Writing is what maps a page in, reading may only map the shared
+	 * zero page. */
+	p = (volatile unsigned char *) buf;
+	for(i = 0; i < siz; i += pagesiz)
+		p[i] = p[i];
+	if(siz > 0)
+		p[siz - 1] = p[siz - 1];
+}
@@ -0,0 +1,50 @@
+#ifndef MIDI_RT_H
+#define MIDI_RT_H
+
+#include <stddef.h>
+
+/*
+ * Realtime mode for the threads that send and receive.
+ *
+ * Off unless MIDI_RT_ENV is set, to "[fifo:|rr:]<priority>[@<cpu>]", eg.
+ * "70" or "rr:80@2". Memory is then locked, so that nothing is paged out
+ * or faulted in while a thread is on time, and each such thread runs
+ * with a realtime policy, pinned to the cpu if one is given.
+ *
+ * On OS X threads get the time constraint policy instead, which takes no
+ * priority, and can't be pinned.
+ */
+
+#define MIDI_RT_ENV		"MIDISYSEX_RT"
+
+#define MIDI_RT_FIFO		0
+#define MIDI_RT_RR		1
+
+#define MIDI_RT_ANYCPU		-1
+
+/* Stack each realtime thread touches when it starts. Less than the
+ * smallest default stack, 512KB on OS X. */
+#define MIDI_RT_STACKSIZ	(128 * 1024)
+
+/* Time constraint policy: how long a wakeup takes at most, and by when it
+ * must be done. */
+#define MIDI_RT_COMPUTATION_NS	(500 * 1000)
+#define MIDI_RT_CONSTRAINT_NS	(2 * 1000 * 1000)
+
+extern int midi_rt_on;
+
+/* NOTE: Call from the main thread before starting any others, and before
+ * allocating what they use. midi_rt_init() reads MIDI_RT_ENV,
+ * midi_rt_setup() is for programs that configure it themselves. */
+int midi_rt_init(void);
+int midi_rt_setup(int, int, int);
+
+/* Called by each thread that has to be on time when it starts. Does
+ * nothing when realtime mode is off. */
+int midi_rt_thread(const char *);
+
+/* Touches every page of a buffer allocated while realtime mode is on, so
+ * that the first message doesn't wait for them to be mapped in. */
+void midi_rt_prefault(void *, size_t);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef MIDI_RUNSTAT_H
+#define MIDI_RUNSTAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MIDI_RUNSTAT_MAXDEST	32
+
+/* How often the status byte is sent again even if it hasn't changed, so
+ * that a receiver that missed it (plugged in late, dropped a byte) picks
+ * up the stream again. */
+#define MIDI_RUNSTAT_REFRESH_MS	500
+
+/* Running status of every destination. The last slot is for messages that
+ * go to all destinations. */
+typedef struct midi_runstat {
+	int		rs_status[MIDI_RUNSTAT_MAXDEST + 1];
+	uint64_t	rs_sent[MIDI_RUNSTAT_MAXDEST + 1];
+	uint64_t	rs_refresh;	/* ns, 0 means never */
+	uint64_t	rs_saved;	/* Status bytes left out */
+} midi_runstat_t;
+
+void midi_runstat_init(midi_runstat_t *, uint64_t);
+size_t midi_runstat_skip(midi_runstat_t *, int, uint64_t, unsigned char *,
+	size_t);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Timer wheel for messages that should go out at a later time.
+ *
+ * Adding and expiring a message is O(1) (not counting the cascade from
+ * the second level to the first, which every message goes through at most
+ * once), no matter how many messages are waiting.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "midi_sched.h"
+
+void _midi_sched_append(midi_sched_slot_t *, midi_queue_ent_t *);
+void _midi_sched_place(midi_sched_t *, midi_queue_ent_t *);
+void _midi_sched_cascade(midi_sched_t *, midi_sched_slot_t *);
+void _midi_sched_freeslot(midi_sched_slot_t *);
+
+
+int
+midi_sched_init(midi_sched_t *ms, uint64_t now)
+{
+	if(ms == NULL)
+		return EINVAL;
+
+	memset(ms, 0, sizeof(midi_sched_t));
+	ms->ms_tick = now / MIDI_SCHED_TICK_NS;
+
+	return 0;
+}
+
+
+int
+midi_sched_uninit(midi_sched_t *ms)
+{
+	int	i;
+
+	if(ms == NULL)
+		return EINVAL;
+
+	for(i = 0; i < MIDI_SCHED_L0_SLOTS; ++i)
+		_midi_sched_freeslot(&ms->ms_l0[i]);
+	for(i = 0; i < MIDI_SCHED_L1_SLOTS; ++i)
+		_midi_sched_freeslot(&ms->ms_l1[i]);
+	_midi_sched_freeslot(&ms->ms_overflow);
+
+	ms->ms_cnt = 0;
+
+	return 0;
+}
+
+
+int
+midi_sched_add(midi_sched_t *ms, midi_queue_ent_t *ent)
+{
+	if(ms == NULL || ent == NULL)
+		return EINVAL;
+
+	_midi_sched_place(ms, ent);
+	++ms->ms_cnt;
+
+	return 0;
+}
+
+
+int
+midi_sched_expire(midi_sched_t *ms, uint64_t now, midi_queue_t *due)
+{
+	uint64_t		tick;
+	midi_sched_slot_t	*slot;
+	midi_queue_ent_t	*ent;
+	midi_queue_ent_t	*next;
+	int			ret;
+
+	if(ms == NULL || due == NULL)
+		return EINVAL;
+
+	tick = now / MIDI_SCHED_TICK_NS;
+
+	while(ms->ms_tick <= tick) {
+
+		if(ms->ms_cnt == 0) {
+			/* Nothing to walk through. */
+			ms->ms_tick = tick + 1;
+			break;
+		}
+
+		slot = &ms->ms_l0[ms->ms_tick & (MIDI_SCHED_L0_SLOTS - 1)];
+		for(ent = slot->ss_first; ent != NULL; ent = next) {
+			next = ent->me_next;
+			ret = midi_queue_putent(due, ent);
+			if(ret != 0) {
+				fprintf(stderr, "Can't add MIDI message: %s\n",
+				    strerror(ret));
+				free(ent);
+			}
+			--ms->ms_cnt;
+		}
+		slot->ss_first = slot->ss_last = NULL;
+
+		++ms->ms_tick;
+
+		/* Start of a new turn of the first level: bring down what's
+		 * due during it from the second level (and the overflow list
+		 * when the second level has turned too). */
+		if((ms->ms_tick & (MIDI_SCHED_L0_SLOTS - 1)) == 0) {
+			if(((ms->ms_tick >> MIDI_SCHED_L0_BITS) &
+			    (MIDI_SCHED_L1_SLOTS - 1)) == 0)
+				_midi_sched_cascade(ms, &ms->ms_overflow);
+
+			_midi_sched_cascade(ms,
+			    &ms->ms_l1[(ms->ms_tick >> MIDI_SCHED_L0_BITS) &
+			    (MIDI_SCHED_L1_SLOTS - 1)]);
+		}
+	}
+
+	return 0;
+}
+
+
+uint64_t
+midi_sched_next(midi_sched_t *ms)
+{
+	uint64_t	tick;
+
+	if(ms == NULL || ms->ms_cnt == 0)
+		return 0;
+
+	for(tick = ms->ms_tick; tick < ms->ms_tick + MIDI_SCHED_L0_SLOTS;
+	    ++tick) {
+		if(ms->ms_l0[tick & (MIDI_SCHED_L0_SLOTS - 1)].ss_first)
+			return tick * MIDI_SCHED_TICK_NS;
+
+		/* Past the end of this turn only the cascade can bring
+		 * anything into the first level. */
+		if(((tick + 1) & (MIDI_SCHED_L0_SLOTS - 1)) == 0)
+			return (tick + 1) * MIDI_SCHED_TICK_NS;
+	}
+
+	return tick * MIDI_SCHED_TICK_NS;
+}
+
+
+void
+_midi_sched_place(midi_sched_t *ms, midi_queue_ent_t *ent)
+{
+	uint64_t	tick;
+	uint64_t	delta;
+
+	tick = ent->me_time / MIDI_SCHED_TICK_NS;
+
+	/* Overdue messages go out on the next expiry. */
+	if(tick < ms->ms_tick)
+		tick = ms->ms_tick;
+
+	delta = tick - ms->ms_tick;
+
+	if(delta < MIDI_SCHED_L0_SLOTS - (ms->ms_tick &
+	    (MIDI_SCHED_L0_SLOTS - 1))) {
+		/* Due during the current turn of the first level. */
+		_midi_sched_append(
+		    &ms->ms_l0[tick & (MIDI_SCHED_L0_SLOTS - 1)], ent);
+	} else
+	if((tick >> MIDI_SCHED_L0_BITS) - (ms->ms_tick >> MIDI_SCHED_L0_BITS)
+	    < MIDI_SCHED_L1_SLOTS) {
+		_midi_sched_append(&ms->ms_l1[(tick >> MIDI_SCHED_L0_BITS) &
+		    (MIDI_SCHED_L1_SLOTS - 1)], ent);
+	} else
+		_midi_sched_append(&ms->ms_overflow, ent);
+}
+
+
+void
+_midi_sched_cascade(midi_sched_t *ms, midi_sched_slot_t *slot)
+{
+	midi_queue_ent_t	*ent;
+	midi_queue_ent_t	*next;
+
+	ent = slot->ss_first;
+	slot->ss_first = slot->ss_last = NULL;
+
+	for(; ent != NULL; ent = next) {
+		next = ent->me_next;
+		ent->me_next = NULL;
+		_midi_sched_place(ms, ent);
+	}
+}
+
+
+void
+_midi_sched_append(midi_sched_slot_t *slot, midi_queue_ent_t *ent)
+{
+	/* Appending keeps messages due in the same tick in the order they
+	 * were added. */
+
+	ent->me_next = NULL;
+
+	if(slot->ss_first == NULL) {
+		slot->ss_first = slot->ss_last = ent;
+	} else {
+		slot->ss_last->me_next = ent;
+		slot->ss_last = ent;
+	}
+}
+
+
+void
+_midi_sched_freeslot(midi_sched_slot_t *slot)
+{
+	midi_queue_ent_t	*ent;
+	midi_queue_ent_t	*next;
+
+	for(ent = slot->ss_first; ent != NULL; ent = next) {
+		next = ent->me_next;
+		free(ent);
+	}
+
+	slot->ss_first = slot->ss_last = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef MIDI_SCHED_H
+#define MIDI_SCHED_H
+
+#include <stdint.h>
+#include "midi_queue.h"
+
+/* Two level timer wheel. The first level has one slot per tick, the
+ * second one slot per turn of the first. Anything further out than the
+ * second level reaches waits on an overflow list. */
+#define MIDI_SCHED_TICK_NS	1000000ULL	/* 1ms */
+#define MIDI_SCHED_L0_BITS	8
+#define MIDI_SCHED_L1_BITS	6
+#define MIDI_SCHED_L0_SLOTS	(1 << MIDI_SCHED_L0_BITS)
+#define MIDI_SCHED_L1_SLOTS	(1 << MIDI_SCHED_L1_BITS)
+
+typedef struct midi_sched_slot {
+	midi_queue_ent_t	*ss_first;
+	midi_queue_ent_t	*ss_last;
+} midi_sched_slot_t;
+
+typedef struct midi_sched {
+	uint64_t		ms_tick;	/* Next tick to expire */
+	int			ms_cnt;
+	midi_sched_slot_t	ms_l0[MIDI_SCHED_L0_SLOTS];
+	midi_sched_slot_t	ms_l1[MIDI_SCHED_L1_SLOTS];
+	midi_sched_slot_t	ms_overflow;
+} midi_sched_t;
+
+/* NOTE: The scheduler has no lock of its own; it's meant to be owned by a
+ * single thread. */
+int midi_sched_init(midi_sched_t *, uint64_t);
+int midi_sched_uninit(midi_sched_t *);
+
+/* Takes ownership of an entry taken off a queue, which is due at its
+ * me_time. */
+int midi_sched_add(midi_sched_t *, midi_queue_ent_t *);
+
+/* Moves all messages due at or before the given time onto the queue, in
+ * order of their due time. */
+int midi_sched_expire(midi_sched_t *, uint64_t, midi_queue_t *);
+
+/* Returns the time the next message may be due, or 0 if there are none. */
+uint64_t midi_sched_next(midi_sched_t *);
+
+#endif
@@ -0,0 +1,406 @@
+/*
+ * Sessions, the library's way in.
+ *
+ * Requests to a device are answered in the order they were sent and
+ * replies are only told apart by how they start, so a session does one
+ * request at a time. Callers don't have to wait for that: requests are
+ * put on a list, and the session's thread goes through it and calls each
+ * request's callback when it's done.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "midi_session.h"
+#include "midi_queue.h"
+#include "midi_osx.h"
+#include "midi_writer.h"
+#include "midi_trace.h"
+#include "midi_rt.h"
+
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int session_isopen = 0;
+
+/* What a synchronous request waits on. */
+typedef struct midi_session_wait {
+	pthread_mutex_t		sw_mutex;
+	pthread_cond_t		sw_cond;
+	int			sw_done;
+	int			sw_err;
+	unsigned char		*sw_resp;
+	size_t			sw_respsiz;
+} midi_session_wait_t;
+
+void *_midi_session_thread(void *);
+void _midi_session_wakeup(void *, int, unsigned char *, size_t);
+
+
+int
+midi_session_open(midi_session_t **res, midi_dev_t *dev,
+	midi_xact_errfn_t iserr)
+{
+	midi_session_t	*ms;
+	int		ret;
+	int		mutex_inited;
+	int		cond_inited;
+	int		osx_inited;
+	int		writer_started;
+
+	if(res == NULL)
+		return EINVAL;
+
+	*res = NULL;
+	mutex_inited = 0;
+	cond_inited = 0;
+	osx_inited = 0;
+	writer_started = 0;
+
+	ret = pthread_mutex_lock(&session_mutex);
+	if(ret != 0)
+		return ret;
+	if(session_isopen) {
+		(void) pthread_mutex_unlock(&session_mutex);
+		return EBUSY;
+	}
+	session_isopen = 1;
+	(void) pthread_mutex_unlock(&session_mutex);
+
+	ms = calloc(1, sizeof(midi_session_t));
+	if(ms == NULL) {
+		ret = ENOMEM;
+		goto fail;
+	}
+
+	if(dev) {
+		ms->ms_dev = *dev;
+		midi_osx_select(dev->md_srcuid, dev->md_destuid);
+	} else {
+		ms->ms_dev.md_src = MIDI_EP_ANY;
+		ms->ms_dev.md_dest = MIDI_EP_ANY;
+		midi_osx_select(0, 0);
+	}
+
+	ret = pthread_mutex_init(&ms->ms_mutex, NULL);
+	if(ret != 0)
+		goto fail;
+	mutex_inited = 1;
+
+	ret = pthread_cond_init(&ms->ms_cond, NULL);
+	if(ret != 0)
+		goto fail;
+	cond_inited = 1;
+
+	/* Before any other thread starts. */
+	(void) midi_trace_init();
+	(void) midi_rt_init();
+
+	ret = midi_queue_init(&midi_inq);
+	if(ret == 0)
+		ret = midi_queue_setinput(midi_inq, "MIDI in");
+	if(ret != 0)
+		goto fail;
+
+	ret = midi_queue_init(&midi_outq);
+	if(ret != 0)
+		goto fail;
+
+	ret = midi_osx_init();
+	if(ret != 0) {
+		fprintf(stderr, "Can't initialize system MIDI.\n");
+		goto fail;
+	}
+	osx_inited = 1;
+
+	if(dev)
+		(void) midi_dev_resolve(&ms->ms_dev);
+
+	ret = midi_writer_start(&ms->ms_writer_thrd);
+	if(ret != 0)
+		goto fail;
+	writer_started = 1;
+
+	ret = midi_xact_init(&ms->ms_xact, midi_inq, ms->ms_dev.md_dest,
+	    iserr);
+	if(ret != 0)
+		goto fail;
+
+	ret = pthread_create(&ms->ms_thrd, NULL, _midi_session_thread, ms);
+	if(ret != 0) {
+		fprintf(stderr, "Can't start session thread: %s\n",
+		    strerror(ret));
+		goto fail;
+	}
+
+	*res = ms;
+	return 0;
+
+fail:
+	if(writer_started)
+		(void) midi_writer_stop(&ms->ms_writer_thrd);
+	if(osx_inited)
+		(void) midi_osx_uninit();
+	if(midi_inq)
+		(void) midi_queue_uninit(&midi_inq);
+	if(midi_outq)
+		(void) midi_queue_uninit(&midi_outq);
+	if(cond_inited)
+		(void) pthread_cond_destroy(&ms->ms_cond);
+	if(mutex_inited)
+		(void) pthread_mutex_destroy(&ms->ms_mutex);
+	free(ms);
+
+	(void) pthread_mutex_lock(&session_mutex);
+	session_isopen = 0;
+	(void) pthread_mutex_unlock(&session_mutex);
+
+	return ret;
+}
+
+
+int
+midi_session_close(midi_session_t **msp)
+{
+	midi_session_t	*ms;
+	int		ret;
+
+	if(msp == NULL || *msp == NULL)
+		return EINVAL;
+
+	ms = *msp;
+
+	/* The thread goes through what's still on the list before it
+	 * exits. */
+	ret = pthread_mutex_lock(&ms->ms_mutex);
+	if(ret != 0)
+		return ret;
+	ms->ms_closing = 1;
+	(void) pthread_cond_broadcast(&ms->ms_cond);
+	(void) pthread_mutex_unlock(&ms->ms_mutex);
+
+	ret = pthread_join(ms->ms_thrd, NULL);
+	if(ret != 0) {
+		fprintf(stderr, "Can't join session thread: %s\n",
+		    strerror(ret));
+		return ret;
+	}
+
+	(void) midi_writer_stop(&ms->ms_writer_thrd);
+
+	ret = midi_osx_uninit();
+	if(ret != 0)
+		fprintf(stderr, "Can't uninitialize system MIDI.\n");
+
+	(void) midi_queue_uninit(&midi_inq);
+	(void) midi_queue_uninit(&midi_outq);
+
+	/* Everything has stopped, nothing records anymore. */
+	(void) midi_trace_write();
+
+	(void) pthread_cond_destroy(&ms->ms_cond);
+	(void) pthread_mutex_destroy(&ms->ms_mutex);
+	free(ms);
+	*msp = NULL;
+
+	(void) pthread_mutex_lock(&session_mutex);
+	session_isopen = 0;
+	(void) pthread_mutex_unlock(&session_mutex);
+
+	return 0;
+}
+
+
+int
+midi_session_submit(midi_session_t *ms, unsigned char *req, size_t reqsiz,
+	size_t matchsiz, size_t expsiz, midi_session_cb_t cb, void *arg)
+{
+	midi_session_req_t	*sr;
+	int			ret;
+
+	if(ms == NULL || req == NULL || reqsiz == 0 || matchsiz > reqsiz ||
+	    cb == NULL)
+		return EINVAL;
+
+	sr = calloc(1, sizeof(midi_session_req_t));
+	if(sr == NULL)
+		return ENOMEM;
+
+	sr->sr_req = malloc(reqsiz);
+	if(sr->sr_req == NULL) {
+		free(sr);
+		return ENOMEM;
+	}
+	memcpy(sr->sr_req, req, reqsiz);
+	sr->sr_reqsiz = reqsiz;
+	sr->sr_matchsiz = matchsiz;
+	sr->sr_expsiz = expsiz;
+	sr->sr_cb = cb;
+	sr->sr_arg = arg;
+
+	ret = pthread_mutex_lock(&ms->ms_mutex);
+	if(ret != 0) {
+		free(sr->sr_req);
+		free(sr);
+		return ret;
+	}
+
+	if(ms->ms_closing) {
+		(void) pthread_mutex_unlock(&ms->ms_mutex);
+		free(sr->sr_req);
+		free(sr);
+		return ESHUTDOWN;
+	}
+
+	if(ms->ms_last)
+		ms->ms_last->sr_next = sr;
+	else
+		ms->ms_first = sr;
+	ms->ms_last = sr;
+	++ms->ms_pending;
+
+	(void) pthread_cond_broadcast(&ms->ms_cond);
+	(void) pthread_mutex_unlock(&ms->ms_mutex);
+
+	return 0;
+}
+
+
+int
+midi_session_request(midi_session_t *ms, unsigned char *req, size_t reqsiz,
+	size_t matchsiz, size_t expsiz, unsigned char **resp, size_t *respsiz)
+{
+	midi_session_wait_t	sw;
+	int			ret;
+
+	if(resp == NULL || respsiz == NULL)
+		return EINVAL;
+
+	*resp = NULL;
+	*respsiz = 0;
+
+	memset(&sw, 0, sizeof(midi_session_wait_t));
+	ret = pthread_mutex_init(&sw.sw_mutex, NULL);
+	if(ret != 0)
+		return ret;
+	ret = pthread_cond_init(&sw.sw_cond, NULL);
+	if(ret != 0) {
+		(void) pthread_mutex_destroy(&sw.sw_mutex);
+		return ret;
+	}
+
+	ret = midi_session_submit(ms, req, reqsiz, matchsiz, expsiz,
+	    _midi_session_wakeup, &sw);
+	if(ret == 0) {
+		(void) pthread_mutex_lock(&sw.sw_mutex);
+		while(!sw.sw_done)
+			(void) pthread_cond_wait(&sw.sw_cond, &sw.sw_mutex);
+		(void) pthread_mutex_unlock(&sw.sw_mutex);
+
+		ret = sw.sw_err;
+		*resp = sw.sw_resp;
+		*respsiz = sw.sw_respsiz;
+	}
+
+	(void) pthread_cond_destroy(&sw.sw_cond);
+	(void) pthread_mutex_destroy(&sw.sw_mutex);
+
+	return ret;
+}
+
+
+int
+midi_session_drain(midi_session_t *ms)
+{
+	int	ret;
+
+	if(ms == NULL)
+		return EINVAL;
+
+	ret = pthread_mutex_lock(&ms->ms_mutex);
+	if(ret != 0)
+		return ret;
+	while(ms->ms_pending > 0)
+		(void) pthread_cond_wait(&ms->ms_cond, &ms->ms_mutex);
+	(void) pthread_mutex_unlock(&ms->ms_mutex);
+
+	return 0;
+}
+
+
+void *
+_midi_session_thread(void *arg)
+{
+	midi_session_t		*ms;
+	midi_session_req_t	*sr;
+	unsigned char		*resp;
+	size_t			respsiz;
+	int			ret;
+
+	ms = (midi_session_t *) arg;
+
+	midi_trace_thread("session");
+
+	while(1) {
+		ret = pthread_mutex_lock(&ms->ms_mutex);
+		if(ret != 0) {
+			fprintf(stderr, "Can't lock session: %s\n"
+			    " This is bad, exiting\n", strerror(ret));
+			exit(-1);
+		}
+
+		while(ms->ms_first == NULL && !ms->ms_closing)
+			(void) pthread_cond_wait(&ms->ms_cond, &ms->ms_mutex);
+
+		sr = ms->ms_first;
+		if(sr) {
+			ms->ms_first = sr->sr_next;
+			if(ms->ms_first == NULL)
+				ms->ms_last = NULL;
+		}
+
+		(void) pthread_mutex_unlock(&ms->ms_mutex);
+
+		if(sr == NULL)
+			break;
+
+		/* Only this thread uses the transaction, so its round trip
+		 * estimate carries over from one request to the next. */
+		ret = midi_xact_request(&ms->ms_xact, sr->sr_req,
+		    sr->sr_reqsiz, sr->sr_matchsiz, sr->sr_expsiz, &resp,
+		    &respsiz);
+		if(ret != 0) {
+			resp = NULL;
+			respsiz = 0;
+		}
+
+		sr->sr_cb(sr->sr_arg, ret, resp, respsiz);
+
+		free(sr->sr_req);
+		free(sr);
+
+		(void) pthread_mutex_lock(&ms->ms_mutex);
+		--ms->ms_pending;
+		(void) pthread_cond_broadcast(&ms->ms_cond);
+		(void) pthread_mutex_unlock(&ms->ms_mutex);
+	}
+
+	return (void *) 0;
+}
+
+
+void
+_midi_session_wakeup(void *arg, int err, unsigned char *resp,
+	size_t respsiz)
+{
+	midi_session_wait_t	*sw;
+
+	sw = (midi_session_wait_t *) arg;
+
+	(void) pthread_mutex_lock(&sw->sw_mutex);
+	sw->sw_err = err;
+	sw->sw_resp = resp;
+	sw->sw_respsiz = respsiz;
+	sw->sw_done = 1;
+	(void) pthread_cond_signal(&sw->sw_cond);
+	(void) pthread_mutex_unlock(&sw->sw_mutex);
+}
@@ -0,0 +1,72 @@
+#ifndef MIDI_SESSION_H
+#define MIDI_SESSION_H
+
+#include <pthread.h>
+#include "midi_discover.h"
+#include "midi_xact.h"
+
+/*
+ * libmidisysex: talking to a device from another program.
+ *
+ * A session starts system MIDI and the writer thread, and does the
+ * requests submitted to it one after the other on a thread of its own.
+ * As system MIDI and the queues are per process, only one session can be
+ * open at a time.
+ */
+
+/* Called on the session's thread when a request is done. err is 0 or an
+ * errno; on success resp is the reply payload (without F0 and F7), which
+ * the callback has to free(). */
+typedef void (*midi_session_cb_t)(void *, int, unsigned char *, size_t);
+
+typedef struct midi_session_req {
+	unsigned char		*sr_req;	/* Copy of the request */
+	size_t			sr_reqsiz;
+	size_t			sr_matchsiz;
+	size_t			sr_expsiz;
+	midi_session_cb_t	sr_cb;
+	void			*sr_arg;
+	struct midi_session_req	*sr_next;
+} midi_session_req_t;
+
+typedef struct midi_session {
+	midi_dev_t		ms_dev;
+	midi_xact_t		ms_xact;
+
+	pthread_t		ms_writer_thrd;
+	pthread_t		ms_thrd;
+
+	pthread_mutex_t		ms_mutex;
+	pthread_cond_t		ms_cond;	/* Request submitted or
+						 * closing */
+	midi_session_req_t	*ms_first;
+	midi_session_req_t	*ms_last;
+	int			ms_pending;
+	int			ms_closing;
+} midi_session_t;
+
+/* Talks to dev if it's given (see midi_devcache_load()), to all endpoints
+ * otherwise. iserr, which may be NULL, says whether a reply means the
+ * device rejected the request. To keep unrelated traffic out, call
+ * midi_osx_setfilter() first. */
+int midi_session_open(midi_session_t **, midi_dev_t *, midi_xact_errfn_t);
+
+/* Waits for the submitted requests to be done. */
+int midi_session_close(midi_session_t **);
+
+/* Sends a sysex request and calls cb with the reply that starts with the
+ * same matchsiz bytes, see midi_xact_request(). The request is copied, so
+ * it can be freed as soon as this returns.
+ * NOTE: Don't call midi_session_request() or midi_session_close() from the
+ * callback, they would wait for the callback itself. */
+int midi_session_submit(midi_session_t *, unsigned char *, size_t, size_t,
+	size_t, midi_session_cb_t, void *);
+
+/* Same, but waits for the reply, which the caller has to free(). */
+int midi_session_request(midi_session_t *, unsigned char *, size_t, size_t,
+	size_t, unsigned char **, size_t *);
+
+/* Waits until every request submitted so far is done. */
+int midi_session_drain(midi_session_t *);
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "midi_time.h"
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+
+static mach_timebase_info_data_t midi_time_tb;
+#endif
+
+
+uint64_t
+midi_time_now(void)
+{
+#ifdef __APPLE__
+	/* CoreMIDI timestamps are in host time, so use the same clock. */
+	if(midi_time_tb.denom == 0)
+		(void) mach_timebase_info(&midi_time_tb);
+
+	return mach_absolute_time() * midi_time_tb.numer / midi_time_tb.denom;
+#else
+	struct timespec	ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * MIDI_TIME_NSEC_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+
+int
+midi_time_sleepuntil(uint64_t when)
+{
+	/* Sleeping until an absolute time instead of for an interval means
+	 * that time spent between wakeups doesn't add up. */
+
+#ifdef __APPLE__
+	if(midi_time_tb.denom == 0)
+		(void) mach_timebase_info(&midi_time_tb);
+
+	if(mach_wait_until(when * midi_time_tb.denom / midi_time_tb.numer)
+	    != 0)
+		return EINTR;
+
+	return 0;
+#else
+	struct timespec	ts;
+	int		ret;
+
+	ts.tv_sec = when / MIDI_TIME_NSEC_PER_SEC;
+	ts.tv_nsec = when % MIDI_TIME_NSEC_PER_SEC;
+
+	do {
+		ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+		    NULL);
+	} while(ret == EINTR);
+
+	return ret;
+#endif
+}
+
+
+void
+midi_latstat_init(midi_latstat_t *ls)
+{
+	memset(ls, 0, sizeof(midi_latstat_t));
+}
+
+
+void
+midi_latstat_add(midi_latstat_t *ls, int64_t val)
+{
+	/* Welford's method, so the variance doesn't need the samples. */
+
+	double	delta;
+
+	if(ls->ls_cnt == 0 || val < ls->ls_min)
+		ls->ls_min = val;
+	if(ls->ls_cnt == 0 || val > ls->ls_max)
+		ls->ls_max = val;
+
+	++ls->ls_cnt;
+	delta = val - ls->ls_mean;
+	ls->ls_mean += delta / ls->ls_cnt;
+	ls->ls_m2 += delta * (val - ls->ls_mean);
+}
+
+
+double
+midi_latstat_stddev(midi_latstat_t *ls)
+{
+	if(ls->ls_cnt < 2)
+		return 0;
+
+	return sqrt(ls->ls_m2 / (ls->ls_cnt - 1));
+}
+
+
+void
+midi_latstat_print(FILE *f, const char *name, midi_latstat_t *ls)
+{
+	/* Values are in nanoseconds, printed in microseconds. */
+
+	if(ls->ls_cnt == 0) {
+		fprintf(f, "%s: no samples\n", name);
+		return;
+	}
+
+	fprintf(f, "%s: n=%llu min=%.1fus mean=%.1fus max=%.1fus"
+	    " stddev=%.1fus\n", name, (unsigned long long) ls->ls_cnt,
+	    ls->ls_min / 1000.0, ls->ls_mean / 1000.0, ls->ls_max / 1000.0,
+	    midi_latstat_stddev(ls) / 1000.0);
+}
@@ -0,0 +1,32 @@
+#ifndef MIDI_TIME_H
+#define MIDI_TIME_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define MIDI_TIME_NSEC_PER_USEC	1000ULL
+#define MIDI_TIME_NSEC_PER_MSEC	1000000ULL
+#define MIDI_TIME_NSEC_PER_SEC	1000000000ULL
+
+/* Monotonic time in nanoseconds. */
+uint64_t midi_time_now(void);
+
+/* Sleeps until the given absolute monotonic time. Returns 0 when the time
+ * has been reached. */
+int midi_time_sleepuntil(uint64_t);
+
+/* Running statistics of a latency, eg. how late a thread woke up. */
+typedef struct midi_latstat {
+	uint64_t	ls_cnt;
+	int64_t		ls_min;
+	int64_t		ls_max;
+	double		ls_mean;
+	double		ls_m2;
+} midi_latstat_t;
+
+void midi_latstat_init(midi_latstat_t *);
+void midi_latstat_add(midi_latstat_t *, int64_t);
+double midi_latstat_stddev(midi_latstat_t *);
+void midi_latstat_print(FILE *, const char *, midi_latstat_t *);
+
+#endif
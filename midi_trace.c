@@ -0,0 +1,441 @@
+/*
+ * Message lifecycle tracing.
+ *
+ * Every thread records events into a buffer of its own, so recording takes
+ * no locks. The buffers are only read at exit, when the events are written
+ * as Chrome trace-event JSON (https://ui.perfetto.dev opens it).
+ *
+ * Each message shows up as a row of spans named after what it was doing:
+ * waiting in the queue, waiting for the wire, being sent, waiting for the
+ * device, being received, decoded and written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "midi_trace.h"
+#include "midi_time.h"
+
+#define _KIND_STAGE	0
+#define _KIND_SPAN	1
+#define _KIND_LINK	2
+
+#define MIDI_TRACE_NAMELEN	32
+
+typedef struct midi_trace_ev {
+	uint64_t	te_ts;
+	uint64_t	te_end;
+	uint64_t	te_id;
+	uint64_t	te_arg;		/* Stage, or reply ID of a link */
+	int		te_kind;
+	const char	*te_name;
+	int		te_tid;
+} midi_trace_ev_t;
+
+typedef struct midi_trace_buf {
+	struct midi_trace_buf	*tb_next;
+	int			tb_tid;
+	char			tb_name[MIDI_TRACE_NAMELEN];
+	int			tb_cnt;
+	int			tb_dropped;
+	midi_trace_ev_t		tb_ev[MIDI_TRACE_BUFSIZ];
+} midi_trace_buf_t;
+
+int midi_trace_on = 0;
+
+static const char *trace_path = NULL;
+static _Atomic(midi_trace_buf_t *) trace_bufs = NULL;
+static atomic_int trace_tidcnt = 0;
+static atomic_uint_fast64_t trace_idcnt = 0;
+static __thread midi_trace_buf_t *trace_mybuf = NULL;
+
+static const char *trace_stagenames[MIDI_TRACE_NSTAGES] = {
+	"queued",		/* ENQUEUE -> DEQUEUE */
+	"waiting for wire",	/* DEQUEUE -> SEND */
+	"sending",		/* SEND -> SENT */
+	"device",		/* SENT -> REPLY_F0 */
+	"receiving",		/* REPLY_F0 -> REPLY_F7 */
+	"decoding",		/* REPLY_F7 -> DECODED */
+	"writing",		/* DECODED -> WRITTEN */
+	"written"
+};
+
+midi_trace_buf_t *_midi_trace_getbuf(void);
+midi_trace_ev_t *_midi_trace_newev(void);
+int _midi_trace_cmp(const void *, const void *);
+int _midi_trace_cmpid(const void *, const void *);
+void _midi_trace_putstr(FILE *, const char *);
+
+
+int
+midi_trace_init(void)
+{
+	trace_path = getenv(MIDI_TRACE_ENV);
+	if(trace_path == NULL || trace_path[0] == 0)
+		return 0;
+
+	midi_trace_on = 1;
+	midi_trace_thread("main");
+
+	return 0;
+}
+
+
+uint64_t
+midi_trace_newid(void)
+{
+	return atomic_fetch_add(&trace_idcnt, 1) + 1;
+}
+
+
+void
+midi_trace_thread(const char *name)
+{
+	/* Names the calling thread in the trace. */
+
+	midi_trace_buf_t	*tb;
+
+	if(!midi_trace_on)
+		return;
+
+	tb = _midi_trace_getbuf();
+	if(tb)
+		snprintf(tb->tb_name, sizeof(tb->tb_name), "%s", name);
+}
+
+
+void
+midi_trace_stage(uint64_t id, int stage, uint64_t ts)
+{
+	/* Message id reached stage at time ts, 0 means now. */
+
+	midi_trace_ev_t	*ev;
+
+	if(id == 0)
+		return;
+
+	ev = _midi_trace_newev();
+	if(ev == NULL)
+		return;
+
+	ev->te_kind = _KIND_STAGE;
+	ev->te_ts = ts ? ts : midi_time_now();
+	ev->te_id = id;
+	ev->te_arg = stage;
+}
+
+
+void
+midi_trace_span(const char *name, uint64_t id, uint64_t start)
+{
+	/* Something this thread did from start until now. name must be a
+	 * string constant. */
+
+	midi_trace_ev_t	*ev;
+
+	ev = _midi_trace_newev();
+	if(ev == NULL)
+		return;
+
+	ev->te_kind = _KIND_SPAN;
+	ev->te_ts = start;
+	ev->te_end = midi_time_now();
+	ev->te_id = id;
+	ev->te_name = name;
+}
+
+
+void
+midi_trace_link(uint64_t reqid, uint64_t replyid)
+{
+	/* The message replyid is the answer to reqid. */
+
+	midi_trace_ev_t	*ev;
+
+	if(!midi_trace_on || reqid == 0 || replyid == 0)
+		return;
+
+	ev = _midi_trace_newev();
+	if(ev == NULL)
+		return;
+
+	ev->te_kind = _KIND_LINK;
+	ev->te_ts = midi_time_now();
+	ev->te_id = reqid;
+	ev->te_arg = replyid;
+}
+
+
+int
+midi_trace_write(void)
+{
+	midi_trace_buf_t	*tb;
+	midi_trace_ev_t		*evs;
+	midi_trace_ev_t		*ev;
+	midi_trace_ev_t		key;
+	uint64_t		link;
+	size_t			linkcnt;
+	size_t			evcnt;
+	size_t			i;
+	size_t			k;
+	uint64_t		base;
+	int			seen;
+	int			dropped;
+	int			first;
+	FILE			*f;
+
+	if(!midi_trace_on)
+		return 0;
+
+	/* Everything in one array, with the times relative to the first
+	 * event. */
+	evcnt = 0;
+	dropped = 0;
+	for(tb = atomic_load(&trace_bufs); tb; tb = tb->tb_next) {
+		evcnt += tb->tb_cnt;
+		dropped += tb->tb_dropped;
+	}
+
+	evs = malloc((evcnt + 1) * sizeof(midi_trace_ev_t));
+	if(evs == NULL)
+		return ENOMEM;
+
+	k = 0;
+	base = UINT64_MAX;
+	for(tb = atomic_load(&trace_bufs); tb; tb = tb->tb_next) {
+		for(i = 0; i < tb->tb_cnt; ++i) {
+			evs[k] = tb->tb_ev[i];
+			evs[k].te_tid = tb->tb_tid;
+			if(evs[k].te_ts < base)
+				base = evs[k].te_ts;
+			++k;
+		}
+	}
+
+	/* Replies become part of their requests. Links sort before
+	 * stages, by reply ID. */
+	for(i = 0; i < evcnt; ++i) {
+		if(evs[i].te_kind == _KIND_LINK) {
+			link = evs[i].te_id;
+			evs[i].te_id = evs[i].te_arg;
+			evs[i].te_arg = link;
+		}
+	}
+	qsort(evs, evcnt, sizeof(midi_trace_ev_t), _midi_trace_cmp);
+	for(linkcnt = 0; linkcnt < evcnt &&
+	    evs[linkcnt].te_kind == _KIND_LINK; ++linkcnt)
+		;
+	for(i = linkcnt; i < evcnt; ++i) {
+		if(evs[i].te_kind != _KIND_STAGE)
+			continue;
+		key.te_kind = _KIND_LINK;
+		key.te_id = evs[i].te_id;
+		key.te_ts = 0;
+		ev = bsearch(&key, evs, linkcnt, sizeof(midi_trace_ev_t),
+		    _midi_trace_cmpid);
+		if(ev)
+			evs[i].te_id = ev->te_arg;
+	}
+	qsort(evs, evcnt, sizeof(midi_trace_ev_t), _midi_trace_cmp);
+
+	f = fopen(trace_path, "w");
+	if(f == NULL) {
+		fprintf(stderr, "Can't open %s: %s\n", trace_path,
+		    strerror(errno));
+		free(evs);
+		return errno;
+	}
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	first = 1;
+
+	for(tb = atomic_load(&trace_bufs); tb; tb = tb->tb_next) {
+		/* Names come from devices, they can have anything in
+		 * them. */
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+		    "\"pid\":1,\"tid\":%d,\"args\":{\"name\":",
+		    first ? "" : ",\n", tb->tb_tid);
+		_midi_trace_putstr(f, tb->tb_name);
+		fprintf(f, "}}");
+		first = 0;
+	}
+
+	seen = 0;
+	for(i = 0; i < evcnt; ++i) {
+		ev = &evs[i];
+
+		if(ev->te_kind == _KIND_SPAN) {
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\","
+			    "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+			    "\"args\":{\"msg\":%llu}}", ev->te_name,
+			    ev->te_tid, (ev->te_ts - base) / 1000.0,
+			    (ev->te_end - ev->te_ts) / 1000.0,
+			    (unsigned long long) ev->te_id);
+			continue;
+		}
+
+		if(ev->te_kind != _KIND_STAGE)
+			continue;
+
+		/* Stages are sorted by message and time. Only the first
+		 * time a message reaches a stage counts (messages that
+		 * wait on the wheel go through the writer twice). */
+		if(i == 0 || evs[i - 1].te_kind != _KIND_STAGE ||
+		    evs[i - 1].te_id != ev->te_id)
+			seen = 0;
+		if(seen & (1 << ev->te_arg))
+			continue;
+		seen |= 1 << ev->te_arg;
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"msg\",\"ph\":\"i\","
+		    "\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+		    "\"args\":{\"msg\":%llu}}",
+		    trace_stagenames[ev->te_arg], ev->te_tid,
+		    (ev->te_ts - base) / 1000.0,
+		    (unsigned long long) ev->te_id);
+
+		/* The span up to the message's next stage. */
+		for(k = i + 1; k < evcnt; ++k) {
+			if(evs[k].te_kind != _KIND_STAGE ||
+			    evs[k].te_id != ev->te_id ||
+			    !(seen & (1 << evs[k].te_arg)))
+				break;
+		}
+		if(k >= evcnt || evs[k].te_kind != _KIND_STAGE ||
+		    evs[k].te_id != ev->te_id)
+			continue;
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"msg\",\"ph\":\"b\","
+		    "\"id\":%llu,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+		    trace_stagenames[ev->te_arg],
+		    (unsigned long long) ev->te_id, ev->te_tid,
+		    (ev->te_ts - base) / 1000.0);
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"msg\",\"ph\":\"e\","
+		    "\"id\":%llu,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+		    trace_stagenames[ev->te_arg],
+		    (unsigned long long) ev->te_id, ev->te_tid,
+		    (evs[k].te_ts - base) / 1000.0);
+	}
+
+	fprintf(f, "\n],\"otherData\":{\"dropped\":%d}}\n", dropped);
+
+	if(fclose(f) != 0) {
+		free(evs);
+		return errno;
+	}
+
+	if(dropped)
+		fprintf(stderr, "Trace buffers were full, %d events dropped\n",
+		    dropped);
+
+	free(evs);
+
+	return 0;
+}
+
+
+midi_trace_buf_t *
+_midi_trace_getbuf(void)
+{
+	/* Every thread gets a buffer the first time it records something.
+	 * Buffers are never freed, the trace is written at exit. */
+
+	midi_trace_buf_t	*tb;
+
+	if(trace_mybuf)
+		return trace_mybuf;
+
+	tb = calloc(1, sizeof(midi_trace_buf_t));
+	if(tb == NULL)
+		return NULL;
+
+	tb->tb_tid = atomic_fetch_add(&trace_tidcnt, 1) + 1;
+	snprintf(tb->tb_name, sizeof(tb->tb_name), "thread %d", tb->tb_tid);
+
+	tb->tb_next = atomic_load(&trace_bufs);
+	while(!atomic_compare_exchange_weak(&trace_bufs, &tb->tb_next, tb))
+		;
+
+	trace_mybuf = tb;
+
+	return tb;
+}
+
+
+midi_trace_ev_t *
+_midi_trace_newev(void)
+{
+	midi_trace_buf_t	*tb;
+
+	tb = _midi_trace_getbuf();
+	if(tb == NULL)
+		return NULL;
+
+	if(tb->tb_cnt >= MIDI_TRACE_BUFSIZ) {
+		++tb->tb_dropped;
+		return NULL;
+	}
+
+	return &tb->tb_ev[tb->tb_cnt++];
+}
+
+
+int
+_midi_trace_cmp(const void *a, const void *b)
+{
+	const midi_trace_ev_t	*ea;
+	const midi_trace_ev_t	*eb;
+
+	/* By kind, then message, then time. */
+
+	ea = (const midi_trace_ev_t *) a;
+	eb = (const midi_trace_ev_t *) b;
+
+	if(ea->te_kind != eb->te_kind)
+		return ea->te_kind == _KIND_LINK ? -1 :
+		    eb->te_kind == _KIND_LINK ? 1 : ea->te_kind - eb->te_kind;
+	if(ea->te_id != eb->te_id)
+		return ea->te_id < eb->te_id ? -1 : 1;
+	if(ea->te_ts != eb->te_ts)
+		return ea->te_ts < eb->te_ts ? -1 : 1;
+	return 0;
+}
+
+
+int
+_midi_trace_cmpid(const void *a, const void *b)
+{
+	/* Finds a link by reply ID, whatever its time. */
+
+	const midi_trace_ev_t	*ea;
+	const midi_trace_ev_t	*eb;
+
+	ea = (const midi_trace_ev_t *) a;
+	eb = (const midi_trace_ev_t *) b;
+
+	if(ea->te_id != eb->te_id)
+		return ea->te_id < eb->te_id ? -1 : 1;
+	return 0;
+}
+
+
+void
+_midi_trace_putstr(FILE *f, const char *str)
+{
+	/* Writes str as a JSON string. */
+
+	const unsigned char	*p;
+
+	putc('"', f);
+	for(p = (const unsigned char *) str; *p; ++p) {
+		if(*p == '"' || *p == '\\')
+			fprintf(f, "\\%c", *p);
+		else
+		if(*p < 0x20 || *p == 0x7F)
+			fprintf(f, "\\u%04x", *p);
+		else
+			putc(*p, f);
+	}
+	putc('"', f);
+}
@@ -0,0 +1,57 @@
+#ifndef MIDI_TRACE_H
+#define MIDI_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Tracing is off unless this names the file to write the trace to. */
+#define MIDI_TRACE_ENV		"MIDISYSEX_TRACE"
+
+/* Events each thread can record. Later ones are dropped and counted. */
+#define MIDI_TRACE_BUFSIZ	65536
+
+/* Where a message is in its life. A reply is part of the life of the
+ * request it answers. */
+#define MIDI_TRACE_ENQUEUE	0	/* Put on a queue */
+#define MIDI_TRACE_DEQUEUE	1	/* Taken off the out queue */
+#define MIDI_TRACE_SEND		2	/* First byte handed to the system */
+#define MIDI_TRACE_SENT		3	/* Last byte handed to the system */
+#define MIDI_TRACE_REPLY_F0	4	/* First byte of the reply in */
+#define MIDI_TRACE_REPLY_F7	5	/* Last byte of the reply in */
+#define MIDI_TRACE_DECODED	6
+#define MIDI_TRACE_WRITTEN	7
+#define MIDI_TRACE_NSTAGES	8
+
+extern int midi_trace_on;
+
+#define MIDI_TRACE_STAGE(id, stage)					\
+	do {								\
+		if(midi_trace_on)					\
+			midi_trace_stage((id), (stage), 0);		\
+	} while(0)
+
+#define MIDI_TRACE_STAGE_AT(id, stage, ts)				\
+	do {								\
+		if(midi_trace_on)					\
+			midi_trace_stage((id), (stage), (ts));		\
+	} while(0)
+
+#define MIDI_TRACE_SPAN(name, id, start)				\
+	do {								\
+		if(midi_trace_on)					\
+			midi_trace_span((name), (id), (start));		\
+	} while(0)
+
+/* NOTE: Call from the main thread before starting any others. */
+int midi_trace_init(void);
+
+/* NOTE: Call from the main thread after all others have stopped. */
+int midi_trace_write(void);
+
+uint64_t midi_trace_newid(void);
+void midi_trace_thread(const char *);
+void midi_trace_stage(uint64_t, int, uint64_t);
+void midi_trace_span(const char *, uint64_t, uint64_t);
+void midi_trace_link(uint64_t, uint64_t);
+
+#endif
@@ -0,0 +1,580 @@
+/*
+ * Universal MIDI Packets.
+ *
+ * Only what MIDI 1.0 devices send and understand is translated: system
+ * messages (MT 1), channel voice (MT 2) and 7 bit sysex (MT 3). The 8 bit
+ * sysex and MIDI 2.0 channel voice packets have no byte stream form; with
+ * MIDI_UMP_ALSA, 8 bit sysex can be made for ports that take packets.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "midi_ump.h"
+#include "midi_queue.h"
+
+/* Words per packet by message type (M2-104-UM, 2.1.4). */
+static const int ump_words[16] = {
+	1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4
+};
+
+void _midi_ump_short(midi_ump_t *, int, int, int, int, int);
+void _midi_ump_sysex(midi_ump_t *, int, int, const unsigned char *, int);
+int _midi_ump_sysex_pos(size_t, size_t, size_t);
+#ifdef MIDI_UMP_ALSA
+void _midi_ump_sysex8(midi_ump_t *, int, int, int, const unsigned char *,
+	int);
+#endif
+
+
+int
+midi_ump_words(const midi_ump_t *ump)
+{
+	return ump_words[MIDI_UMP_MT(ump)];
+}
+
+
+int
+midi_ump_msgtype(const midi_ump_t *ump)
+{
+	if(ump == NULL)
+		return -1;
+
+	switch(MIDI_UMP_MT(ump)) {
+	case MIDI_UMP_MT_SYSTEM:
+		switch(MIDI_UMP_STATUS(ump)) {
+		case 0xF8:
+			return MIDI_MSG_SYSRT_CLOCK;
+		case 0xFA:
+			return MIDI_MSG_SYSRT_START;
+		case 0xFB:
+			return MIDI_MSG_SYSRT_CONTINUE;
+		case 0xFC:
+			return MIDI_MSG_SYSRT_STOP;
+		}
+		return -1;
+
+	case MIDI_UMP_MT_MIDI1:
+		if((MIDI_UMP_STATUS(ump) & 0xF0) == 0xB0)
+			return MIDI_MSG_CHANCC;
+		if((MIDI_UMP_STATUS(ump) & 0xF0) == 0xC0)
+			return MIDI_MSG_CHANPROG;
+		return -1;
+
+	case MIDI_UMP_MT_DATA64:
+		return MIDI_MSG_SYSEX;
+
+	default:
+		return -1;
+	}
+}
+
+
+int
+midi_ump_check(const midi_ump_t *ump, int cnt)
+{
+	int	mt;
+	int	pos;
+	int	i;
+
+	if(ump == NULL || cnt < 1)
+		return EINVAL;
+
+	mt = MIDI_UMP_MT(&ump[0]);
+
+	/* Mixed data sets (MT 5, 0x8 and 0x9) aren't sysex. */
+	if(mt != MIDI_UMP_MT_DATA64 && (mt != MIDI_UMP_MT_DATA128 ||
+	    MIDI_UMP_SYSEX_POS(&ump[0]) > MIDI_UMP_SYSEX_END))
+		return cnt == 1 ? 0 : EINVAL;
+
+	for(i = 0; i < cnt; ++i) {
+		if(MIDI_UMP_MT(&ump[i]) != mt)
+			return EINVAL;
+		if(mt == MIDI_UMP_MT_DATA64 &&
+		    midi_ump_sysex_data(&ump[i], NULL) < 0)
+			return EINVAL;
+
+		pos = MIDI_UMP_SYSEX_POS(&ump[i]);
+		if(cnt == 1 && pos != MIDI_UMP_SYSEX_COMPLETE)
+			return EINVAL;
+		if(cnt > 1 && pos != (i == 0 ? MIDI_UMP_SYSEX_START :
+		    i == cnt - 1 ? MIDI_UMP_SYSEX_END :
+		    MIDI_UMP_SYSEX_CONTINUE))
+			return EINVAL;
+	}
+
+	return 0;
+}
+
+
+void
+_midi_ump_short(midi_ump_t *ump, int mt, int group, int status, int d1,
+	int d2)
+{
+	memset(ump, 0, sizeof(midi_ump_t));
+	ump->mu_w[0] = (uint32_t) mt << 28 | (uint32_t) (group & 0x0F) << 24 |
+	    (uint32_t) status << 16 | (uint32_t) (d1 & 0x7F) << 8 |
+	    (uint32_t) (d2 & 0x7F);
+}
+
+
+void
+_midi_ump_sysex(midi_ump_t *ump, int group, int status,
+	const unsigned char *dat, int cnt)
+{
+	/* The data bytes follow the status and count in the first word and
+	 * fill the second. */
+
+	unsigned char	b[MIDI_UMP_SYSEXSIZ];
+
+	memset(b, 0, sizeof(b));
+	memcpy(b, dat, cnt);
+
+	memset(ump, 0, sizeof(midi_ump_t));
+	ump->mu_w[0] = (uint32_t) MIDI_UMP_MT_DATA64 << 28 |
+	    (uint32_t) (group & 0x0F) << 24 | (uint32_t) status << 20 |
+	    (uint32_t) cnt << 16 | (uint32_t) b[0] << 8 | b[1];
+	ump->mu_w[1] = (uint32_t) b[2] << 24 | (uint32_t) b[3] << 16 |
+	    (uint32_t) b[4] << 8 | b[5];
+}
+
+
+int
+_midi_ump_sysex_pos(size_t off, size_t n, size_t siz)
+{
+	/* Where the packet with n bytes from off is in a message of siz. */
+
+	if(off == 0)
+		return off + n == siz ? MIDI_UMP_SYSEX_COMPLETE :
+		    MIDI_UMP_SYSEX_START;
+
+	return off + n == siz ? MIDI_UMP_SYSEX_END : MIDI_UMP_SYSEX_CONTINUE;
+}
+
+
+int
+midi_ump_from_msg(const midi_msg_t *msg, int group, midi_ump_t *ump,
+	int maxcnt, int *cnt)
+{
+	unsigned char	buf[MIDI_MSG_SHORTSIZ];
+	size_t		siz;
+	int		ret;
+
+	if(msg == NULL || ump == NULL || cnt == NULL || maxcnt < 1)
+		return EINVAL;
+
+	*cnt = 0;
+
+	if(msg->mm_type != MIDI_MSG_SYSEX) {
+		ret = midi_msg_encode_short((midi_msg_t *) msg, buf, &siz);
+		if(ret != 0)
+			return ret;
+		ret = midi_ump_from_bytes(buf, siz, group, ump);
+		if(ret == 0)
+			*cnt = 1;
+		return ret;
+	}
+
+	if(msg->mm_payload == NULL && msg->mm_payload_siz != 0)
+		return EINVAL;
+
+	return midi_ump_from_sysex(msg->mm_payload, msg->mm_payload_siz, group,
+	    ump, maxcnt, cnt);
+}
+
+
+int
+midi_ump_from_bytes(const unsigned char *buf, size_t siz, int group,
+	midi_ump_t *ump)
+{
+	size_t	need;
+	size_t	i;
+
+	if(buf == NULL || ump == NULL || siz < 1 || buf[0] < 0x80 ||
+	    buf[0] == 0xF0 || buf[0] == 0xF7)
+		return EINVAL;
+
+	if(buf[0] >= 0xF0)
+		need = buf[0] == 0xF2 ? 3 : buf[0] == 0xF1 || buf[0] == 0xF3 ?
+		    2 : 1;
+	else
+		need = (buf[0] & 0xF0) == 0xC0 || (buf[0] & 0xF0) == 0xD0 ?
+		    2 : 3;
+	if(siz != need)
+		return EINVAL;
+
+	for(i = 1; i < siz; ++i) {
+		if(buf[i] & 0x80)
+			return EINVAL;
+	}
+
+	_midi_ump_short(ump, buf[0] >= 0xF0 ? MIDI_UMP_MT_SYSTEM :
+	    MIDI_UMP_MT_MIDI1, group, buf[0], siz > 1 ? buf[1] : 0,
+	    siz > 2 ? buf[2] : 0);
+
+	return 0;
+}
+
+
+int
+midi_ump_from_sysex(const unsigned char *dat, size_t siz, int group,
+	midi_ump_t *ump, int maxcnt, int *cnt)
+{
+	size_t	off;
+	size_t	i;
+	int	n;
+
+	if((dat == NULL && siz != 0) || ump == NULL || cnt == NULL)
+		return EINVAL;
+
+	*cnt = 0;
+
+	if(MIDI_UMP_SYSEX_PKTS(siz) > maxcnt)
+		return ENOBUFS;
+
+	for(i = 0; i < siz; ++i) {
+		if(dat[i] & 0x80)
+			return EINVAL;
+	}
+
+	off = 0;
+	do {
+		n = siz - off;
+		if(n > MIDI_UMP_SYSEXSIZ)
+			n = MIDI_UMP_SYSEXSIZ;
+
+		_midi_ump_sysex(&ump[*cnt], group, _midi_ump_sysex_pos(off, n,
+		    siz), dat + off, n);
+		++*cnt;
+		off += n;
+	} while(off < siz);
+
+	return 0;
+}
+
+
+int
+midi_ump_to_msg(const midi_ump_t *ump, midi_msg_t *msg)
+{
+	int	status;
+
+	if(ump == NULL || msg == NULL)
+		return EINVAL;
+
+	memset(msg, 0, sizeof(midi_msg_t));
+	msg->mm_src = MIDI_EP_ANY;
+	msg->mm_dest = MIDI_EP_ANY;
+
+	status = MIDI_UMP_STATUS(ump);
+
+	if(MIDI_UMP_MT(ump) == MIDI_UMP_MT_SYSTEM) {
+		switch(status) {
+		case 0xF8:
+			msg->mm_type = MIDI_MSG_SYSRT_CLOCK;
+			return 0;
+		case 0xFA:
+			msg->mm_type = MIDI_MSG_SYSRT_START;
+			return 0;
+		case 0xFB:
+			msg->mm_type = MIDI_MSG_SYSRT_CONTINUE;
+			return 0;
+		case 0xFC:
+			msg->mm_type = MIDI_MSG_SYSRT_STOP;
+			return 0;
+		default:
+			return ENOTSUP;
+		}
+	}
+
+	if(MIDI_UMP_MT(ump) != MIDI_UMP_MT_MIDI1)
+		return ENOTSUP;
+
+	msg->mm_chan = status & 0x0F;
+
+	if((status & 0xF0) == 0xB0) {
+		msg->mm_type = MIDI_MSG_CHANCC;
+		msg->mm_num = (ump->mu_w[0] >> 8) & 0x7F;
+		msg->mm_val = ump->mu_w[0] & 0x7F;
+	} else
+	if((status & 0xF0) == 0xC0) {
+		msg->mm_type = MIDI_MSG_CHANPROG;
+		msg->mm_val = (ump->mu_w[0] >> 8) & 0x7F;
+	} else
+		return ENOTSUP;
+
+	return 0;
+}
+
+
+int
+midi_ump_sysex_data(const midi_ump_t *ump, unsigned char *buf)
+{
+	int	cnt;
+	int	i;
+
+	if(ump == NULL)
+		return -1;
+
+	if(MIDI_UMP_MT(ump) == MIDI_UMP_MT_DATA64) {
+		cnt = (ump->mu_w[0] >> 16) & 0x0F;
+		if(MIDI_UMP_SYSEX_POS(ump) > MIDI_UMP_SYSEX_END ||
+		    cnt > MIDI_UMP_SYSEXSIZ)
+			return -1;
+
+		for(i = 0; buf && i < cnt; ++i) {
+			buf[i] = (i < 2 ? ump->mu_w[0] >> (8 - i * 8) :
+			    ump->mu_w[1] >> (24 - (i - 2) * 8)) & 0x7F;
+		}
+		return cnt;
+	}
+
+#ifdef MIDI_UMP_ALSA
+	if(MIDI_UMP_MT(ump) == MIDI_UMP_MT_DATA128) {
+		/* The count includes the stream ID. */
+		cnt = ((ump->mu_w[0] >> 16) & 0x0F) - 1;
+		if(MIDI_UMP_SYSEX_POS(ump) > MIDI_UMP_SYSEX_END || cnt < 0 ||
+		    cnt > MIDI_UMP_SYSEX8SIZ)
+			return -1;
+
+		/* Data starts in the last byte of the first word. */
+		for(i = 0; buf && i < cnt; ++i) {
+			buf[i] = ump->mu_w[(i + 3) / 4] >>
+			    (24 - ((i + 3) % 4) * 8);
+		}
+		return cnt;
+	}
+#endif
+
+	return -1;
+}
+
+
+int
+midi_ump_to_bytes(const midi_ump_t *ump, unsigned char *buf, size_t *siz)
+{
+	int	status;
+	int	cnt;
+
+	if(ump == NULL || buf == NULL || siz == NULL)
+		return EINVAL;
+
+	*siz = 0;
+	status = MIDI_UMP_STATUS(ump);
+
+	switch(MIDI_UMP_MT(ump)) {
+	case MIDI_UMP_MT_SYSTEM:
+		if(status < 0xF1 || status == 0xF7)
+			return EINVAL;
+		buf[(*siz)++] = status;
+		if(status == 0xF1 || status == 0xF2 || status == 0xF3)
+			buf[(*siz)++] = (ump->mu_w[0] >> 8) & 0x7F;
+		if(status == 0xF2)
+			buf[(*siz)++] = ump->mu_w[0] & 0x7F;
+		return 0;
+
+	case MIDI_UMP_MT_MIDI1:
+		if(status < 0x80 || status >= 0xF0)
+			return EINVAL;
+		buf[(*siz)++] = status;
+		buf[(*siz)++] = (ump->mu_w[0] >> 8) & 0x7F;
+		if((status & 0xF0) != 0xC0 && (status & 0xF0) != 0xD0)
+			buf[(*siz)++] = ump->mu_w[0] & 0x7F;
+		return 0;
+
+	case MIDI_UMP_MT_DATA64:
+		status = MIDI_UMP_SYSEX_POS(ump);
+		if(status == MIDI_UMP_SYSEX_COMPLETE ||
+		    status == MIDI_UMP_SYSEX_START)
+			buf[(*siz)++] = 0xF0;
+
+		cnt = midi_ump_sysex_data(ump, buf + *siz);
+		if(cnt < 0) {
+			*siz = 0;
+			return EINVAL;
+		}
+		*siz += cnt;
+
+		if(status == MIDI_UMP_SYSEX_COMPLETE ||
+		    status == MIDI_UMP_SYSEX_END)
+			buf[(*siz)++] = 0xF7;
+		return 0;
+
+	default:
+		return ENOTSUP;
+	}
+}
+
+
+void
+midi_ump_parser_init(midi_ump_parser_t *up, int group)
+{
+	memset(up, 0, sizeof(midi_ump_parser_t));
+	up->up_group = group & 0x0F;
+}
+
+
+int
+midi_ump_parse(midi_ump_parser_t *up, unsigned char dat, midi_ump_t *ump)
+{
+	int	need;
+
+	if(dat >= 0xF8) {
+		/* Realtime goes between any two bytes, sysex or not, and
+		 * changes nothing. 0xF9 and 0xFD are undefined. */
+		if(dat == 0xF9 || dat == 0xFD)
+			return 0;
+		_midi_ump_short(ump, MIDI_UMP_MT_SYSTEM, up->up_group, dat, 0,
+		    0);
+		return 1;
+	}
+
+	if(dat == 0xF7) {
+		if(!up->up_in_sysex)
+			return 0;
+		_midi_ump_sysex(ump, up->up_group, up->up_started ?
+		    MIDI_UMP_SYSEX_END : MIDI_UMP_SYSEX_COMPLETE, up->up_sysex,
+		    up->up_sysexcnt);
+		up->up_in_sysex = 0;
+		return 1;
+	}
+
+	if(dat >= 0x80) {
+		/* Any other status ends sysex, what was read of it is lost.
+		 * A receiver takes the next START as the end of an unfinished
+		 * one. */
+		up->up_in_sysex = 0;
+		up->up_status = 0;
+		up->up_datacnt = 0;
+
+		if(dat == 0xF0) {
+			up->up_in_sysex = 1;
+			up->up_started = 0;
+			up->up_sysexcnt = 0;
+			return 0;
+		}
+
+		if(dat == 0xF6) {
+			/* Tune Request, no data. */
+			_midi_ump_short(ump, MIDI_UMP_MT_SYSTEM, up->up_group,
+			    dat, 0, 0);
+			return 1;
+		}
+
+		if(dat == 0xF4 || dat == 0xF5)
+			return 0;
+
+		up->up_status = dat;
+		return 0;
+	}
+
+	if(up->up_in_sysex) {
+		if(up->up_sysexcnt < MIDI_UMP_SYSEXSIZ) {
+			up->up_sysex[up->up_sysexcnt++] = dat;
+			return 0;
+		}
+
+		/* Six bytes and more to come. */
+		_midi_ump_sysex(ump, up->up_group, up->up_started ?
+		    MIDI_UMP_SYSEX_CONTINUE : MIDI_UMP_SYSEX_START,
+		    up->up_sysex, up->up_sysexcnt);
+		up->up_started = 1;
+		up->up_sysex[0] = dat;
+		up->up_sysexcnt = 1;
+		return 1;
+	}
+
+	if(up->up_status == 0) {
+		/* Data without status, we came in in the middle. */
+		return 0;
+	}
+
+	up->up_data[up->up_datacnt++] = dat;
+
+	switch(up->up_status & 0xF0) {
+	case 0xC0:
+	case 0xD0:
+		need = 1;
+		break;
+	case 0xF0:
+		need = up->up_status == 0xF2 ? 2 : 1;
+		break;
+	default:
+		need = 2;
+		break;
+	}
+	if(up->up_datacnt < need)
+		return 0;
+
+	up->up_datacnt = 0;
+
+	if(up->up_status >= 0xF0) {
+		/* System common doesn't leave a running status. */
+		_midi_ump_short(ump, MIDI_UMP_MT_SYSTEM, up->up_group,
+		    up->up_status, up->up_data[0], need > 1 ? up->up_data[1] :
+		    0);
+		up->up_status = 0;
+		return 1;
+	}
+
+	_midi_ump_short(ump, MIDI_UMP_MT_MIDI1, up->up_group, up->up_status,
+	    up->up_data[0], need > 1 ? up->up_data[1] : 0);
+
+	return 1;
+}
+
+
+#ifdef MIDI_UMP_ALSA
+void
+_midi_ump_sysex8(midi_ump_t *ump, int group, int status, int stream,
+	const unsigned char *dat, int cnt)
+{
+	/* The count includes the stream ID, which comes before the data. */
+
+	unsigned char	b[MIDI_UMP_SYSEX8SIZ];
+
+	memset(b, 0, sizeof(b));
+	memcpy(b, dat, cnt);
+
+	memset(ump, 0, sizeof(midi_ump_t));
+	ump->mu_w[0] = (uint32_t) MIDI_UMP_MT_DATA128 << 28 |
+	    (uint32_t) (group & 0x0F) << 24 | (uint32_t) status << 20 |
+	    (uint32_t) (cnt + 1) << 16 | (uint32_t) (stream & 0xFF) << 8 |
+	    b[0];
+	ump->mu_w[1] = (uint32_t) b[1] << 24 | (uint32_t) b[2] << 16 |
+	    (uint32_t) b[3] << 8 | b[4];
+	ump->mu_w[2] = (uint32_t) b[5] << 24 | (uint32_t) b[6] << 16 |
+	    (uint32_t) b[7] << 8 | b[8];
+	ump->mu_w[3] = (uint32_t) b[9] << 24 | (uint32_t) b[10] << 16 |
+	    (uint32_t) b[11] << 8 | b[12];
+}
+
+
+int
+midi_ump_from_sysex8(const unsigned char *dat, size_t siz, int group,
+	int stream, midi_ump_t *ump, int maxcnt, int *cnt)
+{
+	size_t	off;
+	int	n;
+
+	if((dat == NULL && siz != 0) || ump == NULL || cnt == NULL)
+		return EINVAL;
+
+	*cnt = 0;
+
+	if(MIDI_UMP_SYSEX8_PKTS(siz) > maxcnt)
+		return ENOBUFS;
+
+	off = 0;
+	do {
+		n = siz - off;
+		if(n > MIDI_UMP_SYSEX8SIZ)
+			n = MIDI_UMP_SYSEX8SIZ;
+
+		_midi_ump_sysex8(&ump[*cnt], group, _midi_ump_sysex_pos(off,
+		    n, siz), stream, dat + off, n);
+		++*cnt;
+		off += n;
+	} while(off < siz);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,127 @@
+#ifndef MIDI_UMP_H
+#define MIDI_UMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct midi_msg;
+
+/*
+ * Universal MIDI Packets (MIDI 2.0 UMP format, MIDI 1.0 protocol).
+ *
+ * Every message is one to four 32 bit words, the first of which says
+ * what it is and how long. Sysex is cut into packets of up to 6 bytes, so
+ * nothing has a payload of its own.
+ *
+ * This is what queues and the ring carry. Bytes are turned into packets
+ * where they come in (the CoreMIDI reader, fd ports of the loop) and back
+ * where they go out; midi_msg_t is only a view of a message that's been
+ * taken off.
+ *
+ * With MIDI_UMP_ALSA defined, ports that speak UMP themselves (ALSA's
+ * /dev/snd/umpC*D*) pass packets through as they are, 8 bit sysex (MT 5)
+ * included, which has no byte stream form.
+ */
+
+#define MIDI_UMP_MT_UTILITY	0x0
+#define MIDI_UMP_MT_SYSTEM	0x1	/* Realtime and system common */
+#define MIDI_UMP_MT_MIDI1	0x2	/* MIDI 1.0 channel voice */
+#define MIDI_UMP_MT_DATA64	0x3	/* 7 bit sysex */
+#define MIDI_UMP_MT_DATA128	0x5	/* 8 bit sysex and mixed data */
+
+/* Where a sysex packet is in its message. */
+#define MIDI_UMP_SYSEX_COMPLETE	0x0
+#define MIDI_UMP_SYSEX_START	0x1
+#define MIDI_UMP_SYSEX_CONTINUE	0x2
+#define MIDI_UMP_SYSEX_END	0x3
+
+#define MIDI_UMP_SYSEXSIZ	6	/* Data bytes per sysex packet */
+#define MIDI_UMP_SYSEX_PKTS(siz) ((siz) ? ((siz) + MIDI_UMP_SYSEXSIZ - 1) / \
+				 MIDI_UMP_SYSEXSIZ : 1)
+
+/* 8 bit sysex packets have the same four, in the high nibble of the
+ * status byte, and a stream ID before 13 bytes of data. */
+#define MIDI_UMP_SYSEX8SIZ	13
+#define MIDI_UMP_SYSEX8_PKTS(siz) ((siz) ? ((siz) + MIDI_UMP_SYSEX8SIZ - 1) / \
+				 MIDI_UMP_SYSEX8SIZ : 1)
+
+/* Most bytes a packet takes on the wire: F0, 6 bytes of data, F7. */
+#define MIDI_UMP_MAXBYTES	8
+
+#define MIDI_UMP_MT(u)		((int) ((u)->mu_w[0] >> 28))
+#define MIDI_UMP_GROUP(u)	((int) ((u)->mu_w[0] >> 24) & 0x0F)
+#define MIDI_UMP_STATUS(u)	((int) ((u)->mu_w[0] >> 16) & 0xFF)
+#define MIDI_UMP_DATA1(u)	((int) ((u)->mu_w[0] >> 8) & 0x7F)
+#define MIDI_UMP_DATA2(u)	((int) (u)->mu_w[0] & 0x7F)
+
+/* Which of the four a sysex packet is, 7 or 8 bit. */
+#define MIDI_UMP_SYSEX_POS(u)	((int) ((u)->mu_w[0] >> 20) & 0x0F)
+
+/* Big enough for the longest packet, 128 bits, and aligned like one. */
+typedef struct midi_ump {
+	_Alignas(16) uint32_t	mu_w[4];
+} midi_ump_t;
+
+/* Byte stream to packet translation, one per input. */
+typedef struct midi_ump_parser {
+	int		up_group;
+	int		up_status;	/* Running status, or system common
+					 * waiting for data; 0 if none */
+	unsigned char	up_data[2];
+	int		up_datacnt;
+	int		up_in_sysex;
+	int		up_started;	/* A START packet went out */
+	unsigned char	up_sysex[MIDI_UMP_SYSEXSIZ];
+	int		up_sysexcnt;
+} midi_ump_parser_t;
+
+int midi_ump_words(const midi_ump_t *);
+
+/* The MIDI_MSG_* type of the message a packet belongs to, -1 if midi_msg_t
+ * has none for it. */
+int midi_ump_msgtype(const midi_ump_t *);
+
+/* Returns 0 if the packets are one whole message: a single packet, or the
+ * packets of one sysex message from START to END. */
+int midi_ump_check(const midi_ump_t *, int);
+
+/* Packets for msg, MIDI_UMP_SYSEX_PKTS(mm_payload_siz) of them for sysex,
+ * one for anything else. */
+int midi_ump_from_msg(const struct midi_msg *, int, midi_ump_t *, int,
+	int *);
+
+/* A packet for a message that isn't sysex, as it came on the wire. */
+int midi_ump_from_bytes(const unsigned char *, size_t, int, midi_ump_t *);
+
+/* Packets for the bytes between F0 and F7, which must all be data. */
+int midi_ump_from_sysex(const unsigned char *, size_t, int, midi_ump_t *,
+	int, int *);
+
+/* The other way around, for the message types midi_msg_t knows that fit
+ * in a packet (not sysex). */
+int midi_ump_to_msg(const midi_ump_t *, struct midi_msg *);
+
+/* Copies the data bytes of a sysex packet to buf, if not NULL, and returns
+ * how many there are, -1 if it isn't one. */
+int midi_ump_sysex_data(const midi_ump_t *, unsigned char *);
+
+/* Bytes to send for a packet, at most MIDI_UMP_MAXBYTES. Sysex packets
+ * come out as they go on the wire, F0 and F7 included where they start and
+ * end the message, so nothing has to be reassembled. */
+int midi_ump_to_bytes(const midi_ump_t *, unsigned char *, size_t *);
+
+void midi_ump_parser_init(midi_ump_parser_t *, int);
+
+/* Feeds a byte read. Returns 1 when a packet is complete, 0 otherwise.
+ * A sysex packet is only handed out once the byte after it has come, to
+ * know whether it ends the message. */
+int midi_ump_parse(midi_ump_parser_t *, unsigned char, midi_ump_t *);
+
+#ifdef MIDI_UMP_ALSA
+/* Packets for 8 bit sysex on stream ID stream, MIDI_UMP_SYSEX8_PKTS(siz)
+ * of them. The data is taken as it is, no byte needs to be below 0x80. */
+int midi_ump_from_sysex8(const unsigned char *, size_t, int, int,
+	midi_ump_t *, int, int *);
+#endif
+
+#endif
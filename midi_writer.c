@@ -0,0 +1,642 @@
+/*
+ * The writer thread: everything put on midi_outq goes out from here.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "bstr.h"
+#include "midi_writer.h"
+#include "midi_osx.h"
+#include "midi_time.h"
+#include "midi_sched.h"
+#include "midi_cc.h"
+#include "midi_trace.h"
+#include "midi_rt.h"
+#include "btime.h"
+
+/* Sysex being sent to one destination. */
+typedef struct midi_writer_lane {
+	midi_queue_t	*wl_dueq;	/* Due messages waiting their turn */
+	bstr_t		*wl_bulk;	/* Bulk message going out */
+	int		wl_bulkdest;
+	uint64_t	wl_bulkid;
+	uint64_t	wl_bulkts;
+	size_t		wl_bulkoff;
+	uint64_t	wl_wirefree;	/* When the wire can take more */
+	uint64_t	wl_queued;	/* Bulk messages put on wl_dueq */
+	uint64_t	wl_taken;	/* and taken off it, so far */
+} midi_writer_lane_t;
+
+void *midi_writer(void *);
+midi_writer_lane_t *midi_writer_lane(midi_writer_lane_t *, int);
+int _midi_writer_inbulk(midi_writer_lane_t *, int);
+int _midi_writer_canstart(midi_writer_lane_t *, int);
+uint64_t _midi_writer_wirefree(midi_writer_lane_t *, int);
+int midi_writer_add(midi_osx_batch_t *, midi_runstat_t *, int, uint64_t,
+	unsigned char *, size_t, uint64_t *);
+
+#define MIDIIO_CHUNK_SIZ	32	/* ~10ms on the wire */
+#define MIDIIO_LOOKAHEAD_NS	(5 * MIDI_TIME_NSEC_PER_MSEC)
+#define MIDIIO_MAXLANES		33	/* All, and destinations 0-31 */
+
+#define WRITER_STATE_NONE	0
+#define WRITER_STATE_RUNNING	1
+#define WRITER_STATE_SHUTDOWN	2
+
+static int writer_state = WRITER_STATE_NONE;
+static pthread_rwlock_t writer_state_rwlock;
+
+/* Only written by the writer thread, read once it has stopped. */
+static midi_latstat_t writer_wakeup;
+
+int _midi_writer_setstate(int);
+
+
+int
+midi_writer_start(pthread_t *thrd)
+{
+	int	ret;
+
+	if(thrd == NULL)
+		return EINVAL;
+
+	if(midi_outq == NULL)
+		return ENXIO;
+
+	/* Create state variable lock */
+	ret = pthread_rwlock_init(&writer_state_rwlock, NULL);
+	if(ret != 0) {
+		fprintf(stderr, "Can't create writer state rwlock\n");
+		return ret;
+	}
+
+	ret = _midi_writer_setstate(WRITER_STATE_RUNNING);
+	if(ret != 0)
+		goto fail;
+
+	midi_latstat_init(&writer_wakeup);
+
+	ret = pthread_create(thrd, NULL, midi_writer, NULL);
+	if(ret != 0) {
+		fprintf(stderr, "Can't start MIDI writer thread: %s\n",
+		    strerror(ret));
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	writer_state = WRITER_STATE_NONE;
+	(void) pthread_rwlock_destroy(&writer_state_rwlock);
+	return ret;
+}
+
+
+int
+midi_writer_stop(pthread_t *thrd)
+{
+	int	ret;
+
+	if(thrd == NULL)
+		return EINVAL;
+
+	/* Signal to thread(s) to shut down. */
+	ret = _midi_writer_setstate(WRITER_STATE_SHUTDOWN);
+	if(ret != 0)
+		return ret;
+
+	/* Wake it up now rather than at its next timeout. */
+	(void) pthread_cond_signal(&midi_outq->mq_cond);
+
+	/* Wait for thread(d) to exit. */
+	ret = pthread_join(*thrd, NULL);
+	if(ret != 0) {
+		fprintf(stderr, "Can't join writer thread.\n");
+		return ret;
+	}
+
+	writer_state = WRITER_STATE_NONE;
+
+	ret = pthread_rwlock_destroy(&writer_state_rwlock);
+	if(ret != 0) {
+		fprintf(stderr, "Can't destroy writer state rwlock\n");
+	}
+
+	return ret;
+}
+
+
+void *
+midi_writer(void *arg)
+{
+	/* Realtime messages are sent as soon as they are due. Sysex is
+	 * sent in chunks no faster than the wire can carry them, so that
+	 * realtime bytes queued during a long dump go out between two chunks
+	 * instead of after the whole dump. Every destination is a separate
+	 * wire, so each has its own lane: a dump going to one device doesn't
+	 * hold up the others.
+	 *
+	 * Messages that are due later wait on a timer wheel. They are
+	 * handed to the system a little ahead of time, with their
+	 * timestamp, and the system sends them at the right moment.
+	 *
+	 * The out queue's lock is only held to take everything off it at
+	 * once. Whatever is ready to go out on a wakeup is collected into
+	 * one packet list per destination.
+	 *
+	 * Control Changes are not queued one by one. Only the latest value
+	 * of each controller is kept and sent when the wire is free, between
+	 * two bulk messages, so a fast knob never backs up behind its own
+	 * stale values. */
+
+	int			ret;
+	midi_msg_t		msg;
+	midi_queue_ent_t	*ent;
+	midi_writer_lane_t	lanes[MIDIIO_MAXLANES];
+	midi_writer_lane_t	*wl;
+	int			i;
+	int			type;
+	int			busy;
+	int			marks;
+	size_t			chunksiz;
+	uint64_t		now;
+	uint64_t		wakeat;
+	uint64_t		next;
+	int			doshutdown;
+	struct timespec		condwaitto;
+	midi_sched_t		sched;
+	midi_queue_t		*inbox;
+	midi_osx_batch_t	batch;
+	unsigned char		shortmsg[MIDI_UMP_MAXBYTES];
+	size_t			shortsiz;
+	midi_cctab_t		*cctab;
+	midi_cc_ent_t		*ce;
+	midi_cc_ent_t		*cenext;
+	midi_runstat_t		runstat;
+	midi_runstat_t		*rs;
+
+	wakeat = 0;
+	doshutdown = 0;
+	inbox = NULL;
+	cctab = NULL;
+	memset(lanes, 0, sizeof(lanes));
+
+#if 0
+	printf("MIDI writer thread started.\n");
+	fflush(stdout);
+#endif
+
+	/* Only this thread uses these, so their locks aren't needed. */
+	ret = midi_queue_init(&inbox);
+	for(i = 0; ret == 0 && i < MIDIIO_MAXLANES; ++i)
+		ret = midi_queue_init(&lanes[i].wl_dueq);
+	if(ret != 0) {
+		fprintf(stderr, "Can't initialize MIDI writer queues\n");
+		return (void *) -1;
+	}
+	cctab = malloc(sizeof(midi_cctab_t));
+	if(cctab == NULL) {
+		fprintf(stderr, "Can't allocate Control Change table\n");
+		return (void *) -1;
+	}
+	midi_cctab_init(cctab);
+
+	/* Running status only where the transport takes it. */
+	midi_runstat_init(&runstat, MIDI_RUNSTAT_REFRESH_MS *
+	    MIDI_TIME_NSEC_PER_MSEC);
+	rs = MIDI_OSX_RUNSTATUS ? &runstat : NULL;
+
+	(void) midi_sched_init(&sched, midi_time_now());
+	(void) midi_osx_batch_init(&batch);
+
+	midi_trace_thread("writer");
+	(void) midi_rt_thread("writer");
+
+	while(1) {
+
+		/* Check whether it's time to quit. */
+		ret = pthread_rwlock_rdlock(&writer_state_rwlock);
+		if(ret != 0) {
+			fprintf(stderr,
+			    "Can't lock writer state rwlock for reading: %s\n",
+			    strerror(ret));
+			exit(-1);	
+		}
+		if(writer_state == WRITER_STATE_SHUTDOWN) {
+			doshutdown++;
+		}
+		ret = pthread_rwlock_unlock(&writer_state_rwlock);
+		if(ret != 0) {
+			fprintf(stderr,
+			    "Can't unlock writer state rwlock"
+			    " after reading: %s\n", strerror(ret));
+			exit(-1);	
+		}
+
+		if(doshutdown)
+			break;
+
+		ret = pthread_mutex_lock(&midi_outq->mq_mutex);
+		if(ret != 0) {
+			fprintf(stderr, "Can't lock queue: %s\n"
+			    " This is bad, exiting\n", strerror(ret));
+			exit(-1);
+		}
+
+		/* Nothing to do, so go to sleep until something happens
+		 * on the queue, a wire is free for the next chunk or
+		 * something on the wheel is due. */
+		now = midi_time_now();
+		if(midi_queue_isempty(midi_outq) && wakeat > now) {
+			btimespec_tonow(&condwaitto);
+			btimespec_addus(&condwaitto, (wakeat - now) /
+			    MIDI_TIME_NSEC_PER_USEC + 1);
+			ret = pthread_cond_timedwait(&midi_outq->mq_cond,
+			    &midi_outq->mq_mutex, &condwaitto);
+			if(ret != 0 && ret != ETIMEDOUT) {
+				fprintf(stderr, "Error while waiting on"
+				    " condvar: %s\n"
+				    " This is bad, exiting\n", strerror(ret));
+				exit(-1);
+			}
+
+			/* Woken up by the timeout, how late it was is how
+			 * late the wire or the wheel gets served. */
+			if(ret == ETIMEDOUT) {
+				midi_latstat_add(&writer_wakeup, (int64_t)
+				    (midi_time_now() - wakeat));
+			}
+		}
+
+		/* Take everything off the out queue at once. */
+		(void) midi_queue_swap(midi_outq, inbox);
+
+		ret = pthread_mutex_unlock(&midi_outq->mq_mutex);
+		if(ret != 0) {
+			fprintf(stderr, "Can't unlock queue: %s\n"
+			    " This is bad, exiting\n", strerror(ret));
+			exit(-1);
+		}
+
+		now = midi_time_now();
+
+		/* Whatever came due on the wheel is handled like a new
+		 * message. */
+		(void) midi_sched_expire(&sched, now + MIDIIO_LOOKAHEAD_NS,
+		    inbox);
+
+		/* What isn't due yet goes on the wheel, Control Changes in the
+		 * table, the rest on the destination's lane. */
+		while(midi_queue_getent(inbox, &ent) == 0) {
+			MIDI_TRACE_STAGE(ent->me_id, MIDI_TRACE_DEQUEUE);
+			/* Said explicitly or not, the same device is on the
+			 * same lane. Entries move from queue to queue as
+			 * they are, packets and all. */
+			if(ent->me_dest == MIDI_EP_ANY)
+				ent->me_dest = midi_osx_getseldest();
+			type = ent->me_type;
+			if(ent->me_time > now + MIDIIO_LOOKAHEAD_NS)
+				ret = midi_sched_add(&sched, ent);
+			else
+			if(type == MIDI_MSG_CHANCC) {
+				ret = midi_cctab_set(cctab, ent->me_dest,
+				    MIDI_UMP_STATUS(&ent->me_pkts[0]) & 0x0F,
+				    MIDI_UMP_DATA1(&ent->me_pkts[0]),
+				    MIDI_UMP_DATA2(&ent->me_pkts[0]),
+				    ent->me_time, midi_writer_lane(lanes,
+				    ent->me_dest)->wl_queued);
+				free(ent);
+				ent = NULL;
+			} else {
+				wl = midi_writer_lane(lanes, ent->me_dest);
+				ret = midi_queue_putent(wl->wl_dueq, ent);
+				if(ret == 0 && !MIDI_MSG_ISSYSRT(type))
+					++wl->wl_queued;
+			}
+			if(ret != 0) {
+				fprintf(stderr, "Can't hold MIDI message: %s\n",
+				    strerror(ret));
+				free(ent);
+			}
+		}
+
+		/* Realtime first, always. */
+		for(i = 0; i < MIDIIO_MAXLANES; ++i) {
+			wl = &lanes[i];
+			while(midi_queue_getent_rt(wl->wl_dueq, &ent) == 0) {
+				ret = midi_ump_to_bytes(&ent->me_pkts[0],
+				    shortmsg, &shortsiz);
+				if(ret == 0) {
+					(void) midi_writer_add(&batch, rs,
+					    ent->me_dest, ent->me_time > now ?
+					    ent->me_time : 0, shortmsg,
+					    shortsiz, &wl->wl_wirefree);
+					midi_osx_batch_mark(&batch, ent->me_id,
+					    MIDI_OSX_MARK_SEND |
+					    MIDI_OSX_MARK_SENT);
+				}
+				free(ent);
+			}
+		}
+
+		/* A channel message can't go in the middle of a sysex, so
+		 * Control Changes wait for the bulk message to finish, and
+		 * for the ones queued before them on the same lane to have
+		 * started. Only one per lane goes at a time: until the wire is
+		 * free again, the next one can still change. */
+		for(ce = midi_cctab_iter(cctab, NULL); ce; ce = cenext) {
+			cenext = midi_cctab_iter(cctab, ce);
+
+			wl = midi_writer_lane(lanes, ce->ce_dest);
+			i = wl - lanes;
+			if(_midi_writer_inbulk(lanes, i) ||
+			    now < _midi_writer_wirefree(lanes, i) ||
+			    wl->wl_taken < ce->ce_seq)
+				continue;
+
+			msg.mm_type = MIDI_MSG_CHANCC;
+			msg.mm_chan = ce->ce_chan;
+			msg.mm_num = ce->ce_num;
+			msg.mm_val = ce->ce_val;
+			ret = midi_msg_encode_short(&msg, shortmsg, &shortsiz);
+			if(ret == 0) {
+				(void) midi_writer_add(&batch, rs, ce->ce_dest,
+				    ce->ce_time > now ? ce->ce_time : 0,
+				    shortmsg, shortsiz, &wl->wl_wirefree);
+			}
+			midi_cctab_take(cctab, ce);
+		}
+
+		for(i = 0; i < MIDIIO_MAXLANES; ++i) {
+			wl = &lanes[i];
+
+			if(!midi_queue_isempty(wl->wl_dueq) &&
+			    _midi_writer_canstart(lanes, i)) {
+
+				ret = midi_queue_getent(wl->wl_dueq, &ent);
+				if(ret != 0) {
+					fprintf(stderr, "Can't get next message"
+					    " from queue: %s\n"
+					    " This is bad, exiting\n",
+					    strerror(ret));
+					exit(-1);
+				}
+
+				++wl->wl_taken;
+				wl->wl_bulk = binit();
+				wl->wl_bulkdest = ent->me_dest;
+				wl->wl_bulkid = ent->me_id;
+				wl->wl_bulkts = ent->me_time;
+				wl->wl_bulkoff = 0;
+
+				ret = midi_writer_encode(wl->wl_bulk, ent);
+				if(ret != 0 || bstrempty(wl->wl_bulk)) {
+					printf("MIDI message not sent.\n");
+					buninit(&wl->wl_bulk);
+				}
+
+				free(ent);
+			}
+
+			if(wl->wl_bulk == NULL ||
+			    now < _midi_writer_wirefree(lanes, i))
+				continue;
+
+			chunksiz = bstrlen(wl->wl_bulk) - wl->wl_bulkoff;
+			if(chunksiz > MIDIIO_CHUNK_SIZ)
+				chunksiz = MIDIIO_CHUNK_SIZ;
+
+			/* Every chunk carries the message's timestamp
+			 * until it's in the past, so none of them can
+			 * overtake the first one. */
+			(void) midi_writer_add(&batch, rs, wl->wl_bulkdest,
+			    wl->wl_bulkts > now ? wl->wl_bulkts : 0,
+			    (unsigned char *) bget(wl->wl_bulk) +
+			    wl->wl_bulkoff, chunksiz, &wl->wl_wirefree);
+
+			marks = wl->wl_bulkoff == 0 ? MIDI_OSX_MARK_SEND : 0;
+			wl->wl_bulkoff += chunksiz;
+			if(wl->wl_bulkoff >= bstrlen(wl->wl_bulk))
+				marks |= MIDI_OSX_MARK_SENT;
+			midi_osx_batch_mark(&batch, wl->wl_bulkid, marks);
+
+			if(marks & MIDI_OSX_MARK_SENT)
+				buninit(&wl->wl_bulk);
+		}
+
+		ret = midi_osx_batch_flush(&batch);
+		if(ret != 0)
+			fprintf(stderr, "Couldn't send MIDI message.\n");
+
+		/* Work out when there will be something to do again. */
+		wakeat = now + MIDIIO_WAKEUP_MS * MIDI_TIME_NSEC_PER_MSEC;
+		for(i = 0; i < MIDIIO_MAXLANES; ++i) {
+			/* Lanes waiting for another one's bulk message are
+			 * woken up for that. */
+			wl = &lanes[i];
+			busy = wl->wl_bulk != NULL ||
+			    (!midi_queue_isempty(wl->wl_dueq) &&
+			    _midi_writer_canstart(lanes, i));
+			if(busy && _midi_writer_wirefree(lanes, i) < wakeat)
+				wakeat = _midi_writer_wirefree(lanes, i);
+		}
+		for(ce = midi_cctab_iter(cctab, NULL); ce;
+		    ce = midi_cctab_iter(cctab, ce)) {
+			wl = midi_writer_lane(lanes, ce->ce_dest);
+			i = wl - lanes;
+			if(!_midi_writer_inbulk(lanes, i) &&
+			    wl->wl_taken >= ce->ce_seq &&
+			    _midi_writer_wirefree(lanes, i) < wakeat)
+				wakeat = _midi_writer_wirefree(lanes, i);
+		}
+		next = midi_sched_next(&sched);
+		if(next != 0 && next < wakeat + MIDIIO_LOOKAHEAD_NS)
+			wakeat = next > MIDIIO_LOOKAHEAD_NS ?
+			    next - MIDIIO_LOOKAHEAD_NS : 0;
+	}
+
+	for(i = 0; i < MIDIIO_MAXLANES; ++i) {
+		buninit(&lanes[i].wl_bulk);
+		(void) midi_queue_uninit(&lanes[i].wl_dueq);
+	}
+	free(cctab);
+	(void) midi_sched_uninit(&sched);
+	(void) midi_queue_uninit(&inbox);
+
+#if 0
+	printf("MIDI writer thread exiting.\n");
+	fflush(stdout);
+#endif
+
+	return (void *) 0;
+
+}
+
+
+void
+midi_writer_report(FILE *f)
+{
+	/* NOTE: Only once the writer has stopped. */
+
+	midi_latstat_print(f, "Writer wakeup lateness", &writer_wakeup);
+}
+
+
+midi_writer_lane_t *
+midi_writer_lane(midi_writer_lane_t *lanes, int dest)
+{
+	/* Lane 0 is for messages to all destinations, and for the
+	 * destinations that don't have a lane of their own. Either way it
+	 * shares its wire with every other lane. */
+
+	if(dest < 0 || dest + 1 >= MIDIIO_MAXLANES)
+		return &lanes[0];
+
+	return &lanes[dest + 1];
+}
+
+
+int
+_midi_writer_inbulk(midi_writer_lane_t *lanes, int idx)
+{
+	/* Whether a bulk message is going out on a wire lane idx uses:
+	 * its own, lane 0's, or for lane 0 any lane's. Nothing else can go
+	 * in the middle of it. */
+
+	int	i;
+
+	if(lanes[idx].wl_bulk != NULL || lanes[0].wl_bulk != NULL)
+		return 1;
+
+	for(i = 1; idx == 0 && i < MIDIIO_MAXLANES; ++i) {
+		if(lanes[i].wl_bulk != NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+int
+_midi_writer_canstart(midi_writer_lane_t *lanes, int idx)
+{
+	/* Whether lane idx can take its next bulk message. Lane 0 waits for
+	 * all the others to finish theirs, which don't start new ones in the
+	 * meantime. */
+
+	if(_midi_writer_inbulk(lanes, idx))
+		return 0;
+
+	return idx == 0 || midi_queue_isempty(lanes[0].wl_dueq);
+}
+
+
+uint64_t
+_midi_writer_wirefree(midi_writer_lane_t *lanes, int idx)
+{
+	/* When every wire lane idx uses can take more. */
+
+	uint64_t	t;
+	int		i;
+
+	t = lanes[idx].wl_wirefree;
+	if(lanes[0].wl_wirefree > t)
+		t = lanes[0].wl_wirefree;
+
+	for(i = 1; idx == 0 && i < MIDIIO_MAXLANES; ++i) {
+		if(lanes[i].wl_wirefree > t)
+			t = lanes[i].wl_wirefree;
+	}
+
+	return t;
+}
+
+
+int
+midi_writer_encode(bstr_t *midimsg, const midi_queue_ent_t *ent)
+{
+	/* Appends the bytes that go on the wire for the packets of ent. A
+	 * sysex message's come out with F0 and F7 where they belong. */
+
+	unsigned char	buf[MIDI_UMP_MAXBYTES];
+	size_t		siz;
+	int		ret;
+	int		i;
+
+	if(midimsg == NULL || ent == NULL)
+		return EINVAL;
+
+	for(i = 0; i < ent->me_pktcnt; ++i) {
+		ret = midi_ump_to_bytes(&ent->me_pkts[i], buf, &siz);
+		if(ret != 0)
+			return ret;
+		bmemcat(midimsg, (char *) buf, siz);
+	}
+
+	return 0;
+}
+
+
+int
+midi_writer_add(midi_osx_batch_t *batch, midi_runstat_t *rs, int dest,
+	uint64_t when, unsigned char *buf, size_t siz, uint64_t *wirefree)
+{
+	/* Adds buf to the batch (to be sent at the time when, 0 means now)
+	 * and moves *wirefree to when the wire will have carried it. If rs
+	 * isn't NULL, the status byte is left out when running status
+	 * allows it. */
+
+	int		ret;
+	uint64_t	now;
+	size_t		skip;
+
+	now = midi_time_now();
+	if(when > now)
+		now = when;
+
+	skip = midi_runstat_skip(rs, dest, now, buf, siz);
+	buf += skip;
+	siz -= skip;
+
+	ret = midi_osx_batch_add(batch, dest, when, buf, siz);
+	if(ret != 0) {
+		fprintf(stderr, "Couldn't send MIDI message.\n");
+		return ret;
+	}
+
+	if(*wirefree < now)
+		*wirefree = now;
+	*wirefree += siz * MIDI_TIME_NSEC_PER_SEC / MIDI_WIRE_BYTES_PER_SEC;
+
+	return 0;
+}
+
+
+int
+_midi_writer_setstate(int newstate)
+{
+	int	ret;
+
+	ret = pthread_rwlock_wrlock(&writer_state_rwlock);
+	if(ret != 0) {
+		fprintf(stderr,
+		    "Can't lock writer state rwlock for writing: %s\n",
+		    strerror(ret));
+		return ret;
+	}
+
+	writer_state = newstate;
+	
+	ret = pthread_rwlock_unlock(&writer_state_rwlock);
+	if(ret != 0) {
+		fprintf(stderr,
+		    "Can't unlock writer state rwlock after writing: %s\n",
+		    strerror(ret));
+		return ret;
+	}
+
+	return 0;
+
+}
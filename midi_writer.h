@@ -0,0 +1,23 @@
+#ifndef MIDI_WRITER_H
+#define MIDI_WRITER_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "bstr.h"
+#include "midi_queue.h"
+#include "midi_runstat.h"
+
+#define MIDIIO_WAKEUP_MS	50	/* Longest the writer sleeps */
+
+/* NOTE: midi_outq must have been initialized, and system MIDI should be
+ * before anything is put on it. Whatever hasn't gone out yet when
+ * midi_writer_stop() is called is dropped. */
+int midi_writer_start(pthread_t *);
+int midi_writer_stop(pthread_t *);
+
+/* How late the writer woke up for what was due, after it has stopped. */
+void midi_writer_report(FILE *);
+
+int midi_writer_encode(bstr_t *, const midi_queue_ent_t *);
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ * Sysex request/response transactions.
+ *
+ * How long to wait for a reply depends on how big it is: a 5 byte ACK
+ * takes under 2ms on the wire, a pattern dump 6 seconds. So the timeout of
+ * each request is the time both the request and the expected reply take
+ * on the wire, plus a retransmission timeout worked out from the measured
+ * round trip times the way TCP does it. Requests that time out or that
+ * the device answers with an error are retried a limited number of
+ * times.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "midi_xact.h"
+#include "midi_trace.h"
+#include "midi_osx.h"
+#include "midi_time.h"
+#include "btime.h"
+
+extern midi_queue_t *midi_outq;
+
+int _midi_xact_wait(midi_xact_t *, unsigned char *, size_t, uint64_t,
+	unsigned char **, size_t *);
+int _midi_xact_wait_ring(midi_xact_t *, unsigned char *, size_t, uint64_t,
+	unsigned char **, size_t *);
+
+
+int
+midi_xact_init(midi_xact_t *mx, midi_queue_t *inq, int dest,
+	midi_xact_errfn_t iserr)
+{
+	if(mx == NULL || inq == NULL)
+		return EINVAL;
+
+	memset(mx, 0, sizeof(midi_xact_t));
+	mx->mx_inq = inq;
+	mx->mx_dest = dest;
+	mx->mx_maxtries = MIDI_XACT_MAXTRIES;
+	mx->mx_iserr = iserr;
+	midi_rtt_init(&mx->mx_rtt);
+
+	return 0;
+}
+
+
+int
+midi_xact_setring(midi_xact_t *mx, midi_ring_cons_t *rc)
+{
+	if(mx == NULL)
+		return EINVAL;
+
+	mx->mx_cons = rc;
+
+	return 0;
+}
+
+
+uint64_t
+midi_xact_timeout(midi_xact_t *mx, size_t reqsiz, size_t expsiz)
+{
+	/* F0 and F7 go on the wire too. */
+	return (reqsiz + 2 + expsiz + 2) * MIDI_TIME_NSEC_PER_SEC /
+	    MIDI_WIRE_BYTES_PER_SEC + mx->mx_rtt.mr_rto;
+}
+
+
+int
+midi_xact_request(midi_xact_t *mx, unsigned char *req, size_t reqsiz,
+	size_t matchsiz, size_t expsiz, unsigned char **resp, size_t *respsiz)
+{
+	int		ret;
+	int		try;
+	uint64_t	timeout;
+	uint64_t	sent;
+	uint64_t	rtt;
+	uint64_t	wire;
+	uint64_t	backoff;
+
+	if(mx == NULL || req == NULL || reqsiz == 0 || matchsiz > reqsiz ||
+	    resp == NULL || respsiz == NULL)
+		return EINVAL;
+
+	*resp = NULL;
+	*respsiz = 0;
+	backoff = 1;
+	ret = ETIMEDOUT;
+
+	++mx->mx_cnt;
+
+	for(try = 0; try < mx->mx_maxtries; ++try) {
+
+		if(try > 0)
+			++mx->mx_retries;
+
+		timeout = midi_xact_timeout(mx, reqsiz, expsiz);
+		timeout += (backoff - 1) * mx->mx_rtt.mr_rto;
+
+		ret = pthread_mutex_lock(&midi_outq->mq_mutex);
+		if(ret != 0) {
+			fprintf(stderr, "Can't lock queue: %s\n",
+			    strerror(ret));
+			return ENOEXEC;
+		}
+		/* Every try is a message of its own in the trace. */
+		mx->mx_lastid = midi_trace_on ? midi_trace_newid() : 0;
+		MIDI_TRACE_STAGE(mx->mx_lastid, MIDI_TRACE_ENQUEUE);
+		ret = midi_queue_addmsg_sysex_id(midi_outq, MIDI_EP_ANY,
+		    mx->mx_dest, mx->mx_lastid, req, reqsiz);
+		(void) pthread_mutex_unlock(&midi_outq->mq_mutex);
+		if(ret != 0) {
+			fprintf(stderr, "Can't add MIDI message: %s\n",
+			    strerror(ret));
+			return ret;
+		}
+
+		sent = midi_time_now();
+
+		if(mx->mx_cons)
+			ret = _midi_xact_wait_ring(mx, req, matchsiz,
+			    sent + timeout, resp, respsiz);
+		else
+			ret = _midi_xact_wait(mx, req, matchsiz,
+			    sent + timeout, resp, respsiz);
+
+		if(ret == ETIMEDOUT) {
+			++mx->mx_timeouts;
+			fprintf(stderr, "No answer from device within %llums"
+			    "%s\n", (unsigned long long) (timeout /
+			    MIDI_TIME_NSEC_PER_MSEC),
+			    try + 1 < mx->mx_maxtries ? ", retrying" : "");
+
+			/* Like TCP, wait longer each time. */
+			backoff *= 2;
+			continue;
+		}
+		if(ret != 0)
+			return ret;
+
+		if(mx->mx_iserr && mx->mx_iserr(*resp, *respsiz)) {
+			++mx->mx_errors;
+			fprintf(stderr, "Device reported an error%s\n",
+			    try + 1 < mx->mx_maxtries ? ", retrying" : "");
+			free(*resp);
+			*resp = NULL;
+			*respsiz = 0;
+			ret = EIO;
+			continue;
+		}
+
+		/* Only a reply to the first try tells us the round trip
+		 * time, otherwise we can't know which try it answers
+		 * (Karn's algorithm). The time the bytes spend on the wire
+		 * isn't part of it. */
+		if(try == 0) {
+			rtt = midi_time_now() - sent;
+			wire = (reqsiz + 2 + *respsiz + 2) *
+			    MIDI_TIME_NSEC_PER_SEC / MIDI_WIRE_BYTES_PER_SEC;
+			midi_rtt_sample(&mx->mx_rtt, rtt > wire ? rtt - wire : 0);
+		}
+
+		return 0;
+	}
+
+	return ret;
+}
+
+
+int
+_midi_xact_wait(midi_xact_t *mx, unsigned char *req, size_t matchsiz,
+	uint64_t deadline, unsigned char **resp, size_t *respsiz)
+{
+	/* Waits for a sysex that starts like the request did. Everything
+	 * else on the queue is dropped. */
+
+	int		ret;
+	int		err;
+	midi_msg_t	msg;
+	uint64_t	now;
+	struct timespec	condwaitto;
+
+	err = ETIMEDOUT;
+
+	ret = pthread_mutex_lock(&mx->mx_inq->mq_mutex);
+	if(ret != 0) {
+		fprintf(stderr, "Can't lock queue: %s\n", strerror(ret));
+		return ENOEXEC;
+	}
+
+	while(1) {
+
+		while(!midi_queue_isempty(mx->mx_inq)) {
+
+			ret = midi_queue_getnext(mx->mx_inq, &msg);
+			if(ret != 0) {
+				fprintf(stderr, "Can't get next message"
+				    " from queue: %s\n"
+				    " This is bad, exiting\n", strerror(ret));
+				exit(-1);
+			}
+
+			if(msg.mm_type == MIDI_MSG_SYSEX &&
+			    msg.mm_payload_siz >= matchsiz &&
+			    !memcmp(msg.mm_payload, req, matchsiz)) {
+				/* Hand the payload over as it is. */
+				midi_trace_link(mx->mx_lastid, msg.mm_id);
+				*resp = msg.mm_payload;
+				*respsiz = msg.mm_payload_siz;
+				err = 0;
+				goto end_label;
+			}
+				
+			(void) midi_msg_free_payload(&msg);
+		}
+
+		now = midi_time_now();
+		if(now >= deadline)
+			break;
+
+		/* No more items to process, so go to sleep until
+		 * something happens on the queue or it's time to give up. */
+		btimespec_tonow(&condwaitto);
+		btimespec_addus(&condwaitto, (deadline - now) /
+		    MIDI_TIME_NSEC_PER_USEC + 1);
+		ret = pthread_cond_timedwait(&mx->mx_inq->mq_cond,
+		    &mx->mx_inq->mq_mutex, &condwaitto);
+		if(ret != 0 && ret != ETIMEDOUT) {
+			fprintf(stderr, "Error while waiting on condvar: %s\n"
+			    " This is bad, exiting\n", strerror(ret));
+			exit(-1);
+		}
+	}
+
+end_label:
+
+	ret = pthread_mutex_unlock(&mx->mx_inq->mq_mutex);
+	if(ret != 0) {
+		fprintf(stderr, "Can't unlock queue: %s\n", strerror(ret));
+		return ENOEXEC;
+	}
+
+	return err;
+}
+
+
+int
+_midi_xact_wait_ring(midi_xact_t *mx, unsigned char *req, size_t matchsiz,
+	uint64_t deadline, unsigned char **resp, size_t *respsiz)
+{
+	/* Same as _midi_xact_wait(), but with the ring's messages, which
+	 * are the consumer's own until the next one. The reply is the only
+	 * one that gets copied out. */
+
+	int			ret;
+	const midi_msg_t	*msg;
+
+	while(1) {
+		ret = midi_ring_next(mx->mx_cons, deadline, &msg);
+		if(ret != 0)
+			return ret;
+
+		if(msg->mm_type == MIDI_MSG_SYSEX &&
+		    msg->mm_payload_siz >= matchsiz &&
+		    !memcmp(msg->mm_payload, req, matchsiz)) {
+			midi_trace_link(mx->mx_lastid, msg->mm_id);
+			*resp = malloc(msg->mm_payload_siz);
+			if(*resp == NULL) {
+				midi_ring_release(mx->mx_cons);
+				return ENOMEM;
+			}
+			memcpy(*resp, msg->mm_payload, msg->mm_payload_siz);
+			*respsiz = msg->mm_payload_siz;
+			midi_ring_release(mx->mx_cons);
+			return 0;
+		}
+
+		midi_ring_release(mx->mx_cons);
+	}
+}
+
+
+void
+midi_rtt_init(midi_rtt_t *rtt)
+{
+	memset(rtt, 0, sizeof(midi_rtt_t));
+	rtt->mr_rto = MIDI_XACT_RTO_INIT_MS * MIDI_TIME_NSEC_PER_MSEC;
+}
+
+
+void
+midi_rtt_sample(midi_rtt_t *rtt, uint64_t sample)
+{
+	/* RFC 6298, section 2. */
+
+	double	r;
+	double	rto;
+
+	r = (double) sample;
+
+	if(!rtt->mr_valid) {
+		rtt->mr_srtt = r;
+		rtt->mr_rttvar = r / 2;
+		rtt->mr_valid++;
+	} else {
+		rtt->mr_rttvar = 0.75 * rtt->mr_rttvar +
+		    0.25 * fabs(rtt->mr_srtt - r);
+		rtt->mr_srtt = 0.875 * rtt->mr_srtt + 0.125 * r;
+	}
+
+	rto = rtt->mr_srtt + 4 * rtt->mr_rttvar;
+
+	if(rto < MIDI_XACT_RTO_MIN_MS * MIDI_TIME_NSEC_PER_MSEC)
+		rto = MIDI_XACT_RTO_MIN_MS * MIDI_TIME_NSEC_PER_MSEC;
+	if(rto > MIDI_XACT_RTO_MAX_MS * MIDI_TIME_NSEC_PER_MSEC)
+		rto = MIDI_XACT_RTO_MAX_MS * MIDI_TIME_NSEC_PER_MSEC;
+
+	rtt->mr_rto = (uint64_t) rto;
+}
@@ -0,0 +1,63 @@
+#ifndef MIDI_XACT_H
+#define MIDI_XACT_H
+
+#include <stdint.h>
+#include "midi_queue.h"
+#include "midi_ring.h"
+
+#define MIDI_XACT_MAXTRIES	3
+
+/* Round trip time estimate is kept like TCP's (RFC 6298). Until there's a
+ * sample, MIDI_XACT_RTO_INIT_MS is used. */
+#define MIDI_XACT_RTO_INIT_MS	1000
+#define MIDI_XACT_RTO_MIN_MS	50
+#define MIDI_XACT_RTO_MAX_MS	10000
+
+typedef struct midi_rtt {
+	int		mr_valid;
+	double		mr_srtt;	/* ns */
+	double		mr_rttvar;	/* ns */
+	uint64_t	mr_rto;		/* ns */
+} midi_rtt_t;
+
+/* Returns nonzero if a reply payload says the request failed and should be
+ * tried again. */
+typedef int (*midi_xact_errfn_t)(unsigned char *, size_t);
+
+/* Request/response transactions with one device. */
+typedef struct midi_xact {
+	midi_queue_t	*mx_inq;	/* Where the device's replies arrive */
+	midi_ring_cons_t *mx_cons;	/* Or here, if set */
+	int		mx_dest;
+	int		mx_maxtries;
+	midi_xact_errfn_t mx_iserr;
+	midi_rtt_t	mx_rtt;
+	uint64_t	mx_lastid;	/* Trace ID of the last request sent */
+
+	int		mx_cnt;		/* Stats */
+	int		mx_retries;
+	int		mx_timeouts;
+	int		mx_errors;
+} midi_xact_t;
+
+/* NOTE: Requests are put on midi_outq, so the writer thread must be
+ * running. */
+int midi_xact_init(midi_xact_t *, midi_queue_t *, int, midi_xact_errfn_t);
+
+/* Look for replies on a ring instead of the queue. What isn't a reply
+ * is left to the ring's other consumers. */
+int midi_xact_setring(midi_xact_t *, midi_ring_cons_t *);
+
+/* Sends a sysex request and waits for a sysex reply that starts with the
+ * same matchsiz bytes as the request. expsiz is the expected size of the
+ * reply payload, used to work out how long it takes to arrive. The reply
+ * payload is returned in a newly allocated buffer. */
+int midi_xact_request(midi_xact_t *, unsigned char *, size_t, size_t, size_t,
+	unsigned char **, size_t *);
+
+uint64_t midi_xact_timeout(midi_xact_t *, size_t, size_t);
+
+void midi_rtt_init(midi_rtt_t *);
+void midi_rtt_sample(midi_rtt_t *, uint64_t);
+
+#endif
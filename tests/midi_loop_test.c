@@ -0,0 +1,514 @@
+/*
+ * Tests for the epoll loop, driven over pipes and pseudo-terminals.
+ *
+ * Each test sets up its own loop and fds, and returns the number of checks
+ * that failed.
+ */
+#define _GNU_SOURCE	/* F_SETPIPE_SZ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <pty.h>
+#include "../midi_loop.h"
+#include "../midi_time.h"
+
+#define TEST_MAXMSGS	16
+#define TEST_PIPESIZ	4096
+#define TEST_SYSEXSIZ	20000
+
+#define CHECK(c)	do { if(!(c)) { \
+		fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, \
+		    __LINE__, __func__, #c); \
+		++fails; } } while(0)
+
+typedef struct test_rcv {
+	midi_msg_t	tr_msgs[TEST_MAXMSGS];
+	int		tr_cnt;
+	size_t		tr_sysex_siz;	/* Payload of the last sysex */
+	int		tr_sysex_ok;	/* It had the bytes sent */
+	int		tr_quit_type;	/* Quit when this comes, -1: never */
+} test_rcv_t;
+
+typedef struct test_tmr {
+	int		tt_order[4];
+	int		tt_cnt;
+} test_tmr_t;
+
+typedef struct test_tag {
+	test_tmr_t	*ta_tmr;
+	int		ta_id;
+} test_tag_t;
+
+void rcv_init(test_rcv_t *, int);
+void rcv_msg(midi_loop_t *, midi_msg_t *, void *);
+void tmr_fire(midi_loop_t *, void *);
+unsigned char sysex_byte(size_t);
+ssize_t read_all(int, unsigned char *, size_t);
+int test_parse(void);
+int test_runstat(void);
+int test_partial(void);
+int test_hup(void);
+int test_eio(void);
+int test_timers(void);
+
+
+void
+rcv_init(test_rcv_t *tr, int quit_type)
+{
+	memset(tr, 0, sizeof(test_rcv_t));
+	tr->tr_quit_type = quit_type;
+}
+
+
+void
+rcv_msg(midi_loop_t *ml, midi_msg_t *msg, void *arg)
+{
+	test_rcv_t	*tr;
+	size_t		i;
+
+	tr = arg;
+
+	if(tr->tr_cnt < TEST_MAXMSGS)
+		tr->tr_msgs[tr->tr_cnt++] = *msg;
+
+	if(msg->mm_type == MIDI_MSG_SYSEX) {
+		/* The payload goes away when we return. */
+		tr->tr_msgs[tr->tr_cnt - 1].mm_payload = NULL;
+		tr->tr_sysex_siz = msg->mm_payload_siz;
+		tr->tr_sysex_ok = 1;
+		for(i = 0; i < msg->mm_payload_siz; ++i) {
+			if(msg->mm_payload[i] != sysex_byte(i))
+				tr->tr_sysex_ok = 0;
+		}
+	}
+
+	if(msg->mm_type == tr->tr_quit_type)
+		midi_loop_quit(ml);
+}
+
+
+void
+tmr_fire(midi_loop_t *ml, void *arg)
+{
+	test_tag_t	*ta;
+
+	ta = arg;
+	if(ta->ta_tmr->tt_cnt < 4)
+		ta->ta_tmr->tt_order[ta->ta_tmr->tt_cnt++] = ta->ta_id;
+}
+
+
+unsigned char
+sysex_byte(size_t i)
+{
+	return (unsigned char) (i % 0x7F);
+}
+
+
+ssize_t
+read_all(int fd, unsigned char *buf, size_t siz)
+{
+	/* Reads what's there, without waiting for more. */
+
+	ssize_t	n;
+	size_t	got;
+
+	got = 0;
+	while(got < siz) {
+		n = read(fd, buf + got, siz - got);
+		if(n <= 0)
+			break;
+		got += n;
+	}
+
+	return got;
+}
+
+
+int
+test_parse(void)
+{
+	/* Running status, realtime between the bytes of a message and
+	 * inside sysex, and messages that are only read past. */
+
+	static const unsigned char	in[] = {
+		0xB0, 0x07, 0x64,	/* CC 7 = 100 */
+		0x08, 0x50,		/* Running status, CC 8 = 80 */
+		0xB0, 0xF8, 0x0A,	/* Clock in between */
+		0x0B,			/* CC 10 = 11 */
+		0x90, 0x3C, 0x40,	/* Note On, not handed on */
+		0xC1, 0x05,		/* Program Change */
+		0xF0, 0x00, 0xFA, 0x01, 0x02, 0xF7,
+		0x05,			/* No status after sysex */
+	};
+	midi_loop_t	ml;
+	test_rcv_t	tr;
+	int		p[2];
+	int		fails;
+
+	fails = 0;
+	rcv_init(&tr, -1);
+
+	if(pipe(p) != 0)
+		return 1;
+
+	CHECK(midi_loop_init(&ml, rcv_msg, &tr) == 0);
+	CHECK(midi_loop_addport(&ml, p[0], -1, NULL) == 0);
+
+	CHECK(write(p[1], in, sizeof(in)) == sizeof(in));
+	(void) close(p[1]);
+
+	/* The port is dropped at end of file, then there's nothing left. */
+	CHECK(midi_loop_run(&ml) == 0);
+	CHECK(ml.ml_ports[0].mp_rfd == -1);
+	CHECK(ml.ml_rbytes == sizeof(in));
+
+	CHECK(tr.tr_cnt == 7);
+	if(tr.tr_cnt == 7) {
+		CHECK(tr.tr_msgs[0].mm_type == MIDI_MSG_CHANCC);
+		CHECK(tr.tr_msgs[0].mm_num == 7 && tr.tr_msgs[0].mm_val == 100);
+		CHECK(tr.tr_msgs[1].mm_type == MIDI_MSG_CHANCC);
+		CHECK(tr.tr_msgs[1].mm_num == 8 && tr.tr_msgs[1].mm_val == 80);
+		CHECK(tr.tr_msgs[2].mm_type == MIDI_MSG_SYSRT_CLOCK);
+		CHECK(tr.tr_msgs[3].mm_type == MIDI_MSG_CHANCC);
+		CHECK(tr.tr_msgs[3].mm_num == 10 && tr.tr_msgs[3].mm_val == 11);
+		CHECK(tr.tr_msgs[4].mm_type == MIDI_MSG_CHANPROG);
+		CHECK(tr.tr_msgs[4].mm_chan == 1 && tr.tr_msgs[4].mm_val == 5);
+		CHECK(tr.tr_msgs[5].mm_type == MIDI_MSG_SYSRT_START);
+		CHECK(tr.tr_msgs[6].mm_type == MIDI_MSG_SYSEX);
+		CHECK(tr.tr_sysex_siz == 3 && tr.tr_sysex_ok);
+	}
+
+	(void) midi_loop_uninit(&ml);
+	(void) close(p[0]);
+
+	return fails;
+}
+
+
+int
+test_runstat(void)
+{
+	/* Status bytes are left out while they don't change, and sysex
+	 * ends the running status. */
+
+	static const unsigned char	want[] = {
+		0xB0, 0x07, 0x01, 0x08, 0x02,
+		0xB1, 0x07, 0x03,
+		0xF0, 0x00, 0x01, 0xF7,
+		0xB1, 0x07, 0x04,
+	};
+	midi_loop_t	ml;
+	midi_msg_t	msg;
+	unsigned char	buf[64];
+	unsigned char	payload[2];
+	int		p[2];
+	int		fails;
+
+	fails = 0;
+
+	if(pipe(p) != 0)
+		return 1;
+
+	CHECK(midi_loop_init(&ml, NULL, NULL) == 0);
+	CHECK(midi_loop_addport(&ml, -1, p[1], NULL) == 0);
+	(void) fcntl(p[0], F_SETFL, O_NONBLOCK);
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_type = MIDI_MSG_CHANCC;
+	msg.mm_num = 7;
+	msg.mm_val = 1;
+	CHECK(midi_loop_send(&ml, 0, &msg) == 0);
+	msg.mm_num = 8;
+	msg.mm_val = 2;
+	CHECK(midi_loop_send(&ml, 0, &msg) == 0);
+	msg.mm_chan = 1;
+	msg.mm_num = 7;
+	msg.mm_val = 3;
+	CHECK(midi_loop_send(&ml, 0, &msg) == 0);
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	payload[0] = 0x00;
+	payload[1] = 0x01;
+	msg.mm_type = MIDI_MSG_SYSEX;
+	msg.mm_payload = payload;
+	msg.mm_payload_siz = sizeof(payload);
+	CHECK(midi_loop_send(&ml, 0, &msg) == 0);
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_type = MIDI_MSG_CHANCC;
+	msg.mm_chan = 1;
+	msg.mm_num = 7;
+	msg.mm_val = 4;
+	CHECK(midi_loop_send(&ml, 0, &msg) == 0);
+
+	/* All of it fits, nothing should be waiting. */
+	CHECK(ml.ml_ports[0].mp_outsiz == 0);
+	CHECK(ml.ml_runstat.rs_saved == 1);
+
+	CHECK(read_all(p[0], buf, sizeof(buf)) == sizeof(want));
+	CHECK(memcmp(buf, want, sizeof(want)) == 0);
+
+	(void) midi_loop_uninit(&ml);
+	(void) close(p[0]);
+	(void) close(p[1]);
+
+	return fails;
+}
+
+
+int
+test_partial(void)
+{
+	/* A sysex message longer than the pipe takes is written in parts as
+	 * the other side reads. A clock sent meanwhile goes out right away,
+	 * in the middle of the sysex, and the sysex still arrives whole. */
+
+	midi_loop_t	ml;
+	midi_msg_t	msg;
+	test_rcv_t	tr;
+	unsigned char	*payload;
+	size_t		i;
+	int		p[2];
+	int		fails;
+
+	fails = 0;
+	rcv_init(&tr, MIDI_MSG_SYSEX);
+
+	/* The default size would take the whole message. */
+	if(pipe(p) != 0 || fcntl(p[1], F_SETPIPE_SZ, TEST_PIPESIZ) < 0)
+		return 1;
+
+	payload = malloc(TEST_SYSEXSIZ);
+	if(payload == NULL)
+		return 1;
+	for(i = 0; i < TEST_SYSEXSIZ; ++i)
+		payload[i] = sysex_byte(i);
+
+	CHECK(midi_loop_init(&ml, rcv_msg, &tr) == 0);
+	CHECK(midi_loop_addport(&ml, p[0], -1, NULL) == 0);
+	CHECK(midi_loop_addport(&ml, -1, p[1], NULL) == 0);
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_type = MIDI_MSG_SYSEX;
+	msg.mm_payload = payload;
+	msg.mm_payload_siz = TEST_SYSEXSIZ;
+	CHECK(midi_loop_send(&ml, 1, &msg) == 0);
+
+	CHECK(ml.ml_partial == 1);
+	CHECK(ml.ml_ports[1].mp_polling);
+	CHECK(ml.ml_ports[1].mp_outoff > 0);
+	CHECK(ml.ml_ports[1].mp_outoff < TEST_SYSEXSIZ + 2);
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_type = MIDI_MSG_SYSRT_CLOCK;
+	CHECK(midi_loop_send(&ml, 1, &msg) == 0);
+	CHECK(ml.ml_ports[1].mp_rtcnt == 1);
+
+	CHECK(midi_loop_run(&ml) == 0);
+
+	CHECK(tr.tr_cnt == 2);
+	if(tr.tr_cnt == 2) {
+		CHECK(tr.tr_msgs[0].mm_type == MIDI_MSG_SYSRT_CLOCK);
+		CHECK(tr.tr_msgs[1].mm_type == MIDI_MSG_SYSEX);
+	}
+	CHECK(tr.tr_sysex_siz == TEST_SYSEXSIZ && tr.tr_sysex_ok);
+	CHECK(ml.ml_wbytes == TEST_SYSEXSIZ + 3);
+	CHECK(ml.ml_ports[1].mp_outsiz == 0);
+	CHECK(!ml.ml_ports[1].mp_polling);
+
+	(void) midi_loop_uninit(&ml);
+	(void) close(p[0]);
+	(void) close(p[1]);
+	free(payload);
+
+	return fails;
+}
+
+
+int
+test_hup(void)
+{
+	/* A port whose reader went away is dropped, whether or not it has
+	 * output waiting. */
+
+	midi_loop_t	ml;
+	midi_msg_t	msg;
+	unsigned char	*payload;
+	int		p[2];
+	int		q[2];
+	int		fails;
+
+	fails = 0;
+
+	if(pipe(p) != 0 || pipe(q) != 0 ||
+	    fcntl(p[1], F_SETPIPE_SZ, TEST_PIPESIZ) < 0)
+		return 1;
+
+	payload = calloc(1, TEST_SYSEXSIZ);
+	if(payload == NULL)
+		return 1;
+
+	CHECK(midi_loop_init(&ml, NULL, NULL) == 0);
+	CHECK(midi_loop_addport(&ml, -1, p[1], NULL) == 0);
+	CHECK(midi_loop_addport(&ml, -1, q[1], NULL) == 0);
+
+	memset(&msg, 0, sizeof(midi_msg_t));
+	msg.mm_type = MIDI_MSG_SYSEX;
+	msg.mm_payload = payload;
+	msg.mm_payload_siz = TEST_SYSEXSIZ;
+	CHECK(midi_loop_send(&ml, 0, &msg) == 0);
+	CHECK(ml.ml_ports[0].mp_polling);
+
+	(void) close(p[0]);
+	(void) close(q[0]);
+
+	CHECK(midi_loop_run(&ml) == 0);
+	CHECK(ml.ml_ports[0].mp_wfd == -1);
+	CHECK(ml.ml_ports[0].mp_outsiz == 0);
+	CHECK(ml.ml_ports[1].mp_wfd == -1);
+
+	/* Sending to it now is refused. */
+	CHECK(midi_loop_send(&ml, 0, &msg) == EBADF);
+
+	(void) midi_loop_uninit(&ml);
+	(void) close(p[1]);
+	(void) close(q[1]);
+	free(payload);
+
+	return fails;
+}
+
+
+int
+test_eio(void)
+{
+	/* Reading the master side of a pseudo-terminal whose slave side
+	 * was closed fails with EIO, and the port is dropped. */
+
+	static const unsigned char	in[] = { 0xB2, 0x01, 0x7F };
+	struct termios	tio;
+	midi_loop_t	ml;
+	test_rcv_t	tr;
+	int		master;
+	int		slave;
+	int		fails;
+
+	fails = 0;
+	rcv_init(&tr, MIDI_MSG_CHANCC);
+
+	if(openpty(&master, &slave, NULL, NULL, NULL) != 0) {
+		fprintf(stderr, "Can't open pseudo-terminal: %s, skipped\n",
+		    strerror(errno));
+		return 0;
+	}
+
+	/* Bytes as they are, no line discipline. */
+	if(tcgetattr(slave, &tio) == 0) {
+		cfmakeraw(&tio);
+		(void) tcsetattr(slave, TCSANOW, &tio);
+	}
+
+	CHECK(midi_loop_init(&ml, rcv_msg, &tr) == 0);
+	CHECK(midi_loop_addport(&ml, master, master, NULL) == 0);
+
+	CHECK(write(slave, in, sizeof(in)) == sizeof(in));
+	CHECK(midi_loop_run(&ml) == 0);
+	CHECK(tr.tr_cnt == 1);
+	if(tr.tr_cnt == 1) {
+		CHECK(tr.tr_msgs[0].mm_chan == 2);
+		CHECK(tr.tr_msgs[0].mm_num == 1 && tr.tr_msgs[0].mm_val == 127);
+	}
+	CHECK(ml.ml_ports[0].mp_rfd == master);
+
+	(void) close(slave);
+
+	CHECK(midi_loop_run(&ml) == 0);
+	CHECK(ml.ml_ports[0].mp_rfd == -1);
+	CHECK(ml.ml_ports[0].mp_wfd == -1);
+
+	(void) midi_loop_uninit(&ml);
+	(void) close(master);
+
+	return fails;
+}
+
+
+int
+test_timers(void)
+{
+	/* Timers fire in the order they are due, not set, and a cancelled
+	 * one doesn't. */
+
+	midi_loop_t	ml;
+	test_tmr_t	tt;
+	test_tag_t	tags[3];
+	uint64_t	now;
+	uint64_t	start;
+	int		id;
+	int		i;
+	int		fails;
+
+	fails = 0;
+	memset(&tt, 0, sizeof(tt));
+	for(i = 0; i < 3; ++i) {
+		tags[i].ta_tmr = &tt;
+		tags[i].ta_id = i;
+	}
+
+	CHECK(midi_loop_init(&ml, NULL, NULL) == 0);
+
+	start = midi_time_now();
+	CHECK(midi_loop_settimer(&ml, start + 3 * MIDI_TIME_NSEC_PER_MSEC,
+	    tmr_fire, &tags[0], NULL) == 0);
+	CHECK(midi_loop_settimer(&ml, start + 1 * MIDI_TIME_NSEC_PER_MSEC,
+	    tmr_fire, &tags[1], NULL) == 0);
+	CHECK(midi_loop_settimer(&ml, start + 2 * MIDI_TIME_NSEC_PER_MSEC,
+	    tmr_fire, &tags[2], &id) == 0);
+	CHECK(midi_loop_canceltimer(&ml, id) == 0);
+	CHECK(midi_loop_canceltimer(&ml, id) == ENOENT);
+
+	CHECK(midi_loop_run(&ml) == 0);
+	now = midi_time_now();
+
+	CHECK(tt.tt_cnt == 2);
+	CHECK(tt.tt_order[0] == 1 && tt.tt_order[1] == 0);
+	CHECK(now >= start + 3 * MIDI_TIME_NSEC_PER_MSEC);
+
+	(void) midi_loop_uninit(&ml);
+
+	return fails;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	int	fails;
+
+	/* Writing to a pipe without a reader has to fail with EPIPE. */
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	fails = 0;
+	fails += test_parse();
+	fails += test_runstat();
+	fails += test_partial();
+	fails += test_hup();
+	fails += test_eio();
+	fails += test_timers();
+
+	if(fails) {
+		fprintf(stderr, "%s: %d check(s) failed\n", argv[0], fails);
+		return 1;
+	}
+
+	printf("%s: ok\n", argv[0]);
+
+	return 0;
+}
@@ -0,0 +1,407 @@
+/*
+ * Tests for the limits of a queue: what each policy does with a message
+ * that doesn't fit, and when the watermark hook is called. And for what
+ * is queued: the packets of a message, taken off and put back as they are.
+ *
+ * Each test returns the number of checks that failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../midi_queue.h"
+
+#define CHECK(c)	do { if(!(c)) { \
+		fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, \
+		    __LINE__, __func__, #c); \
+		++fails; } } while(0)
+
+typedef struct test_wm {
+	int		tw_up;
+	int		tw_down;
+} test_wm_t;
+
+typedef struct test_prod {
+	midi_queue_t	*tp_mq;
+	int		tp_ret;
+} test_prod_t;
+
+void count_wm(midi_queue_t *, int, void *);
+void *block_prod(void *);
+int drain(midi_queue_t *);
+int test_dropoldest(void);
+int test_coalesce(void);
+int test_block(void);
+int test_watermarks(void);
+int test_packets(void);
+
+
+void
+count_wm(midi_queue_t *mq, int above, void *arg)
+{
+	test_wm_t	*tw;
+
+	tw = arg;
+	if(above)
+		++tw->tw_up;
+	else
+		++tw->tw_down;
+}
+
+
+void *
+block_prod(void *arg)
+{
+	test_prod_t	*tp;
+	unsigned char	payload[1];
+
+	tp = arg;
+	payload[0] = 0x02;
+
+	(void) pthread_mutex_lock(&tp->tp_mq->mq_mutex);
+	tp->tp_ret = midi_queue_addmsg_sysex(tp->tp_mq, payload,
+	    sizeof(payload));
+	(void) pthread_mutex_unlock(&tp->tp_mq->mq_mutex);
+
+	return NULL;
+}
+
+
+int
+drain(midi_queue_t *mq)
+{
+	midi_msg_t	msg;
+	int		cnt;
+
+	cnt = 0;
+	while(midi_queue_getnext(mq, &msg) == 0) {
+		(void) midi_msg_free_payload(&msg);
+		++cnt;
+	}
+
+	return cnt;
+}
+
+
+int
+test_dropoldest(void)
+{
+	/* Clocks make room for newer clocks and for anything else, oldest
+	 * first. */
+
+	midi_queue_t	*mq;
+	midi_msg_t	msg;
+	int		src;
+	int		fails;
+
+	fails = 0;
+
+	if(midi_queue_init(&mq) != 0)
+		return 1;
+	CHECK(midi_queue_setlimits(mq, 4, 0) == 0);
+	CHECK(midi_queue_setpolicy(mq, MIDI_MSG_SYSRT_CLOCK,
+	    MIDI_QUEUE_DROPOLDEST) == 0);
+
+	for(src = 0; src < 6; ++src)
+		CHECK(midi_queue_addmsg_sysrt_from(mq, src,
+		    MIDI_MSG_SYSRT_CLOCK) == 0);
+	CHECK(mq->mq_cnt == 4);
+	CHECK(mq->mq_dropped == 2);
+
+	/* Refused when full, unless there's a clock to drop. */
+	CHECK(midi_queue_addmsg_chanprog_from(mq, 9, 0, 1) == 0);
+	CHECK(mq->mq_cnt == 4);
+	CHECK(mq->mq_dropped == 3);
+
+	for(src = 3; src < 6; ++src) {
+		CHECK(midi_queue_getnext(mq, &msg) == 0);
+		CHECK(msg.mm_type == MIDI_MSG_SYSRT_CLOCK);
+		CHECK(msg.mm_src == src);
+	}
+	CHECK(midi_queue_getnext(mq, &msg) == 0);
+	CHECK(msg.mm_type == MIDI_MSG_CHANPROG && msg.mm_src == 9);
+	CHECK(midi_queue_isempty(mq));
+
+	(void) midi_queue_uninit(&mq);
+
+	return fails;
+}
+
+
+int
+test_coalesce(void)
+{
+	/* A CC that doesn't fit replaces the value of one queued for the
+	 * same controller, where that one is. Others are refused. */
+
+	midi_queue_t	*mq;
+	midi_msg_t	msg;
+	int		fails;
+
+	fails = 0;
+
+	if(midi_queue_init(&mq) != 0)
+		return 1;
+	CHECK(midi_queue_setlimits(mq, 3, 0) == 0);
+	CHECK(midi_queue_setpolicy(mq, MIDI_MSG_CHANCC,
+	    MIDI_QUEUE_COALESCE) == 0);
+	CHECK(midi_queue_setpolicy(mq, MIDI_MSG_SYSEX,
+	    MIDI_QUEUE_COALESCE) == EINVAL);
+
+	CHECK(midi_queue_addmsg_chancc_from(mq, 0, 0, 7, 1) == 0);
+	CHECK(midi_queue_addmsg_chanprog_from(mq, 0, 0, 5) == 0);
+	CHECK(midi_queue_addmsg_chancc_from(mq, 0, 0, 8, 1) == 0);
+
+	CHECK(midi_queue_addmsg_chancc_from(mq, 0, 0, 7, 99) == 0);
+	CHECK(mq->mq_cnt == 3);
+	CHECK(mq->mq_coalesced == 1);
+	CHECK(mq->mq_dropped == 0);
+
+	/* Another channel is another controller. */
+	CHECK(midi_queue_addmsg_chancc_from(mq, 0, 1, 7, 2) == ENOBUFS);
+	CHECK(mq->mq_dropped == 1);
+
+	CHECK(midi_queue_getnext(mq, &msg) == 0);
+	CHECK(msg.mm_type == MIDI_MSG_CHANCC);
+	CHECK(msg.mm_num == 7 && msg.mm_val == 99);
+	CHECK(midi_queue_getnext(mq, &msg) == 0);
+	CHECK(msg.mm_type == MIDI_MSG_CHANPROG);
+	CHECK(midi_queue_getnext(mq, &msg) == 0);
+	CHECK(msg.mm_num == 8 && msg.mm_val == 1);
+
+	(void) midi_queue_uninit(&mq);
+
+	return fails;
+}
+
+
+int
+test_block(void)
+{
+	/* A producer that blocks waits until the consumer takes something
+	 * off. One that can never fit doesn't wait at all. */
+
+	midi_queue_t	*mq;
+	test_prod_t	tp;
+	pthread_t	thr;
+	unsigned char	payload[64];
+	int		blocked;
+	int		tries;
+	int		fails;
+
+	fails = 0;
+	memset(payload, 0x01, sizeof(payload));
+
+	if(midi_queue_init(&mq) != 0)
+		return 1;
+	CHECK(midi_queue_setlimits(mq, 1, sizeof(midi_queue_ent_t) + 16) ==
+	    0);
+	CHECK(midi_queue_setpolicy(mq, MIDI_MSG_SYSEX, MIDI_QUEUE_BLOCK) ==
+	    0);
+
+	(void) pthread_mutex_lock(&mq->mq_mutex);
+	CHECK(midi_queue_addmsg_sysex(mq, payload, 1) == 0);
+	CHECK(midi_queue_addmsg_sysex(mq, payload, sizeof(payload)) ==
+	    ENOBUFS);
+	CHECK(mq->mq_dropped == 1);
+	(void) pthread_mutex_unlock(&mq->mq_mutex);
+
+	tp.tp_mq = mq;
+	tp.tp_ret = -1;
+	if(pthread_create(&thr, NULL, block_prod, &tp) != 0) {
+		(void) midi_queue_uninit(&mq);
+		return fails + 1;
+	}
+
+	blocked = 0;
+	for(tries = 0; tries < 1000 && !blocked; ++tries) {
+		(void) pthread_mutex_lock(&mq->mq_mutex);
+		blocked = mq->mq_blocked;
+		(void) pthread_mutex_unlock(&mq->mq_mutex);
+		if(!blocked)
+			(void) usleep(1000);
+	}
+	CHECK(blocked == 1);
+
+	(void) pthread_mutex_lock(&mq->mq_mutex);
+	CHECK(tp.tp_ret == -1);
+	CHECK(drain(mq) == 1);
+	(void) pthread_mutex_unlock(&mq->mq_mutex);
+
+	(void) pthread_join(thr, NULL);
+	CHECK(tp.tp_ret == 0);
+	CHECK(mq->mq_cnt == 1);
+	CHECK(mq->mq_blocked == 0);
+
+	(void) drain(mq);
+	(void) midi_queue_uninit(&mq);
+
+	return fails;
+}
+
+
+int
+test_watermarks(void)
+{
+	/* The hook is called once each time the queue goes above the high
+	 * watermark and once when it's back below the low one, and a
+	 * message dropped counts as going above. */
+
+	midi_queue_t	*mq;
+	midi_msg_t	msg;
+	test_wm_t	tw;
+	unsigned char	payload[2048];
+	int		i;
+	int		fails;
+
+	fails = 0;
+	memset(&tw, 0, sizeof(tw));
+	memset(payload, 0x01, sizeof(payload));
+
+	if(midi_queue_init(&mq) != 0)
+		return 1;
+	CHECK(midi_queue_setlimits(mq, 10, 0) == 0);
+	CHECK(midi_queue_setwatermarks(mq, 50, 20, count_wm, &tw) == 0);
+
+	for(i = 0; i < 4; ++i)
+		CHECK(midi_queue_addmsg_chanprog_from(mq, 0, 0, i) == 0);
+	CHECK(tw.tw_up == 0);
+	for(i = 4; i < 8; ++i)
+		CHECK(midi_queue_addmsg_chanprog_from(mq, 0, 0, i) == 0);
+	CHECK(tw.tw_up == 1 && tw.tw_down == 0);
+
+	/* 30% isn't low enough. */
+	for(i = 0; i < 5; ++i)
+		CHECK(midi_queue_getnext(mq, &msg) == 0);
+	CHECK(tw.tw_down == 0);
+	CHECK(midi_queue_getnext(mq, &msg) == 0);
+	CHECK(tw.tw_down == 1);
+	(void) drain(mq);
+	CHECK(tw.tw_up == 1 && tw.tw_down == 1);
+
+	for(i = 0; i < 5; ++i)
+		CHECK(midi_queue_addmsg_chanprog_from(mq, 0, 0, i) == 0);
+	CHECK(tw.tw_up == 2);
+	(void) drain(mq);
+	CHECK(tw.tw_down == 2);
+
+	/* Too big for the queue even empty: dropped, and reported once. */
+	CHECK(midi_queue_setlimits(mq, 10, sizeof(midi_queue_ent_t) * 10) ==
+	    0);
+	CHECK(midi_queue_addmsg_sysex(mq, payload, sizeof(payload)) ==
+	    ENOBUFS);
+	CHECK(mq->mq_dropped == 1);
+	CHECK(tw.tw_up == 3);
+	CHECK(midi_queue_addmsg_sysex(mq, payload, sizeof(payload)) ==
+	    ENOBUFS);
+	CHECK(mq->mq_dropped == 2);
+	CHECK(tw.tw_up == 3);
+
+	/* The next one that fits finds it back to normal. */
+	CHECK(midi_queue_addmsg_chanprog_from(mq, 0, 0, 1) == 0);
+	CHECK(tw.tw_down == 3);
+
+	(void) drain(mq);
+	(void) midi_queue_uninit(&mq);
+
+	return fails;
+}
+
+
+int
+test_packets(void)
+{
+	/* A sysex message is queued as its packets, in one entry, and comes
+	 * back out the same. */
+
+	midi_queue_t		*mq;
+	midi_queue_t		*other;
+	midi_queue_ent_t	*ent;
+	midi_msg_t		msg;
+	midi_ump_t		ump[2];
+	unsigned char		payload[20];
+	int			i;
+	int			fails;
+
+	fails = 0;
+	for(i = 0; i < sizeof(payload); ++i)
+		payload[i] = i;
+
+	if(midi_queue_init(&mq) != 0)
+		return 1;
+	if(midi_queue_init(&other) != 0) {
+		(void) midi_queue_uninit(&mq);
+		return 1;
+	}
+
+	CHECK(midi_queue_addmsg_sysex_id(mq, 3, 4, 99, payload,
+	    sizeof(payload)) == 0);
+	CHECK(mq->mq_bytes == sizeof(midi_queue_ent_t) +
+	    MIDI_UMP_SYSEX_PKTS(sizeof(payload)) * sizeof(midi_ump_t));
+
+	CHECK(midi_queue_getent(mq, &ent) == 0);
+	CHECK(mq->mq_bytes == 0);
+	CHECK(ent->me_type == MIDI_MSG_SYSEX);
+	CHECK(ent->me_pktcnt == 4);
+	CHECK(((uintptr_t) ent->me_pkts & (_Alignof(midi_ump_t) - 1)) == 0);
+	CHECK(MIDI_UMP_SYSEX_POS(&ent->me_pkts[3]) == MIDI_UMP_SYSEX_END);
+
+	/* Moved to another queue without being unpacked. */
+	CHECK(midi_queue_putent(other, ent) == 0);
+	CHECK(midi_queue_getnext(other, &msg) == 0);
+	CHECK(msg.mm_type == MIDI_MSG_SYSEX);
+	CHECK(msg.mm_src == 3 && msg.mm_dest == 4 && msg.mm_id == 99);
+	CHECK(msg.mm_payload_siz == sizeof(payload));
+	CHECK(msg.mm_payload &&
+	    memcmp(msg.mm_payload, payload, sizeof(payload)) == 0);
+	(void) midi_msg_free_payload(&msg);
+
+	/* Packets from a port: one message, not the start of one. */
+	CHECK(midi_ump_from_sysex(payload, 12, 0, ump, 2, &i) == 0);
+	CHECK(midi_queue_addump(mq, 1, MIDI_EP_ANY, 0, 0, ump, 1) ==
+	    EINVAL);
+	CHECK(midi_queue_addump(mq, 1, MIDI_EP_ANY, 0, 0, ump, 2) == 0);
+	CHECK(midi_queue_getnext(mq, &msg) == 0);
+	CHECK(msg.mm_payload_siz == 12 && msg.mm_src == 1);
+	(void) midi_msg_free_payload(&msg);
+
+	/* A MIDI 2.0 Note On is queued, but has no midi_msg_t. */
+	memset(ump, 0, sizeof(ump));
+	ump[0].mu_w[0] = 0x40903C00;
+	CHECK(midi_queue_addump(mq, 0, MIDI_EP_ANY, 0, 0, ump, 1) == 0);
+	CHECK(midi_queue_addmsg_chanprog_from(mq, 0, 0, 1) == 0);
+	CHECK(midi_queue_getnext(mq, &msg) == ENOTSUP);
+	CHECK(midi_queue_getnext(mq, &msg) == 0);
+	CHECK(msg.mm_type == MIDI_MSG_CHANPROG && msg.mm_val == 1);
+	CHECK(midi_queue_isempty(mq));
+
+	(void) midi_queue_uninit(&other);
+	(void) midi_queue_uninit(&mq);
+
+	return fails;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	int	fails;
+
+	fails = 0;
+	fails += test_dropoldest();
+	fails += test_coalesce();
+	fails += test_block();
+	fails += test_watermarks();
+	fails += test_packets();
+
+	if(fails) {
+		fprintf(stderr, "%s: %d check(s) failed\n", argv[0], fails);
+		return 1;
+	}
+
+	printf("%s: ok\n", argv[0]);
+
+	return 0;
+}
@@ -0,0 +1,496 @@
+/*
+ * Tests for the translation between byte streams, messages and Universal
+ * MIDI Packets, and for the loop's UMP mode over a pipe.
+ *
+ * Each test returns the number of checks that failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../midi_ump.h"
+#include "../midi_loop.h"
+
+#define TEST_MAXPKTS	32
+
+#define CHECK(c)	do { if(!(c)) { \
+		fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, \
+		    __LINE__, __func__, #c); \
+		++fails; } } while(0)
+
+typedef struct test_pkts {
+	midi_ump_t	tp_pkts[TEST_MAXPKTS];
+	int		tp_cnt;
+} test_pkts_t;
+
+int sysex_status(const midi_ump_t *);
+int sysex_count(const midi_ump_t *);
+int parse_all(midi_ump_parser_t *, const unsigned char *, size_t,
+	test_pkts_t *);
+size_t bytes_all(const test_pkts_t *, unsigned char *);
+void echo_ump(midi_loop_t *, int, const midi_ump_t *, void *);
+int test_msg(void);
+int test_sysex(void);
+int test_check(void);
+#ifdef MIDI_UMP_ALSA
+int test_sysex8(void);
+#endif
+int test_parse(void);
+int test_loop(void);
+
+
+int
+sysex_status(const midi_ump_t *ump)
+{
+	return (ump->mu_w[0] >> 20) & 0x0F;
+}
+
+
+int
+sysex_count(const midi_ump_t *ump)
+{
+	return (ump->mu_w[0] >> 16) & 0x0F;
+}
+
+
+int
+parse_all(midi_ump_parser_t *up, const unsigned char *buf, size_t siz,
+	test_pkts_t *tp)
+{
+	size_t	i;
+
+	tp->tp_cnt = 0;
+	for(i = 0; i < siz; ++i) {
+		if(tp->tp_cnt == TEST_MAXPKTS)
+			return ENOBUFS;
+		if(midi_ump_parse(up, buf[i], &tp->tp_pkts[tp->tp_cnt]))
+			++tp->tp_cnt;
+	}
+
+	return 0;
+}
+
+
+size_t
+bytes_all(const test_pkts_t *tp, unsigned char *buf)
+{
+	size_t	siz;
+	size_t	n;
+	int	i;
+
+	siz = 0;
+	for(i = 0; i < tp->tp_cnt; ++i) {
+		if(midi_ump_to_bytes(&tp->tp_pkts[i], buf + siz, &n) != 0)
+			return 0;
+		siz += n;
+	}
+
+	return siz;
+}
+
+
+void
+echo_ump(midi_loop_t *ml, int idx, const midi_ump_t *ump, void *arg)
+{
+	test_pkts_t	*tp;
+
+	tp = arg;
+	if(tp->tp_cnt < TEST_MAXPKTS)
+		tp->tp_pkts[tp->tp_cnt++] = *ump;
+
+	(void) midi_loop_send_ump(ml, idx, ump);
+}
+
+
+int
+test_msg(void)
+{
+	/* Every message type that fits in a packet comes back the same. */
+
+	static const int	types[] = {
+		MIDI_MSG_SYSRT_CLOCK, MIDI_MSG_SYSRT_START,
+		MIDI_MSG_SYSRT_STOP, MIDI_MSG_SYSRT_CONTINUE,
+		MIDI_MSG_CHANCC, MIDI_MSG_CHANPROG,
+	};
+	midi_msg_t	msg;
+	midi_msg_t	back;
+	midi_ump_t	ump;
+	int		cnt;
+	int		i;
+	int		fails;
+
+	fails = 0;
+
+	for(i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+		memset(&msg, 0, sizeof(midi_msg_t));
+		msg.mm_type = types[i];
+		if(types[i] == MIDI_MSG_CHANCC) {
+			msg.mm_chan = 9;
+			msg.mm_num = 74;
+			msg.mm_val = 127;
+		} else
+		if(types[i] == MIDI_MSG_CHANPROG) {
+			msg.mm_chan = 15;
+			msg.mm_val = 63;
+		}
+
+		CHECK(midi_ump_from_msg(&msg, 3, &ump, 1, &cnt) == 0);
+		CHECK(cnt == 1);
+		CHECK(midi_ump_words(&ump) == 1);
+		CHECK(MIDI_UMP_GROUP(&ump) == 3);
+		CHECK(MIDI_UMP_MT(&ump) == (MIDI_MSG_ISSYSRT(types[i]) ?
+		    MIDI_UMP_MT_SYSTEM : MIDI_UMP_MT_MIDI1));
+
+		CHECK(midi_ump_to_msg(&ump, &back) == 0);
+		CHECK(back.mm_type == msg.mm_type);
+		CHECK(back.mm_chan == msg.mm_chan);
+		CHECK(back.mm_num == msg.mm_num);
+		CHECK(back.mm_val == msg.mm_val);
+	}
+
+	return fails;
+}
+
+
+int
+test_sysex(void)
+{
+	/* Sysex is cut into packets of 6 bytes, and their bytes put
+	 * together are the message as it goes on the wire. */
+
+	static const size_t	sizes[] = { 0, 1, 6, 7, 12, 14 };
+	midi_msg_t	msg;
+	test_pkts_t	tp;
+	unsigned char	payload[14];
+	unsigned char	buf[TEST_MAXPKTS * MIDI_UMP_MAXBYTES];
+	size_t		siz;
+	int		want;
+	int		s;
+	int		i;
+	int		fails;
+
+	fails = 0;
+
+	for(i = 0; i < sizeof(payload); ++i)
+		payload[i] = 0x10 + i;
+
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		memset(&msg, 0, sizeof(midi_msg_t));
+		msg.mm_type = MIDI_MSG_SYSEX;
+		msg.mm_payload = payload;
+		msg.mm_payload_siz = sizes[s];
+
+		want = MIDI_UMP_SYSEX_PKTS(sizes[s]);
+		CHECK(midi_ump_from_msg(&msg, 0, tp.tp_pkts, TEST_MAXPKTS,
+		    &tp.tp_cnt) == 0);
+		CHECK(tp.tp_cnt == want);
+		if(tp.tp_cnt != want)
+			continue;
+
+		for(i = 0; i < tp.tp_cnt; ++i) {
+			CHECK(MIDI_UMP_MT(&tp.tp_pkts[i]) ==
+			    MIDI_UMP_MT_DATA64);
+			CHECK(midi_ump_words(&tp.tp_pkts[i]) == 2);
+			CHECK(sysex_count(&tp.tp_pkts[i]) == (i < want - 1 ?
+			    MIDI_UMP_SYSEXSIZ : sizes[s] - i *
+			    MIDI_UMP_SYSEXSIZ));
+		}
+		if(want == 1) {
+			CHECK(sysex_status(&tp.tp_pkts[0]) ==
+			    MIDI_UMP_SYSEX_COMPLETE);
+		} else {
+			CHECK(sysex_status(&tp.tp_pkts[0]) ==
+			    MIDI_UMP_SYSEX_START);
+			for(i = 1; i < want - 1; ++i)
+				CHECK(sysex_status(&tp.tp_pkts[i]) ==
+				    MIDI_UMP_SYSEX_CONTINUE);
+			CHECK(sysex_status(&tp.tp_pkts[want - 1]) ==
+			    MIDI_UMP_SYSEX_END);
+		}
+
+		siz = bytes_all(&tp, buf);
+		CHECK(siz == sizes[s] + 2);
+		CHECK(buf[0] == 0xF0 && buf[siz - 1] == 0xF7);
+		CHECK(memcmp(buf + 1, payload, sizes[s]) == 0);
+	}
+
+	/* Too few packets, and bytes that aren't data. */
+	msg.mm_payload_siz = 14;
+	CHECK(midi_ump_from_msg(&msg, 0, tp.tp_pkts, 2, &tp.tp_cnt) ==
+	    ENOBUFS);
+	payload[3] = 0xF7;
+	CHECK(midi_ump_from_msg(&msg, 0, tp.tp_pkts, TEST_MAXPKTS,
+	    &tp.tp_cnt) == EINVAL);
+
+	return fails;
+}
+
+
+int
+test_check(void)
+{
+	/* What a packet is a part of, and whether packets are one whole
+	 * message, as the queues and the ring take them. */
+
+	static const unsigned char	cc[] = { 0xB2, 0x07, 0x64 };
+	static const unsigned char	prog[] = { 0xC2, 0x05 };
+	static const unsigned char	clock[] = { 0xF8 };
+	static const unsigned char	bad[] = { 0xB2, 0x07 };
+	unsigned char			payload[14];
+	unsigned char			dat[MIDI_UMP_SYSEXSIZ];
+	test_pkts_t			tp;
+	midi_ump_t			ump;
+	midi_ump_t			two[2];
+	int				i;
+	int				fails;
+
+	fails = 0;
+
+	CHECK(midi_ump_from_bytes(cc, sizeof(cc), 1, &ump) == 0);
+	CHECK(midi_ump_msgtype(&ump) == MIDI_MSG_CHANCC);
+	CHECK(MIDI_UMP_GROUP(&ump) == 1 && MIDI_UMP_STATUS(&ump) == 0xB2);
+	CHECK(MIDI_UMP_DATA1(&ump) == 0x07 && MIDI_UMP_DATA2(&ump) == 0x64);
+	CHECK(midi_ump_check(&ump, 1) == 0);
+
+	CHECK(midi_ump_from_bytes(prog, sizeof(prog), 0, &ump) == 0);
+	CHECK(midi_ump_msgtype(&ump) == MIDI_MSG_CHANPROG);
+	CHECK(midi_ump_from_bytes(clock, sizeof(clock), 0, &ump) == 0);
+	CHECK(midi_ump_msgtype(&ump) == MIDI_MSG_SYSRT_CLOCK);
+
+	/* Short, and not a message at all. */
+	CHECK(midi_ump_from_bytes(bad, sizeof(bad), 0, &ump) == EINVAL);
+	CHECK(midi_ump_from_bytes(payload, 0, 0, &ump) == EINVAL);
+
+	/* Two packets are only a message if they are one sysex. */
+	two[0] = two[1] = ump;
+	CHECK(midi_ump_check(two, 2) == EINVAL);
+
+	for(i = 0; i < sizeof(payload); ++i)
+		payload[i] = i;
+	CHECK(midi_ump_from_sysex(payload, sizeof(payload), 0, tp.tp_pkts,
+	    TEST_MAXPKTS, &tp.tp_cnt) == 0);
+	CHECK(tp.tp_cnt == 3);
+	CHECK(midi_ump_check(tp.tp_pkts, tp.tp_cnt) == 0);
+	CHECK(midi_ump_msgtype(&tp.tp_pkts[1]) == MIDI_MSG_SYSEX);
+	CHECK(midi_ump_sysex_data(&tp.tp_pkts[2], dat) == 2);
+	CHECK(dat[0] == 12 && dat[1] == 13);
+	CHECK(midi_ump_sysex_data(&ump, dat) == -1);
+
+	/* Missing its END or its START. */
+	CHECK(midi_ump_check(tp.tp_pkts, 2) == EINVAL);
+	CHECK(midi_ump_check(tp.tp_pkts + 1, 2) == EINVAL);
+
+	/* No midi_msg_t for a MIDI 2.0 Note On, but it's a message. */
+	memset(&ump, 0, sizeof(ump));
+	ump.mu_w[0] = 0x40903C00;
+	ump.mu_w[1] = 0xFFFF0000;
+	CHECK(midi_ump_words(&ump) == 2);
+	CHECK(midi_ump_msgtype(&ump) == -1);
+	CHECK(midi_ump_check(&ump, 1) == 0);
+
+	return fails;
+}
+
+
+#ifdef MIDI_UMP_ALSA
+int
+test_sysex8(void)
+{
+	/* 8 bit sysex goes in 13 bytes a packet, high bit and all, and
+	 * has no bytes on the wire. */
+
+	unsigned char	payload[30];
+	unsigned char	back[30];
+	unsigned char	buf[MIDI_UMP_MAXBYTES];
+	test_pkts_t	tp;
+	size_t		siz;
+	int		n;
+	int		i;
+	int		fails;
+
+	fails = 0;
+
+	for(i = 0; i < sizeof(payload); ++i)
+		payload[i] = 0xF0 + i;
+
+	CHECK(midi_ump_from_sysex8(payload, sizeof(payload), 2, 7,
+	    tp.tp_pkts, 2, &tp.tp_cnt) == ENOBUFS);
+	CHECK(midi_ump_from_sysex8(payload, sizeof(payload), 2, 7,
+	    tp.tp_pkts, TEST_MAXPKTS, &tp.tp_cnt) == 0);
+	CHECK(tp.tp_cnt == MIDI_UMP_SYSEX8_PKTS(sizeof(payload)));
+	CHECK(tp.tp_cnt == 3);
+	CHECK(midi_ump_check(tp.tp_pkts, tp.tp_cnt) == 0);
+
+	siz = 0;
+	for(i = 0; i < tp.tp_cnt; ++i) {
+		CHECK(MIDI_UMP_MT(&tp.tp_pkts[i]) == MIDI_UMP_MT_DATA128);
+		CHECK(midi_ump_words(&tp.tp_pkts[i]) == 4);
+		CHECK(MIDI_UMP_GROUP(&tp.tp_pkts[i]) == 2);
+		CHECK(((tp.tp_pkts[i].mu_w[0] >> 8) & 0xFF) == 7);
+		CHECK(midi_ump_msgtype(&tp.tp_pkts[i]) == -1);
+		n = midi_ump_sysex_data(&tp.tp_pkts[i], back + siz);
+		CHECK(n == (i < 2 ? MIDI_UMP_SYSEX8SIZ : 4));
+		siz += n;
+	}
+	CHECK(siz == sizeof(payload));
+	CHECK(memcmp(back, payload, sizeof(payload)) == 0);
+	CHECK(MIDI_UMP_SYSEX_POS(&tp.tp_pkts[0]) == MIDI_UMP_SYSEX_START);
+	CHECK(MIDI_UMP_SYSEX_POS(&tp.tp_pkts[2]) == MIDI_UMP_SYSEX_END);
+
+	CHECK(midi_ump_to_bytes(&tp.tp_pkts[0], buf, &siz) == ENOTSUP);
+
+	return fails;
+}
+#endif
+
+
+int
+test_parse(void)
+{
+	/* Bytes to packets and back. Running status comes out in full, and
+	 * a clock in the middle of sysex goes out before it. */
+
+	static const unsigned char	in[] = {
+		0xB0, 0x07, 0x64, 0x08, 0x50,
+		0xC1, 0x05,
+		0xF2, 0x01, 0x02,
+		0xF0, 0x01, 0x02, 0x03, 0x04, 0xF8, 0x05, 0x06, 0x07, 0xF7,
+		0xFA,
+		0xF0, 0x7E, 0xF7,
+	};
+	static const unsigned char	want[] = {
+		0xB0, 0x07, 0x64, 0xB0, 0x08, 0x50,
+		0xC1, 0x05,
+		0xF2, 0x01, 0x02,
+		0xF8,
+		0xF0, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0xF7,
+		0xFA,
+		0xF0, 0x7E, 0xF7,
+	};
+	midi_ump_parser_t	up;
+	test_pkts_t		tp;
+	unsigned char		buf[TEST_MAXPKTS * MIDI_UMP_MAXBYTES];
+	int			fails;
+
+	fails = 0;
+
+	midi_ump_parser_init(&up, 5);
+	CHECK(parse_all(&up, in, sizeof(in), &tp) == 0);
+	CHECK(tp.tp_cnt == 9);
+	if(tp.tp_cnt == 9) {
+		CHECK(MIDI_UMP_GROUP(&tp.tp_pkts[0]) == 5);
+		CHECK(MIDI_UMP_STATUS(&tp.tp_pkts[1]) == 0xB0);
+		CHECK(MIDI_UMP_MT(&tp.tp_pkts[4]) == MIDI_UMP_MT_SYSTEM);
+		CHECK(MIDI_UMP_STATUS(&tp.tp_pkts[4]) == 0xF8);
+		CHECK(sysex_status(&tp.tp_pkts[5]) == MIDI_UMP_SYSEX_START);
+		CHECK(sysex_count(&tp.tp_pkts[5]) == 6);
+		CHECK(sysex_status(&tp.tp_pkts[6]) == MIDI_UMP_SYSEX_END);
+		CHECK(sysex_count(&tp.tp_pkts[6]) == 1);
+		CHECK(sysex_status(&tp.tp_pkts[8]) ==
+		    MIDI_UMP_SYSEX_COMPLETE);
+	}
+
+	CHECK(bytes_all(&tp, buf) == sizeof(want));
+	CHECK(memcmp(buf, want, sizeof(want)) == 0);
+
+	/* Another status cuts sysex short, and what was read of it is
+	 * lost. Data without status is read past. */
+	midi_ump_parser_init(&up, 0);
+	CHECK(parse_all(&up, (const unsigned char *) "\x40\xF0\x01\x02\xB2"
+	    "\x01\x02", 7, &tp) == 0);
+	CHECK(tp.tp_cnt == 1);
+	CHECK(MIDI_UMP_STATUS(&tp.tp_pkts[0]) == 0xB2);
+
+	return fails;
+}
+
+
+int
+test_loop(void)
+{
+	/* The loop in UMP mode hands on packets as it reads, and sending
+	 * them back puts the same bytes on the wire, running status left
+	 * out. */
+
+	static const unsigned char	in[] = {
+		0xB0, 0x07, 0x64, 0xB0, 0x08, 0x50,
+		0xF0, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0xF7,
+		0xB0, 0x09, 0x01,
+	};
+	static const unsigned char	want[] = {
+		0xB0, 0x07, 0x64, 0x08, 0x50,
+		0xF0, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0xF7,
+		0xB0, 0x09, 0x01,
+	};
+	midi_loop_t	ml;
+	test_pkts_t	tp;
+	unsigned char	buf[64];
+	ssize_t		n;
+	int		p[2];
+	int		q[2];
+	int		fails;
+
+	fails = 0;
+	memset(&tp, 0, sizeof(tp));
+
+	if(pipe(p) != 0 || pipe(q) != 0)
+		return 1;
+
+	CHECK(midi_loop_init(&ml, NULL, NULL) == 0);
+	CHECK(midi_loop_setumpfn(&ml, echo_ump, &tp) == 0);
+	CHECK(midi_loop_addport(&ml, p[0], q[1], NULL) == 0);
+	CHECK(midi_loop_setumpfn(&ml, echo_ump, &tp) == EBUSY);
+
+	CHECK(write(p[1], in, sizeof(in)) == sizeof(in));
+	(void) close(p[1]);
+
+	CHECK(midi_loop_run(&ml) == 0);
+	CHECK(tp.tp_cnt == 5);
+	if(tp.tp_cnt == 5) {
+		CHECK(MIDI_UMP_GROUP(&tp.tp_pkts[0]) == 0);
+		CHECK(sysex_status(&tp.tp_pkts[2]) == MIDI_UMP_SYSEX_START);
+		CHECK(sysex_status(&tp.tp_pkts[3]) == MIDI_UMP_SYSEX_END);
+	}
+
+	n = read(q[0], buf, sizeof(buf));
+	CHECK(n == sizeof(want));
+	CHECK(n == sizeof(want) && memcmp(buf, want, sizeof(want)) == 0);
+
+	(void) midi_loop_uninit(&ml);
+	(void) close(p[0]);
+	(void) close(q[0]);
+	(void) close(q[1]);
+
+	return fails;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	int	fails;
+
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	fails = 0;
+	fails += test_msg();
+	fails += test_sysex();
+	fails += test_check();
+#ifdef MIDI_UMP_ALSA
+	fails += test_sysex8();
+#endif
+	fails += test_parse();
+	fails += test_loop();
+
+	if(fails) {
+		fprintf(stderr, "%s: %d check(s) failed\n", argv[0], fails);
+		return 1;
+	}
+
+	printf("%s: ok\n", argv[0]);
+
+	return 0;
+}